@@ -1,146 +1,1662 @@
+#define _GNU_SOURCE  // pthread_setaffinity_np y las macros CPU_* de numa_topology.h
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <math.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define IMAGE_ALLOC_IMPLEMENTATION
+#include "image_alloc.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
+#define IMAGE_IO_IMPLEMENTATION
+#include "image_io.h"
+#define BATCH_IMPLEMENTATION
+#include "batch.h"
+#define FILTER_DAEMON_IMPLEMENTATION
+#include "filter_daemon.h"
+#define RESULT_CACHE_IMPLEMENTATION
+#include "result_cache.h"
+#define DIRTY_RECTS_IMPLEMENTATION
+#include "dirty_rects.h"
+#define NUMA_TOPOLOGY_IMPLEMENTATION
+#include "numa_topology.h"
+#define ROI_IMPLEMENTATION
+#include "roi.h"
+#define PREVIEW_IMPLEMENTATION
+#include "preview.h"
+
+// Normas para medir el cambio entre iteraciones
+#define NORM_L1 0    // Cambio medio absoluto por muestra
+#define NORM_LINF 1  // Cambio máximo absoluto
+
+// Esquemas de integración de la difusión
+#define SCHEME_EXPLICIT 0  // Paso explícito de 0.25 por iteración
+#define SCHEME_AOS 1       // Separación aditiva de operadores (AOS) semi-implícita
+
+#define MAX_PYRAMID_LEVELS 8    // Niveles máximos de la pirámide multirresolución
+#define MIN_PYRAMID_SIZE 16     // Tamaño mínimo (en píxeles) del lado menor de un nivel
+
+#define FLAT_TILE 32            // Lado de los bloques del mapa de actividad (--flat-threshold)
+
+#define BATCH_QUEUE_CAPACITY 4  // Imágenes que pueden esperar entre dos etapas del pipeline del modo por lotes
+
+typedef struct DDFPool DDFPool;
+
+// Opciones del filtro DDF (de la línea de comandos o de una línea del manifiesto)
+typedef struct {
+    int iterations;              // Número de iteraciones del filtro DDF
+    float lambda;                // Parámetro lambda (en unidades de 8 bits hasta que se escala al tipo de píxel)
+    int pixel_type;              // Tipo de píxel con el que se filtra (PIXEL_AUTO = el del archivo)
+    const char *checkpoint_dir;  // Directorio de los puntos de control (NULL = desactivado)
+    int checkpoint_every;        // Iteraciones entre puntos de control
+    float tolerance;             // Tolerancia de convergencia (0 = siempre se ejecutan todas las iteraciones)
+    int check_every;             // Iteraciones entre comprobaciones de convergencia
+    int norm;                    // Norma del cambio (NORM_L1 o NORM_LINF)
+    int scheme;                  // Esquema de integración (SCHEME_EXPLICIT o SCHEME_AOS)
+    float step;                  // Tamaño del paso de tiempo del esquema AOS
+    int pyramid_levels;          // Niveles de la pirámide (1 = solo resolución completa)
+    int level_iterations[MAX_PYRAMID_LEVELS];  // Iteraciones por nivel, del más grueso al más fino (0 = automático)
+    float flat_threshold;        // Diferencia entre vecinos por debajo de la cual un bloque deja de calcularse (0 = desactivado)
+    DDFPool *pool;               // Grupo de hilos que ejecuta las franjas de todas las llamadas
+    ImageRect rois[ROI_MAX_RECTS]; // Regiones de interés (--roi); el resto de la imagen se copia sin filtrar
+    int num_rois;                // Número de regiones (0 = la imagen completa)
+} DDFOptions;
+
+// Estado compartido por los hilos para reducir el cambio entre iteraciones
+typedef struct {
+    pthread_barrier_t barrier;
+    int num_threads;
+    size_t total_samples;   // Muestras de toda la imagen (para normalizar la norma L1)
+    double *changes;        // Cambio medido por cada hilo, con doble buffer: [2][num_threads]
+    int *first_iters;       // Iteración desde la que arranca cada hilo (puede diferir al reanudar)
+    int check_from;         // Primera iteración en la que todos los hilos comprueban la convergencia
+    int iterations_run;     // Iteraciones ejecutadas al detenerse por convergencia (0 = no convergió)
+} ConvergenceState;
+
+// Estado compartido por los hilos en el esquema semi-implícito AOS
+typedef struct {
+    pthread_barrier_t barrier;
+    float *u;               // Imagen actual en coma flotante
+    float *vx;              // Solución de los sistemas tridiagonales por filas
+    float *vy;              // Solución de los sistemas tridiagonales por columnas
+    int row_stride;         // Floats de una fila a la siguiente en u, vx y vy (filas alineadas como las de image_alloc_view)
+    int steps;              // Número de pasos de tiempo
+    float tau;              // Tamaño de cada paso de tiempo
+} AOSState;
 
 // Estructura para pasar parámetros a los hilos
 typedef struct {
-    unsigned char *input;   // Puntero a la imagen de entrada
-    unsigned char *output;  // Puntero a la imagen de salida
-    int width;              // Ancho de la imagen
-    int height;             // Alto de la imagen
-    int channels;           // Número de canales de la imagen (e.g., 3 para RGB)
+    DDFPool *pool;          // Grupo de hilos al que pertenece el hilo
+    ImageView input;        // Imagen de entrada (tamaño, canales y tipo de las muestras)
+    ImageView output;       // Imagen de salida, del mismo tamaño
     int start_row;          // Fila de inicio de la sección a procesar
     int end_row;            // Fila de fin de la sección a procesar
     int iterations;         // Número de iteraciones del filtro DDF
     float lambda;           // Parámetro lambda para el filtro DDF
+    int thread_index;       // Índice del hilo (identifica su archivo de punto de control)
+    const DDFOptions *options;  // Opciones del filtro compartidas por todos los hilos
+    ConvergenceState *convergence;  // Estado de convergencia compartido (NULL = desactivado)
+    AOSState *aos;          // Estado del esquema AOS compartido (NULL = esquema explícito)
+    int start_col;          // Columna de inicio de los sistemas por columnas (esquema AOS)
+    int end_col;            // Columna de fin de los sistemas por columnas (esquema AOS)
+    uint64_t input_hash;    // Hash de la imagen de entrada para validar los puntos de control
+    size_t tile_updates;    // Actualizaciones de bloques del mapa de actividad (salida)
+    size_t tiles_skipped;   // De ellas, las que se omitieron por ser planos (salida)
+    int cpu;                // CPU al que se fija el hilo (-1 = sin fijar)
+    ScratchArena arena;     // Memoria temporal del hilo y de sus kernels, que se conserva entre llamadas (niveles, regiones sucias)
 } FilterParams;
 
+// Grupo de hilos persistente: se crean una vez y cada llamada a parallel_ddf_filter les reparte sus franjas
+struct DDFPool {
+    int num_threads;
+    pthread_t *threads;
+    FilterParams *params;     // Parámetros de cada hilo para la llamada actual
+    pthread_barrier_t start;  // Los hilos esperan aquí a que haya una llamada
+    pthread_barrier_t done;   // Y aquí a que todos hayan terminado su franja
+    int active;               // Hilos con franja en la llamada actual (los demás esperan a la siguiente)
+    int stop;                 // Indica a los hilos que deben terminar
+};
+
+// Cabecera del archivo binario de punto de control de una franja
+typedef struct {
+    char magic[8];          // "DDFCKPT1"
+    int32_t width;
+    int32_t height;
+    int32_t channels;
+    int32_t pixel_type;
+    int32_t start_row;
+    int32_t end_row;
+    int32_t iterations_done;  // Iteraciones completadas cuando se tomó la copia
+    float lambda;
+    uint64_t input_hash;
+} CheckpointHeader;
+
+// Estado del escritor asíncrono de puntos de control de un hilo
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    char path[1024];        // Archivo de punto de control
+    char tmp_path[1040];    // Archivo temporal que se renombra al terminar la escritura
+    CheckpointHeader header;
+    unsigned char *snapshot;  // Copia de la franja pendiente de escribir
+    size_t snapshot_size;
+    int pending;            // Hay una copia pendiente de escribir
+    int done;               // El hilo de cómputo terminó
+} CheckpointWriter;
+
 // Función para calcular la conductancia
 float conductance(float gradient, float lambda) {
     return expf(- (gradient * gradient) / (lambda * lambda));
 }
 
+// Función para calcular el hash FNV-1a de las muestras de una imagen, fila a fila (el relleno de las filas no cuenta)
+uint64_t hash_image(const ImageView *image) {
+    uint64_t hash = 1469598103934665603ULL;
+    size_t row_bytes = image_view_row_bytes(image);
+    for (int y = 0; y < image->height; y++) {
+        const unsigned char *row = (const unsigned char *)image_view_row(image, y);
+        for (size_t i = 0; i < row_bytes; i++) {
+            hash = (hash ^ row[i]) * 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+// Función para reservar en la arena una imagen con las filas alineadas como las de image_alloc_view
+ImageView scratch_image(ScratchArena *arena, int width, int height, int channels, int pixel_type) {
+    size_t stride = image_row_stride(width, channels, pixel_type);
+    return image_view_strided(scratch_arena_alloc(arena, stride * height), width, height, channels, pixel_type, stride);
+}
+
+// Función para rellenar la cabecera del punto de control de un hilo
+void fill_checkpoint_header(CheckpointHeader *header, FilterParams *params, int iterations_done) {
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, "DDFCKPT1", 8);
+    header->width = params->input.width;
+    header->height = params->input.height;
+    header->channels = params->input.channels;
+    header->pixel_type = params->input.pixel_type;
+    header->start_row = params->start_row;
+    header->end_row = params->end_row;
+    header->iterations_done = iterations_done;
+    header->lambda = params->lambda;
+    header->input_hash = params->input_hash;
+}
+
+// Función que será ejecutada por el hilo escritor: escribe cada copia pendiente y la renombra de forma atómica
+void *checkpoint_writer_thread(void *arg) {
+    CheckpointWriter *writer = (CheckpointWriter *)arg;
+
+    pthread_mutex_lock(&writer->lock);
+    while (1) {
+        while (!writer->pending && !writer->done) {
+            pthread_cond_wait(&writer->ready, &writer->lock);
+        }
+        if (!writer->pending) {
+            break;
+        }
+        CheckpointHeader header = writer->header;
+        pthread_mutex_unlock(&writer->lock);
+
+        // La copia no se modifica mientras `pending` esté activo, así que se escribe sin el candado
+        FILE *file = fopen(writer->tmp_path, "wb");
+        int ok = file != NULL;
+        if (file) {
+            ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                 fwrite(writer->snapshot, 1, writer->snapshot_size, file) == writer->snapshot_size;
+            ok = fflush(file) == 0 && fsync(fileno(file)) == 0 && ok;
+            fclose(file);
+        }
+        if (!ok || rename(writer->tmp_path, writer->path) != 0) {
+            printf("Error writing checkpoint %s: %s\n", writer->path, strerror(errno));
+        }
+
+        pthread_mutex_lock(&writer->lock);
+        writer->pending = 0;
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+// Función para iniciar el escritor de puntos de control de un hilo
+void start_checkpoint_writer(CheckpointWriter *writer, FilterParams *params) {
+    snprintf(writer->path, sizeof(writer->path), "%s/ddf-%d.ckpt", params->options->checkpoint_dir, params->thread_index);
+    snprintf(writer->tmp_path, sizeof(writer->tmp_path), "%s.tmp", writer->path);
+    writer->snapshot_size = (size_t)(params->end_row - params->start_row) * image_view_row_bytes(&params->input);
+    writer->snapshot = (unsigned char *)image_alloc(writer->snapshot_size > 0 ? writer->snapshot_size : 1);
+    writer->pending = 0;
+    writer->done = 0;
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->ready, NULL);
+    pthread_create(&writer->thread, NULL, checkpoint_writer_thread, writer);
+}
+
+// Función para entregar una copia de la franja al escritor; si todavía está escribiendo la anterior,
+// se omite este punto de control para no detener el cómputo. La copia tiene las filas seguidas, como el archivo
+void submit_checkpoint(CheckpointWriter *writer, FilterParams *params, const ImageView *strip, int iterations_done) {
+    pthread_mutex_lock(&writer->lock);
+    if (!writer->pending) {
+        ImageView snapshot = image_view(writer->snapshot, strip->width, strip->height, strip->channels, strip->pixel_type);
+        image_view_copy(strip, &snapshot);
+        fill_checkpoint_header(&writer->header, params, iterations_done);
+        writer->pending = 1;
+        pthread_cond_signal(&writer->ready);
+    }
+    pthread_mutex_unlock(&writer->lock);
+}
+
+// Función para detener el escritor; al terminar el filtro ya no se necesitan los puntos de control
+void stop_checkpoint_writer(CheckpointWriter *writer) {
+    pthread_mutex_lock(&writer->lock);
+    writer->done = 1;
+    pthread_cond_signal(&writer->ready);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+
+    remove(writer->path);
+    remove(writer->tmp_path);
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->ready);
+    image_free(writer->snapshot);
+}
+
+// Función para cargar el último punto de control válido de un hilo en `strip`
+// Devuelve el número de iteraciones completadas, o 0 si no hay un punto de control compatible
+int load_checkpoint(FilterParams *params, const ImageView *strip) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/ddf-%d.ckpt", params->options->checkpoint_dir, params->thread_index);
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return 0;
+    }
+
+    CheckpointHeader header, expected;
+    size_t row_bytes = image_view_row_bytes(strip);
+    int iterations_done = 0;
+    if (fread(&header, sizeof(header), 1, file) == 1) {
+        fill_checkpoint_header(&expected, params, header.iterations_done);
+        int complete = memcmp(&header, &expected, sizeof(header)) == 0 && header.iterations_done <= params->iterations;
+        for (int y = 0; complete && y < strip->height; y++) {
+            complete = fread(image_view_row(strip, y), 1, row_bytes, file) == row_bytes;
+        }
+        iterations_done = complete ? header.iterations_done : 0;
+    }
+    fclose(file);
+
+    if (iterations_done == 0) {
+        printf("Ignoring incompatible checkpoint %s\n", path);
+    }
+    return iterations_done;
+}
+
+// Función para medir el cambio de una franja entre dos iteraciones según la norma elegida
+double strip_change(const ImageView *previous, const ImageView *current, int norm) {
+    double change = 0.0;
+    size_t row_samples = (size_t)current->width * current->channels;
+    for (int y = 0; y < current->height; y++) {
+        const void *before = image_view_row(previous, y);
+        const void *after = image_view_row(current, y);
+        for (size_t i = 0; i < row_samples; i++) {
+            double diff = fabsf(image_sample(after, current->pixel_type, i) - image_sample(before, current->pixel_type, i));
+            change = norm == NORM_L1 ? change + diff : (diff > change ? diff : change);
+        }
+    }
+    return change;
+}
+
+// Función para reducir el cambio medido por todos los hilos; todos obtienen la misma decisión
+// Devuelve 1 si el cambio global es menor que la tolerancia
+int reduce_change(ConvergenceState *convergence, const DDFOptions *options, int thread_index, int check_index, double change) {
+    double *slots = convergence->changes + (check_index & 1) * convergence->num_threads;
+    slots[thread_index] = change;
+    pthread_barrier_wait(&convergence->barrier);
+
+    double total = 0.0;
+    for (int i = 0; i < convergence->num_threads; i++) {
+        total = options->norm == NORM_L1 ? total + slots[i] : (slots[i] > total ? slots[i] : total);
+    }
+    if (options->norm == NORM_L1) {
+        total /= convergence->total_samples;
+    }
+    return total < options->tolerance;
+}
+
+// Función para comprobar si algún píxel de un bloque de la franja cambió en la última iteración
+int block_changed(const ImageView *before, const ImageView *after, int x0, int y0, int x1, int y1) {
+    size_t pixel_bytes = (size_t)before->channels * pixel_size(before->pixel_type);
+    for (int y = y0; y < y1; y++) {
+        if (memcmp(image_view_pixel(before, x0, y), image_view_pixel(after, x0, y), (x1 - x0) * pixel_bytes) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Función para una iteración de la franja con el mapa de actividad (bloques de FLAT_TILE, 1 = activo)
+// `active` tiene dos mapas: el de esta iteración y, a continuación, el de la siguiente, que se construye aquí.
+// Un bloque activo plano se copia y se desactiva; el resto se calcula y sigue activo, y si cambia los píxeles de
+// uno de sus bordes activa al bloque vecino de ese lado, el único cuyo resultado depende de ellos. Las filas
+// vecinas de otras franjas no cambian, así que no hace falta avisar a otros hilos.
+// Devuelve 0 si no hay kernel especializado para la imagen
+int update_active_tiles(FilterParams *params, const ImageView *strip, const ImageView *output_strip, const ImageView *temp, unsigned char *active, int tiles_x, int tiles_y) {
+    unsigned char *next = active + tiles_x * tiles_y;
+    memset(next, 0, tiles_x * tiles_y);
+    int width = strip->width;
+    int rows = strip->height;
+
+    for (int ty = 0; ty < tiles_y; ty++) {
+        int y0 = ty * FLAT_TILE;  // Filas relativas a la franja
+        int y1 = y0 + FLAT_TILE < rows ? y0 + FLAT_TILE : rows;
+        for (int tx = 0; tx < tiles_x; tx++) {
+            int x0 = tx * FLAT_TILE;
+            int x1 = x0 + FLAT_TILE < width ? x0 + FLAT_TILE : width;
+            params->tile_updates++;
+            if (!active[ty * tiles_x + tx]) {
+                params->tiles_skipped++;  // La salida de la iteración anterior ya es la de esta
+                continue;
+            }
+            ImageView block = image_view_crop(output_strip, x0, y0, x1 - x0, y1 - y0);
+            if (ddf_view_flat(temp, params->options->flat_threshold, x0, params->start_row + y0, x1 - x0, y1 - y0)) {
+                ImageView previous = image_view_crop(strip, x0, y0, x1 - x0, y1 - y0);
+                image_view_copy(&previous, &block);
+                params->tiles_skipped++;
+                continue;
+            }
+            if (!ddf_filter_view(temp, &block, x0, params->start_row + y0, params->lambda)) {
+                return 0;
+            }
+            next[ty * tiles_x + tx] = 1;
+
+            // Activar los vecinos de los bordes que cambiaron
+            if (ty > 0 && block_changed(strip, output_strip, x0, y0, x1, y0 + 1)) {
+                next[(ty - 1) * tiles_x + tx] = 1;
+            }
+            if (ty < tiles_y - 1 && block_changed(strip, output_strip, x0, y1 - 1, x1, y1)) {
+                next[(ty + 1) * tiles_x + tx] = 1;
+            }
+            if (tx > 0 && block_changed(strip, output_strip, x0, y0, x0 + 1, y1)) {
+                next[ty * tiles_x + tx - 1] = 1;
+            }
+            if (tx < tiles_x - 1 && block_changed(strip, output_strip, x1 - 1, y0, x1, y1)) {
+                next[ty * tiles_x + tx + 1] = 1;
+            }
+        }
+    }
+    memcpy(active, next, tiles_x * tiles_y);
+    return 1;
+}
+
 // Función para aplicar el filtro de difusión direccional a una parte de la imagen
 void apply_ddf_section(FilterParams *params) {
-    int width = params->width;
-    int height = params->height;
-    int channels = params->channels;
+    int width = params->input.width;
+    int height = params->input.height;
+    int channels = params->input.channels;
     int start_row = params->start_row;
     int end_row = params->end_row;
     int iterations = params->iterations;
     float lambda = params->lambda;
 
-    // Buffer temporal para la imagen procesada en cada iteración
-    unsigned char *temp = (unsigned char *)malloc(width * height * channels * sizeof(unsigned char));
-    memcpy(temp, params->input, width * height * channels * sizeof(unsigned char));
+    // Imagen temporal procesada en cada iteración
+    ImageView temp = scratch_image(&params->arena, width, height, channels, params->input.pixel_type);
+    image_view_copy(&params->input, &temp);
+
+    // Reanudar desde el último punto de control completado, si existe
+    int first_iter = 0;
+    ImageView strip = image_view_crop(&temp, 0, start_row, width, end_row - start_row);
+    ImageView output_strip = image_view_crop(&params->output, 0, start_row, width, end_row - start_row);
+    CheckpointWriter writer;
+    if (params->options->checkpoint_dir) {
+        first_iter = load_checkpoint(params, &strip);
+        image_view_copy(&strip, &output_strip);
+        start_checkpoint_writer(&writer, params);
+    }
+
+    // Alinear las comprobaciones de convergencia: todos los hilos deben llegar a las mismas barreras,
+    // así que solo se comprueba a partir de la iteración más avanzada desde la que se reanudó
+    ConvergenceState *convergence = params->convergence;
+    if (convergence) {
+        convergence->first_iters[params->thread_index] = first_iter;
+        pthread_barrier_wait(&convergence->barrier);
+        int check_from = 0;
+        for (int i = 0; i < convergence->num_threads; i++) {
+            check_from = convergence->first_iters[i] > check_from ? convergence->first_iters[i] : check_from;
+        }
+        if (params->thread_index == 0) {
+            convergence->check_from = check_from;
+        }
+        pthread_barrier_wait(&convergence->barrier);
+    }
+
+    // Mapas de actividad (esta iteración y la siguiente): al principio todos los bloques de la franja están activos
+    int tiles_x = (width + FLAT_TILE - 1) / FLAT_TILE;
+    int tiles_y = (end_row - start_row + FLAT_TILE - 1) / FLAT_TILE;
+    unsigned char *active = NULL;
+    if (params->options->flat_threshold > 0) {
+        active = (unsigned char *)scratch_arena_alloc(&params->arena, tiles_x * tiles_y > 0 ? 2 * tiles_x * tiles_y : 1);
+        memset(active, 1, tiles_x * tiles_y);
+    }
 
     // Iteraciones del filtro de difusión direccional
-    for (int iter = 0; iter < iterations; iter++) {
-        // Procesar cada píxel de la sección correspondiente
-        for (int y = start_row; y < end_row; y++) {
-            for (int x = 0; x < width; x++) {
-                for (int c = 0; c < channels; c++) {
-                    int idx = (y * width + x) * channels + c;
-                    int up = ((y - 1) * width + x) * channels + c;
-                    int down = ((y + 1) * width + x) * channels + c;
-                    int left = (y * width + (x - 1)) * channels + c;
-                    int right = (y * width + (x + 1)) * channels + c;
-
-                    // Calcular las diferencias de intensidad con los píxeles vecinos
-                    float deltaN = (y > 0) ? (temp[up] - temp[idx]) : 0.0f;
-                    float deltaS = (y < height - 1) ? (temp[down] - temp[idx]) : 0.0f;
-                    float deltaE = (x < width - 1) ? (temp[right] - temp[idx]) : 0.0f;
-                    float deltaW = (x > 0) ? (temp[left] - temp[idx]) : 0.0f;
-
-                    // Calcular los coeficientes de conductancia
-                    float cN = conductance(deltaN, lambda);
-                    float cS = conductance(deltaS, lambda);
-                    float cE = conductance(deltaE, lambda);
-                    float cW = conductance(deltaW, lambda);
-
-                    // Actualizar el valor del píxel aplicando el filtro DDF
-                    params->output[idx] = temp[idx] + 0.25 * (cN * deltaN + cS * deltaS + cE * deltaE + cW * deltaW);
+    for (int iter = first_iter; iter < iterations; iter++) {
+        // Procesar cada píxel de la sección correspondiente, con el kernel especializado si existe
+        // (las imágenes de 16 bits y float siempre lo usan; el camino genérico es solo de 8 bits)
+        // Con el mapa de actividad solo se calculan los bloques activos
+        if (active && !update_active_tiles(params, &strip, &output_strip, &temp, active, tiles_x, tiles_y)) {
+            active = NULL;
+        }
+        if (!active && !ddf_filter_view(&temp, &output_strip, 0, start_row, lambda)) {
+            for (int y = start_row; y < end_row; y++) {
+                const unsigned char *row = (const unsigned char *)image_view_row(&temp, y);
+                const unsigned char *up = (const unsigned char *)image_view_row(&temp, y > 0 ? y - 1 : y);
+                const unsigned char *down = (const unsigned char *)image_view_row(&temp, y < height - 1 ? y + 1 : y);
+                unsigned char *output_row = (unsigned char *)image_view_row(&params->output, y);
+                for (int x = 0; x < width; x++) {
+                    for (int c = 0; c < channels; c++) {
+                        int idx = x * channels + c;
+
+                        // Calcular las diferencias de intensidad con los píxeles vecinos
+                        float deltaN = (y > 0) ? (up[idx] - row[idx]) : 0.0f;
+                        float deltaS = (y < height - 1) ? (down[idx] - row[idx]) : 0.0f;
+                        float deltaE = (x < width - 1) ? (row[idx + channels] - row[idx]) : 0.0f;
+                        float deltaW = (x > 0) ? (row[idx - channels] - row[idx]) : 0.0f;
+
+                        // Calcular los coeficientes de conductancia
+                        float cN = conductance(deltaN, lambda);
+                        float cS = conductance(deltaS, lambda);
+                        float cE = conductance(deltaE, lambda);
+                        float cW = conductance(deltaW, lambda);
+
+                        // Actualizar el valor del píxel aplicando el filtro DDF
+                        output_row[idx] = row[idx] + 0.25 * (cN * deltaN + cS * deltaS + cE * deltaE + cW * deltaW);
+                    }
                 }
             }
         }
+        // Comprobar la convergencia cada `check_every` iteraciones; la salida ya contiene el resultado final
+        if (convergence && (iter + 1) % params->options->check_every == 0 && iter >= convergence->check_from) {
+            double change = strip_change(&strip, &output_strip, params->options->norm);
+            if (reduce_change(convergence, params->options, params->thread_index, (iter + 1) / params->options->check_every, change)) {
+                if (params->thread_index == 0) {
+                    convergence->iterations_run = iter + 1;
+                }
+                break;
+            }
+        }
+
         // Copiar la salida a la entrada para la próxima iteración
-        memcpy(temp + start_row * width * channels, params->output + start_row * width * channels, (end_row - start_row) * width * channels);
+        image_view_copy(&output_strip, &strip);
+
+        // Entregar la franja al escritor asíncrono cada `checkpoint_every` iteraciones
+        if (params->options->checkpoint_dir && (iter + 1) % params->options->checkpoint_every == 0 && iter + 1 < iterations) {
+            submit_checkpoint(&writer, params, &strip, iter + 1);
+        }
     }
 
-    free(temp);
+    if (params->options->checkpoint_dir) {
+        stop_checkpoint_writer(&writer);
+    }
+}
+
+// Función para resolver un sistema tridiagonal (I - 2 tau A) x = d con el algoritmo de Thomas
+// `u` son los valores actuales a lo largo de la línea (separados por `stride`), de los que se obtienen
+// las conductancias entre vecinos; `d` y `x` usan el mismo `stride`. `scratch` debe tener `n` floats.
+void solve_aos_line(const float *u, const float *d, float *x, int n, int stride, float tau, float lambda, float *scratch) {
+    float w_prev = 0.0f;  // Conductancia entre el elemento anterior y el actual
+    float d_prev = 0.0f;
+    for (int i = 0; i < n; i++) {
+        float w_next = (i < n - 1) ? conductance(u[(i + 1) * stride] - u[i * stride], lambda) : 0.0f;
+        float a = -2.0f * tau * w_prev;
+        float b = 1.0f + 2.0f * tau * (w_prev + w_next);
+        float c = -2.0f * tau * w_next;
+        float denom = b - (i > 0 ? a * scratch[i - 1] : 0.0f);
+        scratch[i] = c / denom;
+        d_prev = (d[i * stride] - (i > 0 ? a * d_prev : 0.0f)) / denom;
+        x[i * stride] = d_prev;
+        w_prev = w_next;
+    }
+    for (int i = n - 2; i >= 0; i--) {
+        x[i * stride] -= scratch[i] * x[(i + 1) * stride];
+    }
 }
 
-// Función que será ejecutada por cada hilo
+// Función para aplicar el esquema AOS: en cada paso cada hilo resuelve los sistemas de sus filas y de
+// sus columnas, y después promedia ambas soluciones en sus filas
+void apply_aos_section(FilterParams *params) {
+    AOSState *aos = params->aos;
+    int width = params->input.width;
+    int height = params->input.height;
+    int channels = params->input.channels;
+    int pixel_type = params->input.pixel_type;
+    int row_stride = aos->row_stride;
+    int row_samples = width * channels;
+    int block_cols = params->end_col - params->start_col;
+
+    // Los sistemas por columnas del bloque se resuelven fila a fila para recorrer la memoria en orden,
+    // por lo que se guardan los coeficientes modificados de todo el bloque
+    float *scratch = (float *)scratch_arena_alloc(&params->arena, (size_t)width * sizeof(float));
+    float *column_scratch = (float *)scratch_arena_alloc(&params->arena, (size_t)height * (block_cols > 0 ? block_cols : 1) * channels * sizeof(float));
+    float *w_prev = (float *)scratch_arena_alloc(&params->arena, (size_t)(block_cols > 0 ? block_cols : 1) * channels * sizeof(float));  // Conductancia con la fila anterior de cada columna del bloque
+
+    // Cada hilo inicializa sus filas, así que con --numa quedan en la memoria de su nodo; el relleno queda a cero
+    for (int y = params->start_row; y < params->end_row; y++) {
+        const void *row = image_view_row(&params->input, y);
+        for (int k = 0; k < row_stride; k++) {
+            int i = y * row_stride + k;
+            aos->u[i] = k < row_samples ? image_sample(row, pixel_type, k) : 0.0f;
+            aos->vx[i] = 0.0f;
+            aos->vy[i] = 0.0f;
+        }
+    }
+    pthread_barrier_wait(&aos->barrier);
+
+    for (int step = 0; step < aos->steps; step++) {
+        // Sistemas por filas
+        for (int y = params->start_row; y < params->end_row; y++) {
+            for (int c = 0; c < channels; c++) {
+                float *u = aos->u + y * row_stride + c;
+                solve_aos_line(u, u, aos->vx + y * row_stride + c, width, channels, aos->tau, params->lambda, scratch);
+            }
+        }
+
+        // Sistemas por columnas: barrido hacia delante fila a fila sobre todo el bloque de columnas
+        int block = block_cols * channels;
+        for (int y = 0; y < height; y++) {
+            float *u = aos->u + y * row_stride + params->start_col * channels;
+            float *x = aos->vy + y * row_stride + params->start_col * channels;
+            float *cp = column_scratch + (size_t)y * block;
+            for (int k = 0; k < block; k++) {
+                float w_next = (y < height - 1) ? conductance(u[k + row_stride] - u[k], params->lambda) : 0.0f;
+                float w_before = (y > 0) ? w_prev[k] : 0.0f;
+                float a = -2.0f * aos->tau * w_before;
+                float b = 1.0f + 2.0f * aos->tau * (w_before + w_next);
+                float denom = b - (y > 0 ? a * cp[k - block] : 0.0f);
+                cp[k] = -2.0f * aos->tau * w_next / denom;
+                x[k] = (u[k] - (y > 0 ? a * x[k - row_stride] : 0.0f)) / denom;
+                w_prev[k] = w_next;
+            }
+        }
+        for (int y = height - 2; y >= 0; y--) {
+            float *x = aos->vy + y * row_stride + params->start_col * channels;
+            float *cp = column_scratch + (size_t)y * block;
+            for (int k = 0; k < block; k++) {
+                x[k] -= cp[k] * x[k + row_stride];
+            }
+        }
+
+        // Esperar a que todos los sistemas estén resueltos antes de promediar
+        pthread_barrier_wait(&aos->barrier);
+        for (int i = params->start_row * row_stride; i < params->end_row * row_stride; i++) {
+            aos->u[i] = 0.5f * (aos->vx[i] + aos->vy[i]);
+        }
+        // Esperar a que la imagen esté actualizada antes del siguiente paso
+        pthread_barrier_wait(&aos->barrier);
+    }
+
+    // Convertir las filas del hilo a la imagen de salida
+    for (int y = params->start_row; y < params->end_row; y++) {
+        void *row = image_view_row(&params->output, y);
+        for (int k = 0; k < row_samples; k++) {
+            image_store(row, pixel_type, k, aos->u[y * row_stride + k]);
+        }
+    }
+}
+
+// Función que será ejecutada por cada hilo: procesa su franja de cada llamada hasta que se detiene el grupo
+// Toda la memoria temporal del hilo sale de su arena, así que tras la primera imagen de cada tamaño no se reserva nada
 void *filter_thread(void *arg) {
     FilterParams *params = (FilterParams *)arg;  // Convertir el argumento a un puntero a FilterParams
-    apply_ddf_section(params);                   // Aplicar el filtro DDF a la sección especificada
+    DDFPool *pool = params->pool;
+    // Fijar el hilo antes de tocar sus búferes: las páginas que escribe primero quedan en su nodo
+    if (params->cpu >= 0 && !numa_pin_current_thread(params->cpu)) {
+        printf("Could not pin a thread to CPU %d\n", params->cpu);
+    }
+    filter_kernels_bind_arena(&params->arena);
+    while (1) {
+        pthread_barrier_wait(&pool->start);      // Esperar a la siguiente llamada
+        if (pool->stop) {
+            break;
+        }
+        if (params->thread_index < pool->active) {
+            // La memoria temporal de la llamada anterior ya no se usa; la arena conserva sus bloques
+            scratch_arena_reset(&params->arena);
+            if (params->aos) {
+                apply_aos_section(params);       // Aplicar el esquema AOS a la sección especificada
+            } else {
+                apply_ddf_section(params);       // Aplicar el filtro DDF a la sección especificada
+            }
+        }
+        pthread_barrier_wait(&pool->done);
+    }
+    scratch_arena_destroy(&params->arena);
     return NULL;
 }
 
-// Función para dividir la imagen en secciones y crear hilos para el procesamiento
-void parallel_ddf_filter(unsigned char *input, unsigned char *output, int width, int height, int channels, int iterations, float lambda, int num_nodes) {
-    pthread_t threads[num_nodes];  // Array para almacenar los identificadores de los hilos
-    FilterParams params[num_nodes]; // Array para almacenar los parámetros de cada hilo
+// Función para crear el grupo de hilos
+// Con numa (la topología leída, NULL = sin fijar), cada hilo se fija a un CPU según su índice en el grupo
+void create_thread_pool(DDFPool *pool, int num_threads, const NumaTopology *numa) {
+    pool->num_threads = num_threads;
+    pool->threads = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+    pool->params = (FilterParams *)calloc(num_threads, sizeof(FilterParams));
+    pool->active = 0;
+    pool->stop = 0;
+    pthread_barrier_init(&pool->start, NULL, num_threads + 1);
+    pthread_barrier_init(&pool->done, NULL, num_threads + 1);
+    for (int i = 0; i < num_threads; i++) {
+        pool->params[i].pool = pool;
+        pool->params[i].thread_index = i;
+        pool->params[i].cpu = -1;
+        scratch_arena_init(&pool->params[i].arena);
+        if (numa) {
+            int node;
+            pool->params[i].cpu = numa_thread_cpu(numa, i, num_threads, &node);
+        }
+        pthread_create(&pool->threads[i], NULL, filter_thread, &pool->params[i]);  // Crear el hilo
+    }
+}
+
+// Función para detener y liberar el grupo de hilos
+void destroy_thread_pool(DDFPool *pool) {
+    pool->stop = 1;
+    pthread_barrier_wait(&pool->start);
+    for (int i = 0; i < pool->num_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_barrier_destroy(&pool->start);
+    pthread_barrier_destroy(&pool->done);
+    free(pool->threads);
+    free(pool->params);
+}
+
+// Función para dividir la imagen en secciones y repartirlas entre los primeros num_nodes hilos del grupo de las opciones
+// row_bounds (num_nodes + 1 límites) fija las franjas de los hilos; NULL las reparte por igual
+// Devuelve las iteraciones ejecutadas si el filtro se detuvo por convergencia, o 0 en caso contrario
+int parallel_ddf_filter(const ImageView *input, const ImageView *output, int iterations, float lambda, int num_nodes, const DDFOptions *options, const int *row_bounds) {
+    DDFPool *pool = options->pool;
+    FilterParams *params = pool->params;  // Parámetros de cada hilo del grupo
+    int width = input->width, height = input->height, channels = input->channels;
 
     int rows_per_thread = height / num_nodes;  // Calcular el número de filas por hilo
+    uint64_t input_hash = options->checkpoint_dir ? hash_image(input) : 0;
+
+    // Estado compartido para el criterio de convergencia
+    ConvergenceState convergence;
+    double changes[2 * num_nodes];
+    int first_iters[num_nodes];
+    if (options->tolerance > 0) {
+        pthread_barrier_init(&convergence.barrier, NULL, num_nodes);
+        convergence.num_threads = num_nodes;
+        convergence.total_samples = (size_t)width * height * channels;
+        convergence.changes = changes;
+        convergence.first_iters = first_iters;
+        convergence.check_from = 0;
+        convergence.iterations_run = 0;
+    }
+
+    // Estado compartido del esquema AOS: se integra el mismo tiempo de difusión que las iteraciones
+    // explícitas (0.25 por iteración) con pasos de tamaño `step`
+    AOSState aos;
+    int cols_per_thread = width / num_nodes;
+    if (options->scheme == SCHEME_AOS) {
+        float diffusion_time = 0.25f * iterations;
+        size_t stride = image_row_stride(width, channels, PIXEL_F32);
+        pthread_barrier_init(&aos.barrier, NULL, num_nodes);
+        aos.steps = (int)ceilf(diffusion_time / options->step);
+        aos.tau = aos.steps > 0 ? diffusion_time / aos.steps : 0.0f;
+        aos.row_stride = (int)(stride / sizeof(float));
+        aos.u = (float *)image_alloc(stride * height);
+        aos.vx = (float *)image_alloc(stride * height);
+        aos.vy = (float *)image_alloc(stride * height);  // Los hilos inicializan sus filas
+    }
+
     for (int i = 0; i < num_nodes; i++) {
-        params[i].input = input;
-        params[i].output = output;
-        params[i].width = width;
-        params[i].height = height;
-        params[i].channels = channels;
+        params[i].input = *input;
+        params[i].output = *output;
         params[i].iterations = iterations;
         params[i].lambda = lambda;
-        params[i].start_row = i * rows_per_thread;  // Fila de inicio para este hilo
-        params[i].end_row = (i == num_nodes - 1) ? height : (i + 1) * rows_per_thread;  // Fila de fin para este hilo
-        
-        pthread_create(&threads[i], NULL, filter_thread, &params[i]);  // Crear el hilo
+        params[i].start_row = row_bounds ? row_bounds[i] : i * rows_per_thread;  // Fila de inicio para este hilo
+        params[i].end_row = row_bounds ? row_bounds[i + 1] : (i == num_nodes - 1) ? height : (i + 1) * rows_per_thread;  // Fila de fin para este hilo
+        params[i].options = options;
+        params[i].convergence = options->tolerance > 0 ? &convergence : NULL;
+        params[i].aos = options->scheme == SCHEME_AOS ? &aos : NULL;
+        params[i].start_col = i * cols_per_thread;  // Columna de inicio para este hilo
+        params[i].end_col = (i == num_nodes - 1) ? width : (i + 1) * cols_per_thread;  // Columna de fin para este hilo
+        params[i].input_hash = input_hash;
+        params[i].tile_updates = 0;
+        params[i].tiles_skipped = 0;
     }
 
-    // Esperar a que todos los hilos terminen
+    // Despertar a los hilos y esperar a que todos terminen su franja
+    pool->active = num_nodes;
+    pthread_barrier_wait(&pool->start);
+    pthread_barrier_wait(&pool->done);
+    size_t tile_updates = 0, tiles_skipped = 0;
     for (int i = 0; i < num_nodes; i++) {
-        pthread_join(threads[i], NULL);
+        tile_updates += params[i].tile_updates;
+        tiles_skipped += params[i].tiles_skipped;
+    }
+    if (tile_updates > 0) {
+        printf("Flat tiles: %zu of %zu tile updates skipped (%.1f%%)\n", tiles_skipped, tile_updates, 100.0 * tiles_skipped / tile_updates);
     }
+
+    if (options->scheme == SCHEME_AOS) {
+        pthread_barrier_destroy(&aos.barrier);
+        image_free(aos.u);
+        image_free(aos.vx);
+        image_free(aos.vy);
+    }
+    if (options->tolerance > 0) {
+        pthread_barrier_destroy(&convergence.barrier);
+        return convergence.iterations_run;
+    }
+    return 0;
+}
+
+// Función para reducir la imagen a la mitad promediando bloques de 2x2 píxeles
+ImageView downsample_half(const ImageView *src) {
+    int width = src->width, height = src->height, channels = src->channels, pixel_type = src->pixel_type;
+    ImageView dst = image_alloc_view((width + 1) / 2, (height + 1) / 2, channels, pixel_type);
+
+    for (int y = 0; y < dst.height; y++) {
+        const void *row0 = image_view_row(src, 2 * y);
+        const void *row1 = image_view_row(src, (2 * y + 1 < height) ? 2 * y + 1 : 2 * y);
+        void *out = image_view_row(&dst, y);
+        for (int x = 0; x < dst.width; x++) {
+            int x0 = 2 * x;
+            int x1 = (2 * x + 1 < width) ? 2 * x + 1 : x0;
+            for (int c = 0; c < channels; c++) {
+                float sum = image_sample(row0, pixel_type, x0 * channels + c) + image_sample(row0, pixel_type, x1 * channels + c) +
+                            image_sample(row1, pixel_type, x0 * channels + c) + image_sample(row1, pixel_type, x1 * channels + c);
+                image_store(out, pixel_type, x * channels + c, sum / 4.0f);
+            }
+        }
+    }
+    return dst;
+}
+
+// Función para ampliar una imagen con interpolación bilineal (centros de píxel alineados) al tamaño de dst
+void upsample_bilinear(const ImageView *src, const ImageView *dst) {
+    int src_width = src->width, src_height = src->height;
+    int width = dst->width, height = dst->height, channels = dst->channels, pixel_type = dst->pixel_type;
+    float scale_x = (float)src_width / width;
+    float scale_y = (float)src_height / height;
+
+    for (int y = 0; y < height; y++) {
+        float sy = (y + 0.5f) * scale_y - 0.5f;
+        sy = sy < 0.0f ? 0.0f : sy;
+        int y0 = (int)sy;
+        int y1 = (y0 + 1 < src_height) ? y0 + 1 : y0;
+        float fy = sy - y0;
+        const void *row0 = image_view_row(src, y0);
+        const void *row1 = image_view_row(src, y1);
+        void *out = image_view_row(dst, y);
+        for (int x = 0; x < width; x++) {
+            float sx = (x + 0.5f) * scale_x - 0.5f;
+            sx = sx < 0.0f ? 0.0f : sx;
+            int x0 = (int)sx;
+            int x1 = (x0 + 1 < src_width) ? x0 + 1 : x0;
+            float fx = sx - x0;
+            for (int c = 0; c < channels; c++) {
+                float top = image_sample(row0, pixel_type, x0 * channels + c) * (1.0f - fx) + image_sample(row0, pixel_type, x1 * channels + c) * fx;
+                float bottom = image_sample(row1, pixel_type, x0 * channels + c) * (1.0f - fx) + image_sample(row1, pixel_type, x1 * channels + c) * fx;
+                image_store(out, pixel_type, x * channels + c, top * (1.0f - fy) + bottom * fy);
+            }
+        }
+    }
+}
+
+// Función para planificar la pirámide: tamaño de cada nivel (la mitad del anterior mientras el lado menor no baje
+// de MIN_PYRAMID_SIZE) e iteraciones de cada uno; devuelve el número de niveles
+int plan_pyramid(int width, int height, int iterations, const DDFOptions *options, int *widths, int *heights, int *iterations_per_level) {
+    int num_levels = 1;
+    widths[0] = width;
+    heights[0] = height;
+    while (num_levels < options->pyramid_levels &&
+           widths[num_levels - 1] / 2 >= MIN_PYRAMID_SIZE && heights[num_levels - 1] / 2 >= MIN_PYRAMID_SIZE) {
+        widths[num_levels] = (widths[num_levels - 1] + 1) / 2;
+        heights[num_levels] = (heights[num_levels - 1] + 1) / 2;
+        num_levels++;
+    }
+
+    // Repartir las iteraciones: las indicadas por nivel, o por defecto una décima parte a resolución completa y el
+    // resto del tiempo de difusión repartido entre los niveles reducidos (en el nivel l una iteración equivale a 4^l).
+    // Del más grueso al más fino, cada nivel redondea al entero más cercano (puede ser 0) y pasa lo que le sobra o le
+    // falta al siguiente, así que el total se acerca al tiempo pedido; un nivel indicado también descuenta su tiempo
+    int refine_iterations = iterations / 10 > 0 ? iterations / 10 : 1;
+    float share = num_levels > 1 ? (float)(iterations - refine_iterations) / (num_levels - 1) : 0.0f;
+    float carry = 0.0f;  // Tiempo de difusión pendiente, en iteraciones a resolución completa
+    for (int l = num_levels - 1; l >= 0; l--) {
+        int given = options->level_iterations[options->pyramid_levels - 1 - l];
+        float scale = (float)(1 << (2 * l));
+        float wanted = (l == 0 ? refine_iterations : share) + carry;
+        if (given > 0) {
+            iterations_per_level[l] = given;
+        } else if (num_levels == 1) {
+            iterations_per_level[l] = iterations;
+        } else {
+            int level = (int)lroundf(wanted / scale);
+            int least = l == 0 ? 1 : 0;  // La resolución completa siempre refina el resultado ampliado
+            iterations_per_level[l] = level > least ? level : least;
+        }
+        carry = wanted - iterations_per_level[l] * scale;
+    }
+    return num_levels;
+}
+
+// Función para aplicar el filtro DDF con una pirámide multirresolución: la mayor parte de la difusión se
+// realiza en los niveles reducidos (cada iteración cuesta 1/4 por nivel) y el resultado se amplía y refina
+// con unas pocas iteraciones a resolución completa. Los puntos de control no se usan en este modo.
+void pyramid_ddf_filter(const ImageView *input, const ImageView *output, int iterations, float lambda, int num_nodes, const DDFOptions *options) {
+    ImageView levels[MAX_PYRAMID_LEVELS];
+    int widths[MAX_PYRAMID_LEVELS], heights[MAX_PYRAMID_LEVELS];
+    int iterations_per_level[MAX_PYRAMID_LEVELS];
+
+    // Construir la pirámide planificada
+    int num_levels = plan_pyramid(input->width, input->height, iterations, options, widths, heights, iterations_per_level);
+    levels[0] = *input;
+    for (int l = 1; l < num_levels; l++) {
+        levels[l] = downsample_half(&levels[l - 1]);
+    }
+
+    DDFOptions level_options = *options;
+    level_options.checkpoint_dir = NULL;
+
+    // Filtrar del nivel más grueso al más fino, usando el resultado ampliado como entrada del siguiente nivel
+    ImageView current = {NULL, 0, 0, 0, 0, 0};
+    for (int l = num_levels - 1; l >= 0; l--) {
+        ImageView level_input = levels[l];
+        if (current.data) {
+            level_input = image_alloc_view(widths[l], heights[l], input->channels, input->pixel_type);
+            upsample_bilinear(&current, &level_input);
+            image_free(current.data);
+        }
+        ImageView level_output = (l == 0) ? *output : image_alloc_view(widths[l], heights[l], input->channels, input->pixel_type);
+
+        printf("Pyramid level %d: %dx%d, %d iterations\n", l, widths[l], heights[l], iterations_per_level[l]);
+        if (iterations_per_level[l] > 0) {
+            parallel_ddf_filter(&level_input, &level_output, iterations_per_level[l], lambda, num_nodes, &level_options, NULL);
+        } else {
+            image_view_copy(&level_input, &level_output);
+        }
+
+        if (level_input.data != levels[l].data) {
+            image_free(level_input.data);
+        }
+        current = level_output;
+    }
+
+    for (int l = 1; l < num_levels; l++) {
+        image_free(levels[l].data);
+    }
+}
+
+// Función para difundir solo una región de la imagen con el esquema explícito y escribirla en output
+// La región se calcula en un recorte dilatado por el número de iteraciones, partido por las mismas franjas que la
+// ejecución completa con num_nodes hilos, porque cada hilo solo ve las filas vecinas a su franja tal como estaban en
+// la entrada; así la región es idéntica a la de la ejecución completa
+void ddf_filter_region(const ImageView *image, const ImageView *output, int iterations, float lambda, int num_nodes, const DDFOptions *options, ImageRect region) {
+    DDFOptions crop_options = *options;
+    crop_options.checkpoint_dir = NULL;  // Los puntos de control son de la imagen completa
+    int height = image->height;
+    ImageRect crop = dilate_image_rect(region, iterations, image->width, height);  // Píxeles de entrada de los que depende
+
+    // Franjas de la ejecución completa que cortan el recorte, en filas del recorte
+    int rows_per_thread = height / num_nodes;
+    int bounds[num_nodes + 1];
+    int pieces = 0;
+    bounds[0] = 0;
+    for (int t = 0; t < num_nodes; t++) {
+        int start = t * rows_per_thread;
+        int end = (t == num_nodes - 1) ? height : (t + 1) * rows_per_thread;
+        start = start > crop.y ? start : crop.y;
+        end = end < crop.y + crop.height ? end : crop.y + crop.height;
+        if (start < end) {
+            bounds[pieces] = start - crop.y;
+            bounds[++pieces] = end - crop.y;
+        }
+    }
+
+    ImageView crop_input = image_alloc_view(crop.width, crop.height, image->channels, image->pixel_type);
+    ImageView crop_output = image_alloc_view(crop.width, crop.height, image->channels, image->pixel_type);
+    ImageView source = image_view_crop(image, crop.x, crop.y, crop.width, crop.height);
+    image_view_copy(&source, &crop_input);
+    parallel_ddf_filter(&crop_input, &crop_output, iterations, lambda, pieces, &crop_options, bounds);
+    ImageView result = image_view_crop(&crop_output, region.x - crop.x, region.y - crop.y, region.width, region.height);
+    ImageView target = image_view_crop(output, region.x, region.y, region.width, region.height);
+    image_view_copy(&result, &target);
+    image_free(crop_input.data);
+    image_free(crop_output.data);
+}
+
+// Función para filtrar solo las regiones de interés (--roi) con el esquema explícito; el resto de la salida es la entrada
+// Cada región recortada a la imagen se difunde entera con ddf_filter_region, así que coincide con la ejecución completa
+// con los mismos hilos; donde dos regiones se solapan ambas escriben los mismos valores
+// Devuelve 0 si las regiones se parten en demasiados rectángulos
+int parallel_ddf_roi(const ImageView *input, const ImageView *output, int iterations, float lambda, int num_nodes, const DDFOptions *options) {
+    int width = input->width, height = input->height;
+    ImageRect rois[ROI_MAX_PIECES];
+    int num_rois = roi_disjoint(options->rois, options->num_rois, width, height, rois, ROI_MAX_PIECES);
+    if (num_rois < 0) {
+        printf("The regions of interest overlap in more than %d pieces\n", ROI_MAX_PIECES);
+        return 0;
+    }
+    image_view_copy(input, output);
+    printf("Regions of interest: %d rectangles, %.1f%% of the image filtered\n", options->num_rois,
+           100.0 * roi_area(rois, num_rois) / ((double)width * height));
+    for (int i = 0; i < options->num_rois; i++) {
+        ImageRect region = dilate_image_rect(options->rois[i], 0, width, height);
+        if (region.width > 0 && region.height > 0) {
+            ddf_filter_region(input, output, iterations, lambda, num_nodes, options, region);
+        }
+    }
+    return 1;
+}
+
+// Función para volver a filtrar solo las regiones sucias con el esquema explícito; output contiene la salida anterior
+// Cada rectángulo dilatado por el número de iteraciones contiene los píxeles de salida que pueden cambiar y se
+// recalcula con ddf_filter_region
+void ddf_dirty_rects(const ImageView *image, const ImageView *output, int iterations, float lambda, int num_nodes, const DDFOptions *options, const ImageRect *rects, int count) {
+    for (int i = 0; i < count; i++) {
+        ImageRect region = dilate_image_rect(rects[i], iterations, image->width, image->height);  // Píxeles de salida que pueden cambiar
+        if (region.width > 0 && region.height > 0) {
+            ddf_filter_region(image, output, iterations, lambda, num_nodes, options, region);
+        }
+    }
+}
+
+// Función para el modo incremental: copia la salida anterior en output y vuelve a filtrar solo las regiones sucias,
+// las dadas o, si no hay ninguna, las que resultan de comparar la entrada anterior con la actual
+// Devuelve 0 si hay que filtrar la imagen completa
+int ddf_incremental(const ImageView *image, const ImageView *output, int iterations, float lambda, int num_nodes, const DDFOptions *options, const char *previous_input, const char *previous_output, ImageRect *rects, int count) {
+    int width = image->width, height = image->height;
+    // El esquema AOS, la pirámide y la parada por convergencia propagan los cambios por toda la imagen; con un umbral
+    // de bloques planos que no es exacto, el resultado depende de cómo caen los bloques en el recorte
+    int flat_exact = options->flat_threshold == 0 || (image->pixel_type != PIXEL_F32 && options->flat_threshold <= 1.0f);
+    if (options->scheme != SCHEME_EXPLICIT || options->pyramid_levels > 1 || options->tolerance > 0 || !flat_exact) {
+        printf("Incremental mode needs the explicit scheme without --tolerance, --pyramid or an inexact --flat-threshold; filtering the whole image\n");
+        return 0;
+    }
+    ImageView previous = {NULL, 0, 0, 0, 0, 0};
+    if (!load_image_view(previous_output, &previous, image->pixel_type) || previous.width != width || previous.height != height ||
+        previous.channels != image->channels) {
+        printf("Previous output %s does not match the input; filtering the whole image\n", previous_output);
+        image_free(previous.data);
+        return 0;
+    }
+    image_view_copy(&previous, output);
+    image_free(previous.data);
+    previous.data = NULL;
+    if (count == 0) {
+        count = load_image_view(previous_input, &previous, image->pixel_type) && previous.width == width && previous.height == height &&
+                previous.channels == image->channels ? find_dirty_rects(&previous, image, rects, DIRTY_MAX_RECTS) : -1;
+        image_free(previous.data);
+        if (count < 0) {
+            printf("Previous input %s missing or too different; filtering the whole image\n", previous_input);
+            return 0;
+        }
+    }
+
+    // Si los recortes cubren gran parte de la imagen, filtrarla completa es más barato
+    double fraction = dirty_crop_fraction(rects, count, iterations, width, height);
+    if (fraction > DIRTY_FULL_RUN_FRACTION) {
+        printf("Dirty regions need %.0f%% of the image; filtering the whole image\n", 100.0 * fraction);
+        return 0;
+    }
+    ddf_dirty_rects(image, output, iterations, lambda, num_nodes, options, rects, count);
+    printf("Incremental: %d dirty rectangles, %.1f%% of the image recomputed\n", count, 100.0 * fraction);
+    return 1;
+}
+
+// Función para el modelo de coste de la vista previa: píxeles por pasos de difusión (iteraciones explícitas o pasos
+// AOS) de una ejecución, sumados sobre los niveles de la pirámide
+double ddf_work(int width, int height, int iterations, const DDFOptions *options) {
+    int widths[MAX_PYRAMID_LEVELS], heights[MAX_PYRAMID_LEVELS], iterations_per_level[MAX_PYRAMID_LEVELS];
+    int num_levels = 1;
+    widths[0] = width;
+    heights[0] = height;
+    iterations_per_level[0] = iterations;
+    if (options->pyramid_levels > 1) {
+        num_levels = plan_pyramid(width, height, iterations, options, widths, heights, iterations_per_level);
+    }
+    double work = 0.0;
+    for (int l = 0; l < num_levels; l++) {
+        int steps = options->scheme == SCHEME_AOS ? (int)ceilf(0.25f * iterations_per_level[l] / options->step) : iterations_per_level[l];
+        work += (double)widths[l] * heights[l] * steps;
+    }
+    return work;
+}
+
+// Función para la vista previa: difunde una copia de la imagen reducida por área a como mucho max_pixels píxeles y
+// estima el tiempo de la ejecución completa. Un píxel reducido cubre factor x factor píxeles, así que el tiempo de
+// difusión, y con él las iteraciones (también las dadas por nivel), se divide por factor al cuadrado
+// Devuelve la vista previa filtrada
+ImageView ddf_preview(const ImageView *image, int iterations, float lambda, int num_nodes, const DDFOptions *options, size_t max_pixels) {
+    int factor = preview_factor(image->width, image->height, max_pixels);
+    ImageView preview = preview_downsample(image, factor);
+    ImageView output = image_alloc_view(preview.width, preview.height, preview.channels, preview.pixel_type);
+
+    int area = factor * factor;
+    int preview_iterations = (iterations + area - 1) / area;
+    DDFOptions preview_options = *options;
+    preview_options.checkpoint_dir = NULL;  // La vista previa ni reanuda ni deja puntos de control
+    for (int l = 0; l < MAX_PYRAMID_LEVELS; l++) {
+        preview_options.level_iterations[l] = (options->level_iterations[l] + area - 1) / area;
+    }
+    printf("Preview iterations: %d (full run: %d)\n", preview_iterations, iterations);
+
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    int iterations_run = 0;
+    if (options->pyramid_levels > 1) {
+        pyramid_ddf_filter(&preview, &output, preview_iterations, lambda, num_nodes, &preview_options);
+    } else {
+        iterations_run = parallel_ddf_filter(&preview, &output, preview_iterations, lambda, num_nodes, &preview_options, NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double preview_ms = (end.tv_sec - begin.tv_sec) * 1000.0 + (end.tv_nsec - begin.tv_nsec) / 1e6;
+    image_free(preview.data);
+
+    // Si la vista previa convergió antes, el coste por iteración se mide con las que hizo; la ejecución completa
+    // se proyecta con todas, como cota superior
+    if (iterations_run > 0) {
+        printf("Preview converged after %d of %d iterations\n", iterations_run, preview_iterations);
+        preview_iterations = iterations_run;
+    }
+    double preview_work = ddf_work(output.width, output.height, preview_iterations, &preview_options);
+    double full_work = ddf_work(image->width, image->height, iterations, options);
+    preview_report(image->width, image->height, output.width, output.height, factor, preview_ms,
+                   preview_project(preview_ms, preview_work, full_work), num_nodes);
+    return output;
+}
+
+// Función para calcular la clave de la caché de resultados: la imagen y todas las opciones que cambian el resultado
+// Incluye el número de hilos y las franjas (row_bounds, NULL = reparto por igual), porque cada hilo ve las filas
+// vecinas a su franja tal como estaban en la entrada
+uint64_t result_key(const ImageView *image, int iterations, float lambda, int num_nodes, const int *row_bounds, const DDFOptions *options) {
+    char description[512 + ROI_MAX_RECTS * 64 + (row_bounds ? 12 * (num_nodes + 1) : 0)];
+    int length = snprintf(description, sizeof(description), "DDF iterations=%d lambda=%g scheme=%d step=%g tolerance=%g check=%d norm=%d flat=%g %dx%dx%d pixel=%d threads=%d levels=%d:",
+                          iterations, lambda, options->scheme, options->step, options->tolerance, options->check_every, options->norm,
+                          options->flat_threshold, image->width, image->height, image->channels, image->pixel_type, num_nodes, options->pyramid_levels);
+    for (int i = 0; i < options->pyramid_levels && length < (int)sizeof(description) - 16; i++) {
+        length += snprintf(description + length, sizeof(description) - length, "%d,", options->level_iterations[i]);
+    }
+    for (int i = 0; i < options->num_rois; i++) {
+        length += snprintf(description + length, sizeof(description) - length, " roi=%d,%d,%d,%d", options->rois[i].x,
+                           options->rois[i].y, options->rois[i].width, options->rois[i].height);
+    }
+    for (int i = 0; row_bounds && i <= num_nodes; i++) {
+        length += snprintf(description + length, sizeof(description) - length, "%s%d", i == 0 ? " rows=" : ",", row_bounds[i]);
+    }
+    return result_cache_key_view(image, description);
+}
+
+// Función para leer las opciones del filtro sobre las ya dadas; devuelve 0 si alguna no es válida
+// Una lista --level-iterations sustituye a la anterior y se alinea para que su último elemento corresponda al nivel más
+// fino; sin --pyramid fija el número de niveles, y con él no puede tener más elementos que niveles. Si solo cambia
+// --pyramid, las iteraciones por nivel ya dadas se descartan y vuelven a ser automáticas
+int parse_ddf_options(int argc, char **argv, DDFOptions *options) {
+    int level_list[MAX_PYRAMID_LEVELS];  // --level-iterations tal como se dio, del nivel más grueso al más fino
+    int level_count = 0, pyramid_given = 0;
+    int previous_levels = options->pyramid_levels;
+    for (int i = 0; i < argc; i++) {
+        int valid = 1;
+        if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            options->iterations = atoi(argv[++i]);
+            valid = options->iterations >= 0;
+        } else if (strcmp(argv[i], "--lambda") == 0 && i + 1 < argc) {
+            options->lambda = atof(argv[++i]);
+            valid = options->lambda > 0;
+        } else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+            options->tolerance = atof(argv[++i]);
+            valid = options->tolerance > 0;
+        } else if (strcmp(argv[i], "--check-every") == 0 && i + 1 < argc) {
+            options->check_every = atoi(argv[++i]);
+            valid = options->check_every > 0;
+        } else if (strcmp(argv[i], "--norm") == 0 && i + 1 < argc) {
+            i++;
+            options->norm = strcmp(argv[i], "l1") == 0 ? NORM_L1 : NORM_LINF;
+            valid = strcmp(argv[i], "l1") == 0 || strcmp(argv[i], "linf") == 0;
+        } else if (strcmp(argv[i], "--scheme") == 0 && i + 1 < argc) {
+            i++;
+            options->scheme = strcmp(argv[i], "aos") == 0 ? SCHEME_AOS : SCHEME_EXPLICIT;
+            valid = strcmp(argv[i], "aos") == 0 || strcmp(argv[i], "explicit") == 0;
+        } else if (strcmp(argv[i], "--step") == 0 && i + 1 < argc) {
+            options->step = atof(argv[++i]);
+            valid = options->step > 0;
+        } else if (strcmp(argv[i], "--pyramid") == 0 && i + 1 < argc) {
+            pyramid_given = 1;
+            options->pyramid_levels = atoi(argv[++i]);
+            valid = options->pyramid_levels > 0 && options->pyramid_levels <= MAX_PYRAMID_LEVELS;
+        } else if (strcmp(argv[i], "--level-iterations") == 0 && i + 1 < argc) {
+            // Lista separada por comas, del nivel más grueso al más fino; se alinea tras leer todas las opciones
+            char *list = argv[++i];
+            level_count = 0;
+            for (char *token = strtok(list, ","); token && valid; token = strtok(NULL, ",")) {
+                valid = level_count < MAX_PYRAMID_LEVELS && atoi(token) >= 0;
+                if (valid) {
+                    level_list[level_count++] = atoi(token);
+                }
+            }
+        } else if (strcmp(argv[i], "--flat-threshold") == 0 && i + 1 < argc) {
+            options->flat_threshold = atof(argv[++i]);
+            valid = options->flat_threshold >= 0;
+        } else if (strcmp(argv[i], "--pixel") == 0 && i + 1 < argc) {
+            valid = parse_pixel_type(argv[++i], &options->pixel_type);
+        } else if (strcmp(argv[i], "--roi") == 0 && i + 1 < argc) {
+            valid = options->num_rois < ROI_MAX_RECTS && parse_image_rect(argv[++i], &options->rois[options->num_rois++]);
+        } else {
+            valid = 0;
+        }
+        if (!valid) {
+            return 0;
+        }
+    }
+
+    if (level_count > 0 || options->pyramid_levels != previous_levels) {
+        memset(options->level_iterations, 0, sizeof(options->level_iterations));
+    }
+    if (level_count > 0) {
+        if (!pyramid_given) {
+            options->pyramid_levels = level_count;
+        }
+        if (level_count > options->pyramid_levels) {
+            return 0;
+        }
+        for (int l = 0; l < level_count; l++) {
+            options->level_iterations[options->pyramid_levels - level_count + l] = level_list[l];
+        }
+    }
+    return 1;
+}
+
+// Función para comprobar que las opciones se pueden combinar; incremental indica que se parte de una ejecución anterior
+int ddf_options_compatible(const DDFOptions *options, int incremental) {
+    // Las regiones de interés se difunden con el esquema explícito, cada una por su cuenta
+    int roi_exclusive = options->scheme != SCHEME_EXPLICIT || options->pyramid_levels > 1 || options->tolerance > 0 ||
+                        options->checkpoint_dir || options->flat_threshold > 0 || incremental;
+    // El esquema AOS no comprueba la convergencia, ni guarda puntos de control, ni salta bloques planos
+    int aos_exclusive = options->tolerance > 0 || options->checkpoint_dir || options->flat_threshold > 0;
+    return !(options->num_rois > 0 && roi_exclusive) && !(options->scheme == SCHEME_AOS && aos_exclusive);
+}
+
+// Función para escalar lambda, la tolerancia y el umbral de bloques planos, dados en unidades de 8 bits, al rango del tipo de píxel
+void scale_to_pixel_range(DDFOptions *options, int pixel_type) {
+    options->lambda *= pixel_range(pixel_type) / 255.0f;
+    options->tolerance *= pixel_range(pixel_type) / 255.0f;
+    options->flat_threshold *= pixel_range(pixel_type) / 255.0f;
+}
+
+// Función para filtrar una imagen ya cargada en una salida ya reservada, con las opciones ya escaladas a su tipo de píxel:
+// solo las regiones de interés si las hay, con la pirámide si tiene varios niveles o la imagen completa
+// Devuelve 0 si las regiones de interés no se pudieron filtrar
+int ddf_image(const ImageView *image, const ImageView *output, int num_nodes, const DDFOptions *options) {
+    if (options->num_rois > 0) {
+        return parallel_ddf_roi(image, output, options->iterations, options->lambda, num_nodes, options);
+    }
+    if (options->pyramid_levels > 1) {
+        pyramid_ddf_filter(image, output, options->iterations, options->lambda, num_nodes, options);
+        return 1;
+    }
+    int iterations_run = parallel_ddf_filter(image, output, options->iterations, options->lambda, num_nodes, options, NULL);
+    if (iterations_run > 0) {
+        printf("Converged after %d of %d iterations\n", iterations_run, options->iterations);
+    }
+    return 1;
+}
+
+// Función para filtrar una imagen pasando por la caché de resultados; hit indica si el resultado estaba en ella
+// Devuelve la imagen de salida, sin datos (NULL) si no se pudo filtrar
+ImageView ddf_image_cached(const ResultCache *cache, const ImageView *image, int num_nodes, const DDFOptions *options, int *hit) {
+    ImageView output = image_alloc_view(image->width, image->height, image->channels, image->pixel_type);
+    uint64_t key = cache->directory ? result_key(image, options->iterations, options->lambda, num_nodes, NULL, options) : 0;
+    *hit = result_cache_get_view(cache, key, &output);
+    if (*hit) {
+        return output;
+    }
+    if (!ddf_image(image, &output, num_nodes, options)) {
+        image_free(output.data);
+        output.data = NULL;
+        return output;
+    }
+    result_cache_put_view(cache, key, &output);
+    return output;
+}
+
+// Imagen en tránsito por el pipeline del modo por lotes
+typedef struct {
+    int job;                // Índice del trabajo en el manifiesto
+    ImageView image;        // Imagen decodificada (sin datos si no se pudo cargar)
+    ImageView output;       // Imagen filtrada
+} BatchItem;
+
+// Estado compartido por las etapas del pipeline: decodificación -> filtrado -> codificación
+typedef struct {
+    BatchJob *jobs;
+    DDFOptions *options;
+    int *valid;             // Trabajos cuyas opciones son válidas
+    int count;
+    atomic_int next_job;    // Siguiente trabajo que decodificar
+    atomic_int failed;      // Trabajos fallidos
+    BatchQueue decoded;     // Imágenes decodificadas, a la espera del filtro
+    BatchQueue filtered;    // Imágenes filtradas, a la espera de codificarse
+} BatchPipeline;
+
+// Función de los hilos de decodificación: toman el siguiente trabajo del manifiesto y lo cargan
+void *decode_stage(void *arg) {
+    BatchPipeline *pipeline = (BatchPipeline *)arg;
+    while (1) {
+        int job = atomic_fetch_add(&pipeline->next_job, 1);
+        if (job >= pipeline->count) {
+            break;
+        }
+        if (!pipeline->valid[job]) {
+            continue;
+        }
+        BatchItem *item = (BatchItem *)calloc(1, sizeof(BatchItem));
+        item->job = job;
+        load_image_view(pipeline->jobs[job].input, &item->image, pipeline->options[job].pixel_type);
+        batch_queue_push(&pipeline->decoded, item);
+    }
+    return NULL;
+}
+
+// Función de los hilos de codificación: guardan las imágenes filtradas hasta recibir NULL
+void *encode_stage(void *arg) {
+    BatchPipeline *pipeline = (BatchPipeline *)arg;
+    BatchItem *item;
+    while ((item = (BatchItem *)batch_queue_pop(&pipeline->filtered)) != NULL) {
+        const char *path = pipeline->jobs[item->job].output;
+        if (!write_image_view(path, &item->output)) {
+            printf("Error writing image %s\n", path);
+            atomic_fetch_add(&pipeline->failed, 1);
+        }
+        image_free(item->output.data);
+        free(item);
+    }
+    return NULL;
+}
+
+// Función para procesar un lote en un pipeline de tres etapas unidas por colas acotadas: `decoders` hilos
+// decodifican, el hilo principal difunde cada imagen con los num_nodes hilos del grupo y `encoders` hilos
+// codifican, de modo que la decodificación y la compresión PNG de unas imágenes se solapan con el filtrado de otras
+int run_batch(const ResultCache *cache, const char *manifest, const DDFOptions *defaults, int num_nodes, int decoders, int encoders) {
+    BatchPipeline pipeline;
+    pipeline.count = load_manifest(manifest, &pipeline.jobs);
+    if (pipeline.count < 0) {
+        printf("Error reading manifest %s\n", manifest);
+        return 1;
+    }
+    int count = pipeline.count;
+
+    // Las opciones de cada línea se aplican sobre las de la línea de comandos
+    pipeline.options = (DDFOptions *)malloc((count > 0 ? count : 1) * sizeof(DDFOptions));
+    pipeline.valid = (int *)malloc((count > 0 ? count : 1) * sizeof(int));
+    int valid_count = 0;
+    atomic_init(&pipeline.next_job, 0);
+    atomic_init(&pipeline.failed, 0);
+    for (int j = 0; j < count; j++) {
+        pipeline.options[j] = *defaults;
+        pipeline.valid[j] = parse_ddf_options(pipeline.jobs[j].argc, pipeline.jobs[j].argv, &pipeline.options[j]) &&
+                            ddf_options_compatible(&pipeline.options[j], 0);
+        if (!pipeline.valid[j]) {
+            printf("Invalid options for %s\n", pipeline.jobs[j].input);
+            atomic_fetch_add(&pipeline.failed, 1);
+        }
+        valid_count += pipeline.valid[j];
+    }
+    // Colas acotadas: como mucho BATCH_QUEUE_CAPACITY imágenes esperan entre dos etapas
+    batch_queue_init(&pipeline.decoded, BATCH_QUEUE_CAPACITY);
+    batch_queue_init(&pipeline.filtered, BATCH_QUEUE_CAPACITY);
+
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    pthread_t decode_threads[decoders];
+    pthread_t encode_threads[encoders];
+    for (int i = 0; i < decoders; i++) {
+        pthread_create(&decode_threads[i], NULL, decode_stage, &pipeline);
+    }
+    for (int i = 0; i < encoders; i++) {
+        pthread_create(&encode_threads[i], NULL, encode_stage, &pipeline);
+    }
+
+    // Etapa de filtrado, en el orden en que terminan de decodificarse las imágenes
+    int cache_hits = 0;
+    for (int k = 0; k < valid_count; k++) {
+        BatchItem *item = (BatchItem *)batch_queue_pop(&pipeline.decoded);
+        if (item->image.data) {
+            int hit;
+            DDFOptions options = pipeline.options[item->job];
+            scale_to_pixel_range(&options, item->image.pixel_type);
+            item->output = ddf_image_cached(cache, &item->image, num_nodes, &options, &hit);
+            cache_hits += hit;
+            image_free(item->image.data);  // Liberar la memoria de la imagen de entrada
+        } else {
+            printf("Error loading image %s\n", pipeline.jobs[item->job].input);
+        }
+        if (!item->output.data) {
+            atomic_fetch_add(&pipeline.failed, 1);
+            free(item);
+            continue;
+        }
+        batch_queue_push(&pipeline.filtered, item);
+    }
+
+    // Un NULL por hilo de codificación indica el final del lote
+    for (int i = 0; i < encoders; i++) {
+        batch_queue_push(&pipeline.filtered, NULL);
+    }
+    for (int i = 0; i < decoders; i++) {
+        pthread_join(decode_threads[i], NULL);
+    }
+    for (int i = 0; i < encoders; i++) {
+        pthread_join(encode_threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+    int failed = atomic_load(&pipeline.failed);
+    printf("Batch: %d images, %d failed, %.3f s (%.2f ms per image; %d decoders, %d encoders)\n",
+           count, failed, seconds, count > 0 ? 1000.0 * seconds / count : 0.0, decoders, encoders);
+    if (cache->directory) {
+        printf("Result cache: %d of %d images found in %s\n", cache_hits, valid_count, cache->directory);
+    }
+
+    batch_queue_free(&pipeline.decoded);
+    batch_queue_free(&pipeline.filtered);
+    free(pipeline.options);
+    free(pipeline.valid);
+    free_manifest(pipeline.jobs, count);
+    return failed > 0;
+}
+
+// Función para medir el tiempo transcurrido en milisegundos
+double elapsed_ms(const struct timespec *begin) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - begin->tv_sec) * 1e3 + (now.tv_nsec - begin->tv_nsec) / 1e6;
+}
+
+// Contexto de las peticiones del daemon
+typedef struct {
+    const ResultCache *cache;
+    const DDFOptions *defaults;  // Opciones de la línea de comandos, en unidades de 8 bits
+    int num_nodes;
+} DaemonContext;
+
+// Función para atender una petición del daemon con el grupo de hilos ya creado
+// Las iteraciones y lambda de la petición sustituyen a las del daemon; después se escalan al tipo de píxel de la petición
+void serve_request(void *context, FilterRequest *request, const int *fds, int num_fds, FilterReply *reply) {
+    DaemonContext *daemon = (DaemonContext *)context;
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    memset(reply, 0, sizeof(FilterReply));
+    request->input_shm[sizeof(request->input_shm) - 1] = '\0';
+    request->output_shm[sizeof(request->output_shm) - 1] = '\0';
+
+    // Las opciones del daemon, con las que fije la petición
+    DDFOptions options = *daemon->defaults;
+    if (request->iterations > 0) {
+        options.iterations = request->iterations;
+    }
+    if (request->lambda > 0) {
+        options.lambda = request->lambda;
+    }
+    if (request->magic != FILTER_DAEMON_MAGIC || request->width <= 0 || request->height <= 0 || request->channels < 1 ||
+        request->channels > 4 || request->pixel_type < PIXEL_U8 || request->pixel_type > PIXEL_F32) {
+        reply->status = FILTER_DAEMON_BAD_REQUEST;
+        return;
+    }
+    if (request->iterations < 0 || request->lambda < 0) {
+        reply->status = FILTER_DAEMON_BAD_OPTIONS;
+        return;
+    }
+    scale_to_pixel_range(&options, request->pixel_type);
+
+    // Las muestras que filtra la ejecución: las de las regiones de interés, si las hay
+    size_t pixels = (size_t)request->width * request->height;
+    if (options.num_rois > 0) {
+        ImageRect rois[ROI_MAX_PIECES];
+        int num_rois = roi_disjoint(options.rois, options.num_rois, request->width, request->height, rois, ROI_MAX_PIECES);
+        pixels = num_rois > 0 ? roi_area(rois, num_rois) : 0;
+    }
+
+    // Proyectar las imágenes de entrada y salida; con nombres vacíos se usan las descripciones recibidas
+    // Las imágenes del cliente tienen las filas seguidas, sin relleno
+    size_t size = (size_t)request->width * request->height * request->channels * pixel_size(request->pixel_type);
+    ImageView input = image_view(map_shared_buffer(request->input_shm, num_fds > 0 ? fds[0] : -1, size, 0), request->width,
+                                 request->height, request->channels, request->pixel_type);
+    ImageView output = image_view(map_shared_buffer(request->output_shm, num_fds > 1 ? fds[1] : -1, size, 1), request->width,
+                                  request->height, request->channels, request->pixel_type);
+    uint64_t key = 0;
+    if (!input.data || !output.data) {
+        reply->status = FILTER_DAEMON_BAD_BUFFER;
+    } else if (daemon->cache->directory &&
+               (key = result_key(&input, options.iterations, options.lambda, daemon->num_nodes, NULL, &options),
+                result_cache_get_view(daemon->cache, key, &output))) {
+        reply->cached = 1;
+        reply->filtered = pixels * request->channels;
+    } else {
+        struct timespec filter_begin;
+        clock_gettime(CLOCK_MONOTONIC, &filter_begin);
+        if (ddf_image(&input, &output, daemon->num_nodes, &options)) {
+            reply->filtered = pixels * request->channels;
+            reply->filter_ms = elapsed_ms(&filter_begin);
+            result_cache_put_view(daemon->cache, key, &output);
+        } else {
+            reply->status = FILTER_DAEMON_BAD_OPTIONS;
+        }
+    }
+    if (input.data) {
+        munmap(input.data, size);
+    }
+    if (output.data) {
+        munmap(output.data, size);
+    }
+    reply->total_ms = elapsed_ms(&begin);
+}
+
+// Modo daemon: atiende peticiones por un socket Unix con el grupo de hilos siempre creado, hasta SIGINT o SIGTERM
+// Las peticiones de todas las conexiones se difunden de una en una, cada una con todos los hilos (ver filter_daemon.h)
+int run_daemon(const ResultCache *cache, const char *socket_path, const DDFOptions *defaults, int num_nodes) {
+    DaemonContext context = {cache, defaults, num_nodes};
+    return run_filter_daemon(socket_path, num_nodes, serve_request, &context);
 }
 
 int main(int argc, char *argv[]) {
     // Comprobar los argumentos de la línea de comandos
-    if (argc != 6) {
-        printf("Usage: %s <input_image> <output_image> <iterations> <lambda> <num_nodes>\n", argv[0]);
+    // Con --batch, el segundo argumento es el manifiesto y las opciones son las de todas sus líneas, que pueden dar también
+    // --iterations y --lambda; --decoders y --encoders fijan los hilos de las etapas de decodificación y codificación del lote
+    // Con --daemon, el segundo argumento es la ruta del socket y las opciones son las de todas las peticiones, que pueden
+    // fijar sus propias iteraciones y lambda
+    // Los puntos de control, el modo incremental y la vista previa son de una sola imagen
+    int batch = argc >= 2 && strcmp(argv[1], "--batch") == 0;
+    int daemon_mode = argc >= 2 && strcmp(argv[1], "--daemon") == 0;
+    int decoders = 1, encoders = 2;  // La compresión PNG es la etapa más lenta
+    DDFOptions options = {0, 0.0f, PIXEL_AUTO, NULL, 10, 0.0f, 10, NORM_LINF, SCHEME_EXPLICIT, 5.0f, 1, {0}, 0.0f, NULL, {{0, 0, 0, 0}}, 0};
+    NumaTopology topology;
+    int numa = 0;  // --numa: hilos fijados según la topología NUMA y franjas colocadas en el nodo de su hilo
+    ResultCache cache = {NULL, RESULT_CACHE_DEFAULT_BYTES};
+    const char *previous_input = NULL, *previous_output = NULL;  // Ejecución anterior para el modo incremental
+    ImageRect dirty[DIRTY_MAX_RECTS];
+    int num_dirty = 0;
+    size_t preview_pixels = 0;  // Tamaño máximo de la vista previa en píxeles (0 = sin vista previa)
+    int filter_argc = 0;
+    char *filter_argv[argc > 6 ? argc - 6 : 1];
+    int valid_args = argc >= 6;
+    for (int i = 6; valid_args && i < argc; i++) {
+        if (batch && strcmp(argv[i], "--decoders") == 0 && i + 1 < argc) {
+            decoders = atoi(argv[++i]);
+            valid_args = decoders > 0;
+        } else if (batch && strcmp(argv[i], "--encoders") == 0 && i + 1 < argc) {
+            encoders = atoi(argv[++i]);
+            valid_args = encoders > 0;
+        } else if (!batch && !daemon_mode && strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            options.checkpoint_dir = argv[++i];
+        } else if (!batch && !daemon_mode && strcmp(argv[i], "--checkpoint-every") == 0 && i + 1 < argc) {
+            options.checkpoint_every = atoi(argv[++i]);
+            valid_args = options.checkpoint_every > 0;
+        } else if (strcmp(argv[i], "--numa") == 0) {
+            numa = 1;
+        } else if (strcmp(argv[i], "--huge-pages") == 0) {
+            image_alloc_huge_pages(1);
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            cache.directory = argv[++i];
+        } else if (strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc) {
+            cache.max_bytes = (size_t)(atof(argv[++i]) * 1024 * 1024);
+            valid_args = cache.max_bytes > 0;
+        } else if (!batch && !daemon_mode && strcmp(argv[i], "--incremental") == 0 && i + 2 < argc) {
+            previous_input = argv[++i];
+            previous_output = argv[++i];
+        } else if (!batch && !daemon_mode && strcmp(argv[i], "--dirty") == 0 && i + 1 < argc) {
+            valid_args = num_dirty < DIRTY_MAX_RECTS && parse_image_rect(argv[++i], &dirty[num_dirty++]);
+        } else if (!batch && !daemon_mode && strcmp(argv[i], "--preview") == 0) {
+            preview_pixels = preview_pixels > 0 ? preview_pixels : PREVIEW_MAX_PIXELS;
+        } else if (!batch && !daemon_mode && strcmp(argv[i], "--preview-pixels") == 0 && i + 1 < argc) {
+            preview_pixels = (size_t)atof(argv[++i]);
+            valid_args = preview_pixels > 0;
+        } else {
+            filter_argv[filter_argc++] = argv[i];
+        }
+    }
+    if (valid_args) {
+        options.iterations = atoi(argv[3]);  // Número de iteraciones del filtro DDF
+        options.lambda = atof(argv[4]);      // Parámetro lambda para el filtro DDF
+    }
+    // La vista previa sustituye la salida por la imagen reducida, así que no se combina con salidas parciales
+    valid_args = valid_args && parse_ddf_options(filter_argc, filter_argv, &options) && ddf_options_compatible(&options, previous_output != NULL) &&
+                 (num_dirty == 0 || previous_output) && (preview_pixels == 0 || (options.num_rois == 0 && !previous_output));
+    if (!valid_args) {
+        printf("Usage: %s <input_image> <output_image> <iterations> <lambda> <num_nodes> [options]\n", argv[0]);
+        printf("       %s --batch <manifest> <iterations> <lambda> <num_nodes> [--decoders <n>] [--encoders <n>] [options]\n", argv[0]);
+        printf("       %s --daemon <socket_path> <iterations> <lambda> <num_nodes> [options]\n", argv[0]);
+        printf("  --checkpoint <dir>             Checkpoint directory (explicit scheme)\n");
+        printf("  --checkpoint-every <iters>     Iterations between checkpoints (default 10)\n");
+        printf("  --tolerance <t>                Stop once the change falls below t (explicit scheme)\n");
+        printf("  --check-every <iters>          Iterations between convergence checks (default 10)\n");
+        printf("  --norm l1|linf                 Norm of the change (default linf)\n");
+        printf("  --scheme explicit|aos          Integration scheme (default explicit); aos takes no --tolerance, --checkpoint\n");
+        printf("                                 or --flat-threshold\n");
+        printf("  --step <tau>                   AOS time step; covers 0.25 * iterations in total (default 5)\n");
+        printf("  --pyramid <levels>             Coarse-to-fine diffusion over this many levels (default 1)\n");
+        printf("  --level-iterations <n,...>     Iterations per level, coarsest first; the last is the finest level and\n");
+        printf("                                 missing coarse levels are automatic (default: automatic; at most --pyramid values)\n");
+        printf("  --flat-threshold <t>           Skip %dx%d tiles whose neighbour differences are all below t until a\n", FLAT_TILE, FLAT_TILE);
+        printf("                                 neighbouring tile changes (explicit scheme; default 0 = off, <= 1 is exact for 8 bits)\n");
+        printf("  --pixel auto|u8|u16|f32        Sample type to filter with (default: the file's)\n");
+        printf("  --numa                         Pin the threads by NUMA node and place each stripe in its thread's node\n");
+        printf("  --huge-pages                   Back images of 2 MB or more with transparent huge pages\n");
+        printf("  --cache <dir>                  Reuse results stored in dir for the same image and options\n");
+        printf("  --cache-size <MB>              Cache size cap; least recently used results are evicted (default 1024)\n");
+        printf("  --incremental <in> <out>       Update the output of a previous run with input <in> only where needed\n");
+        printf("  --dirty x,y,w,h                Changed rectangle (repeatable); by default, where <in> and the input differ\n");
+        printf("  --roi x,y,w,h                  Filter only this rectangle (repeatable), as a full run with num_nodes threads\n");
+        printf("                                 would, and copy the rest of the input; explicit scheme, without --tolerance,\n");
+        printf("                                 --pyramid, --checkpoint, --flat-threshold or --incremental\n");
+        printf("  --preview                      Write a copy reduced by area to at most %zu pixels, diffused for 1/factor^2 of the\n", PREVIEW_MAX_PIXELS);
+        printf("                                 iterations, and print the projected time of the full run (not with --roi or --incremental)\n");
+        printf("  --preview-pixels <n>           Preview size cap in pixels (implies --preview)\n");
+        printf("  --decoders <n>                 Batch threads decoding the next images (default 1)\n");
+        printf("  --encoders <n>                 Batch threads encoding the results (default 2)\n");
+        printf("lambda, the tolerance and the flat threshold are given in 8-bit units for every sample type.\n");
+        printf("Each manifest line is \"<input_image> <output_image> [options]\", where the options may include --iterations <n>\n");
+        printf("and --lambda <l>; --checkpoint, --incremental and --preview apply to single images only.\n");
+        printf("The daemon diffuses images in shared memory on request, which may give their own iterations and lambda;\n");
+        printf("see filter_daemon.h for the protocol.\n");
+        return 1;
+    }
+    // Crear el directorio de los puntos de control si no existe, como hace la caché de resultados
+    if (options.checkpoint_dir && mkdir(options.checkpoint_dir, 0755) != 0 && errno != EEXIST) {
+        printf("Could not create checkpoint directory %s: %s\n", options.checkpoint_dir, strerror(errno));
         return 1;
     }
 
-    int width, height, channels;
+    // Con --numa, leer la topología antes de reservar ninguna imagen, para que cada hilo coloque sus franjas en su nodo
+    int num_nodes = atoi(argv[5]);   // Número de nodos (hilos) para el procesamiento paralelo
+    if (numa) {
+        numa_read_topology(&topology);
+        numa_fresh_pages();
+        printf("NUMA: %d nodes\n", topology.num_nodes);
+    }
+    DDFPool pool;  // Hilos creados una vez para todas las llamadas y, con --batch o --daemon, para todas las imágenes
+    create_thread_pool(&pool, num_nodes, numa ? &topology : NULL);
+    options.pool = &pool;
+    if (batch || daemon_mode) {
+        int status = batch ? run_batch(&cache, argv[2], &options, num_nodes, decoders, encoders)
+                           : run_daemon(&cache, argv[2], &options, num_nodes);
+        destroy_thread_pool(&pool);
+        return status;
+    }
+
     // Cargar la imagen de entrada
-    unsigned char *image = stbi_load(argv[1], &width, &height, &channels, 0);
-    if (!image) {
+    ImageView image;
+    if (!load_image_view(argv[1], &image, options.pixel_type)) {
         printf("Error loading image %s\n", argv[1]);
+        destroy_thread_pool(&pool);
         return 1;
     }
+    int height = image.height;
+    int pixel_type = image.pixel_type;
+    int iterations = options.iterations;
 
-    int iterations = atoi(argv[3]);  // Número de iteraciones del filtro DDF
-    float lambda = atof(argv[4]);    // Parámetro lambda para el filtro DDF
-    int num_nodes = atoi(argv[5]);   // Número de nodos (hilos) para el procesamiento paralelo
-    unsigned char *output = (unsigned char *)malloc(width * height * channels * sizeof(unsigned char));  // Imagen de salida
+    // Con --numa, mostrar dónde se ejecuta cada franja de la imagen completa
+    for (int i = 0; numa && i < num_nodes; i++) {
+        int node;
+        int cpu = numa_thread_cpu(&topology, i, num_nodes, &node);
+        int rows_per_thread = height / num_nodes;
+        printf("  thread %d: node %d, cpu %d, rows %d-%d\n", i, topology.node_ids[node], cpu, i * rows_per_thread,
+               (i == num_nodes - 1 ? height : (i + 1) * rows_per_thread) - 1);
+    }
+
+    // lambda, la tolerancia y el umbral de bloques planos se expresan en unidades de 8 bits; se escalan al rango del tipo de píxel
+    scale_to_pixel_range(&options, pixel_type);
+    float lambda = options.lambda;
+
+    ImageView output;
+    int filtered = 1;  // 0 si las regiones de interés no se pudieron filtrar
+    if (preview_pixels > 0) {
+        // Con --preview la salida es la vista previa, sin pasar por la caché
+        output = ddf_preview(&image, iterations, lambda, num_nodes, &options, preview_pixels);
+    } else {
+        output = image_alloc_view(image.width, image.height, image.channels, pixel_type);  // Imagen de salida
 
-    // Aplicar el filtro de difusión direccional en paralelo
-    parallel_ddf_filter(image, output, width, height, channels, iterations, lambda, num_nodes);
+        // Consultar la caché de resultados antes de filtrar
+        uint64_t key = cache.directory ? result_key(&image, iterations, lambda, num_nodes, NULL, &options) : 0;
+        if (result_cache_get_view(&cache, key, &output)) {
+            printf("Result found in cache %s\n", cache.directory);
+        } else {
+            // En el modo incremental solo se filtran las regiones sucias, salvo que haya que filtrar la imagen completa
+            int updated = previous_output && ddf_incremental(&image, &output, iterations, lambda, num_nodes, &options, previous_input, previous_output, dirty, num_dirty);
+
+            // Aplicar el filtro de difusión direccional en paralelo, solo a las regiones de interés si las hay
+            if (!updated) {
+                filtered = ddf_image(&image, &output, num_nodes, &options);
+            }
+            if (filtered) {
+                result_cache_put_view(&cache, key, &output);
+            }
+        }
+    }
+    destroy_thread_pool(&pool);
 
     // Guardar la imagen de salida
-    if (!stbi_write_png(argv[2], width, height, channels, output, width * channels)) {
-        printf("Error writing image %s\n", argv[2]);
-        free(image);
-        free(output);
+    if (!filtered || !write_image_view(argv[2], &output)) {
+        if (filtered) {
+            printf("Error writing image %s\n", argv[2]);
+        }
+        image_free(image.data);
+        image_free(output.data);
         return 1;
     }
 
-    stbi_image_free(image);  // Liberar la memoria de la imagen de entrada
-    free(output);            // Liberar la memoria de la imagen de salida
+    image_free(image.data);   // Liberar la memoria de la imagen de entrada
+    image_free(output.data);  // Liberar la memoria de la imagen de salida
     return 0;
 }
@@ -1,98 +1,1008 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <mpi.h>
+#define IMAGE_ALLOC_IMPLEMENTATION
+#include "image_alloc.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
+#define IMAGE_IO_IMPLEMENTATION
+#include "image_io.h"
+#define BATCH_IMPLEMENTATION
+#include "batch.h"
+#define RESULT_CACHE_IMPLEMENTATION
+#include "result_cache.h"
+#define ROI_IMPLEMENTATION
+#include "roi.h"
+
+// Modo por lotes: las imágenes de hasta BATCH_WHOLE_IMAGE_PIXELS píxeles se reparten enteras entre los procesos;
+// las mayores se filtran entre todos, por filas
+#define BATCH_WHOLE_IMAGE_PIXELS (1 << 20)
+#define TAG_BATCH_JOB 1000     // Cabecera de una imagen completa enviada a un proceso trabajador
+#define TAG_BATCH_KERNEL 1001  // Pesos del kernel de la imagen
+#define TAG_BATCH_PIXELS 1002  // Píxeles de la imagen
+#define TAG_BATCH_RESULT 1003  // Imagen filtrada devuelta al proceso 0
+#define JOB_HEADER_SIZE 9      // Ancho, alto, canales, tipo de píxel, borde, valor del borde, bloques y ancho y alto del kernel (ancho 0 = fin)
+
+// Opciones del filtro de una imagen (de la línea de comandos o de una línea del manifiesto)
+typedef struct {
+    int chunks;               // Número de bloques por proceso en el modo segmentado (0 = modo por bloques)
+    int border;               // Política de borde
+    int border_value;         // Valor fuera de la imagen con BORDER_CONSTANT
+    int pixel_type;           // Tipo de píxel con el que se filtra (PIXEL_AUTO = el del archivo)
+    const char *kernel_spec;  // Kernel de la línea de comandos (NULL = el laplaciano 3x3)
+} FilterOptions;
+
+// Kernel de convolución de tamaño arbitrario (ancho y alto impares), con los pesos por filas
+typedef struct {
+    int width;
+    int height;
+    float *weights;
+} Kernel;
+
+// Función para leer un kernel de un archivo o de la línea de comandos
+// Las filas se separan con ';' o saltos de línea y los pesos con ',' o espacios; un "/divisor" final divide todos los pesos
+// Ejemplos: "1,2,1;2,4,2;1,2,1/16" o un archivo con una fila de pesos por línea
+int load_kernel(const char *spec, Kernel *kernel) {
+    char *text;
+    FILE *file = fopen(spec, "r");
+    if (file) {
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        text = (char *)malloc(size + 1);
+        text[fread(text, 1, size, file)] = '\0';
+        fclose(file);
+    } else {
+        text = (char *)malloc(strlen(spec) + 1);
+        strcpy(text, spec);
+    }
+
+    float divisor = 1.0f;
+    char *slash = strchr(text, '/');
+    if (slash) {
+        *slash = '\0';
+        divisor = strtof(slash + 1, NULL);
+    }
+
+    int capacity = 16, count = 0, rows = 0, columns = 0, row_count = 0, ok = divisor != 0.0f;
+    float *weights = (float *)malloc(capacity * sizeof(float));
+    for (char *p = text; ok; ) {
+        while (*p == ' ' || *p == '\t' || *p == ',') {
+            p++;
+        }
+        if (*p == ';' || *p == '\n' || *p == '\r' || *p == '\0') {
+            // Fin de fila: todas las filas deben tener el mismo número de pesos
+            if (row_count > 0) {
+                ok = rows == 0 || row_count == columns;
+                columns = row_count;
+                rows++;
+                row_count = 0;
+            }
+            if (*p == '\0') {
+                break;
+            }
+            p++;
+            continue;
+        }
+        char *end;
+        float weight = strtof(p, &end);
+        if (end == p) {
+            ok = 0;
+            break;
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            weights = (float *)realloc(weights, capacity * sizeof(float));
+        }
+        weights[count++] = weight / divisor;
+        row_count++;
+        p = end;
+    }
+    free(text);
+
+    if (!ok || rows == 0 || rows % 2 == 0 || columns % 2 == 0) {
+        free(weights);
+        return 0;
+    }
+    kernel->width = columns;
+    kernel->height = rows;
+    kernel->weights = weights;
+    return 1;
+}
+
+// Función para comprobar si un kernel es 3x3 con pesos enteros (camino de convolve3x3_rows)
+int integer_3x3_kernel(const Kernel *kernel) {
+    if (kernel->width != 3 || kernel->height != 3) {
+        return 0;
+    }
+    for (int i = 0; i < 9; i++) {
+        if (kernel->weights[i] != (float)(int)kernel->weights[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Función para aplicar el kernel 3x3 a un píxel del borde, cuyos vecinos fuera de la imagen siguen la política de borde
+void ddf_border_pixel(const ImageView *input, unsigned char *output_row, int weights[3][3], int border, int border_value, int x, int y) {
+    int channels = input->channels;
+    for (int c = 0; c < channels; c++) {
+        int sum = 0;
+        for (int ky = -1; ky <= 1; ky++) {
+            int ny = border_index(y + ky, input->height, border);
+            for (int kx = -1; kx <= 1; kx++) {
+                int nx = border_index(x + kx, input->width, border);
+                if (ny >= 0 && nx >= 0) {
+                    sum += ((const unsigned char *)image_view_pixel(input, nx, ny))[c] * weights[ky + 1][kx + 1];
+                } else if (border == BORDER_CONSTANT) {
+                    sum += border_value * weights[ky + 1][kx + 1];
+                }
+            }
+        }
+        output_row[x * channels + c] = (unsigned char)(sum > 255 ? 255 : (sum < 0 ? 0 : sum));
+    }
+}
 
 // Función para aplicar el filtro DDF a una sección de la imagen
-void apply_ddf_section(unsigned char *input, unsigned char *output, int width, int height, int channels) {
+// `input` contiene las filas de la sección (incluyendo las filas de halo); se filtran las filas [start_row, end_row)
+// y el resultado se escribe a partir de la primera fila de `output`
+void apply_ddf_section(const ImageView *input, const ImageView *output, const Kernel *kernel, int border, int border_value, int start_row, int end_row) {
+    // El valor del borde constante llega en unidades de 8 bits; los kernels lo toman en el rango del tipo de píxel
+    float outside = border_sample(border_value, input->pixel_type);
+    ImageView rows = image_view_crop(output, 0, 0, input->width, end_row - start_row);
+    // Los demás kernels van al motor de convolución general (dos pasadas 1D si es separable, por bloques si no)
+    if (!integer_3x3_kernel(kernel)) {
+        convolve_view(input, &rows, 0, start_row, kernel->weights, kernel->width, kernel->height, border, outside);
+        return;
+    }
+
     int kernel_size = 3;
     int kernel_half = kernel_size / 2;
-    int weights[3][3] = {
-        {-1, -1, -1},
-        {-1,  8, -1},
-        {-1, -1, -1}
-    };
-
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
+    int weights[3][3];
+    for (int i = 0; i < 9; i++) {
+        weights[i / 3][i % 3] = (int)kernel->weights[i];
+    }
+
+    // filter_kernels filtra las imágenes de 16 bits y float, y las de 8 bits cuando los pesos son el laplaciano
+    // (9*x - suma de la caja 3x3 con SSE2); aquí solo queda el camino genérico de 8 bits para otros pesos
+    if (convolve3x3_view(input, &rows, 0, start_row, &weights[0][0], border, outside)) {
+        return;
+    }
+    int width = input->width, height = input->height, channels = input->channels;
+
+    for (int y = start_row; y < end_row; y++) {
+        unsigned char *output_row = (unsigned char *)image_view_row(&rows, y - start_row);
+
+        // Las filas cuyo kernel sale de la imagen y las columnas de ambos extremos van por el camino del borde
+        int interior_row = y >= kernel_half && y < height - kernel_half;
+        int interior_begin = interior_row ? (kernel_half < width ? kernel_half : width) : width;
+        int interior_end = interior_row && width - kernel_half > interior_begin ? width - kernel_half : interior_begin;
+        for (int x = 0; x < interior_begin; x++) {
+            ddf_border_pixel(input, output_row, weights, border, (int)outside, x, y);
+        }
+
+        // Píxeles interiores: el kernel completo está dentro de la imagen, sin comprobar los límites
+        for (int x = interior_begin; x < interior_end; x++) {
             for (int c = 0; c < channels; c++) {
                 int sum = 0;
                 for (int ky = -kernel_half; ky <= kernel_half; ky++) {
+                    const unsigned char *row = (const unsigned char *)image_view_pixel(input, x, y + ky) + c;
                     for (int kx = -kernel_half; kx <= kernel_half; kx++) {
-                        int nx = x + kx;
-                        int ny = y + ky;
-                        if (nx >= 0 && ny >= 0 && nx < width && ny < height) {
-                            sum += input[(ny * width + nx) * channels + c] * weights[ky + kernel_half][kx + kernel_half];
-                        }
+                        sum += row[kx * channels] * weights[ky + kernel_half][kx + kernel_half];
                     }
                 }
-                output[(y * width + x) * channels + c] = (unsigned char)(sum > 255 ? 255 : (sum < 0 ? 0 : sum));
+                output_row[x * channels + c] = (unsigned char)(sum > 255 ? 255 : (sum < 0 ? 0 : sum));
+            }
+        }
+
+        for (int x = interior_end; x < width; x++) {
+            ddf_border_pixel(input, output_row, weights, border, (int)outside, x, y);
+        }
+    }
+}
+
+// Función para calcular el rango de filas [start, end) asignado a un proceso
+void rows_for_rank(int height, int size, int rank, int *start, int *end) {
+    int rows_per_rank = height / size;
+    int extra_rows = height % size;
+    *start = rank * rows_per_rank + (rank < extra_rows ? rank : extra_rows);
+    *end = *start + rows_per_rank + (rank < extra_rows ? 1 : 0);
+}
+
+// Función para calcular el rango de filas [start, end) de un bloque dentro de la sección de un proceso
+void rows_for_chunk(int rank_start, int rank_end, int chunks, int chunk, int *start, int *end) {
+    rows_for_rank(rank_end - rank_start, chunks, chunk, start, end);
+    *start += rank_start;
+    *end += rank_start;
+}
+
+// Función para obtener el tipo de dato MPI de un tipo de píxel
+MPI_Datatype mpi_pixel_type(int pixel_type) {
+    return pixel_type == PIXEL_U16 ? MPI_UNSIGNED_SHORT : pixel_type == PIXEL_F32 ? MPI_FLOAT : MPI_UNSIGNED_CHAR;
+}
+
+// Función para crear el tipo MPI de una fila de una imagen: sus muestras, con la extensión del paso entre filas, de modo
+// que n filas seguidas se envían o reciben con un contador n sin mover el relleno. La imagen, la salida y las secciones
+// se reservan con image_alloc_view, así que comparten el paso entre filas
+MPI_Datatype row_datatype(const ImageView *image) {
+    MPI_Datatype row, type;
+    MPI_Type_contiguous(image->width * image->channels, mpi_pixel_type(image->pixel_type), &row);
+    MPI_Type_create_resized(row, 0, (MPI_Aint)image->stride, &type);
+    MPI_Type_commit(&type);
+    MPI_Type_free(&row);
+    return type;
+}
+
+// Modo por bloques: MPI_Scatterv de las filas, reparto de las filas de halo, filtrado y MPI_Gatherv
+// Los contadores y desplazamientos de MPI van en filas. En los procesos trabajadores `image` solo da la forma de la imagen
+void blocking_ddf(const ImageView *image, const ImageView *output, const Kernel *kernel, int border, int border_value, int rank, int size) {
+    int halo = kernel->height / 2;  // Filas de halo a cada lado de una sección
+    int width = image->width, height = image->height, channels = image->channels, pixel_type = image->pixel_type;
+    MPI_Datatype row_type = row_datatype(image);
+    int *counts = (int *)malloc(size * sizeof(int));
+    int *displs = (int *)malloc(size * sizeof(int));
+    ImageView halos = {NULL, 0, 0, 0, 0, 0};  // 2 * halo filas de halo (superiores e inferiores) por proceso, solo en el proceso 0
+
+    for (int i = 0; i < size; i++) {
+        int start, end;
+        rows_for_rank(height, size, i, &start, &end);
+        counts[i] = end - start;
+        displs[i] = start;
+    }
+
+    if (rank == 0) {
+        // Las filas de halo superiores se alinean al final de su bloque y las inferiores al principio
+        halos = image_alloc_view(width, size * 2 * halo + 1, channels, pixel_type);
+        memset(halos.data, 0, halos.stride * halos.height);
+        for (int i = 0; i < size; i++) {
+            int start, end;
+            rows_for_rank(height, size, i, &start, &end);
+            int top = start < halo ? start : halo;
+            int bottom = height - end < halo ? height - end : halo;
+            ImageView top_rows = image_view_crop(image, 0, start - top, width, top);
+            ImageView bottom_rows = image_view_crop(image, 0, end, width, bottom);
+            ImageView top_halo = image_view_crop(&halos, 0, 2 * i * halo + halo - top, width, top);
+            ImageView bottom_halo = image_view_crop(&halos, 0, (2 * i + 1) * halo, width, bottom);
+            image_view_copy(&top_rows, &top_halo);
+            image_view_copy(&bottom_rows, &bottom_halo);
+        }
+    }
+
+    int start, end;
+    rows_for_rank(height, size, rank, &start, &end);
+    int rows = end - start;
+    int halo_top = start < halo ? start : halo;
+    int halo_bottom = height - end < halo ? height - end : halo;
+
+    // El proceso 0 filtra sus filas directamente de la imagen a la salida: su halo inferior ya está en la imagen
+    if (rank == 0) {
+        MPI_Scatterv(image->data, counts, displs, row_type, MPI_IN_PLACE, counts[0], row_type, 0, MPI_COMM_WORLD);
+        MPI_Scatter(halos.data, 2 * halo, row_type, MPI_IN_PLACE, 2 * halo, row_type, 0, MPI_COMM_WORLD);
+        ImageView section = image_view_crop(image, 0, 0, width, rows + halo_bottom);
+        apply_ddf_section(&section, output, kernel, border, border_value, 0, rows);
+        MPI_Gatherv(MPI_IN_PLACE, counts[0], row_type, output->data, counts, displs, row_type, 0, MPI_COMM_WORLD);
+        image_free(halos.data);
+        MPI_Type_free(&row_type);
+        free(counts);
+        free(displs);
+        return;
+    }
+
+    // Sección local con las filas de halo alrededor de las filas propias
+    ImageView input_section = image_alloc_view(width, rows + 2 * halo + 1, channels, pixel_type);
+    ImageView output_section = image_alloc_view(width, rows > 0 ? rows : 1, channels, pixel_type);
+    ImageView halo_rows = image_alloc_view(width, 2 * halo + 1, channels, pixel_type);
+
+    // Recibir la sección de datos y sus halos
+    MPI_Scatterv(NULL, counts, displs, row_type, image_view_row(&input_section, halo_top), counts[rank], row_type, 0, MPI_COMM_WORLD);
+    MPI_Scatter(NULL, 2 * halo, row_type, halo_rows.data, 2 * halo, row_type, 0, MPI_COMM_WORLD);
+    ImageView top_halo = image_view_crop(&halo_rows, 0, halo - halo_top, width, halo_top);
+    ImageView bottom_halo = image_view_crop(&halo_rows, 0, halo, width, halo_bottom);
+    ImageView top_rows = image_view_crop(&input_section, 0, 0, width, halo_top);
+    ImageView bottom_rows = image_view_crop(&input_section, 0, halo_top + rows, width, halo_bottom);
+    image_view_copy(&top_halo, &top_rows);
+    image_view_copy(&bottom_halo, &bottom_rows);
+
+    // Aplicar el filtro DDF a la sección de datos localmente
+    input_section.height = halo_top + rows + halo_bottom;
+    apply_ddf_section(&input_section, &output_section, kernel, border, border_value, halo_top, halo_top + rows);
+
+    // Enviar la sección de salida al proceso 0
+    MPI_Gatherv(output_section.data, counts[rank], row_type, NULL, counts, displs, row_type, 0, MPI_COMM_WORLD);
+
+    image_free(input_section.data);
+    image_free(output_section.data);
+    image_free(halo_rows.data);
+    MPI_Type_free(&row_type);
+    free(counts);
+    free(displs);
+}
+
+// Modo segmentado: la sección de cada proceso se divide en `chunks` bloques que se envían y reciben con
+// MPI_Isend/MPI_Irecv, de modo que el bloque k+1 llega mientras se filtra el bloque k y el bloque k-1 regresa
+void pipelined_ddf(const ImageView *image, const ImageView *output, const Kernel *kernel, int border, int border_value, int rank, int size, int chunks) {
+    int halo = kernel->height / 2;  // Filas de halo a cada lado de un bloque
+    int width = image->width, height = image->height;
+    MPI_Datatype row_type = row_datatype(image);
+
+    if (rank == 0) {
+        int transfers = (size - 1) * chunks;
+        MPI_Request *send_requests = (MPI_Request *)malloc((transfers > 0 ? transfers : 1) * sizeof(MPI_Request));
+        MPI_Request *recv_requests = (MPI_Request *)malloc((transfers > 0 ? transfers : 1) * sizeof(MPI_Request));
+
+        // Enviar todos los bloques (con su halo) y preparar la recepción de los resultados directamente en la imagen de salida
+        for (int i = 1; i < size; i++) {
+            int rank_start, rank_end;
+            rows_for_rank(height, size, i, &rank_start, &rank_end);
+            for (int k = 0; k < chunks; k++) {
+                int start, end;
+                rows_for_chunk(rank_start, rank_end, chunks, k, &start, &end);
+                int first = start > halo ? start - halo : 0;
+                int last = end + halo < height ? end + halo : height;
+                if (end == start) {
+                    first = last = start;
+                }
+                int t = (i - 1) * chunks + k;
+                MPI_Isend(image_view_row(image, first), last - first, row_type, i, k, MPI_COMM_WORLD, &send_requests[t]);
+                MPI_Irecv(image_view_row(output, start), end - start, row_type, i, k, MPI_COMM_WORLD, &recv_requests[t]);
+            }
+        }
+
+        // El proceso 0 filtra su propia sección por bloques, haciendo progresar las transferencias entre bloques
+        int rank_start, rank_end;
+        rows_for_rank(height, size, 0, &rank_start, &rank_end);
+        for (int k = 0; k < chunks; k++) {
+            int start, end, flag;
+            rows_for_chunk(rank_start, rank_end, chunks, k, &start, &end);
+            int first = start > halo ? start - halo : 0;
+            int last = end + halo < height ? end + halo : height;
+            if (end > start) {
+                ImageView section = image_view_crop(image, 0, first, width, last - first);
+                ImageView result = image_view_crop(output, 0, start, width, end - start);
+                apply_ddf_section(&section, &result, kernel, border, border_value, start - first, end - first);
             }
+            MPI_Testall(transfers, send_requests, &flag, MPI_STATUSES_IGNORE);
         }
+
+        MPI_Waitall(transfers, send_requests, MPI_STATUSES_IGNORE);
+        MPI_Waitall(transfers, recv_requests, MPI_STATUSES_IGNORE);
+        free(send_requests);
+        free(recv_requests);
+    } else {
+        int rank_start, rank_end;
+        rows_for_rank(height, size, rank, &rank_start, &rank_end);
+        int rows = rank_end - rank_start;
+
+        // Cada bloque se recibe con su propio halo, por lo que se reservan 2 * halo filas extra por bloque
+        ImageView input_section = image_alloc_view(width, rows + 2 * halo * chunks + 1, image->channels, image->pixel_type);
+        ImageView output_section = image_alloc_view(width, rows > 0 ? rows : 1, image->channels, image->pixel_type);
+        MPI_Request *recv_requests = (MPI_Request *)malloc(chunks * sizeof(MPI_Request));
+        MPI_Request *send_requests = (MPI_Request *)malloc(chunks * sizeof(MPI_Request));
+        int *offsets = (int *)malloc(chunks * sizeof(int));  // Primera fila de cada bloque en input_section
+
+        // Publicar todas las recepciones de antemano
+        int offset = 0;
+        for (int k = 0; k < chunks; k++) {
+            int start, end;
+            rows_for_chunk(rank_start, rank_end, chunks, k, &start, &end);
+            int first = start > halo ? start - halo : 0;
+            int last = end + halo < height ? end + halo : height;
+            if (end == start) {
+                first = last = start;
+            }
+            offsets[k] = offset;
+            MPI_Irecv(image_view_row(&input_section, offset), last - first, row_type, 0, k, MPI_COMM_WORLD, &recv_requests[k]);
+            offset += last - first;
+        }
+
+        // Filtrar cada bloque en cuanto llega y devolverlo sin esperar a los demás
+        for (int k = 0; k < chunks; k++) {
+            int start, end;
+            rows_for_chunk(rank_start, rank_end, chunks, k, &start, &end);
+            int first = start > halo ? start - halo : 0;
+            int last = end + halo < height ? end + halo : height;
+            ImageView result = image_view_crop(&output_section, 0, start - rank_start, width, end - start);
+
+            MPI_Wait(&recv_requests[k], MPI_STATUS_IGNORE);
+            if (end > start) {
+                ImageView section = image_view_crop(&input_section, 0, offsets[k], width, last - first);
+                apply_ddf_section(&section, &result, kernel, border, border_value, start - first, end - first);
+            }
+            MPI_Isend(result.data, end - start, row_type, 0, k, MPI_COMM_WORLD, &send_requests[k]);
+        }
+
+        MPI_Waitall(chunks, send_requests, MPI_STATUSES_IGNORE);
+        image_free(input_section.data);
+        image_free(output_section.data);
+        free(recv_requests);
+        free(send_requests);
+        free(offsets);
+    }
+    MPI_Type_free(&row_type);
+}
+
+// Función para crear el tipo MPI de un rectángulo dentro de una imagen, para enviarlo o recibirlo en su sitio sin
+// copiarlo a un búfer contiguo
+MPI_Datatype rect_datatype(ImageRect rect, const ImageView *image) {
+    MPI_Datatype type;
+    MPI_Type_create_hvector(rect.height, rect.width * image->channels, (MPI_Aint)image->stride, mpi_pixel_type(image->pixel_type), &type);
+    MPI_Type_commit(&type);
+    return type;
+}
+
+// Función para filtrar un trozo de una región de interés a partir del recorte de la entrada que lo rodea
+// (crop, con los píxeles de crop_rect) y escribirlo en target, de piece.width x piece.height píxeles
+void filter_roi_piece(const ImageView *crop, ImageRect crop_rect, ImageRect piece, const ImageView *target, const Kernel *kernel, int border, int border_value) {
+    // Las filas del trozo se filtran con todo el ancho del recorte y después se descartan las columnas de halo
+    ImageView rows = image_alloc_view(crop_rect.width, piece.height, crop->channels, crop->pixel_type);
+    apply_ddf_section(crop, &rows, kernel, border, border_value, piece.y - crop_rect.y, piece.y - crop_rect.y + piece.height);
+    ImageView columns = image_view_crop(&rows, piece.x - crop_rect.x, 0, piece.width, piece.height);
+    image_view_copy(&columns, target);
+    image_free(rows.data);
+}
+
+// Modo por regiones de interés: la salida parte de la entrada y solo se filtran las regiones (disjuntas y dentro de la
+// imagen), repartidas entre los procesos por área. Cada trozo viaja con su recorte de la entrada, que incluye el halo
+// de la imagen que lo rodea, y vuelve directamente a su sitio en la salida
+void roi_ddf(const ImageView *image, const ImageView *output, const Kernel *kernel, int border, int border_value, const ImageRect *rois, int num_rois, int rank, int size) {
+    int halo = (kernel->width > kernel->height ? kernel->width : kernel->height) / 2;  // Radio del kernel
+    int width = image->width, height = image->height;
+    ImageRect pieces[num_rois + size];
+    int part_begin[size + 1];
+    roi_partition(rois, num_rois, size, pieces, part_begin);  // Todos los procesos calculan el mismo reparto
+
+    if (rank == 0) {
+        int transfers = part_begin[size] - part_begin[1];
+        MPI_Request *send_requests = (MPI_Request *)malloc((transfers > 0 ? transfers : 1) * sizeof(MPI_Request));
+        MPI_Request *recv_requests = (MPI_Request *)malloc((transfers > 0 ? transfers : 1) * sizeof(MPI_Request));
+        MPI_Datatype *types = (MPI_Datatype *)malloc((transfers > 0 ? 2 * transfers : 1) * sizeof(MPI_Datatype));
+        image_view_copy(image, output);
+
+        // Enviar el recorte de cada trozo desde la imagen y preparar la recepción del resultado en la salida
+        for (int i = 1; i < size; i++) {
+            for (int k = part_begin[i]; k < part_begin[i + 1]; k++) {
+                ImageRect crop = dilate_image_rect(pieces[k], halo, width, height);
+                int t = k - part_begin[1];
+                types[2 * t] = rect_datatype(crop, image);
+                types[2 * t + 1] = rect_datatype(pieces[k], output);
+                MPI_Isend(image_view_pixel(image, crop.x, crop.y), 1, types[2 * t], i, k, MPI_COMM_WORLD, &send_requests[t]);
+                MPI_Irecv(image_view_pixel(output, pieces[k].x, pieces[k].y), 1, types[2 * t + 1], i, k, MPI_COMM_WORLD, &recv_requests[t]);
+            }
+        }
+
+        // El proceso 0 filtra sus propios trozos leyendo el recorte en su sitio, haciendo progresar las transferencias
+        // entre trozos
+        for (int k = part_begin[0]; k < part_begin[1]; k++) {
+            int flag;
+            ImageRect crop = dilate_image_rect(pieces[k], halo, width, height);
+            ImageView source = image_view_crop(image, crop.x, crop.y, crop.width, crop.height);
+            ImageView target = image_view_crop(output, pieces[k].x, pieces[k].y, pieces[k].width, pieces[k].height);
+            filter_roi_piece(&source, crop, pieces[k], &target, kernel, border, border_value);
+            MPI_Testall(transfers, send_requests, &flag, MPI_STATUSES_IGNORE);
+        }
+
+        MPI_Waitall(transfers, send_requests, MPI_STATUSES_IGNORE);
+        MPI_Waitall(transfers, recv_requests, MPI_STATUSES_IGNORE);
+        for (int t = 0; t < 2 * transfers; t++) {
+            MPI_Type_free(&types[t]);
+        }
+        free(types);
+        free(send_requests);
+        free(recv_requests);
+    } else {
+        int first = part_begin[rank];
+        int count = part_begin[rank + 1] - first;
+        MPI_Request *recv_requests = (MPI_Request *)malloc((count > 0 ? count : 1) * sizeof(MPI_Request));
+        MPI_Request *send_requests = (MPI_Request *)malloc((count > 0 ? count : 1) * sizeof(MPI_Request));
+        ImageView *crops = (ImageView *)malloc((count > 0 ? count : 1) * sizeof(ImageView));
+        ImageView *results = (ImageView *)malloc((count > 0 ? count : 1) * sizeof(ImageView));
+
+        // Publicar todas las recepciones de antemano, cada recorte en su propia imagen
+        for (int k = 0; k < count; k++) {
+            ImageRect piece = pieces[first + k];
+            ImageRect crop = dilate_image_rect(piece, halo, width, height);
+            crops[k] = image_alloc_view(crop.width, crop.height, image->channels, image->pixel_type);
+            results[k] = image_alloc_view(piece.width, piece.height, image->channels, image->pixel_type);
+            MPI_Datatype row_type = row_datatype(&crops[k]);
+            MPI_Irecv(crops[k].data, crop.height, row_type, 0, first + k, MPI_COMM_WORLD, &recv_requests[k]);
+            MPI_Type_free(&row_type);
+        }
+
+        // Filtrar cada trozo en cuanto llega y devolverlo sin esperar a los demás
+        for (int k = 0; k < count; k++) {
+            ImageRect piece = pieces[first + k];
+            ImageRect crop = dilate_image_rect(piece, halo, width, height);
+            MPI_Wait(&recv_requests[k], MPI_STATUS_IGNORE);
+            filter_roi_piece(&crops[k], crop, piece, &results[k], kernel, border, border_value);
+            MPI_Datatype row_type = row_datatype(&results[k]);
+            MPI_Isend(results[k].data, piece.height, row_type, 0, first + k, MPI_COMM_WORLD, &send_requests[k]);
+            MPI_Type_free(&row_type);
+        }
+
+        MPI_Waitall(count, send_requests, MPI_STATUSES_IGNORE);
+        for (int k = 0; k < count; k++) {
+            image_free(crops[k].data);
+            image_free(results[k].data);
+        }
+        free(recv_requests);
+        free(send_requests);
+        free(crops);
+        free(results);
+    }
+}
+
+// Función para calcular la clave de la caché de resultados: la imagen, los pesos del kernel, el borde y las regiones de interés
+uint64_t result_key(const ImageView *image, const int *dims, const Kernel *kernel, int border, int border_value, const ImageRect *rois, int num_rois) {
+    char description[160 + ROI_MAX_RECTS * 64];
+    uint64_t weights = result_cache_hash(kernel->weights, (size_t)kernel->width * kernel->height * sizeof(float), 0);
+    int length = snprintf(description, sizeof(description), "DDF-mpi kernel=%dx%d:%016llx border=%d:%d %dx%dx%d pixel=%d",
+                          kernel->width, kernel->height, (unsigned long long)weights, border, border_value, dims[0], dims[1], dims[2], dims[3]);
+    for (int i = 0; i < num_rois; i++) {
+        length += snprintf(description + length, sizeof(description) - length, " roi=%d,%d,%d,%d", rois[i].x, rois[i].y,
+                           rois[i].width, rois[i].height);
+    }
+    return result_cache_key_view(image, description);
+}
+
+// Función para leer las opciones del filtro; devuelve 0 si alguna no es válida
+int parse_filter_options(int argc, char **argv, FilterOptions *options) {
+    for (int i = 0; i < argc; i++) {
+        int valid = 1;
+        if (strcmp(argv[i], "--pipeline") == 0 && i + 1 < argc) {
+            options->chunks = atoi(argv[++i]);
+            valid = options->chunks > 0;
+        } else if (strcmp(argv[i], "--border") == 0 && i + 1 < argc) {
+            valid = parse_border(argv[++i], &options->border, &options->border_value);
+        } else if (strcmp(argv[i], "--pixel") == 0 && i + 1 < argc) {
+            valid = parse_pixel_type(argv[++i], &options->pixel_type);
+        } else if (strcmp(argv[i], "--kernel") == 0 && i + 1 < argc) {
+            options->kernel_spec = argv[++i];
+        } else {
+            valid = 0;
+        }
+        if (!valid) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Función para cargar el kernel de unas opciones; devuelve 0 si no es válido
+int load_options_kernel(const FilterOptions *options, Kernel *kernel) {
+    if (!load_kernel(options->kernel_spec ? options->kernel_spec : "-1,-1,-1; -1,8,-1; -1,-1,-1", kernel)) {
+        printf("Error loading kernel %s\n", options->kernel_spec);
+        return 0;
+    }
+    return 1;
+}
+
+// Función para filtrar una imagen entre todos los procesos; solo el proceso 0 tiene la imagen y la salida (NULL en
+// los demás, que toman la forma de la imagen de la cabecera)
+void filter_collective(const ImageView *image, const ImageView *output, const int *header, const Kernel *kernel, int rank, int size) {
+    ImageView shape = image_view_strided(NULL, header[0], header[1], header[2], header[3], image_row_stride(header[0], header[2], header[3]));
+    if (!image) {
+        image = output = &shape;
+    }
+    if (header[6] > 0) {
+        pipelined_ddf(image, output, kernel, header[4], header[5], rank, size, header[6]);
+    } else {
+        blocking_ddf(image, output, kernel, header[4], header[5], rank, size);
+    }
+}
+
+// Función para rellenar la cabecera de trabajo de una imagen con sus opciones y su kernel
+void fill_job_header(const ImageView *image, const FilterOptions *options, const Kernel *kernel, int *header) {
+    int values[JOB_HEADER_SIZE] = {image->width, image->height, image->channels, image->pixel_type, options->border,
+                                   options->border_value, options->chunks, kernel->width, kernel->height};
+    memcpy(header, values, sizeof(values));
+}
+
+// Función para cargar la imagen de un trabajo del lote y rellenar su cabecera; devuelve 0 si no se puede cargar
+int load_batch_image(const BatchJob *job, const FilterOptions *options, const Kernel *kernel, ImageView *image, int *header) {
+    if (!load_image_view(job->input, image, options->pixel_type)) {
+        printf("Error loading image %s\n", job->input);
+        return 0;
+    }
+    fill_job_header(image, options, kernel, header);
+    return 1;
+}
+
+// Función para guardar el resultado de un trabajo del lote; devuelve 0 si falla
+int write_batch_image(const BatchJob *job, const ImageView *output) {
+    if (!write_image_view(job->output, output)) {
+        printf("Error writing image %s\n", job->output);
+        return 0;
+    }
+    return 1;
+}
+
+// Modo por lotes, proceso 0. Fase 1: las imágenes pequeñas se envían enteras, con su kernel, a los procesos
+// trabajadores; el proceso 0 decodifica la siguiente mientras ellos filtran y codifica cada resultado en cuanto llega.
+// Fase 2: las imágenes grandes se filtran entre todos los procesos por filas, decodificando la siguiente en segundo plano
+// Devuelve el número de trabajos fallidos
+int run_batch_master(const char *manifest, const FilterOptions *defaults, const ResultCache *cache, int size) {
+    BatchJob *jobs = NULL;
+    int count = load_manifest(manifest, &jobs);
+    int failed = 0;
+    if (count < 0) {
+        printf("Error reading manifest %s\n", manifest);
+        count = 0;
+        failed = 1;
+    }
+
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    // Opciones y kernel de cada trabajo, y clasificación por tamaño leyendo solo la cabecera del archivo
+    FilterOptions *options = (FilterOptions *)malloc((count > 0 ? count : 1) * sizeof(FilterOptions));
+    Kernel *kernels = (Kernel *)calloc(count > 0 ? count : 1, sizeof(Kernel));
+    int *whole = (int *)malloc((count > 0 ? count : 1) * sizeof(int));  // 1 = imagen completa, 0 = por filas, -1 = no válida
+    int whole_count = 0, split_count = 0, cache_hits = 0;
+    for (int j = 0; j < count; j++) {
+        options[j] = *defaults;
+        int width, height, channels;
+        if (!parse_filter_options(jobs[j].argc, jobs[j].argv, &options[j]) || !load_options_kernel(&options[j], &kernels[j])) {
+            printf("Invalid options for %s\n", jobs[j].input);
+            whole[j] = -1;
+            failed++;
+        } else {
+            whole[j] = size > 1 && stbi_info(jobs[j].input, &width, &height, &channels) && (long)width * height <= BATCH_WHOLE_IMAGE_PIXELS;
+            whole_count += whole[j];
+            split_count += !whole[j];
+        }
+    }
+
+    // Fase 1: una imagen completa por proceso trabajador
+    if (size > 1) {
+        int *job_of = (int *)malloc(size * sizeof(int));                              // Trabajo de cada proceso
+        uint64_t *key_of = (uint64_t *)malloc(size * sizeof(uint64_t));               // Clave en la caché del trabajo de cada proceso
+        int *headers = (int *)malloc((size_t)size * JOB_HEADER_SIZE * sizeof(int));  // Cabecera de la imagen de cada proceso
+        int pending_header[JOB_HEADER_SIZE];
+        ImageView pending = {NULL, 0, 0, 0, 0, 0};  // Imagen ya decodificada, a la espera de un proceso libre
+        int pending_job = -1;
+        uint64_t pending_key = 0;
+        int next = 0, next_worker = 1, active = 0;
+        while (1) {
+            // Decodificar la siguiente imagen pequeña mientras los procesos trabajadores filtran las suyas
+            while (!pending.data && next < count) {
+                if (whole[next] == 1) {
+                    failed += !load_batch_image(&jobs[next], &options[next], &kernels[next], &pending, pending_header);
+                    pending_job = next;
+                }
+                // Los resultados que ya están en la caché se guardan sin pasar por ningún proceso trabajador
+                if (pending.data && cache->directory) {
+                    pending_key = result_key(&pending, pending_header, &kernels[next], pending_header[4], pending_header[5], NULL, 0);
+                    ImageView cached = image_alloc_view(pending.width, pending.height, pending.channels, pending.pixel_type);
+                    if (result_cache_get_view(cache, pending_key, &cached)) {
+                        failed += !write_batch_image(&jobs[pending_job], &cached);
+                        cache_hits++;
+                        image_free(pending.data);
+                        pending.data = NULL;
+                    }
+                    image_free(cached.data);
+                }
+                next++;
+            }
+            if (!pending.data && active == 0) {
+                break;
+            }
+
+            // Proceso libre: uno que aún no ha recibido nada o el primero que devuelva su resultado
+            int worker, result_job = -1;
+            uint64_t returned_key = 0;  // Clave del resultado, que se guarda después de dar otro trabajo al proceso
+            ImageView result = {NULL, 0, 0, 0, 0, 0};
+            if (pending.data && next_worker < size) {
+                worker = next_worker++;
+            } else {
+                MPI_Status status;
+                MPI_Probe(MPI_ANY_SOURCE, TAG_BATCH_RESULT, MPI_COMM_WORLD, &status);
+                worker = status.MPI_SOURCE;
+                result_job = job_of[worker];
+                returned_key = key_of[worker];
+                const int *result_header = headers + (size_t)worker * JOB_HEADER_SIZE;
+                result = image_alloc_view(result_header[0], result_header[1], result_header[2], result_header[3]);
+                MPI_Datatype row_type = row_datatype(&result);
+                MPI_Recv(result.data, result.height, row_type, worker, TAG_BATCH_RESULT, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+                MPI_Type_free(&row_type);
+                active--;
+            }
+
+            // Enviar la imagen pendiente y su kernel al proceso libre antes de codificar el resultado que ha devuelto
+            if (pending.data) {
+                const Kernel *kernel = &kernels[pending_job];
+                MPI_Datatype row_type = row_datatype(&pending);
+                MPI_Send(pending_header, JOB_HEADER_SIZE, MPI_INT, worker, TAG_BATCH_JOB, MPI_COMM_WORLD);
+                MPI_Send(kernel->weights, kernel->width * kernel->height, MPI_FLOAT, worker, TAG_BATCH_KERNEL, MPI_COMM_WORLD);
+                MPI_Send(pending.data, pending.height, row_type, worker, TAG_BATCH_PIXELS, MPI_COMM_WORLD);
+                MPI_Type_free(&row_type);
+                memcpy(headers + (size_t)worker * JOB_HEADER_SIZE, pending_header, sizeof(pending_header));
+                job_of[worker] = pending_job;
+                key_of[worker] = pending_key;
+                image_free(pending.data);
+                pending.data = NULL;
+                active++;
+            }
+            if (result.data) {
+                result_cache_put_view(cache, returned_key, &result);
+                failed += !write_batch_image(&jobs[result_job], &result);
+                image_free(result.data);
+            }
+        }
+
+        // Terminar la fase 1 en todos los procesos trabajadores
+        int stop[JOB_HEADER_SIZE] = {0};
+        for (int worker = 1; worker < size; worker++) {
+            MPI_Send(stop, JOB_HEADER_SIZE, MPI_INT, worker, TAG_BATCH_JOB, MPI_COMM_WORLD);
+        }
+        free(job_of);
+        free(key_of);
+        free(headers);
+    }
+
+    // Fase 2: imágenes grandes entre todos los procesos
+    ImagePrefetch prefetch;
+    int next = 0;
+    while (next < count && whole[next] != 0) {
+        next++;
+    }
+    if (next < count) {
+        prefetch_image(&prefetch, jobs[next].input, options[next].pixel_type);
+    }
+    while (next < count) {
+        int current = next;
+        ImageView image;
+        int loaded = prefetched_image(&prefetch, &image);
+
+        // Empezar a decodificar la siguiente imagen grande antes de filtrar la actual
+        next++;
+        while (next < count && whole[next] != 0) {
+            next++;
+        }
+        if (next < count) {
+            prefetch_image(&prefetch, jobs[next].input, options[next].pixel_type);
+        }
+
+        if (!loaded) {
+            printf("Error loading image %s\n", jobs[current].input);
+            failed++;
+            continue;
+        }
+        Kernel *kernel = &kernels[current];
+        int header[JOB_HEADER_SIZE];
+        fill_job_header(&image, &options[current], kernel, header);
+        ImageView output = image_alloc_view(image.width, image.height, image.channels, image.pixel_type);
+        uint64_t key = cache->directory ? result_key(&image, header, kernel, header[4], header[5], NULL, 0) : 0;
+        if (result_cache_get_view(cache, key, &output)) {
+            cache_hits++;
+        } else {
+            MPI_Bcast(header, JOB_HEADER_SIZE, MPI_INT, 0, MPI_COMM_WORLD);
+            MPI_Bcast(kernel->weights, kernel->width * kernel->height, MPI_FLOAT, 0, MPI_COMM_WORLD);
+            filter_collective(&image, &output, header, kernel, 0, size);
+            result_cache_put_view(cache, key, &output);
+        }
+        failed += !write_batch_image(&jobs[current], &output);
+        image_free(image.data);
+        image_free(output.data);
+    }
+    int stop[JOB_HEADER_SIZE] = {0};
+    MPI_Bcast(stop, JOB_HEADER_SIZE, MPI_INT, 0, MPI_COMM_WORLD);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+    printf("Batch: %d images (%d whole, %d split by rows), %d failed, %.3f s (%.2f ms per image)\n",
+           count, whole_count, split_count, failed, seconds, count > 0 ? 1000.0 * seconds / count : 0.0);
+    if (cache->directory) {
+        printf("Result cache: %d images found in %s\n", cache_hits, cache->directory);
+    }
+
+    for (int j = 0; j < count; j++) {
+        free(kernels[j].weights);
+    }
+    free(kernels);
+    free(options);
+    free(whole);
+    if (jobs) {
+        free_manifest(jobs, count);
+    }
+    return failed;
+}
+
+// Modo por lotes, procesos trabajadores: filtran imágenes completas hasta que el proceso 0 termina la fase 1
+// y después participan en el filtrado por filas de cada imagen grande
+void run_batch_worker(int rank, int size) {
+    int header[JOB_HEADER_SIZE];
+    while (1) {
+        MPI_Recv(header, JOB_HEADER_SIZE, MPI_INT, 0, TAG_BATCH_JOB, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        if (header[0] == 0) {
+            break;
+        }
+        Kernel kernel = {header[7], header[8], (float *)malloc((size_t)header[7] * header[8] * sizeof(float))};
+        ImageView input = image_alloc_view(header[0], header[1], header[2], header[3]);
+        ImageView output = image_alloc_view(header[0], header[1], header[2], header[3]);
+        MPI_Datatype row_type = row_datatype(&input);
+        MPI_Recv(kernel.weights, kernel.width * kernel.height, MPI_FLOAT, 0, TAG_BATCH_KERNEL, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        MPI_Recv(input.data, input.height, row_type, 0, TAG_BATCH_PIXELS, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        apply_ddf_section(&input, &output, &kernel, header[4], header[5], 0, input.height);
+        MPI_Send(output.data, output.height, row_type, 0, TAG_BATCH_RESULT, MPI_COMM_WORLD);
+        MPI_Type_free(&row_type);
+        image_free(input.data);
+        image_free(output.data);
+        free(kernel.weights);
+    }
+    while (1) {
+        MPI_Bcast(header, JOB_HEADER_SIZE, MPI_INT, 0, MPI_COMM_WORLD);
+        if (header[0] == 0) {
+            break;
+        }
+        Kernel kernel = {header[7], header[8], (float *)malloc((size_t)header[7] * header[8] * sizeof(float))};
+        MPI_Bcast(kernel.weights, kernel.width * kernel.height, MPI_FLOAT, 0, MPI_COMM_WORLD);
+        filter_collective(NULL, NULL, header, &kernel, rank, size);
+        free(kernel.weights);
     }
 }
 
 int main(int argc, char *argv[]) {
-    // Initialize MPI
-    MPI_Init(&argc, &argv);
+    // Initialize MPI (the batch mode decodes the next image on a second thread, which never calls MPI)
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
 
     int rank, size;
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);  // Get the rank of the current process
     MPI_Comm_size(MPI_COMM_WORLD, &size);  // Get the total number of processes
 
     // Comprobar los argumentos de la línea de comandos
-    if (argc != 4) {
+    // Con --batch, el segundo argumento es el manifiesto y las opciones son las de todas sus líneas, que pueden dar su propio --kernel
+    // --cache y --cache-size activan la caché de resultados, que solo consulta el proceso 0
+    // --huge-pages respalda las imágenes y secciones grandes con páginas de 2 MB en todos los procesos
+    // --roi filtra solo las regiones de interés y copia el resto de la entrada (no en el modo por lotes)
+    int batch = argc >= 2 && strcmp(argv[1], "--batch") == 0;
+    FilterOptions options = {0, BORDER_SHRINK, 0, PIXEL_AUTO, NULL};
+    ResultCache cache = {NULL, RESULT_CACHE_DEFAULT_BYTES};  // Caché de resultados, que solo consulta el proceso 0
+    ImageRect rois[ROI_MAX_RECTS];  // Regiones de interés (--roi); el resto de la imagen se copia sin filtrar
+    int num_rois = 0;
+    int filter_argc = 0;
+    char *filter_argv[argc > 4 ? argc - 4 : 1];
+    int valid_args = argc >= 4;
+    for (int i = 4; valid_args && i < argc; i++) {
+        if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            cache.directory = argv[++i];
+        } else if (strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc) {
+            cache.max_bytes = (size_t)(atof(argv[++i]) * 1024 * 1024);
+            valid_args = cache.max_bytes > 0;
+        } else if (strcmp(argv[i], "--huge-pages") == 0) {
+            image_alloc_huge_pages(1);  // Imágenes y secciones grandes en páginas de 2 MB
+        } else if (!batch && strcmp(argv[i], "--roi") == 0 && i + 1 < argc) {
+            valid_args = num_rois < ROI_MAX_RECTS && parse_image_rect(argv[++i], &rois[num_rois++]);
+        } else {
+            filter_argv[filter_argc++] = argv[i];
+        }
+    }
+    valid_args = valid_args && parse_filter_options(filter_argc, filter_argv, &options);
+    if (!valid_args) {
         if (rank == 0) {
-            printf("Usage: %s <input_image> <output_image> <num_nodes>\n", argv[0]);
+            printf("Usage: %s <input_image> <output_image> <num_nodes> [--pipeline <chunks>] [--border shrink|replicate|reflect|constant[:value]] [--pixel auto|u8|u16|f32]\n", argv[0]);
+            printf("       [--kernel <file>|<w,w,w;w,w,w;w,w,w[/divisor]>] [--cache <dir>] [--cache-size <MB>] [--huge-pages] [--roi x,y,w,h]...\n");
+            printf("       %s --batch <manifest> <num_nodes> [options]\n", argv[0]);
+            printf("Each manifest line is \"<input_image> <output_image> [options]\", where the options may include --kernel.\n");
+            printf("The constant:value border is given in 8-bit units (0-255) for every sample type.\n");
+            printf("--roi filters only the given rectangles, split among the processes by area, and copies the other pixels.\n");
         }
         MPI_Finalize();
         return 1;
     }
 
-    int width, height, channels;
-    unsigned char *image;
-    // Cargar la imagen de entrada solo en el proceso 0
+    if (batch) {
+        int failed = 0;
+        if (rank == 0) {
+            failed = run_batch_master(argv[2], &options, &cache, size);
+        } else {
+            run_batch_worker(rank, size);
+        }
+        MPI_Finalize();
+        return failed > 0;
+    }
+
+    int dims[7] = {0, 0, 0, 0, 0, 0, 0};  // Ancho, alto, canales y tipo de píxel de la imagen; ancho y alto del kernel; 1 si el resultado está en la caché
+    ImageView image = {NULL, 0, 0, 0, 0, 0};
+    ImageView output = {NULL, 0, 0, 0, 0, 0};
+    Kernel kernel = {0, 0, NULL};
+    uint64_t key = 0;
+    // Cargar el kernel y la imagen de entrada, y consultar la caché, solo en el proceso 0
     if (rank == 0) {
-        image = stbi_load(argv[1], &width, &height, &channels, 0);
-        if (!image) {
-            printf("Error loading image %s\n", argv[1]);
-            MPI_Finalize();
-            return 1;
+        if (load_options_kernel(&options, &kernel)) {
+            if (!load_image_view(argv[1], &image, options.pixel_type)) {
+                printf("Error loading image %s\n", argv[1]);
+            } else {
+                dims[0] = image.width;
+                dims[1] = image.height;
+                dims[2] = image.channels;
+                dims[3] = image.pixel_type;
+            }
+            dims[4] = kernel.width;
+            dims[5] = kernel.height;
+        }
+        if (options.kernel_spec && image.data) {
+            printf("Kernel %dx%d, %s\n", kernel.width, kernel.height,
+                   separable_kernel(kernel.weights, kernel.width, kernel.height, NULL, NULL) ? "separable (two 1D passes)" : "not separable");
+        }
+        if (image.data) {
+            output = image_alloc_view(image.width, image.height, image.channels, image.pixel_type);  // Imagen de salida
+            key = cache.directory ? result_key(&image, dims, &kernel, options.border, options.border_value, rois, num_rois) : 0;
+            dims[6] = result_cache_get_view(&cache, key, &output);
+            if (dims[6]) {
+                printf("Result found in cache %s\n", cache.directory);
+            }
         }
     }
 
-    int num_nodes = atoi(argv[3]);   // Número de nodos (procesos) en el clúster
-    int total_size = width * height * channels;
-    int section_size = total_size / size;  // Calcular el tamaño de la sección para cada proceso
-    unsigned char *input_section = (unsigned char *)malloc(section_size * sizeof(unsigned char));  // Sección de datos de entrada para este proceso
-    unsigned char *output_section = (unsigned char *)malloc(section_size * sizeof(unsigned char));  // Sección de datos de salida para este proceso
+    // Compartir las dimensiones y el tipo de píxel de la imagen, y el kernel, con todos los procesos
+    MPI_Bcast(dims, 7, MPI_INT, 0, MPI_COMM_WORLD);
+    if (dims[0] == 0) {
+        free(kernel.weights);
+        MPI_Finalize();
+        return 1;
+    }
+    int width = dims[0], height = dims[1], channels = dims[2];
+    int pixel_type = dims[3];
+    if (rank != 0) {
+        // Los demás procesos solo necesitan la forma de la imagen
+        image = output = image_view_strided(NULL, width, height, channels, pixel_type, image_row_stride(width, channels, pixel_type));
+        kernel.width = dims[4];
+        kernel.height = dims[5];
+        kernel.weights = (float *)malloc((size_t)kernel.width * kernel.height * sizeof(float));
+    }
+    MPI_Bcast(kernel.weights, kernel.width * kernel.height, MPI_FLOAT, 0, MPI_COMM_WORLD);
 
-    // Distribuir las secciones de datos a todos los procesos
-    MPI_Scatter(image, section_size, MPI_UNSIGNED_CHAR, input_section, section_size, MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
+    int num_nodes = atoi(argv[3]);   // Número de nodos (procesos) en el clúster
 
-    // Aplicar el filtro DDF a la sección de datos localmente
-    apply_ddf_section(input_section, output_section, width, height, channels);
+    // Regiones de interés recortadas a la imagen y sin solapes; todos los procesos las calculan igual
+    ImageRect regions[ROI_MAX_PIECES];
+    int num_regions = num_rois > 0 ? roi_disjoint(rois, num_rois, width, height, regions, ROI_MAX_PIECES) : 0;
+    if (num_regions < 0) {
+        if (rank == 0) {
+            printf("The regions of interest overlap in more than %d pieces\n", ROI_MAX_PIECES);
+            image_free(image.data);
+            image_free(output.data);
+        }
+        free(kernel.weights);
+        MPI_Finalize();
+        return 1;
+    }
+    if (rank == 0 && num_rois > 0) {
+        printf("Regions of interest: %d rectangles, %.1f%% of the image filtered\n", num_rois,
+               100.0 * roi_area(regions, num_regions) / ((double)width * height));
+    }
 
-    // Recolectar las secciones de salida de todos los procesos en el proceso 0
-    MPI_Gather(output_section, section_size, MPI_UNSIGNED_CHAR, image, section_size, MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
+    if (!dims[6]) {
+        if (num_rois > 0) {
+            roi_ddf(&image, &output, &kernel, options.border, options.border_value, regions, num_regions, rank, size);
+        } else {
+            int header[JOB_HEADER_SIZE];
+            fill_job_header(&image, &options, &kernel, header);
+            filter_collective(&image, &output, header, &kernel, rank, size);
+        }
+        if (rank == 0) {
+            result_cache_put_view(&cache, key, &output);
+        }
+    }
 
     // Guardar la imagen de salida solo desde el proceso 0
     if (rank == 0) {
-        if (!stbi_write_png(argv[2], width, height, channels, image, width * channels)) {
+        int ok = write_image_view(argv[2], &output);
+        image_free(image.data);   // Liberar la memoria de la imagen de entrada
+        image_free(output.data);  // Liberar la memoria de la imagen de salida
+        if (!ok) {
             printf("Error writing image %s\n", argv[2]);
-            free(image);
             MPI_Finalize();
             return 1;
         }
-        stbi_image_free(image);  // Liberar la memoria de la imagen de entrada
     }
 
-    free(input_section);   // Liberar la memoria de la sección de datos de entrada
-    free(output_section);  // Liberar la memoria de la sección de datos de salida
-
+    free(kernel.weights);  // Liberar los pesos del kernel
     MPI_Finalize();  // Finalizar MPI
     return 0;
 }
@@ -1,97 +1,574 @@
 #include <opencv2/opencv.hpp>
 #include <iostream>
 #include <vector>
+#include <string>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <mpi.h>
+#define RESULT_CACHE_IMPLEMENTATION
+#include "result_cache.h"
+#define BATCH_MANIFEST_ONLY
+#define BATCH_IMPLEMENTATION
+#include "batch.h"
 using namespace cv;
 using namespace std;
 
 /*
 mpic++ -o DDF DDF.cpp `pkg-config --cflags --libs opencv4`
 mpirun -np 4 ./DDF test-soft.png soft-output-test.png 10 50.0
+mpirun -np 4 ./DDF test-soft.png soft-output-test.png 500 50.0 --checkpoint /tmp/ddf-ckpt --checkpoint-every 25
+mpirun -np 4 ./DDF test-soft.png soft-output-test.png 500 50.0 --tolerance 0.1 --check-every 10 --norm l1
+mpirun -np 4 ./DDF test-soft.png soft-output-test.png 500 0.2 --scheme aos --step 10
+mpirun -np 4 ./DDF test-soft.png soft-output-test.png 500 50.0 --flat-threshold 1
+mpirun -np 4 ./DDF test-soft.png soft-output-test.png 500 50.0 --cache /tmp/ddf-cache --cache-size 256
+mpirun -np 4 ./DDF --batch manifest.txt 10 50.0 --cache /tmp/ddf-cache
+
+8-bit, 16-bit and float images are filtered at their own depth (other depths are converted to float).
+The diffusion coefficient, the tolerance and the flat threshold use 8-bit units, with float images taken to span [0, 1].
+With --cache the master looks the result up (see result_cache.h) before sending any part to the other nodes.
+With --batch every line of the manifest (see batch.h) is one image, diffused by the same ranks while the master decodes
+the next one; a line may override the iterations and lambda with --iterations and --lambda, and the filter options.
 */
 
-// Function to apply a directional diffusion filter on a part of the image
-void directional_diffusion_filter_part(Mat& image_part, int iterations, double lambda) {
-    Mat grad_x, grad_y, grad_mag, diffusion;
-    int rows = image_part.rows;
-    int cols = image_part.cols;
+// Side of the tiles of the activity map used with --flat-threshold
+constexpr int FLAT_TILE = 32;
 
-    for (int it = 0; it < iterations; ++it) {
-        // Compute gradients
-        Sobel(image_part, grad_x, CV_64F, 1, 0, 3);
-        Sobel(image_part, grad_y, CV_64F, 0, 1, 3);
+// Options of the diffusion filter given on the command line
+struct DiffusionOptions {
+    int iterations = 0;         // Command line arguments, or --iterations and --lambda of a manifest line
+    double lambda = 0.0;
+    string checkpoint_dir;      // Directory on local disk for the checkpoints (empty = disabled)
+    int checkpoint_every = 10;  // Iterations between checkpoints
+    double tolerance = 0.0;     // Convergence tolerance (0 = always run every iteration)
+    int check_every = 10;       // Iterations between convergence checks
+    bool l1 = false;            // Mean absolute change per pixel instead of the maximum absolute change
+    bool aos = false;           // Semi-implicit additive operator splitting instead of explicit updates
+    double step = 5.0;          // AOS time step
+    double flat_threshold = 0.0;  // Neighbour difference below which a tile is left alone until woken (0 = disabled)
+};
 
-        // Compute gradient magnitude
-        magnitude(grad_x, grad_y, grad_mag);
+// Tiles visited and skipped by the lazy explicit update
+struct FlatTileStats {
+    long long updates = 0;
+    long long skipped = 0;
+};
+
+// Header of the binary checkpoint file of one rank's strip
+struct CheckpointHeader {
+    char magic[8];            // "DDFCKPT2"
+    int32_t rows;
+    int32_t cols;
+    int32_t type;             // OpenCV type of the strip
+    int32_t rank;
+    int32_t size;
+    int32_t iterations_done;  // Iterations completed when the snapshot was taken
+    double lambda;
+    uint64_t input_hash;      // Hash of the strip received from the master node
+};
+
+// MPI datatype of the pixels of an image depth (CV_8U, CV_16U or CV_32F)
+MPI_Datatype mpi_datatype(int depth) {
+    return depth == CV_16U ? MPI_UNSIGNED_SHORT : depth == CV_32F ? MPI_FLOAT : MPI_UNSIGNED_CHAR;
+}
+
+// Factor that brings pixel values of an image depth to 8-bit units
+double pixel_scale(int depth) {
+    return depth == CV_16U ? 255.0 / 65535.0 : depth == CV_32F ? 255.0 : 1.0;
+}
+
+// FNV-1a hash of a continuous matrix, used to reject checkpoints of a different input
+uint64_t hash_mat(const Mat& mat) {
+    uint64_t hash = 1469598103934665603ULL;
+    const uchar* data = mat.ptr<uchar>(0);
+    size_t bytes = mat.total() * mat.elemSize();
+    for (size_t i = 0; i < bytes; ++i) {
+        hash = (hash ^ data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Writes snapshots of a rank's strip to local disk on a background thread.
+// A snapshot submitted while the previous one is still being written is skipped, so compute never stalls.
+class CheckpointWriter {
+public:
+    CheckpointWriter(const string& dir, int rank, int size, const Mat& strip, double lambda)
+        : path_(dir + "/ddf-rank" + to_string(rank) + ".ckpt"), tmp_path_(path_ + ".tmp"),
+          snapshot_(strip.size(), strip.type()) {
+        memset(&header_, 0, sizeof(header_));
+        memcpy(header_.magic, "DDFCKPT2", 8);
+        header_.rows = strip.rows;
+        header_.cols = strip.cols;
+        header_.type = strip.type();
+        header_.rank = rank;
+        header_.size = size;
+        header_.lambda = lambda;
+        header_.input_hash = hash_mat(strip);
+        // Each rank writes to its own local disk, so each one creates the directory if it is missing
+        if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+            cerr << "Could not create checkpoint directory " << dir << ": " << strerror(errno) << endl;
+        }
+        worker_ = thread(&CheckpointWriter::run, this);
+    }
+
+    ~CheckpointWriter() {
+        {
+            lock_guard<mutex> lock(mutex_);
+            done_ = true;
+        }
+        ready_.notify_one();
+        worker_.join();
+        // The filter finished, so the checkpoints are no longer needed
+        remove(path_.c_str());
+        remove(tmp_path_.c_str());
+    }
+
+    // Loads the last compatible checkpoint into strip and returns the iterations it completed (0 if none)
+    int load(Mat& strip, int iterations) {
+        FILE* file = fopen(path_.c_str(), "rb");
+        if (!file) {
+            return 0;
+        }
+        CheckpointHeader header;
+        int iterations_done = 0;
+        size_t bytes = strip.total() * strip.elemSize();
+        if (fread(&header, sizeof(header), 1, file) == 1) {
+            CheckpointHeader expected = header_;
+            expected.iterations_done = header.iterations_done;
+            if (memcmp(&header, &expected, sizeof(header)) == 0 && header.iterations_done <= iterations &&
+                fread(snapshot_.data, 1, bytes, file) == bytes) {
+                snapshot_.copyTo(strip);
+                iterations_done = header.iterations_done;
+            }
+        }
+        fclose(file);
+        if (iterations_done == 0) {
+            cerr << "Ignoring incompatible checkpoint " << path_ << endl;
+        }
+        return iterations_done;
+    }
+
+    // Hands a copy of the strip to the writer thread unless it is still busy with the previous one
+    void submit(const Mat& strip, int iterations_done) {
+        {
+            lock_guard<mutex> lock(mutex_);
+            if (pending_) {
+                return;
+            }
+            strip.copyTo(snapshot_);
+            header_.iterations_done = iterations_done;
+            pending_ = true;
+        }
+        ready_.notify_one();
+    }
 
-        // Compute diffusion coefficient
-        diffusion = 1.0 / (1.0 + grad_mag);
+private:
+    void run() {
+        unique_lock<mutex> lock(mutex_);
+        while (true) {
+            ready_.wait(lock, [this] { return pending_ || done_; });
+            if (!pending_) {
+                break;
+            }
+            CheckpointHeader header = header_;
+            lock.unlock();
 
-        // Update the image based on diffusion
-        for (int r = 1; r < rows - 1; ++r) {
-            for (int c = 1; c < cols - 1; ++c) {
-                double diff = diffusion.at<double>(r, c);
-                image_part.at<uchar>(r, c) += lambda * diff * (
-                    image_part.at<uchar>(r + 1, c) +
-                    image_part.at<uchar>(r - 1, c) +
-                    image_part.at<uchar>(r, c + 1) +
-                    image_part.at<uchar>(r, c - 1) -
-                    4 * image_part.at<uchar>(r, c)
-                );
+            // The snapshot is not touched while pending_ is set, so it is written without holding the lock
+            FILE* file = fopen(tmp_path_.c_str(), "wb");
+            bool ok = file != nullptr;
+            if (file) {
+                size_t bytes = snapshot_.total() * snapshot_.elemSize();
+                ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                     fwrite(snapshot_.data, 1, bytes, file) == bytes;
+                ok = fflush(file) == 0 && fsync(fileno(file)) == 0 && ok;
+                fclose(file);
             }
+            if (!ok || rename(tmp_path_.c_str(), path_.c_str()) != 0) {
+                cerr << "Error writing checkpoint " << path_ << ": " << strerror(errno) << endl;
+            }
+
+            lock.lock();
+            pending_ = false;
         }
     }
+
+    string path_;
+    string tmp_path_;
+    CheckpointHeader header_;
+    Mat snapshot_;
+    bool pending_ = false;
+    bool done_ = false;
+    mutex mutex_;
+    condition_variable ready_;
+    thread worker_;
+};
+
+// Reduces the change of the last iteration across all ranks and tells whether it fell below the tolerance
+bool converged(const Mat& previous, const Mat& current, const DiffusionOptions& options) {
+    if (options.l1) {
+        double local[2] = {norm(current, previous, NORM_L1) * pixel_scale(current.depth()), (double)current.total()};
+        double global[2];
+        MPI_Allreduce(local, global, 2, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+        return global[0] / global[1] < options.tolerance;
+    }
+    double local = norm(current, previous, NORM_INF) * pixel_scale(current.depth());
+    double global;
+    MPI_Allreduce(&local, &global, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+    return global < options.tolerance;
 }
 
-int main(int argc, char** argv) {
-    // Initialize MPI
-    MPI_Init(&argc, &argv);
-    int rank, size;
-    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
-    MPI_Comm_size(MPI_COMM_WORLD, &size);
+// Explicit update, in raster order, of the pixels of area (interior pixels of a part of the image stored as T)
+template <typename T>
+void diffusion_update(Mat& image_part, const Mat& diffusion, double lambda, Rect area) {
+    for (int r = area.y; r < area.y + area.height; ++r) {
+        for (int c = area.x; c < area.x + area.width; ++c) {
+            double diff = diffusion.at<double>(r, c);
+            image_part.at<T>(r, c) += lambda * diff * (
+                image_part.at<T>(r + 1, c) +
+                image_part.at<T>(r - 1, c) +
+                image_part.at<T>(r, c + 1) +
+                image_part.at<T>(r, c - 1) -
+                4 * image_part.at<T>(r, c)
+            );
+        }
+    }
+}
 
-    if (argc != 5) {
-        if (rank == 0) {
-            cerr << "Usage: " << argv[0] << " <input_image_path> <output_image_path> <iterations> <lambda>" << endl;
+// Whether every difference between a pixel of area and its four neighbours is below threshold
+template <typename T>
+bool flat_area(const Mat& image_part, Rect area, double threshold) {
+    for (int r = area.y; r < area.y + area.height; ++r) {
+        for (int c = area.x; c < area.x + area.width; ++c) {
+            double center = image_part.at<T>(r, c);
+            if (abs(image_part.at<T>(r + 1, c) - center) >= threshold || abs(image_part.at<T>(r - 1, c) - center) >= threshold ||
+                abs(image_part.at<T>(r, c + 1) - center) >= threshold || abs(image_part.at<T>(r, c - 1) - center) >= threshold) {
+                return false;
+            }
         }
-        MPI_Finalize();
-        return -1;
     }
+    return true;
+}
 
-    string input_image_path = argv[1];
-    string output_image_path = argv[2];
-    int iterations = stoi(argv[3]);
-    double lambda = stod(argv[4]);
+// Explicit update restricted to the tiles of an activity map (FLAT_TILE pixels a side, 1 = active).
+// An active tile whose interior pixels differ from their neighbours by less than threshold (in pixel units) is left
+// as it is and deactivated; the others are updated with the diffusion coefficient of previous (the image before
+// this iteration) and stay active. A tile that changes the pixels of a border wakes the neighbour across it: still
+// in this sweep for the tiles after it, in the next one for those before it. The tiles are visited in raster order,
+// which reads the same updated and pending neighbours as the raster order of diffusion_update, so the result does
+// not change when no tile that would change is skipped (integer pixels and threshold <= 1).
+template <typename T>
+void lazy_diffusion_update(Mat& image_part, const Mat& previous, Mat& diffusion, vector<uchar>& active, double lambda,
+                           double threshold, FlatTileStats& stats) {
+    Mat grad_x, grad_y, grad_mag;
+    double scale = pixel_scale(image_part.depth());
+    int rows = image_part.rows;
+    int cols = image_part.cols;
+    int tiles_x = (cols + FLAT_TILE - 1) / FLAT_TILE;
+    int tiles_y = (rows + FLAT_TILE - 1) / FLAT_TILE;
+    vector<uchar> next(active.size(), 0);
+    Rect interior(1, 1, cols - 2, rows - 2);
 
-    Mat image;
-    int rows_per_node;
-    int total_rows, total_cols;
+    for (int ty = 0; ty < tiles_y; ++ty) {
+        for (int tx = 0; tx < tiles_x; ++tx) {
+            int t = ty * tiles_x + tx;
+            Rect tile(tx * FLAT_TILE, ty * FLAT_TILE, min(FLAT_TILE, cols - tx * FLAT_TILE), min(FLAT_TILE, rows - ty * FLAT_TILE));
+            Rect area = tile & interior;
+            ++stats.updates;
+            if (!active[t] || flat_area<T>(image_part, area, threshold)) {
+                ++stats.skipped;
+                continue;
+            }
 
-    if (rank == 0) {
-        // Master node loads the image
-        image = imread(input_image_path, IMREAD_GRAYSCALE);
-        if (image.empty()) {
-            cerr << "Error: could not read the image." << endl;
-            MPI_Abort(MPI_COMM_WORLD, -1);
+            // Diffusion coefficient of the tile; Sobel reads the pixels around the tile from the rest of previous
+            Sobel(previous(tile), grad_x, CV_64F, 1, 0, 3);
+            Sobel(previous(tile), grad_y, CV_64F, 0, 1, 3);
+            magnitude(grad_x, grad_y, grad_mag);
+            Mat(1.0 / (1.0 + grad_mag * scale)).copyTo(diffusion(tile));
+            diffusion_update<T>(image_part, diffusion, lambda, area);
+            next[t] = 1;
+
+            // Wake the neighbours across the borders that changed
+            Mat before = previous(tile), after = image_part(tile);
+            if (ty > 0 && norm(before.row(0), after.row(0), NORM_INF) > 0) {
+                next[t - tiles_x] = 1;
+            }
+            if (tx > 0 && norm(before.col(0), after.col(0), NORM_INF) > 0) {
+                next[t - 1] = 1;
+            }
+            if (ty < tiles_y - 1 && norm(before.row(tile.height - 1), after.row(tile.height - 1), NORM_INF) > 0) {
+                active[t + tiles_x] = 1;
+            }
+            if (tx < tiles_x - 1 && norm(before.col(tile.width - 1), after.col(tile.width - 1), NORM_INF) > 0) {
+                active[t + 1] = 1;
+            }
         }
+    }
+    active.swap(next);
+}
 
-        // Distribute the workload
-        total_rows = image.rows;
-        total_cols = image.cols;
-        rows_per_node = total_rows / size;
+// Function to apply a directional diffusion filter on a part of the image
+// When a checkpoint writer is given, the strip is resumed from its last checkpoint and snapshotted every checkpoint_every iterations.
+// With a flat threshold, only the tiles of an activity map are updated (see lazy_diffusion_update) and stats counts them.
+// Returns the number of iterations run, which is lower than iterations when the image converged.
+int directional_diffusion_filter_part(Mat& image_part, int iterations, double lambda,
+                                      const DiffusionOptions& options = DiffusionOptions(), CheckpointWriter* checkpoint = nullptr,
+                                      FlatTileStats* stats = nullptr) {
+    Mat grad_x, grad_y, grad_mag, diffusion, previous;
+    double scale = pixel_scale(image_part.depth());
+    int first_iteration = checkpoint ? checkpoint->load(image_part, iterations) : 0;
 
-        // Send the size of the divisions to the other nodes
-        for (int i = 1; i < size; ++i) {
-            MPI_Send(&total_rows, 1, MPI_INT, i, 0, MPI_COMM_WORLD);
-            MPI_Send(&total_cols, 1, MPI_INT, i, 0, MPI_COMM_WORLD);
-            MPI_Send(&rows_per_node, 1, MPI_INT, i, 0, MPI_COMM_WORLD);
+    // Activity map: every tile starts active
+    bool lazy = options.flat_threshold > 0;
+    vector<uchar> active;
+    FlatTileStats local_stats;
+    if (lazy) {
+        active.assign(((image_part.rows + FLAT_TILE - 1) / FLAT_TILE) * ((image_part.cols + FLAT_TILE - 1) / FLAT_TILE), 1);
+        diffusion.create(image_part.size(), CV_64F);
+    }
+    FlatTileStats& tile_stats = stats ? *stats : local_stats;
+    double flat_threshold = options.flat_threshold / scale;
+
+    // Every rank must take part in the same reductions, so convergence is only checked
+    // from the most advanced iteration any rank resumed from
+    int check_from = first_iteration;
+    if (options.tolerance > 0) {
+        MPI_Allreduce(&first_iteration, &check_from, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    }
+
+    for (int it = first_iteration; it < iterations; ++it) {
+        bool check = options.tolerance > 0 && (it + 1) % options.check_every == 0 && it >= check_from;
+        if (check || lazy) {
+            image_part.copyTo(previous);
+        }
+
+        if (lazy) {
+            switch (image_part.depth()) {
+                case CV_16U: lazy_diffusion_update<ushort>(image_part, previous, diffusion, active, lambda, flat_threshold, tile_stats); break;
+                case CV_32F: lazy_diffusion_update<float>(image_part, previous, diffusion, active, lambda, flat_threshold, tile_stats); break;
+                default: lazy_diffusion_update<uchar>(image_part, previous, diffusion, active, lambda, flat_threshold, tile_stats); break;
+            }
+        } else {
+            // Compute gradients
+            Sobel(image_part, grad_x, CV_64F, 1, 0, 3);
+            Sobel(image_part, grad_y, CV_64F, 0, 1, 3);
+
+            // Compute gradient magnitude
+            magnitude(grad_x, grad_y, grad_mag);
+
+            // Compute diffusion coefficient, with the gradient in 8-bit units
+            diffusion = 1.0 / (1.0 + grad_mag * scale);
+
+            // Update the image based on diffusion
+            Rect interior(1, 1, image_part.cols - 2, image_part.rows - 2);
+            switch (image_part.depth()) {
+                case CV_16U: diffusion_update<ushort>(image_part, diffusion, lambda, interior); break;
+                case CV_32F: diffusion_update<float>(image_part, diffusion, lambda, interior); break;
+                default: diffusion_update<uchar>(image_part, diffusion, lambda, interior); break;
+            }
+        }
+
+        if (check && converged(previous, image_part, options)) {
+            return it + 1;
+        }
+
+        if (checkpoint && (it + 1) % options.checkpoint_every == 0 && it + 1 < iterations) {
+            checkpoint->submit(image_part, it + 1);
         }
-    } else {
-        // Other nodes receive the size of the divisions
-        MPI_Recv(&total_rows, 1, MPI_INT, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-        MPI_Recv(&total_cols, 1, MPI_INT, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-        MPI_Recv(&rows_per_node, 1, MPI_INT, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
     }
+    return iterations;
+}
+
+// Solves (I - 2 tau A) x = d along one line with the Thomas algorithm, where A couples
+// neighbours i and i + 1 with weight (g[i] + g[i + 1]) / 2. All arrays are read with the same stride.
+void solve_aos_line(const float* g, const float* d, float* x, int n, int stride, float tau, vector<float>& scratch) {
+    float w_prev = 0.0f;
+    float d_prev = 0.0f;
+    for (int i = 0; i < n; ++i) {
+        float w_next = (i < n - 1) ? 0.5f * (g[i * stride] + g[(i + 1) * stride]) : 0.0f;
+        float a = -2.0f * tau * w_prev;
+        float b = 1.0f + 2.0f * tau * (w_prev + w_next);
+        float denom = b - (i > 0 ? a * scratch[i - 1] : 0.0f);
+        scratch[i] = -2.0f * tau * w_next / denom;
+        d_prev = (d[i * stride] - (i > 0 ? a * d_prev : 0.0f)) / denom;
+        x[i * stride] = d_prev;
+        w_prev = w_next;
+    }
+    for (int i = n - 2; i >= 0; --i) {
+        x[i * stride] -= scratch[i] * x[(i + 1) * stride];
+    }
+}
+
+// Function to apply the diffusion filter on a part of the image with the semi-implicit AOS scheme.
+// It covers the same diffusion time as the explicit updates (lambda per iteration) in steps of size step,
+// which stays stable for large steps. Row and column systems are solved in parallel.
+void aos_diffusion_filter_part(Mat& image_part, int iterations, double lambda, double step) {
+    Mat u, grad_x, grad_y, grad_mag, diffusion;
+    int rows = image_part.rows;
+    int cols = image_part.cols;
+    double scale = pixel_scale(image_part.depth());
+    double diffusion_time = lambda * iterations;
+    int steps = (int)ceil(diffusion_time / step);
+    float tau = steps > 0 ? (float)(diffusion_time / steps) : 0.0f;
+
+    image_part.convertTo(u, CV_32F);
+    Mat vx(rows, cols, CV_32F);
+    Mat vy(rows, cols, CV_32F);
+
+    for (int s = 0; s < steps; ++s) {
+        // Same diffusion coefficient as the explicit scheme, evaluated at the start of the step
+        Sobel(u, grad_x, CV_32F, 1, 0, 3);
+        Sobel(u, grad_y, CV_32F, 0, 1, 3);
+        magnitude(grad_x, grad_y, grad_mag);
+        diffusion = 1.0 / (1.0 + grad_mag * scale);
+
+        // Row systems
+        parallel_for_(Range(0, rows), [&](const Range& range) {
+            vector<float> scratch(cols);
+            for (int r = range.start; r < range.end; ++r) {
+                solve_aos_line(diffusion.ptr<float>(r), u.ptr<float>(r), vx.ptr<float>(r), cols, 1, tau, scratch);
+            }
+        });
+
+        // Column systems
+        parallel_for_(Range(0, cols), [&](const Range& range) {
+            vector<float> scratch(rows);
+            for (int c = range.start; c < range.end; ++c) {
+                solve_aos_line(diffusion.ptr<float>(0) + c, u.ptr<float>(0) + c, vy.ptr<float>(0) + c, rows, cols, tau, scratch);
+            }
+        });
+
+        // Average both directional solutions
+        addWeighted(vx, 0.5, vy, 0.5, 0.0, u);
+    }
+
+    u.convertTo(image_part, image_part.type());
+}
+
+// Key of the result cache: the decoded pixels and every option that changes the result. Each rank diffuses its strip
+// on its own, so the number of ranks is part of the key; the checkpoint options only change how a run resumes
+uint64_t result_key(const Mat& image, const DiffusionOptions& options, int size) {
+    char description[256];
+    snprintf(description, sizeof(description),
+             "DDF-opencv iterations=%d lambda=%g aos=%d step=%g tolerance=%g check=%d l1=%d flat=%g ranks=%d %dx%dx%d type=%d",
+             options.iterations, options.lambda, options.aos ? 1 : 0, options.step, options.tolerance, options.check_every,
+             options.l1 ? 1 : 0, options.flat_threshold, size, image.cols, image.rows, image.channels(), image.type());
+    return result_cache_key(image.data, image.total() * image.elemSize(), description);
+}
+
+// Parses the filter option at argv[i], moving i past its value; returns false when it is unknown or its value is invalid.
+// Manifest lines may also override the iterations and lambda of the command line with --iterations and --lambda
+bool parse_diffusion_option(int argc, char** argv, int& i, DiffusionOptions& options, bool manifest_line) {
+    string option = argv[i];
+    if (i + 1 >= argc) {
+        return false;
+    }
+    if (option == "--tolerance") {
+        options.tolerance = stod(argv[++i]);
+        return options.tolerance > 0;
+    } else if (option == "--check-every") {
+        options.check_every = stoi(argv[++i]);
+        return options.check_every > 0;
+    } else if (option == "--norm") {
+        string norm_name = argv[++i];
+        options.l1 = norm_name == "l1";
+        return norm_name == "l1" || norm_name == "linf";
+    } else if (option == "--scheme") {
+        string scheme = argv[++i];
+        options.aos = scheme == "aos";
+        return scheme == "aos" || scheme == "explicit";
+    } else if (option == "--step") {
+        options.step = stod(argv[++i]);
+        return options.step > 0;
+    } else if (option == "--flat-threshold") {
+        options.flat_threshold = stod(argv[++i]);
+        return options.flat_threshold >= 0;
+    } else if (manifest_line && option == "--iterations") {
+        options.iterations = stoi(argv[++i]);
+        return options.iterations >= 0;
+    } else if (manifest_line && option == "--lambda") {
+        options.lambda = stod(argv[++i]);
+        return options.lambda > 0;
+    }
+    return false;
+}
+
+// AOS does not check convergence, write checkpoints or skip flat tiles
+bool compatible_options(const DiffusionOptions& options) {
+    return !(options.aos && (options.tolerance > 0 || !options.checkpoint_dir.empty() || options.flat_threshold > 0));
+}
+
+// Loads an image at its own depth (other depths are converted to float); the result is empty when it cannot be read
+Mat read_image(const string& path) {
+    Mat image = imread(path, IMREAD_GRAYSCALE | IMREAD_ANYDEPTH);
+    if (!image.empty() && image.depth() != CV_8U && image.depth() != CV_16U && image.depth() != CV_32F) {
+        image.convertTo(image, CV_32F);
+    }
+    return image;
+}
+
+// Parameters of one image that the master broadcasts before its strips: its size and type, whether the result was
+// found in the cache and the filter options of its job. The checkpoint directory is given to every rank on the
+// command line. A header without rows ends a batch
+struct ImageHeader {
+    int32_t rows = 0;
+    int32_t cols = 0;
+    int32_t type = 0;
+    int32_t cached = 0;  // 1 when the master found the result in the cache, so no rank diffuses
+    int32_t iterations = 0;
+    int32_t check_every = 0;
+    int32_t l1 = 0;
+    int32_t aos = 0;
+    double lambda = 0.0;
+    double tolerance = 0.0;
+    double step = 0.0;
+    double flat_threshold = 0.0;
+};
+
+ImageHeader image_header(const Mat& image, int cached, const DiffusionOptions& options) {
+    ImageHeader header;
+    header.rows = image.rows;
+    header.cols = image.cols;
+    header.type = image.type();
+    header.cached = cached;
+    header.iterations = options.iterations;
+    header.check_every = options.check_every;
+    header.l1 = options.l1;
+    header.aos = options.aos;
+    header.lambda = options.lambda;
+    header.tolerance = options.tolerance;
+    header.step = options.step;
+    header.flat_threshold = options.flat_threshold;
+    return header;
+}
+
+// Filter options of a header, with the checkpoint settings of this rank
+void header_options(const ImageHeader& header, DiffusionOptions& options) {
+    options.iterations = header.iterations;
+    options.check_every = header.check_every;
+    options.l1 = header.l1 != 0;
+    options.aos = header.aos != 0;
+    options.lambda = header.lambda;
+    options.tolerance = header.tolerance;
+    options.step = header.step;
+    options.flat_threshold = header.flat_threshold;
+}
+
+// Function to diffuse one image across all the ranks, after the master has broadcast its header.
+// The master passes the image and gets the filtered image back; the other ranks pass an empty Mat
+// and receive their strip, and get an empty Mat back
+Mat diffuse_image(const Mat& image, const ImageHeader& header, const DiffusionOptions& options, int rank, int size) {
+    int total_rows = header.rows;
+    int total_cols = header.cols;
+    int image_type = header.type;
+    int rows_per_node = total_rows / size;
+    MPI_Datatype datatype = mpi_datatype(CV_MAT_DEPTH(image_type));
 
     // Adjust the last part if it does not divide exactly
     int extra_rows = total_rows % size;
@@ -100,7 +577,7 @@ int main(int argc, char** argv) {
     }
 
     // Create the matrix for the part of the image that each node will process
-    Mat image_part(rows_per_node, total_cols, CV_8UC1);
+    Mat image_part(rows_per_node, total_cols, image_type);
     Mat result_part;
 
     if (rank == 0) {
@@ -108,46 +585,265 @@ int main(int argc, char** argv) {
         for (int i = 1; i < size; ++i) {
             int start = i * rows_per_node - (i > 0 ? extra_rows : 0);
             int rows = (i == size - 1) ? (rows_per_node + extra_rows) : rows_per_node;
-            MPI_Send(image.ptr<uchar>(start), rows * total_cols, MPI_UNSIGNED_CHAR, i, 0, MPI_COMM_WORLD);
+            MPI_Send(image.ptr(start), rows * total_cols, datatype, i, 0, MPI_COMM_WORLD);
         }
 
         // Master node processes its own part
         image_part = image.rowRange(0, rows_per_node).clone();
-        directional_diffusion_filter_part(image_part, iterations, lambda);
-        result_part = image_part;
     } else {
         // Other nodes receive their part of the image
-        MPI_Recv(image_part.data, rows_per_node * total_cols, MPI_UNSIGNED_CHAR, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        MPI_Recv(image_part.data, rows_per_node * total_cols, datatype, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    }
 
-        // Process their part
-        directional_diffusion_filter_part(image_part, iterations, lambda);
-        result_part = image_part;
+    // Process the part, checkpointing the strip if requested
+    int iterations = options.iterations;
+    double lambda = options.lambda;
+    int iterations_run = iterations;
+    FlatTileStats tile_stats;
+    if (options.aos) {
+        aos_diffusion_filter_part(image_part, iterations, lambda, options.step);
+    } else if (!options.checkpoint_dir.empty()) {
+        CheckpointWriter checkpoint(options.checkpoint_dir, rank, size, image_part, lambda);
+        iterations_run = directional_diffusion_filter_part(image_part, iterations, lambda, options, &checkpoint, &tile_stats);
+    } else {
+        iterations_run = directional_diffusion_filter_part(image_part, iterations, lambda, options, nullptr, &tile_stats);
+    }
+    result_part = image_part;
+    if (rank == 0 && iterations_run < iterations) {
+        cout << "Converged after " << iterations_run << " of " << iterations << " iterations" << endl;
+    }
+    if (options.flat_threshold > 0 && !options.aos) {
+        long long local[2] = {tile_stats.updates, tile_stats.skipped};
+        long long total[2] = {0, 0};
+        MPI_Reduce(local, total, 2, MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+        if (rank == 0 && total[0] > 0) {
+            printf("Flat tiles: %lld of %lld tile updates skipped (%.1f%%)\n", total[1], total[0], 100.0 * total[1] / total[0]);
+        }
     }
 
+    Mat filtered_image;
     if (rank == 0) {
         // Master node receives the processed parts from the other nodes and concatenates them
-        Mat filtered_image;
         vector<Mat> filtered_parts(size);
         filtered_parts[0] = result_part;
 
         for (int i = 1; i < size; ++i) {
             int rows = (i == size - 1) ? (rows_per_node + extra_rows) : rows_per_node;
-            Mat part(rows, total_cols, CV_8UC1);
-            MPI_Recv(part.data, rows * total_cols, MPI_UNSIGNED_CHAR, i, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            Mat part(rows, total_cols, image_type);
+            MPI_Recv(part.data, rows * total_cols, datatype, i, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
             filtered_parts[i] = part;
         }
 
         vconcat(filtered_parts, filtered_image);
+    } else {
+        // Other nodes send their processed part to the master node
+        MPI_Send(result_part.data, rows_per_node * total_cols, datatype, 0, 0, MPI_COMM_WORLD);
+    }
+    return filtered_image;
+}
+
+// Master side of --batch: diffuses the images of the manifest one after another with all the ranks, while a second
+// thread decodes the next one. Each line's options override the defaults for that image only. Returns the number of
+// images that could not be read, diffused or written
+int run_batch_master(const string& manifest, const DiffusionOptions& defaults, const ResultCache& cache, int size) {
+    BatchJob* jobs = nullptr;
+    int count = load_manifest(manifest.c_str(), &jobs);
+    ImageHeader end;
+    if (count < 0) {
+        cerr << "Error: could not read the manifest " << manifest << "." << endl;
+        MPI_Bcast(&end, sizeof(end), MPI_BYTE, 0, MPI_COMM_WORLD);
+        return 1;
+    }
+
+    double start = MPI_Wtime();
+    int failed = 0;
+    int from_cache = 0;
+    Mat next;
+    thread prefetch;
+    if (count > 0) {
+        prefetch = thread([&] { next = read_image(jobs[0].input); });
+    }
+    for (int j = 0; j < count; ++j) {
+        // Take the decoded image and start decoding the one after it
+        prefetch.join();
+        Mat image = next;
+        next = Mat();
+        if (j + 1 < count) {
+            prefetch = thread([&, j] { next = read_image(jobs[j + 1].input); });
+        }
+
+        // The manifest line's options, in the same syntax as the command line (argv[0] of a line is its first option)
+        DiffusionOptions options = defaults;
+        bool valid = true;
+        try {
+            for (int i = 0; valid && i < jobs[j].argc; ++i) {
+                valid = parse_diffusion_option(jobs[j].argc, jobs[j].argv, i, options, true);
+            }
+        } catch (const logic_error&) {
+            valid = false;  // A value that is not a number
+        }
+        if (!valid || !compatible_options(options)) {
+            cerr << "Skipping " << jobs[j].input << ": invalid options in the manifest line" << endl;
+            failed++;
+            continue;
+        }
+        if (image.empty()) {
+            cerr << "Error: could not read the image " << jobs[j].input << "." << endl;
+            failed++;
+            continue;
+        }
+
+        // Look the result up before any filtering
+        Mat filtered_image;
+        uint64_t key = 0;
+        int cached = 0;
+        if (cache.directory) {
+            key = result_key(image, options, size);
+            filtered_image.create(image.size(), image.type());
+            cached = result_cache_get(&cache, key, filtered_image.data, filtered_image.total() * filtered_image.elemSize());
+        }
+        ImageHeader header = image_header(image, cached, options);
+        MPI_Bcast(&header, sizeof(header), MPI_BYTE, 0, MPI_COMM_WORLD);
+        if (cached) {
+            from_cache++;
+        } else {
+            filtered_image = diffuse_image(image, header, options, 0, size);
+            result_cache_put(&cache, key, filtered_image.data, filtered_image.total() * filtered_image.elemSize());
+        }
+        if (!imwrite(jobs[j].output, filtered_image)) {
+            cerr << "Error: could not write the image " << jobs[j].output << "." << endl;
+            failed++;
+        }
+    }
+    MPI_Bcast(&end, sizeof(end), MPI_BYTE, 0, MPI_COMM_WORLD);
+
+    double seconds = MPI_Wtime() - start;
+    printf("Batch: %d images, %d failed, %d from the cache, %.3f s (%.2f ms per image)\n", count, failed, from_cache,
+           seconds, count > 0 ? 1000.0 * seconds / count : 0.0);
+    free_manifest(jobs, count);
+    return failed;
+}
+
+// Other ranks' side of --batch: diffuse their strip of every image the master sends until the header that ends the batch
+void run_batch_worker(const DiffusionOptions& defaults, int rank, int size) {
+    DiffusionOptions options = defaults;
+    while (true) {
+        ImageHeader header;
+        MPI_Bcast(&header, sizeof(header), MPI_BYTE, 0, MPI_COMM_WORLD);
+        if (header.rows == 0) {
+            break;
+        }
+        if (!header.cached) {
+            header_options(header, options);
+            diffuse_image(Mat(), header, options, rank, size);
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    // Initialize MPI (the batch mode decodes the next image on a second thread, which never calls MPI)
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+    int rank, size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    // With --batch the second argument is the manifest, and the options are the defaults of all its lines
+    bool batch = argc >= 2 && string(argv[1]) == "--batch";
+    DiffusionOptions options;
+    ResultCache cache = {NULL, RESULT_CACHE_DEFAULT_BYTES};
+    bool valid_args = argc >= 5;
+    for (int i = 5; valid_args && i < argc; ++i) {
+        string option = argv[i];
+        if (!batch && option == "--checkpoint" && i + 1 < argc) {
+            options.checkpoint_dir = argv[++i];
+        } else if (!batch && option == "--checkpoint-every" && i + 1 < argc) {
+            options.checkpoint_every = stoi(argv[++i]);
+            valid_args = options.checkpoint_every > 0;
+        } else if (option == "--cache" && i + 1 < argc) {
+            cache.directory = argv[++i];
+        } else if (option == "--cache-size" && i + 1 < argc) {
+            cache.max_bytes = (size_t)(stod(argv[++i]) * 1024 * 1024);
+            valid_args = cache.max_bytes > 0;
+        } else {
+            valid_args = parse_diffusion_option(argc, argv, i, options, false);
+        }
+    }
+    if (!compatible_options(options)) {
+        valid_args = false;
+    }
+    if (!valid_args) {
+        if (rank == 0) {
+            cerr << "Usage: " << argv[0] << " <input_image_path> <output_image_path> <iterations> <lambda>"
+                 << " [--checkpoint <dir>] [--checkpoint-every <iterations>]"
+                 << " [--tolerance <t>] [--check-every <iterations>] [--norm l1|linf]"
+                 << " [--scheme explicit|aos] [--step <tau>] [--flat-threshold <t>] [--cache <dir>] [--cache-size <MB>]" << endl;
+            cerr << "       " << argv[0] << " --batch <manifest> <iterations> <lambda> [options]" << endl;
+            cerr << "--scheme aos takes no --tolerance, --checkpoint or --flat-threshold." << endl;
+            cerr << "Manifest lines: <input> <output> [--iterations <n>] [--lambda <l>] [filter options]; --batch takes no --checkpoint." << endl;
+        }
+        MPI_Finalize();
+        return -1;
+    }
+
+    options.iterations = stoi(argv[3]);
+    options.lambda = stod(argv[4]);
+
+    if (batch) {
+        int failed = 0;
+        if (rank == 0) {
+            failed = run_batch_master(argv[2], options, cache, size);
+        } else {
+            run_batch_worker(options, rank, size);
+        }
+        MPI_Finalize();
+        return failed > 0 ? 1 : 0;
+    }
+
+    string input_image_path = argv[1];
+    string output_image_path = argv[2];
+
+    if (rank == 0) {
+        // Master node loads the image at its own depth
+        Mat image = read_image(input_image_path);
+        if (image.empty()) {
+            cerr << "Error: could not read the image." << endl;
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+
+        // Look the result up before any filtering
+        Mat filtered_image;
+        uint64_t key = 0;
+        int cached = 0;
+        if (cache.directory) {
+            key = result_key(image, options, size);
+            filtered_image.create(image.size(), image.type());
+            cached = result_cache_get(&cache, key, filtered_image.data, filtered_image.total() * filtered_image.elemSize());
+            if (cached) {
+                cout << "Result found in cache " << cache.directory << endl;
+            }
+        }
+
+        // Send the size of the divisions and the options to the other nodes
+        ImageHeader header = image_header(image, cached, options);
+        MPI_Bcast(&header, sizeof(header), MPI_BYTE, 0, MPI_COMM_WORLD);
+        if (!cached) {
+            filtered_image = diffuse_image(image, header, options, rank, size);
+            result_cache_put(&cache, key, filtered_image.data, filtered_image.total() * filtered_image.elemSize());
+        }
 
         // Save the resulting image
         imwrite(output_image_path, filtered_image);
     } else {
-        // Other nodes send their processed part to the master node
-        MPI_Send(result_part.data, rows_per_node * total_cols, MPI_UNSIGNED_CHAR, 0, 0, MPI_COMM_WORLD);
+        // Other nodes receive the size of the divisions; nothing to diffuse when the master already holds the result
+        ImageHeader header;
+        MPI_Bcast(&header, sizeof(header), MPI_BYTE, 0, MPI_COMM_WORLD);
+        if (!header.cached) {
+            diffuse_image(Mat(), header, options, rank, size);
+        }
     }
 
     // Finalize MPI
     MPI_Finalize();
     return 0;
 }
-
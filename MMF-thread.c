@@ -1,123 +1,994 @@
+#define _GNU_SOURCE  // pthread_setaffinity_np y las macros CPU_* de numa_topology.h
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#define IMAGE_ALLOC_IMPLEMENTATION
+#include "image_alloc.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
+#define IMAGE_IO_IMPLEMENTATION
+#include "image_io.h"
+#define BATCH_IMPLEMENTATION
+#include "batch.h"
+#define DIRTY_RECTS_IMPLEMENTATION
+#include "dirty_rects.h"
+#define FILTER_DAEMON_IMPLEMENTATION
+#include "filter_daemon.h"
+#define RESULT_CACHE_IMPLEMENTATION
+#include "result_cache.h"
+#define NUMA_TOPOLOGY_IMPLEMENTATION
+#include "numa_topology.h"
+#define ROI_IMPLEMENTATION
+#include "roi.h"
+#define PREVIEW_IMPLEMENTATION
+#include "preview.h"
+
+// Modos del filtro
+#define MODE_MEDIAN 0     // Mediana de todos los píxeles
+#define MODE_SWITCHING 1  // Mediana solo de los píxeles que el detector marca como impulsos
+#define MODE_ADAPTIVE 2   // Ventana que crece desde 3x3 mientras la mediana sea un impulso
+#define MODE_VECTOR 3     // Mediana vectorial: el píxel de la ventana más cercano (L1) a los demás
+
+#define BATCH_QUEUE_CAPACITY 4  // Imágenes que pueden esperar entre dos etapas del pipeline del modo por lotes
+
+typedef struct ThreadPool ThreadPool;
 
 // Estructura para pasar parámetros a los hilos
 typedef struct {
-    unsigned char *input;   // Puntero a la imagen de entrada
-    unsigned char *output;  // Puntero a la imagen de salida
-    int width;              // Ancho de la imagen
-    int height;             // Alto de la imagen
-    int channels;           // Número de canales de la imagen (e.g., 3 para RGB)
+    ThreadPool *pool;       // Grupo de hilos al que pertenece el hilo
+    ImageView input;        // Imagen de entrada (tamaño, canales y tipo de las muestras)
+    ImageView output;       // Imagen de salida, del mismo tamaño
     int window_size;        // Tamaño de la ventana del filtro de mediana
     int start_row;          // Fila de inicio de la sección a procesar
     int end_row;            // Fila de fin de la sección a procesar
+    int start_col;          // Columna de inicio de la sección a procesar
+    int end_col;            // Columna de fin de la sección a procesar
+    const ImageRect *pieces;  // Con --roi, trozos de las regiones que filtra el hilo (NULL = filas start_row a end_row completas)
+    int num_pieces;         // Número de trozos
+    int border;             // Política de borde (BORDER_SHRINK, BORDER_REPLICATE, ...)
+    float border_value;     // Valor fuera de la imagen con BORDER_CONSTANT, ya en el rango del tipo de píxel
+    int mode;               // Modo del filtro (MODE_MEDIAN, MODE_SWITCHING, MODE_ADAPTIVE o MODE_VECTOR)
+    float impulse_threshold;  // Umbral del detector de impulsos (negativo = valores extremos)
+    size_t filtered;        // Muestras filtradas por el hilo en el modo conmutado
+    size_t *window_counts;  // Muestras del hilo que terminaron en cada ventana en el modo adaptativo
+    const ImageView *source;  // Con --numa, imagen cargada de la que el hilo copia su franja a input (NULL = no se copia)
+    int cpu;                // CPU al que se fija el hilo (-1 = sin fijar)
+    ScratchArena arena;     // Memoria temporal del hilo y de sus kernels, que se reinicia en cada imagen
 } FilterParams;
 
+// Grupo de hilos que se crea una sola vez y filtra todas las imágenes (una sola o un lote completo)
+struct ThreadPool {
+    int num_threads;
+    pthread_t *threads;
+    FilterParams *params;     // Parámetros de cada hilo para la imagen actual
+    pthread_barrier_t start;  // Los hilos esperan aquí a que haya una imagen
+    pthread_barrier_t done;   // Y aquí a que todos hayan terminado su sección
+    pthread_barrier_t copied; // Con --numa, aquí a que todas las franjas estén copiadas (solo los hilos del grupo)
+    int numa;                 // Hilos fijados por nodos NUMA y franjas de la entrada copiadas por cada hilo
+    int stop;                 // Indica a los hilos que deben terminar
+    ScratchArena scratch;     // Memoria temporal del hilo que usa el grupo (contadores por ventana, recortes)
+};
+
+// Opciones del filtro de una imagen (de la línea de comandos o de una línea del manifiesto)
+typedef struct {
+    int window_size;          // Tamaño de la ventana del filtro
+    int border;               // Política de borde
+    int border_value;         // Valor fuera de la imagen con BORDER_CONSTANT
+    int pixel_type;           // Tipo de píxel con el que se filtra (PIXEL_AUTO = el del archivo)
+    int mode;                 // Modo del filtro
+    float impulse_threshold;  // Umbral del detector de impulsos en unidades de 8 bits (negativo = valores extremos)
+    ImageRect rois[ROI_MAX_RECTS];  // Regiones de interés (--roi); el resto de la imagen se copia sin filtrar
+    int num_rois;             // Número de regiones (0 = la imagen completa)
+} FilterOptions;
+
 // Función para comparar dos valores (utilizado por qsort)
 int compare(const void *a, const void *b) {
     return (*(unsigned char *)a - *(unsigned char *)b);
 }
 
-// Función para aplicar el filtro de mediana a una parte de la imagen
+// Función para calcular la mediana de un píxel del borde, cuyos vecinos fuera de la imagen siguen la política de borde
+void median_border_pixel(FilterParams *params, unsigned char *window, int x, int y) {
+    int pad = params->window_size / 2;
+    for (int c = 0; c < params->input.channels; c++) {
+        int count = 0;
+        for (int ky = -pad; ky <= pad; ky++) {
+            int ny = border_index(y + ky, params->input.height, params->border);
+            for (int kx = -pad; kx <= pad; kx++) {
+                int nx = border_index(x + kx, params->input.width, params->border);
+                if (ny >= 0 && nx >= 0) {
+                    window[count++] = ((const unsigned char *)image_view_pixel(&params->input, nx, ny))[c];
+                } else if (params->border == BORDER_CONSTANT) {
+                    window[count++] = (unsigned char)params->border_value;
+                }
+            }
+        }
+        qsort(window, count, sizeof(unsigned char), compare);
+        ((unsigned char *)image_view_pixel(&params->output, x, y))[c] = window[count / 2];
+    }
+}
+
+// Función para aplicar el filtro de mediana a una parte de la imagen: las filas [start_row, end_row) y las
+// columnas [start_col, end_col), leyendo de la imagen de entrada completa los píxeles de alrededor
 void apply_median_filter_section(FilterParams *params) {
+    const ImageView *input = &params->input;
+    ImageView output = image_view_crop(&params->output, params->start_col, params->start_row, params->end_col - params->start_col,
+                                       params->end_row - params->start_row);
+
+    // Modo conmutado: el detector de impulsos decide qué muestras pasan por la mediana
+    if (params->mode == MODE_SWITCHING) {
+        params->filtered += switching_median_view(input, &output, params->start_col, params->start_row, params->window_size,
+                                                  params->border, params->border_value, params->impulse_threshold);
+        return;
+    }
+
+    // Modo adaptativo: window_size es la ventana máxima
+    if (params->mode == MODE_ADAPTIVE) {
+        adaptive_median_view(input, &output, params->start_col, params->start_row, params->window_size,
+                             params->border, params->border_value, params->window_counts);
+        return;
+    }
+
+    // Modo vectorial: los canales de cada píxel se eligen juntos, sin crear colores nuevos
+    if (params->mode == MODE_VECTOR) {
+        vector_median_view(input, &output, params->start_col, params->start_row, params->window_size,
+                           params->border, params->border_value);
+        return;
+    }
+
+    // Usar el kernel especializado si existe para esta ventana y número de canales
+    // (las imágenes de 16 bits y float siempre lo usan; el camino genérico es solo de 8 bits)
+    if (median_filter_view(input, &output, params->start_col, params->start_row, params->window_size,
+                           params->border, params->border_value)) {
+        return;
+    }
+
     int pad = params->window_size / 2;  // Mitad del tamaño de la ventana
     int window_area = params->window_size * params->window_size;
-    unsigned char *window = (unsigned char *)malloc(window_area * sizeof(unsigned char));  // Array para la ventana del filtro
+    unsigned char *window = (unsigned char *)scratch_arena_alloc(&params->arena, window_area * sizeof(unsigned char));  // Array para la ventana del filtro
 
     // Recorrer la sección de la imagen
+    int width = input->width, channels = input->channels;
     for (int y = params->start_row; y < params->end_row; y++) {
-        for (int x = 0; x < params->width; x++) {
-            for (int c = 0; c < params->channels; c++) {
+        // Las filas cuya ventana sale de la imagen y las columnas de ambos extremos van por el camino del borde
+        int interior_row = y >= pad && y < input->height - pad;
+        int interior_begin = interior_row ? (pad < width ? pad : width) : width;
+        int interior_end = interior_row && width - pad > interior_begin ? width - pad : interior_begin;
+        // Limitadas a las columnas de la sección
+        interior_begin = interior_begin < params->start_col ? params->start_col : interior_begin > params->end_col ? params->end_col : interior_begin;
+        interior_end = interior_end < interior_begin ? interior_begin : interior_end > params->end_col ? params->end_col : interior_end;
+        for (int x = params->start_col; x < interior_begin; x++) {
+            median_border_pixel(params, window, x, y);
+        }
+
+        // Píxeles interiores: la ventana completa está dentro de la imagen, sin comprobar los límites
+        for (int x = interior_begin; x < interior_end; x++) {
+            for (int c = 0; c < channels; c++) {
                 int count = 0;
                 // Recorrer los píxeles dentro de la ventana
                 for (int ky = -pad; ky <= pad; ky++) {
+                    const unsigned char *row = (const unsigned char *)image_view_pixel(input, x, y + ky) + c;
                     for (int kx = -pad; kx <= pad; kx++) {
-                        int nx = x + kx;
-                        int ny = y + ky;
-                        // Comprobar los límites de la imagen
-                        if (nx >= 0 && nx < params->width && ny >= 0 && ny < params->height) {
-                            window[count++] = params->input[(ny * params->width + nx) * params->channels + c];
-                        }
+                        window[count++] = row[kx * channels];
                     }
                 }
                 // Ordenar los valores en la ventana y encontrar la mediana
                 qsort(window, count, sizeof(unsigned char), compare);
-                params->output[(y * params->width + x) * params->channels + c] = window[count / 2];
+                ((unsigned char *)image_view_pixel(&params->output, x, y))[c] = window[count / 2];
             }
         }
+
+        for (int x = interior_end; x < params->end_col; x++) {
+            median_border_pixel(params, window, x, y);
+        }
     }
-    free(window);  // Liberar la memoria de la ventana
 }
 
-// Función que será ejecutada por cada hilo
+// Función que será ejecutada por cada hilo: filtra su sección de cada imagen hasta que se detiene el grupo
+// Toda la memoria temporal del hilo sale de su arena, así que tras la primera imagen de cada tamaño no se reserva nada
 void *filter_thread(void *arg) {
     FilterParams *params = (FilterParams *)arg;  // Convertir el argumento a un puntero a FilterParams
-    apply_median_filter_section(params);         // Aplicar el filtro a la sección especificada
+    ThreadPool *pool = params->pool;
+    if (params->cpu >= 0 && !numa_pin_current_thread(params->cpu)) {
+        printf("Could not pin a thread to CPU %d\n", params->cpu);
+    }
+    filter_kernels_bind_arena(&params->arena);
+    while (1) {
+        pthread_barrier_wait(&pool->start);      // Esperar a la siguiente imagen
+        if (pool->stop) {
+            break;
+        }
+        scratch_arena_reset(&params->arena);
+        params->window_counts = params->mode == MODE_ADAPTIVE ? (size_t *)scratch_arena_calloc(&params->arena, params->window_size / 2, sizeof(size_t)) : NULL;
+        if (params->source) {
+            // Copiar la franja propia: sus páginas quedan en el nodo del hilo, que es quien más las lee
+            int rows = params->end_row - params->start_row;
+            ImageView source = image_view_crop(params->source, 0, params->start_row, params->source->width, rows);
+            ImageView strip = image_view_crop(&params->input, 0, params->start_row, params->input.width, rows);
+            image_view_copy(&source, &strip);
+            pthread_barrier_wait(&pool->copied);  // Las filas vecinas son de otros hilos
+        }
+        if (params->pieces) {
+            // Con --roi, cada trozo de las regiones que le tocan al hilo
+            for (int k = 0; k < params->num_pieces; k++) {
+                params->start_row = params->pieces[k].y;
+                params->end_row = params->pieces[k].y + params->pieces[k].height;
+                params->start_col = params->pieces[k].x;
+                params->end_col = params->pieces[k].x + params->pieces[k].width;
+                apply_median_filter_section(params);
+            }
+        } else {
+            apply_median_filter_section(params);     // Aplicar el filtro a la sección especificada
+        }
+        pthread_barrier_wait(&pool->done);
+    }
+    scratch_arena_destroy(&params->arena);
     return NULL;
 }
 
-// Función para dividir la imagen en secciones y crear hilos para el procesamiento
-void parallel_median_filter(unsigned char *input, unsigned char *output, int width, int height, int channels, int window_size, int num_nodes) {
-    pthread_t threads[num_nodes];
-    FilterParams params[num_nodes];
+// Función para crear el grupo de hilos
+// Con numa, cada hilo se fija a un CPU según la topología de sysfs y se muestra la ubicación elegida
+void create_thread_pool(ThreadPool *pool, int num_threads, int numa) {
+    pool->num_threads = num_threads;
+    pool->threads = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+    pool->params = (FilterParams *)calloc(num_threads, sizeof(FilterParams));
+    pool->numa = numa;
+    pool->stop = 0;
+    scratch_arena_init(&pool->scratch);
+    pthread_barrier_init(&pool->start, NULL, num_threads + 1);
+    pthread_barrier_init(&pool->done, NULL, num_threads + 1);
+    pthread_barrier_init(&pool->copied, NULL, num_threads);
+
+    NumaTopology topology;
+    if (numa) {
+        numa_read_topology(&topology);
+        numa_fresh_pages();
+        printf("NUMA: %d nodes\n", topology.num_nodes);
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pool->params[i].pool = pool;
+        pool->params[i].cpu = -1;
+        scratch_arena_init(&pool->params[i].arena);
+        if (numa) {
+            int node;
+            pool->params[i].cpu = numa_thread_cpu(&topology, i, num_threads, &node);
+            printf("  thread %d: node %d, cpu %d\n", i, topology.node_ids[node], pool->params[i].cpu);
+        }
+        pthread_create(&pool->threads[i], NULL, filter_thread, &pool->params[i]);  // Crear el hilo
+    }
+}
+
+// Función para detener y liberar el grupo de hilos
+void destroy_thread_pool(ThreadPool *pool) {
+    pool->stop = 1;
+    pthread_barrier_wait(&pool->start);
+    for (int i = 0; i < pool->num_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_barrier_destroy(&pool->start);
+    pthread_barrier_destroy(&pool->done);
+    pthread_barrier_destroy(&pool->copied);
+    scratch_arena_destroy(&pool->scratch);
+    free(pool->threads);
+    free(pool->params);
+}
+
+// Función para dividir la imagen en secciones y repartirlas entre los hilos del grupo
+// Con regiones de interés (rois disjuntas y dentro de la imagen, num_rois > 0) solo se filtran esas regiones,
+// repartidas por área; los demás píxeles de output no se tocan
+// Devuelve el número de muestras filtradas (todas las de las regiones salvo en el modo conmutado)
+// En el modo adaptativo suma en window_counts[k] las muestras que terminaron con la ventana 2k+3
+size_t parallel_median_filter(ThreadPool *pool, const ImageView *input, const ImageView *output, int window_size, int border, float border_value, int mode, float impulse_threshold, size_t *window_counts, const ImageRect *rois, int num_rois) {
+    int num_nodes = pool->num_threads;
+    int width = input->width, height = input->height;
+    FilterParams *params = pool->params;
+    int num_windows = window_size / 2;  // Ventanas posibles en el modo adaptativo: 3x3, 5x5, ..., window_size
+
+    // Con --numa los hilos leen de una copia de la entrada cuyas franjas escribe cada uno (primer contacto);
+    // la salida ya la escribe primero el hilo de cada franja. Los trozos de las regiones de interés leen
+    // directamente de la entrada, porque no se corresponden con las franjas
+    ImageView numa_input = {NULL, 0, 0, 0, 0, 0};
+    if (pool->numa && num_rois == 0) {
+        numa_input = image_alloc_view(width, height, input->channels, input->pixel_type);
+    }
+
+    // Trozos de las regiones de cada hilo, con aproximadamente la misma área
+    ScratchMark mark = scratch_arena_mark(&pool->scratch);
+    ImageRect *pieces = NULL;
+    int *part_begin = NULL;
+    if (num_rois > 0) {
+        pieces = (ImageRect *)scratch_arena_alloc(&pool->scratch, (num_rois + num_nodes) * sizeof(ImageRect));
+        part_begin = (int *)scratch_arena_alloc(&pool->scratch, (num_nodes + 1) * sizeof(int));
+        roi_partition(rois, num_rois, num_nodes, pieces, part_begin);
+    }
 
     int rows_per_thread = height / num_nodes;  // Filas por nodo
     for (int i = 0; i < num_nodes; i++) {
-        params[i].input = input;
-        params[i].output = output;
-        params[i].width = width;
-        params[i].height = height;
-        params[i].channels = channels;
+        params[i].input = numa_input.data ? numa_input : *input;
+        params[i].source = numa_input.data ? input : NULL;
+        params[i].output = *output;
         params[i].window_size = window_size;
+        params[i].border = border;
+        params[i].border_value = border_value;
+        params[i].mode = mode;
+        params[i].impulse_threshold = impulse_threshold;
+        params[i].filtered = 0;
         params[i].start_row = i * rows_per_thread;
         params[i].end_row = (i == num_nodes - 1) ? height : (i + 1) * rows_per_thread;
-        
-        pthread_create(&threads[i], NULL, filter_thread, &params[i]);  // Crear el hilo
+        params[i].start_col = 0;
+        params[i].end_col = width;
+        params[i].pieces = pieces ? pieces + part_begin[i] : NULL;
+        params[i].num_pieces = pieces ? part_begin[i + 1] - part_begin[i] : 0;
     }
 
-    // Esperar a que todos los hilos terminen
+    // Despertar a los hilos y esperar a que todos terminen; cada uno deja sus contadores por ventana en su arena
+    pthread_barrier_wait(&pool->start);
+    pthread_barrier_wait(&pool->done);
+    image_free(numa_input.data);
+    scratch_arena_release(&pool->scratch, mark);
+    size_t filtered = 0;
     for (int i = 0; i < num_nodes; i++) {
-        pthread_join(threads[i], NULL);
+        filtered += params[i].filtered;
+        if (params[i].window_counts) {
+            for (int k = 0; k < num_windows; k++) {
+                window_counts[k] += params[i].window_counts[k];
+            }
+        }
     }
+    size_t area = num_rois > 0 ? roi_area(rois, num_rois) : (size_t)width * height;
+    return mode == MODE_SWITCHING ? filtered : area * input->channels;
 }
 
-int main(int argc, char *argv[]) {
-    // Comprobar los argumentos de la línea de comandos
-    if (argc != 5) {
-        printf("Usage: %s <input_image> <output_image> <window_size> <num_nodes>\n", argv[0]);
-        return 1;
+// Función para leer las opciones del filtro; devuelve 0 si alguna no es válida
+int parse_filter_options(int argc, char **argv, FilterOptions *options) {
+    for (int i = 0; i < argc; i++) {
+        int valid = 1;
+        if (strcmp(argv[i], "--border") == 0 && i + 1 < argc) {
+            valid = parse_border(argv[++i], &options->border, &options->border_value);
+        } else if (strcmp(argv[i], "--pixel") == 0 && i + 1 < argc) {
+            valid = parse_pixel_type(argv[++i], &options->pixel_type);
+        } else if (strcmp(argv[i], "--mode") == 0 && i + 1 < argc) {
+            i++;
+            options->mode = strcmp(argv[i], "switching") == 0 ? MODE_SWITCHING : strcmp(argv[i], "adaptive") == 0 ? MODE_ADAPTIVE :
+                            strcmp(argv[i], "vector") == 0 ? MODE_VECTOR : MODE_MEDIAN;
+            valid = options->mode != MODE_MEDIAN || strcmp(argv[i], "median") == 0;
+        } else if (strcmp(argv[i], "--impulse-threshold") == 0 && i + 1 < argc) {
+            options->impulse_threshold = atof(argv[++i]);
+            valid = options->impulse_threshold >= 0;
+        } else if (strcmp(argv[i], "--window") == 0 && i + 1 < argc) {
+            options->window_size = atoi(argv[++i]);
+            valid = options->window_size > 0;
+        } else if (strcmp(argv[i], "--roi") == 0 && i + 1 < argc) {
+            valid = options->num_rois < ROI_MAX_RECTS && parse_image_rect(argv[++i], &options->rois[options->num_rois++]);
+        } else {
+            valid = 0;
+        }
+        if (!valid) {
+            return 0;
+        }
     }
+    return 1;
+}
+
+// Función para filtrar una imagen ya cargada en un búfer de salida ya reservado; devuelve 0 si las opciones no son válidas
+// filtered recibe las muestras filtradas y window_counts (window_size / 2 entradas) las del modo adaptativo por ventana
+int filter_image_into(ThreadPool *pool, const ImageView *image, const ImageView *output, const FilterOptions *options, size_t *filtered, size_t *window_counts) {
+    if (options->mode == MODE_ADAPTIVE && (options->window_size < 3 || options->window_size % 2 == 0)) {
+        return 0;
+    }
+
+    // Con --roi la salida parte de la entrada y solo se filtran las regiones, recortadas y sin solapes
+    ScratchMark mark = scratch_arena_mark(&pool->scratch);
+    ImageRect *rois = NULL;
+    int num_rois = 0;
+    if (options->num_rois > 0) {
+        rois = (ImageRect *)scratch_arena_alloc(&pool->scratch, ROI_MAX_PIECES * sizeof(ImageRect));
+        num_rois = roi_disjoint(options->rois, options->num_rois, image->width, image->height, rois, ROI_MAX_PIECES);
+        if (num_rois < 0) {
+            scratch_arena_release(&pool->scratch, mark);
+            return 0;
+        }
+        image_view_copy(image, output);
+    }
+
+    // Aplicar el filtro de mediana en paralelo; el valor del borde constante y el umbral de impulsos se dan en
+    // unidades de 8 bits y se escalan al rango del tipo de píxel
+    float border_value = border_sample(options->border_value, image->pixel_type);
+    float impulse_threshold = options->impulse_threshold;
+    if (impulse_threshold >= 0) {
+        impulse_threshold *= pixel_range(image->pixel_type) / 255.0f;
+    }
+    *filtered = 0;
+    if (options->num_rois == 0 || num_rois > 0) {
+        *filtered = parallel_median_filter(pool, image, output, options->window_size, options->border, border_value, options->mode, impulse_threshold, window_counts, rois, num_rois);
+    }
+    scratch_arena_release(&pool->scratch, mark);
+    return 1;
+}
+
+// Función para filtrar una imagen ya cargada; devuelve la imagen de salida, sin datos (NULL) si las opciones no son válidas
+ImageView filter_image(ThreadPool *pool, const ImageView *image, const FilterOptions *options) {
+    int width = image->width, height = image->height, channels = image->channels;
+    int window_size = options->window_size;
+    int mode = options->mode;
+    ScratchMark mark = scratch_arena_mark(&pool->scratch);
+    size_t *window_counts = (size_t *)scratch_arena_calloc(&pool->scratch, window_size / 2 + 1, sizeof(size_t));  // Muestras por ventana en el modo adaptativo
+    ImageView output = image_alloc_view(width, height, channels, image->pixel_type);  // Imagen de salida
+    size_t filtered;
+    if (!filter_image_into(pool, image, &output, options, &filtered, window_counts)) {
+        if (mode == MODE_ADAPTIVE && (window_size < 3 || window_size % 2 == 0)) {
+            printf("The adaptive window_size must be odd and at least 3\n");
+        } else {
+            printf("The regions of interest overlap in more than %d pieces\n", ROI_MAX_PIECES);
+        }
+        scratch_arena_release(&pool->scratch, mark);
+        image_free(output.data);
+        output.data = NULL;
+        return output;
+    }
+    size_t samples = (size_t)width * height * channels;
+    if (options->num_rois > 0) {
+        // Muestras de las regiones, que son las únicas filtradas
+        ImageRect *rois = (ImageRect *)scratch_arena_alloc(&pool->scratch, ROI_MAX_PIECES * sizeof(ImageRect));
+        int num_rois = roi_disjoint(options->rois, options->num_rois, width, height, rois, ROI_MAX_PIECES);
+        size_t image_samples = samples;
+        samples = roi_area(rois, num_rois) * channels;
+        printf("Regions of interest: %d rectangles, %.1f%% of the image filtered\n", options->num_rois, 100.0 * samples / image_samples);
+        samples = samples > 0 ? samples : 1;
+    }
+    if (mode == MODE_SWITCHING) {
+        printf("Switching median: %zu of %zu samples filtered (%.1f%%)\n", filtered, samples, 100.0 * filtered / samples);
+    } else if (mode == MODE_ADAPTIVE) {
+        printf("Adaptive median window sizes:\n");
+        for (int k = 0; k < window_size / 2; k++) {
+            printf("  %2dx%-2d %10zu samples (%.1f%%)\n", 2 * k + 3, 2 * k + 3, window_counts[k], 100.0 * window_counts[k] / samples);
+        }
+    }
+    scratch_arena_release(&pool->scratch, mark);
+    return output;
+}
+
+// Función para calcular la clave de la caché de resultados de una imagen y unas opciones del filtro
+uint64_t result_key(const ImageView *image, const FilterOptions *options) {
+    char description[192 + ROI_MAX_RECTS * 64];
+    int length = snprintf(description, sizeof(description), "MMF mode=%d window=%d border=%d:%d threshold=%g %dx%dx%d pixel=%d",
+                          options->mode, options->window_size, options->border, options->border_value, options->impulse_threshold,
+                          image->width, image->height, image->channels, image->pixel_type);
+    for (int i = 0; i < options->num_rois; i++) {
+        length += snprintf(description + length, sizeof(description) - length, " roi=%d,%d,%d,%d", options->rois[i].x,
+                           options->rois[i].y, options->rois[i].width, options->rois[i].height);
+    }
+    return result_cache_key_view(image, description);
+}
+
+// Función para filtrar una imagen consultando antes la caché de resultados (si está activada)
+// Devuelve la imagen de salida, sin datos si las opciones no son válidas; hit indica si salió de la caché
+ImageView filter_image_cached(ThreadPool *pool, const ResultCache *cache, const ImageView *image, const FilterOptions *options, int *hit) {
+    *hit = 0;
+    if (!cache->directory) {
+        return filter_image(pool, image, options);
+    }
+    uint64_t key = result_key(image, options);
+    ImageView output = image_alloc_view(image->width, image->height, image->channels, image->pixel_type);
+    if (result_cache_get_view(cache, key, &output)) {
+        *hit = 1;
+        return output;
+    }
+    image_free(output.data);
+    output = filter_image(pool, image, options);
+    if (output.data) {
+        result_cache_put_view(cache, key, &output);
+    }
+    return output;
+}
+
+// Función para reservar en la arena una imagen con las filas alineadas como las de image_alloc_view
+ImageView scratch_image(ScratchArena *arena, int width, int height, int channels, int pixel_type) {
+    size_t stride = image_row_stride(width, channels, pixel_type);
+    return image_view_strided(scratch_arena_alloc(arena, stride * height), width, height, channels, pixel_type, stride);
+}
+
+// Función para volver a filtrar solo las regiones sucias de una imagen
+// output contiene la salida anterior y se actualiza en cada rectángulo dilatado por el radio de la ventana
+// Devuelve 0 si las opciones no son válidas
+int filter_dirty_rects(ThreadPool *pool, const ImageView *image, const ImageView *output, const FilterOptions *options, const ImageRect *rects, int count) {
+    int radius = options->window_size / 2 > 0 ? options->window_size / 2 : 1;  // El detector de impulsos usa los 8 vecinos
+    int width = image->width, height = image->height;
+    ScratchMark mark = scratch_arena_mark(&pool->scratch);
+    size_t *window_counts = (size_t *)scratch_arena_calloc(&pool->scratch, options->window_size / 2 + 1, sizeof(size_t));
+    int ok = 1;
+    for (int i = 0; i < count && ok; i++) {
+        ImageRect region = dilate_image_rect(rects[i], radius, width, height);  // Píxeles de salida que pueden cambiar
+        ImageRect crop = dilate_image_rect(region, radius, width, height);      // Píxeles de entrada de los que dependen
+        if (region.width == 0 || region.height == 0) {
+            continue;
+        }
+        ScratchMark crop_mark = scratch_arena_mark(&pool->scratch);
+        ImageView crop_input = scratch_image(&pool->scratch, crop.width, crop.height, image->channels, image->pixel_type);
+        ImageView crop_output = scratch_image(&pool->scratch, crop.width, crop.height, image->channels, image->pixel_type);
+        ImageView source = image_view_crop(image, crop.x, crop.y, crop.width, crop.height);
+        image_view_copy(&source, &crop_input);
+        size_t filtered;
+        ok = filter_image_into(pool, &crop_input, &crop_output, options, &filtered, window_counts);
+        if (ok) {
+            ImageView result = image_view_crop(&crop_output, region.x - crop.x, region.y - crop.y, region.width, region.height);
+            ImageView target = image_view_crop(output, region.x, region.y, region.width, region.height);
+            image_view_copy(&result, &target);
+        }
+        scratch_arena_release(&pool->scratch, crop_mark);
+    }
+    scratch_arena_release(&pool->scratch, mark);
+    return ok;
+}
 
-    int width, height, channels;
-    // Cargar la imagen de entrada
-    unsigned char *image = stbi_load(argv[1], &width, &height, &channels, 0);
-    if (!image) {
-        printf("Error loading image %s\n", argv[1]);
+// Función para el modo incremental: parte de la salida anterior y vuelve a filtrar solo las regiones sucias,
+// las dadas o, si no hay ninguna, las que resultan de comparar la entrada anterior con la actual
+// Devuelve la imagen de salida, sin datos si hay que filtrar la imagen completa
+ImageView filter_incremental(ThreadPool *pool, const ImageView *image, const FilterOptions *options, const char *previous_input, const char *previous_output, ImageRect *rects, int count) {
+    int width = image->width, height = image->height;
+    ImageView none = {NULL, 0, 0, 0, 0, 0};
+    ImageView output = none, previous = none;
+    if (!load_image_view(previous_output, &output, image->pixel_type) || output.width != width || output.height != height ||
+        output.channels != image->channels) {
+        printf("Previous output %s does not match the input; filtering the whole image\n", previous_output);
+        image_free(output.data);
+        return none;
+    }
+    if (count == 0) {
+        count = load_image_view(previous_input, &previous, image->pixel_type) && previous.width == width &&
+                previous.height == height && previous.channels == image->channels ? find_dirty_rects(&previous, image, rects, DIRTY_MAX_RECTS) : -1;
+        image_free(previous.data);
+        if (count < 0) {
+            printf("Previous input %s missing or too different; filtering the whole image\n", previous_input);
+            image_free(output.data);
+            return none;
+        }
+    }
+
+    // Si los recortes cubren gran parte de la imagen, filtrarla completa es más barato
+    int radius = options->window_size / 2 > 0 ? options->window_size / 2 : 1;
+    double fraction = dirty_crop_fraction(rects, count, radius, width, height);
+    if (fraction > DIRTY_FULL_RUN_FRACTION) {
+        printf("Dirty regions need %.0f%% of the image; filtering the whole image\n", 100.0 * fraction);
+        image_free(output.data);
+        return none;
+    }
+    if (!filter_dirty_rects(pool, image, &output, options, rects, count)) {
+        image_free(output.data);
+        return none;
+    }
+    printf("Incremental: %d dirty rectangles, %.1f%% of the image recomputed\n", count, 100.0 * fraction);
+    return output;
+}
+
+// Imagen en tránsito por el pipeline del modo por lotes
+typedef struct {
+    int job;                // Índice del trabajo en el manifiesto
+    ImageView image;        // Imagen decodificada (sin datos si no se pudo cargar)
+    ImageView output;       // Imagen filtrada
+} BatchItem;
+
+// Estado compartido por las etapas del pipeline: decodificación -> filtrado -> codificación
+typedef struct {
+    BatchJob *jobs;
+    FilterOptions *options;
+    int *valid;             // Trabajos cuyas opciones son válidas
+    int count;
+    atomic_int next_job;    // Siguiente trabajo que decodificar
+    atomic_int failed;      // Trabajos fallidos
+    BatchQueue decoded;     // Imágenes decodificadas, a la espera del filtro
+    BatchQueue filtered;    // Imágenes filtradas, a la espera de codificarse
+} BatchPipeline;
+
+// Función de los hilos de decodificación: toman el siguiente trabajo del manifiesto y lo cargan
+void *decode_stage(void *arg) {
+    BatchPipeline *pipeline = (BatchPipeline *)arg;
+    while (1) {
+        int job = atomic_fetch_add(&pipeline->next_job, 1);
+        if (job >= pipeline->count) {
+            break;
+        }
+        if (!pipeline->valid[job]) {
+            continue;
+        }
+        BatchItem *item = (BatchItem *)calloc(1, sizeof(BatchItem));
+        item->job = job;
+        load_image_view(pipeline->jobs[job].input, &item->image, pipeline->options[job].pixel_type);
+        batch_queue_push(&pipeline->decoded, item);
+    }
+    return NULL;
+}
+
+// Función de los hilos de codificación: guardan las imágenes filtradas hasta recibir NULL
+void *encode_stage(void *arg) {
+    BatchPipeline *pipeline = (BatchPipeline *)arg;
+    BatchItem *item;
+    while ((item = (BatchItem *)batch_queue_pop(&pipeline->filtered)) != NULL) {
+        const char *path = pipeline->jobs[item->job].output;
+        if (!write_image_view(path, &item->output)) {
+            printf("Error writing image %s\n", path);
+            atomic_fetch_add(&pipeline->failed, 1);
+        }
+        image_free(item->output.data);
+        free(item);
+    }
+    return NULL;
+}
+
+// Función para procesar un lote en un pipeline de tres etapas unidas por colas acotadas: `decoders` hilos
+// decodifican, el hilo principal filtra cada imagen con el grupo de hilos y `encoders` hilos codifican,
+// de modo que la decodificación y la compresión PNG de unas imágenes se solapan con el filtrado de otras
+int run_batch(ThreadPool *pool, const ResultCache *cache, const char *manifest, const FilterOptions *defaults, int decoders, int encoders) {
+    BatchPipeline pipeline;
+    pipeline.count = load_manifest(manifest, &pipeline.jobs);
+    if (pipeline.count < 0) {
+        printf("Error reading manifest %s\n", manifest);
         return 1;
     }
+    int count = pipeline.count;
 
-    int window_size = atoi(argv[3]);   // Tamaño de la ventana del filtro
-    int num_nodes = atoi(argv[4]);     // Número de nodos
-    unsigned char *output = (unsigned char *)malloc(width * height * channels * sizeof(unsigned char));  // Imagen de salida
+    // Las opciones de cada línea se aplican sobre las de la línea de comandos
+    pipeline.options = (FilterOptions *)malloc((count > 0 ? count : 1) * sizeof(FilterOptions));
+    pipeline.valid = (int *)malloc((count > 0 ? count : 1) * sizeof(int));
+    int valid_count = 0;
+    atomic_init(&pipeline.next_job, 0);
+    atomic_init(&pipeline.failed, 0);
+    for (int j = 0; j < count; j++) {
+        pipeline.options[j] = *defaults;
+        pipeline.valid[j] = parse_filter_options(pipeline.jobs[j].argc, pipeline.jobs[j].argv, &pipeline.options[j]);
+        if (!pipeline.valid[j]) {
+            printf("Invalid options for %s\n", pipeline.jobs[j].input);
+            atomic_fetch_add(&pipeline.failed, 1);
+        }
+        valid_count += pipeline.valid[j];
+    }
+    // Colas acotadas: como mucho BATCH_QUEUE_CAPACITY imágenes esperan entre dos etapas
+    batch_queue_init(&pipeline.decoded, BATCH_QUEUE_CAPACITY);
+    batch_queue_init(&pipeline.filtered, BATCH_QUEUE_CAPACITY);
+
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    pthread_t decode_threads[decoders];
+    pthread_t encode_threads[encoders];
+    for (int i = 0; i < decoders; i++) {
+        pthread_create(&decode_threads[i], NULL, decode_stage, &pipeline);
+    }
+    for (int i = 0; i < encoders; i++) {
+        pthread_create(&encode_threads[i], NULL, encode_stage, &pipeline);
+    }
+
+    // Etapa de filtrado, en el orden en que terminan de decodificarse las imágenes
+    int cache_hits = 0;
+    for (int k = 0; k < valid_count; k++) {
+        BatchItem *item = (BatchItem *)batch_queue_pop(&pipeline.decoded);
+        if (item->image.data) {
+            int hit;
+            item->output = filter_image_cached(pool, cache, &item->image, &pipeline.options[item->job], &hit);
+            cache_hits += hit;
+            image_free(item->image.data);  // Liberar la memoria de la imagen de entrada
+        } else {
+            printf("Error loading image %s\n", pipeline.jobs[item->job].input);
+        }
+        if (!item->output.data) {
+            atomic_fetch_add(&pipeline.failed, 1);
+            free(item);
+            continue;
+        }
+        batch_queue_push(&pipeline.filtered, item);
+    }
+
+    // Un NULL por hilo de codificación indica el final del lote
+    for (int i = 0; i < encoders; i++) {
+        batch_queue_push(&pipeline.filtered, NULL);
+    }
+    for (int i = 0; i < decoders; i++) {
+        pthread_join(decode_threads[i], NULL);
+    }
+    for (int i = 0; i < encoders; i++) {
+        pthread_join(encode_threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+    int failed = atomic_load(&pipeline.failed);
+    printf("Batch: %d images, %d failed, %.3f s (%.2f ms per image; %d decoders, %d encoders)\n",
+           count, failed, seconds, count > 0 ? 1000.0 * seconds / count : 0.0, decoders, encoders);
+    if (cache->directory) {
+        printf("Result cache: %d of %d images found in %s\n", cache_hits, valid_count, cache->directory);
+    }
+
+    batch_queue_free(&pipeline.decoded);
+    batch_queue_free(&pipeline.filtered);
+    free(pipeline.options);
+    free(pipeline.valid);
+    free_manifest(pipeline.jobs, count);
+    return failed > 0;
+}
+
+// Función para medir el tiempo transcurrido en milisegundos
+double elapsed_ms(const struct timespec *begin) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - begin->tv_sec) * 1e3 + (now.tv_nsec - begin->tv_nsec) / 1e6;
+}
+
+// Función para atender una petición del daemon con el grupo de hilos ya creado
+void serve_request(ThreadPool *pool, const ResultCache *cache, FilterRequest *request, const int *fds, int num_fds, const FilterOptions *defaults, FilterReply *reply) {
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    memset(reply, 0, sizeof(FilterReply));
+    request->input_shm[sizeof(request->input_shm) - 1] = '\0';
+    request->output_shm[sizeof(request->output_shm) - 1] = '\0';
 
-    // Aplicar el filtro de mediana en paralelo
-    parallel_median_filter(image, output, width, height, channels, window_size, num_nodes);
+    // Las opciones del daemon, con las que fije la petición
+    FilterOptions options = *defaults;
+    if (request->window_size > 0) {
+        options.window_size = request->window_size;
+    }
+    if (request->mode >= 0) {
+        options.mode = request->mode;
+    }
+    if (request->border >= 0) {
+        options.border = request->border;
+        options.border_value = request->border_value;
+    }
+    if (request->magic != FILTER_DAEMON_MAGIC || request->width <= 0 || request->height <= 0 || request->channels < 1 ||
+        request->channels > 4 || request->pixel_type < PIXEL_U8 || request->pixel_type > PIXEL_F32) {
+        reply->status = FILTER_DAEMON_BAD_REQUEST;
+        return;
+    }
+    if (options.mode < MODE_MEDIAN || options.mode > MODE_VECTOR || options.border < BORDER_SHRINK || options.border > BORDER_CONSTANT) {
+        reply->status = FILTER_DAEMON_BAD_OPTIONS;
+        return;
+    }
+
+    // Proyectar las imágenes de entrada y salida; con nombres vacíos se usan las descripciones recibidas
+    // Las imágenes del cliente tienen las filas seguidas, sin relleno
+    size_t size = (size_t)request->width * request->height * request->channels * pixel_size(request->pixel_type);
+    ImageView input = image_view(map_shared_buffer(request->input_shm, num_fds > 0 ? fds[0] : -1, size, 0), request->width,
+                                 request->height, request->channels, request->pixel_type);
+    ImageView output = image_view(map_shared_buffer(request->output_shm, num_fds > 1 ? fds[1] : -1, size, 1), request->width,
+                                  request->height, request->channels, request->pixel_type);
+    uint64_t key = 0;
+    if (!input.data || !output.data) {
+        reply->status = FILTER_DAEMON_BAD_BUFFER;
+    } else if (cache->directory && (key = result_key(&input, &options), result_cache_get_view(cache, key, &output))) {
+        // Las muestras que habría filtrado la ejecución: las de las regiones de interés, si las hay
+        size_t pixels = (size_t)request->width * request->height;
+        if (options.num_rois > 0) {
+            ScratchMark mark = scratch_arena_mark(&pool->scratch);
+            ImageRect *rois = (ImageRect *)scratch_arena_alloc(&pool->scratch, ROI_MAX_PIECES * sizeof(ImageRect));
+            int num_rois = roi_disjoint(options.rois, options.num_rois, request->width, request->height, rois, ROI_MAX_PIECES);
+            pixels = num_rois > 0 ? roi_area(rois, num_rois) : 0;
+            scratch_arena_release(&pool->scratch, mark);
+        }
+        reply->cached = 1;
+        reply->filtered = options.mode == MODE_SWITCHING ? 0 : pixels * request->channels;
+    } else {
+        ScratchMark mark = scratch_arena_mark(&pool->scratch);
+        size_t *window_counts = (size_t *)scratch_arena_calloc(&pool->scratch, options.window_size / 2 + 1, sizeof(size_t));
+        size_t filtered = 0;
+        struct timespec filter_begin;
+        clock_gettime(CLOCK_MONOTONIC, &filter_begin);
+        if (filter_image_into(pool, &input, &output, &options, &filtered, window_counts)) {
+            reply->filtered = filtered;
+            reply->filter_ms = elapsed_ms(&filter_begin);
+            if (cache->directory) {
+                result_cache_put_view(cache, key, &output);
+            }
+        } else {
+            reply->status = FILTER_DAEMON_BAD_OPTIONS;
+        }
+        scratch_arena_release(&pool->scratch, mark);
+    }
+    if (input.data) {
+        munmap(input.data, size);
+    }
+    if (output.data) {
+        munmap(output.data, size);
+    }
+    reply->total_ms = elapsed_ms(&begin);
+}
+
+// Contexto de las peticiones del daemon
+typedef struct {
+    ThreadPool *pool;
+    const ResultCache *cache;
+    const FilterOptions *defaults;
+} DaemonContext;
+
+void serve_daemon_request(void *context, FilterRequest *request, const int *fds, int num_fds, FilterReply *reply) {
+    DaemonContext *daemon = (DaemonContext *)context;
+    serve_request(daemon->pool, daemon->cache, request, fds, num_fds, daemon->defaults, reply);
+}
+
+// Modo daemon: atiende peticiones por un socket Unix con el grupo de hilos siempre creado, hasta SIGINT o SIGTERM
+// Las peticiones de todas las conexiones se filtran de una en una, cada una con todos los hilos (ver filter_daemon.h)
+int run_daemon(ThreadPool *pool, const ResultCache *cache, const char *socket_path, const FilterOptions *defaults) {
+    DaemonContext context = {pool, cache, defaults};
+    return run_filter_daemon(socket_path, pool->num_threads, serve_daemon_request, &context);
+}
 
-    // Guardar la imagen de salida
-    if (!stbi_write_png(argv[2], width, height, channels, output, width * channels)) {
-        printf("Error writing image %s\n", argv[2]);
-        free(image);
-        free(output);
+// Función para la vista previa: filtra una copia de la imagen reducida por área a como mucho max_pixels píxeles,
+// con el radio de la ventana reducido en la misma proporción, y estima el tiempo de la ejecución completa
+// El coste por píxel depende de la ventana (elige el kernel), así que se mide en una franja con la ventana completa
+// Devuelve la vista previa filtrada, sin datos si las opciones no son válidas
+ImageView filter_preview(ThreadPool *pool, const ImageView *image, const FilterOptions *options, size_t max_pixels) {
+    int factor = preview_factor(image->width, image->height, max_pixels);
+    ImageView preview = preview_downsample(image, factor);
+    ImageView output = image_alloc_view(preview.width, preview.height, preview.channels, preview.pixel_type);
+    ScratchMark mark = scratch_arena_mark(&pool->scratch);
+    size_t *window_counts = (size_t *)scratch_arena_calloc(&pool->scratch, options->window_size / 2 + 1, sizeof(size_t));
+    size_t filtered;
+    struct timespec begin;
+
+    // Franja de muestra con la ventana completa; la vista previa la sobrescribe después
+    FilterOptions sample_options = *options;
+    sample_options.rois[0] = preview_sample_band(preview.width, preview.height);
+    sample_options.num_rois = 1;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    int ok = filter_image_into(pool, &preview, &output, &sample_options, &filtered, window_counts);
+    double sample_ms = elapsed_ms(&begin);
+
+    // Radio redondeado al de la imagen reducida, al menos 1 para que el filtro siga viéndose
+    FilterOptions preview_options = *options;
+    int radius = (options->window_size / 2 + factor / 2) / factor;
+    preview_options.window_size = 2 * (radius > 0 ? radius : 1) + 1;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    ok = ok && filter_image_into(pool, &preview, &output, &preview_options, &filtered, window_counts);
+    double preview_ms = elapsed_ms(&begin);
+    scratch_arena_release(&pool->scratch, mark);
+    image_free(preview.data);
+    if (!ok) {
+        printf("The adaptive window_size must be odd and at least 3\n");
+        image_free(output.data);
+        output.data = NULL;
+        return output;
+    }
+
+    double sample_pixels = (double)sample_options.rois[0].width * sample_options.rois[0].height;
+    printf("Preview window: %d (full run: %d)\n", preview_options.window_size, options->window_size);
+    preview_report(image->width, image->height, output.width, output.height, factor, preview_ms,
+                   preview_project(sample_ms, sample_pixels, (double)image->width * image->height), pool->num_threads);
+    return output;
+}
+
+int main(int argc, char *argv[]) {
+    // Comprobar los argumentos de la línea de comandos
+    // Con --batch, el segundo argumento es el manifiesto y las opciones son las de todas sus líneas
+    // --decoders y --encoders fijan los hilos de las etapas de decodificación y codificación del lote
+    // Con --daemon, el segundo argumento es la ruta del socket y las opciones son las de todas las peticiones
+    // --cache y --cache-size activan la caché de resultados en todos los modos
+    // --numa fija los hilos del grupo por nodos NUMA en todos los modos
+    // --huge-pages respalda las imágenes grandes con páginas de 2 MB en todos los modos
+    // --incremental parte de una ejecución anterior y solo vuelve a filtrar las regiones sucias (--dirty o comparando)
+    // --roi filtra solo las regiones de interés y copia el resto de la entrada (no se combina con --incremental)
+    // --preview filtra una versión reducida de la imagen y estima el tiempo de la ejecución completa
+    int batch = argc >= 2 && strcmp(argv[1], "--batch") == 0;
+    int daemon_mode = argc >= 2 && strcmp(argv[1], "--daemon") == 0;
+    int decoders = 1, encoders = 2;  // La compresión PNG es la etapa más lenta
+    ResultCache cache = {NULL, RESULT_CACHE_DEFAULT_BYTES};
+    const char *previous_input = NULL, *previous_output = NULL;
+    ImageRect dirty[DIRTY_MAX_RECTS];
+    int num_dirty = 0;
+    int numa = 0;  // --numa: hilos fijados según la topología NUMA y franjas colocadas en el nodo de su hilo
+    size_t preview_pixels = 0;  // Tamaño máximo de la vista previa en píxeles (0 = sin vista previa)
+    int filter_argc = 0;
+    char *filter_argv[argc > 5 ? argc - 5 : 1];
+    int valid_args = argc >= 5;
+    for (int i = 5; valid_args && i < argc; i++) {
+        if (batch && strcmp(argv[i], "--decoders") == 0 && i + 1 < argc) {
+            decoders = atoi(argv[++i]);
+            valid_args = decoders > 0;
+        } else if (batch && strcmp(argv[i], "--encoders") == 0 && i + 1 < argc) {
+            encoders = atoi(argv[++i]);
+            valid_args = encoders > 0;
+        } else if (strcmp(argv[i], "--numa") == 0) {
+            numa = 1;
+        } else if (strcmp(argv[i], "--huge-pages") == 0) {
+            image_alloc_huge_pages(1);
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            cache.directory = argv[++i];
+        } else if (strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc) {
+            cache.max_bytes = (size_t)(atof(argv[++i]) * 1024 * 1024);
+            valid_args = cache.max_bytes > 0;
+        } else if (!batch && !daemon_mode && strcmp(argv[i], "--incremental") == 0 && i + 2 < argc) {
+            previous_input = argv[++i];
+            previous_output = argv[++i];
+        } else if (!batch && !daemon_mode && strcmp(argv[i], "--preview") == 0) {
+            preview_pixels = preview_pixels > 0 ? preview_pixels : PREVIEW_MAX_PIXELS;
+        } else if (!batch && !daemon_mode && strcmp(argv[i], "--preview-pixels") == 0 && i + 1 < argc) {
+            preview_pixels = (size_t)atof(argv[++i]);
+            valid_args = preview_pixels > 0;
+        } else if (!batch && !daemon_mode && strcmp(argv[i], "--dirty") == 0 && i + 1 < argc) {
+            valid_args = num_dirty < DIRTY_MAX_RECTS && parse_image_rect(argv[++i], &dirty[num_dirty++]);
+        } else {
+            filter_argv[filter_argc++] = argv[i];
+        }
+    }
+    FilterOptions options = {0, BORDER_SHRINK, 0, PIXEL_AUTO, MODE_MEDIAN, -1.0f, {{0, 0, 0, 0}}, 0};
+    options.window_size = argc >= 5 ? atoi(argv[3]) : 0;
+    valid_args = valid_args && parse_filter_options(filter_argc, filter_argv, &options) && (num_dirty == 0 || previous_output) &&
+                 (options.num_rois == 0 || !previous_output) && (preview_pixels == 0 || (options.num_rois == 0 && !previous_output));
+    if (!valid_args) {
+        printf("Usage: %s <input_image> <output_image> <window_size> <num_nodes> [--border shrink|replicate|reflect|constant[:value]] [--pixel auto|u8|u16|f32]\n", argv[0]);
+        printf("       [--mode median|switching|adaptive|vector] [--impulse-threshold <t>] [--cache <dir>] [--cache-size <MB>] [--numa] [--huge-pages]\n");
+        printf("       [--roi x,y,w,h]... | [--incremental <previous_input> <previous_output> [--dirty x,y,w,h]...] | [--preview [--preview-pixels <n>]]\n");
+        printf("       %s --batch <manifest> <window_size> <num_nodes> [--decoders <n>] [--encoders <n>] [options]\n", argv[0]);
+        printf("       %s --daemon <socket_path> <window_size> <num_nodes> [options]\n", argv[0]);
+        printf("In switching mode only impulses get the median: samples at the extremes of the pixel range, or with\n");
+        printf("--impulse-threshold, samples more than t (8-bit units) outside the range of their eight neighbours.\n");
+        printf("The constant:value border is given in 8-bit units (0-255) for every sample type, like the threshold.\n");
+        printf("In adaptive mode each window starts at 3x3 and grows while its median is an impulse, up to window_size.\n");
+        printf("In vector mode each pixel becomes the pixel of its window with the smallest L1 distance to the others.\n");
+        printf("Each manifest line is \"<input_image> <output_image> [options]\", where the options may include --window <n>.\n");
+        printf("The daemon filters images in shared memory on request; see filter_daemon.h for the protocol.\n");
+        printf("--cache keeps results in a directory, keyed by the input samples and the options (default cap 1024 MB).\n");
+        printf("--incremental updates the previous output in the --dirty rectangles only, or where the inputs differ.\n");
+        printf("--roi filters only the given rectangles (repeatable), with the surrounding image as context; the other\n");
+        printf("pixels are copied from the input. Manifest lines and daemon defaults may give --roi too.\n");
+        printf("--preview filters a copy reduced by area to at most %zu pixels (or --preview-pixels), with the window\n", PREVIEW_MAX_PIXELS);
+        printf("radius reduced to match, writes it as the output and prints the projected time of the full run.\n");
+        printf("--numa pins the threads by NUMA node and places each thread's stripes in its node's memory.\n");
+        printf("--huge-pages backs images of 2 MB or more with transparent huge pages.\n");
         return 1;
     }
 
-    stbi_image_free(image);  // Liberar la memoria de la imagen de entrada
-    free(output);            // Liberar la memoria de la imagen de salida
-    return 0;
+    int num_nodes = atoi(argv[4]);     // Número de nodos
+    ThreadPool pool;
+    create_thread_pool(&pool, num_nodes, numa);
+    int status = 0;
+    if (batch) {
+        status = run_batch(&pool, &cache, argv[2], &options, decoders, encoders);
+    } else if (daemon_mode) {
+        status = run_daemon(&pool, &cache, argv[2], &options);
+    } else {
+        // Cargar la imagen de entrada, con las filas alineadas como las de las imágenes que reserva el programa
+        ImageView image;
+        if (!load_image_view(argv[1], &image, options.pixel_type)) {
+            printf("Error loading image %s\n", argv[1]);
+            status = 1;
+        } else {
+            int hit = 0;
+            ImageView output = {NULL, 0, 0, 0, 0, 0};
+            if (preview_pixels > 0) {
+                // Con --preview la salida es la vista previa, sin pasar por la caché
+                output = filter_preview(&pool, &image, &options, preview_pixels);
+            } else {
+                if (previous_output) {
+                    output = filter_incremental(&pool, &image, &options, previous_input, previous_output, dirty, num_dirty);
+                }
+                if (!output.data) {
+                    output = filter_image_cached(&pool, &cache, &image, &options, &hit);
+                }
+            }
+            image_free(image.data);  // Liberar la memoria de la imagen de entrada
+            if (hit) {
+                printf("Result found in cache %s\n", cache.directory);
+            }
+
+            // Guardar la imagen de salida
+            if (!output.data || !write_image_view(argv[2], &output)) {
+                if (output.data) {
+                    printf("Error writing image %s\n", argv[2]);
+                }
+                status = 1;
+            }
+            image_free(output.data);  // Liberar la memoria de la imagen de salida
+        }
+    }
+    destroy_thread_pool(&pool);
+    return status;
 }
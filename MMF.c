@@ -1,10 +1,43 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <mpi.h>
+#define IMAGE_ALLOC_IMPLEMENTATION
+#include "image_alloc.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
+#define IMAGE_IO_IMPLEMENTATION
+#include "image_io.h"
+#define BATCH_IMPLEMENTATION
+#include "batch.h"
+#define RESULT_CACHE_IMPLEMENTATION
+#include "result_cache.h"
+#define ROI_IMPLEMENTATION
+#include "roi.h"
+
+// Modos del filtro
+#define MODE_MEDIAN 0  // Mediana de cada canal por separado
+#define MODE_VECTOR 1  // Mediana vectorial: el píxel de la ventana más cercano (L1) a los demás
+
+// Modo por lotes: las imágenes de hasta BATCH_WHOLE_IMAGE_PIXELS píxeles se reparten enteras entre los procesos;
+// las mayores se filtran entre todos, por filas
+#define BATCH_WHOLE_IMAGE_PIXELS (1 << 20)
+#define TAG_BATCH_JOB 1000     // Cabecera de una imagen completa enviada a un proceso trabajador
+#define TAG_BATCH_PIXELS 1001  // Píxeles de la imagen
+#define TAG_BATCH_RESULT 1002  // Imagen filtrada devuelta al proceso 0
+#define JOB_HEADER_SIZE 8      // Ancho, alto, canales, tipo de píxel, borde, valor del borde, modo y bloques (ancho 0 = fin)
+
+// Opciones del filtro de una imagen (de la línea de comandos o de una línea del manifiesto)
+typedef struct {
+    int chunks;        // Número de bloques por proceso en el modo segmentado (0 = modo por bloques)
+    int border;        // Política de borde
+    int border_value;  // Valor fuera de la imagen con BORDER_CONSTANT
+    int pixel_type;    // Tipo de píxel con el que se filtra (PIXEL_AUTO = el del archivo)
+    int mode;          // Modo del filtro
+} FilterOptions;
 
 // Función para encontrar la mediana en un array
 unsigned char find_median(unsigned char *window, int size) {
@@ -20,89 +53,831 @@ unsigned char find_median(unsigned char *window, int size) {
     return window[size / 2];
 }
 
+// Función para calcular la mediana de un píxel del borde, cuyos vecinos fuera de la imagen siguen la política de borde
+void median_border_pixel(const ImageView *input, unsigned char *output_row, int window_half, int border, int border_value, int x, int y) {
+    int channels = input->channels;
+    unsigned char window[(2 * window_half + 1) * (2 * window_half + 1)];
+    for (int c = 0; c < channels; c++) {
+        int count = 0;
+        for (int wy = -window_half; wy <= window_half; wy++) {
+            int ny = border_index(y + wy, input->height, border);
+            for (int wx = -window_half; wx <= window_half; wx++) {
+                int nx = border_index(x + wx, input->width, border);
+                if (ny >= 0 && nx >= 0) {
+                    window[count++] = ((const unsigned char *)image_view_pixel(input, nx, ny))[c];
+                } else if (border == BORDER_CONSTANT) {
+                    window[count++] = (unsigned char)border_value;
+                }
+            }
+        }
+        output_row[x * channels + c] = find_median(window, count);
+    }
+}
+
 // Función para aplicar el filtro de mediana a una sección de la imagen
-void apply_mmf_section(unsigned char *input, unsigned char *output, int width, int height, int channels) {
+// `input` contiene las filas de la sección (incluyendo las filas de halo); se filtran las filas [start_row, end_row)
+// y el resultado se escribe a partir de la primera fila de `output`
+void apply_mmf_section(const ImageView *input, const ImageView *output, int border, int border_value, int mode, int start_row, int end_row) {
+    // El valor del borde constante llega en unidades de 8 bits; los kernels lo toman en el rango del tipo de píxel
+    float outside = border_sample(border_value, input->pixel_type);
     int window_size = 3;
     int window_half = window_size / 2;
     unsigned char window[window_size * window_size];
+    ImageView rows = image_view_crop(output, 0, 0, input->width, end_row - start_row);
 
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
+    // Modo vectorial: los canales de cada píxel se eligen juntos, sin crear colores nuevos
+    if (mode == MODE_VECTOR) {
+        vector_median_view(input, &rows, 0, start_row, window_size, border, outside);
+        return;
+    }
+
+    // Usar el kernel especializado si existe para este número de canales (las imágenes de 16 bits y float siempre lo usan)
+    if (median_filter_view(input, &rows, 0, start_row, window_size, border, outside)) {
+        return;
+    }
+    int width = input->width, height = input->height, channels = input->channels;
+
+    for (int y = start_row; y < end_row; y++) {
+        unsigned char *output_row = (unsigned char *)image_view_row(&rows, y - start_row);
+
+        // Las filas cuya ventana sale de la imagen y las columnas de ambos extremos van por el camino del borde
+        int interior_row = y >= window_half && y < height - window_half;
+        int interior_begin = interior_row ? (window_half < width ? window_half : width) : width;
+        int interior_end = interior_row && width - window_half > interior_begin ? width - window_half : interior_begin;
+        for (int x = 0; x < interior_begin; x++) {
+            median_border_pixel(input, output_row, window_half, border, (int)outside, x, y);
+        }
+
+        // Píxeles interiores: la ventana completa está dentro de la imagen, sin comprobar los límites
+        for (int x = interior_begin; x < interior_end; x++) {
             for (int c = 0; c < channels; c++) {
                 int count = 0;
                 for (int wy = -window_half; wy <= window_half; wy++) {
+                    const unsigned char *row = (const unsigned char *)image_view_pixel(input, x, y + wy) + c;
                     for (int wx = -window_half; wx <= window_half; wx++) {
-                        int ny = y + wy;
-                        int nx = x + wx;
-                        if (ny >= 0 && ny < height && nx >= 0 && nx < width) {
-                            window[count++] = input[(ny * width + nx) * channels + c];
-                        }
+                        window[count++] = row[wx * channels];
+                    }
+                }
+                output_row[x * channels + c] = find_median(window, count);
+            }
+        }
+
+        for (int x = interior_end; x < width; x++) {
+            median_border_pixel(input, output_row, window_half, border, (int)outside, x, y);
+        }
+    }
+}
+
+// Función para calcular el rango de filas [start, end) asignado a un proceso
+void rows_for_rank(int height, int size, int rank, int *start, int *end) {
+    int rows_per_rank = height / size;
+    int extra_rows = height % size;
+    *start = rank * rows_per_rank + (rank < extra_rows ? rank : extra_rows);
+    *end = *start + rows_per_rank + (rank < extra_rows ? 1 : 0);
+}
+
+// Función para calcular el rango de filas [start, end) de un bloque dentro de la sección de un proceso
+void rows_for_chunk(int rank_start, int rank_end, int chunks, int chunk, int *start, int *end) {
+    rows_for_rank(rank_end - rank_start, chunks, chunk, start, end);
+    *start += rank_start;
+    *end += rank_start;
+}
+
+// Función para obtener el tipo de dato MPI de un tipo de píxel
+MPI_Datatype mpi_pixel_type(int pixel_type) {
+    return pixel_type == PIXEL_U16 ? MPI_UNSIGNED_SHORT : pixel_type == PIXEL_F32 ? MPI_FLOAT : MPI_UNSIGNED_CHAR;
+}
+
+// Función para crear el tipo MPI de una fila de una imagen: sus muestras, con la extensión del paso entre filas, de modo
+// que n filas seguidas se envían o reciben con un contador n sin mover el relleno. Todas las imágenes y secciones de
+// una llamada se reservan con image_alloc_view, así que comparten el paso entre filas
+MPI_Datatype row_datatype(const ImageView *image) {
+    MPI_Datatype row, type;
+    MPI_Type_contiguous(image->width * image->channels, mpi_pixel_type(image->pixel_type), &row);
+    MPI_Type_create_resized(row, 0, (MPI_Aint)image->stride, &type);
+    MPI_Type_commit(&type);
+    MPI_Type_free(&row);
+    return type;
+}
+
+// Modo por bloques: MPI_Scatterv de las filas, reparto de las filas de halo, filtrado y MPI_Gatherv
+// Los contadores y desplazamientos de MPI van en filas. En los procesos trabajadores `image` solo da la forma de la imagen
+void blocking_mmf(const ImageView *image, const ImageView *output, int border, int border_value, int mode, int rank, int size) {
+    int width = image->width, height = image->height, channels = image->channels, pixel_type = image->pixel_type;
+    size_t row_bytes = image_view_row_bytes(image);
+    MPI_Datatype row_type = row_datatype(image);
+    int *counts = (int *)malloc(size * sizeof(int));
+    int *displs = (int *)malloc(size * sizeof(int));
+    ImageView halos = {NULL, 0, 0, 0, 0, 0};  // Dos filas de halo (superior e inferior) por proceso, solo en el proceso 0
+
+    for (int i = 0; i < size; i++) {
+        int start, end;
+        rows_for_rank(height, size, i, &start, &end);
+        counts[i] = end - start;
+        displs[i] = start;
+    }
+
+    if (rank == 0) {
+        halos = image_alloc_view(width, 2 * size, channels, pixel_type);
+        memset(halos.data, 0, halos.stride * halos.height);
+        for (int i = 0; i < size; i++) {
+            int start, end;
+            rows_for_rank(height, size, i, &start, &end);
+            if (start > 0) {
+                memcpy(image_view_row(&halos, 2 * i), image_view_row(image, start - 1), row_bytes);
+            }
+            if (end < height) {
+                memcpy(image_view_row(&halos, 2 * i + 1), image_view_row(image, end), row_bytes);
+            }
+        }
+    }
+
+    int start, end;
+    rows_for_rank(height, size, rank, &start, &end);
+    int rows = end - start;
+    int halo_top = start > 0 ? 1 : 0;
+    int halo_bottom = end < height ? 1 : 0;
+
+    // El proceso 0 filtra sus filas directamente de la imagen a la salida: su halo inferior ya está en la imagen
+    if (rank == 0) {
+        MPI_Scatterv(image->data, counts, displs, row_type, MPI_IN_PLACE, counts[0], row_type, 0, MPI_COMM_WORLD);
+        MPI_Scatter(halos.data, 2, row_type, MPI_IN_PLACE, 2, row_type, 0, MPI_COMM_WORLD);
+        ImageView section = image_view_crop(image, 0, 0, width, rows + halo_bottom);
+        apply_mmf_section(&section, output, border, border_value, mode, 0, rows);
+        MPI_Gatherv(MPI_IN_PLACE, counts[0], row_type, output->data, counts, displs, row_type, 0, MPI_COMM_WORLD);
+        image_free(halos.data);
+        MPI_Type_free(&row_type);
+        free(counts);
+        free(displs);
+        return;
+    }
+
+    // Sección local con las filas de halo alrededor de las filas propias
+    ImageView input_section = image_alloc_view(width, rows + 2, channels, pixel_type);
+    ImageView output_section = image_alloc_view(width, rows > 0 ? rows : 1, channels, pixel_type);
+    ImageView halo_rows = image_alloc_view(width, 2, channels, pixel_type);
+
+    // Recibir la sección de datos y sus halos
+    MPI_Scatterv(NULL, counts, displs, row_type, image_view_row(&input_section, halo_top), counts[rank], row_type, 0, MPI_COMM_WORLD);
+    MPI_Scatter(NULL, 2, row_type, halo_rows.data, 2, row_type, 0, MPI_COMM_WORLD);
+    if (halo_top) {
+        memcpy(image_view_row(&input_section, 0), image_view_row(&halo_rows, 0), row_bytes);
+    }
+    if (halo_bottom) {
+        memcpy(image_view_row(&input_section, halo_top + rows), image_view_row(&halo_rows, 1), row_bytes);
+    }
+
+    // Aplicar el filtro de mediana a la sección de datos localmente
+    input_section.height = halo_top + rows + halo_bottom;
+    apply_mmf_section(&input_section, &output_section, border, border_value, mode, halo_top, halo_top + rows);
+
+    // Enviar la sección de salida al proceso 0
+    MPI_Gatherv(output_section.data, counts[rank], row_type, NULL, counts, displs, row_type, 0, MPI_COMM_WORLD);
+
+    image_free(input_section.data);
+    image_free(output_section.data);
+    image_free(halo_rows.data);
+    MPI_Type_free(&row_type);
+    free(counts);
+    free(displs);
+}
+
+// Modo segmentado: la sección de cada proceso se divide en `chunks` bloques que se envían y reciben con
+// MPI_Isend/MPI_Irecv, de modo que el bloque k+1 llega mientras se filtra el bloque k y el bloque k-1 regresa
+void pipelined_mmf(const ImageView *image, const ImageView *output, int border, int border_value, int mode, int rank, int size, int chunks) {
+    int width = image->width, height = image->height;
+    MPI_Datatype row_type = row_datatype(image);
+
+    if (rank == 0) {
+        int transfers = (size - 1) * chunks;
+        MPI_Request *send_requests = (MPI_Request *)malloc((transfers > 0 ? transfers : 1) * sizeof(MPI_Request));
+        MPI_Request *recv_requests = (MPI_Request *)malloc((transfers > 0 ? transfers : 1) * sizeof(MPI_Request));
+
+        // Enviar todos los bloques (con su halo) y preparar la recepción de los resultados directamente en la imagen de salida
+        for (int i = 1; i < size; i++) {
+            int rank_start, rank_end;
+            rows_for_rank(height, size, i, &rank_start, &rank_end);
+            for (int k = 0; k < chunks; k++) {
+                int start, end;
+                rows_for_chunk(rank_start, rank_end, chunks, k, &start, &end);
+                int first = start > 0 ? start - 1 : 0;
+                int last = end < height ? end + 1 : height;
+                if (end == start) {
+                    first = last = start;
+                }
+                int t = (i - 1) * chunks + k;
+                MPI_Isend(image_view_row(image, first), last - first, row_type, i, k, MPI_COMM_WORLD, &send_requests[t]);
+                MPI_Irecv(image_view_row(output, start), end - start, row_type, i, k, MPI_COMM_WORLD, &recv_requests[t]);
+            }
+        }
+
+        // El proceso 0 filtra su propia sección por bloques, haciendo progresar las transferencias entre bloques
+        int rank_start, rank_end;
+        rows_for_rank(height, size, 0, &rank_start, &rank_end);
+        for (int k = 0; k < chunks; k++) {
+            int start, end, flag;
+            rows_for_chunk(rank_start, rank_end, chunks, k, &start, &end);
+            int first = start > 0 ? start - 1 : 0;
+            int last = end < height ? end + 1 : height;
+            if (end > start) {
+                ImageView section = image_view_crop(image, 0, first, width, last - first);
+                ImageView result = image_view_crop(output, 0, start, width, end - start);
+                apply_mmf_section(&section, &result, border, border_value, mode, start - first, end - first);
+            }
+            MPI_Testall(transfers, send_requests, &flag, MPI_STATUSES_IGNORE);
+        }
+
+        MPI_Waitall(transfers, send_requests, MPI_STATUSES_IGNORE);
+        MPI_Waitall(transfers, recv_requests, MPI_STATUSES_IGNORE);
+        free(send_requests);
+        free(recv_requests);
+    } else {
+        int rank_start, rank_end;
+        rows_for_rank(height, size, rank, &rank_start, &rank_end);
+        int rows = rank_end - rank_start;
+
+        // Cada bloque se recibe con su propio halo, por lo que se reservan dos filas extra por bloque
+        ImageView input_section = image_alloc_view(width, rows + 2 * chunks, image->channels, image->pixel_type);
+        ImageView output_section = image_alloc_view(width, rows > 0 ? rows : 1, image->channels, image->pixel_type);
+        MPI_Request *recv_requests = (MPI_Request *)malloc(chunks * sizeof(MPI_Request));
+        MPI_Request *send_requests = (MPI_Request *)malloc(chunks * sizeof(MPI_Request));
+        int *offsets = (int *)malloc(chunks * sizeof(int));  // Primera fila de cada bloque en input_section
+
+        // Publicar todas las recepciones de antemano
+        int offset = 0;
+        for (int k = 0; k < chunks; k++) {
+            int start, end;
+            rows_for_chunk(rank_start, rank_end, chunks, k, &start, &end);
+            int first = start > 0 ? start - 1 : 0;
+            int last = end < height ? end + 1 : height;
+            if (end == start) {
+                first = last = start;
+            }
+            offsets[k] = offset;
+            MPI_Irecv(image_view_row(&input_section, offset), last - first, row_type, 0, k, MPI_COMM_WORLD, &recv_requests[k]);
+            offset += last - first;
+        }
+
+        // Filtrar cada bloque en cuanto llega y devolverlo sin esperar a los demás
+        for (int k = 0; k < chunks; k++) {
+            int start, end;
+            rows_for_chunk(rank_start, rank_end, chunks, k, &start, &end);
+            int first = start > 0 ? start - 1 : 0;
+            int last = end < height ? end + 1 : height;
+            ImageView result = image_view_crop(&output_section, 0, start - rank_start, width, end - start);
+
+            MPI_Wait(&recv_requests[k], MPI_STATUS_IGNORE);
+            if (end > start) {
+                ImageView section = image_view_crop(&input_section, 0, offsets[k], width, last - first);
+                apply_mmf_section(&section, &result, border, border_value, mode, start - first, end - first);
+            }
+            MPI_Isend(result.data, end - start, row_type, 0, k, MPI_COMM_WORLD, &send_requests[k]);
+        }
+
+        MPI_Waitall(chunks, send_requests, MPI_STATUSES_IGNORE);
+        image_free(input_section.data);
+        image_free(output_section.data);
+        free(recv_requests);
+        free(send_requests);
+        free(offsets);
+    }
+    MPI_Type_free(&row_type);
+}
+
+// Función para crear el tipo MPI de un rectángulo dentro de una imagen, para enviarlo o recibirlo en su sitio sin
+// copiarlo a un búfer contiguo
+MPI_Datatype rect_datatype(ImageRect rect, const ImageView *image) {
+    MPI_Datatype type;
+    MPI_Type_create_hvector(rect.height, rect.width * image->channels, (MPI_Aint)image->stride, mpi_pixel_type(image->pixel_type), &type);
+    MPI_Type_commit(&type);
+    return type;
+}
+
+// Función para filtrar un trozo de una región de interés a partir del recorte de la entrada que lo rodea
+// (crop, con los píxeles de crop_rect) y escribirlo en target, de piece.width x piece.height píxeles
+void filter_roi_piece(const ImageView *crop, ImageRect crop_rect, ImageRect piece, const ImageView *target, int border, int border_value, int mode) {
+    // Las filas del trozo se filtran con todo el ancho del recorte y después se descartan las columnas de halo
+    ImageView rows = image_alloc_view(crop_rect.width, piece.height, crop->channels, crop->pixel_type);
+    apply_mmf_section(crop, &rows, border, border_value, mode, piece.y - crop_rect.y, piece.y - crop_rect.y + piece.height);
+    ImageView columns = image_view_crop(&rows, piece.x - crop_rect.x, 0, piece.width, piece.height);
+    image_view_copy(&columns, target);
+    image_free(rows.data);
+}
+
+// Modo por regiones de interés: la salida parte de la entrada y solo se filtran las regiones (disjuntas y dentro de la
+// imagen), repartidas entre los procesos por área. Cada trozo viaja con su recorte de la entrada, que incluye el halo
+// de la imagen que lo rodea, y vuelve directamente a su sitio en la salida
+void roi_mmf(const ImageView *image, const ImageView *output, int border, int border_value, int mode, const ImageRect *rois, int num_rois, int rank, int size) {
+    int width = image->width, height = image->height;
+    ImageRect pieces[num_rois + size];
+    int part_begin[size + 1];
+    roi_partition(rois, num_rois, size, pieces, part_begin);  // Todos los procesos calculan el mismo reparto
+
+    if (rank == 0) {
+        int transfers = part_begin[size] - part_begin[1];
+        MPI_Request *send_requests = (MPI_Request *)malloc((transfers > 0 ? transfers : 1) * sizeof(MPI_Request));
+        MPI_Request *recv_requests = (MPI_Request *)malloc((transfers > 0 ? transfers : 1) * sizeof(MPI_Request));
+        MPI_Datatype *types = (MPI_Datatype *)malloc((transfers > 0 ? 2 * transfers : 1) * sizeof(MPI_Datatype));
+        image_view_copy(image, output);
+
+        // Enviar el recorte de cada trozo desde la imagen y preparar la recepción del resultado en la salida
+        for (int i = 1; i < size; i++) {
+            for (int k = part_begin[i]; k < part_begin[i + 1]; k++) {
+                ImageRect crop = dilate_image_rect(pieces[k], 1, width, height);
+                int t = k - part_begin[1];
+                types[2 * t] = rect_datatype(crop, image);
+                types[2 * t + 1] = rect_datatype(pieces[k], output);
+                MPI_Isend(image_view_pixel(image, crop.x, crop.y), 1, types[2 * t], i, k, MPI_COMM_WORLD, &send_requests[t]);
+                MPI_Irecv(image_view_pixel(output, pieces[k].x, pieces[k].y), 1, types[2 * t + 1], i, k, MPI_COMM_WORLD, &recv_requests[t]);
+            }
+        }
+
+        // El proceso 0 filtra sus propios trozos leyendo el recorte en su sitio, haciendo progresar las transferencias
+        // entre trozos
+        for (int k = part_begin[0]; k < part_begin[1]; k++) {
+            int flag;
+            ImageRect crop = dilate_image_rect(pieces[k], 1, width, height);
+            ImageView source = image_view_crop(image, crop.x, crop.y, crop.width, crop.height);
+            ImageView target = image_view_crop(output, pieces[k].x, pieces[k].y, pieces[k].width, pieces[k].height);
+            filter_roi_piece(&source, crop, pieces[k], &target, border, border_value, mode);
+            MPI_Testall(transfers, send_requests, &flag, MPI_STATUSES_IGNORE);
+        }
+
+        MPI_Waitall(transfers, send_requests, MPI_STATUSES_IGNORE);
+        MPI_Waitall(transfers, recv_requests, MPI_STATUSES_IGNORE);
+        for (int t = 0; t < 2 * transfers; t++) {
+            MPI_Type_free(&types[t]);
+        }
+        free(types);
+        free(send_requests);
+        free(recv_requests);
+    } else {
+        int first = part_begin[rank];
+        int count = part_begin[rank + 1] - first;
+        MPI_Request *recv_requests = (MPI_Request *)malloc((count > 0 ? count : 1) * sizeof(MPI_Request));
+        MPI_Request *send_requests = (MPI_Request *)malloc((count > 0 ? count : 1) * sizeof(MPI_Request));
+        ImageView *crops = (ImageView *)malloc((count > 0 ? count : 1) * sizeof(ImageView));
+        ImageView *results = (ImageView *)malloc((count > 0 ? count : 1) * sizeof(ImageView));
+
+        // Publicar todas las recepciones de antemano, cada recorte en su propia imagen
+        for (int k = 0; k < count; k++) {
+            ImageRect piece = pieces[first + k];
+            ImageRect crop = dilate_image_rect(piece, 1, width, height);
+            crops[k] = image_alloc_view(crop.width, crop.height, image->channels, image->pixel_type);
+            results[k] = image_alloc_view(piece.width, piece.height, image->channels, image->pixel_type);
+            MPI_Datatype row_type = row_datatype(&crops[k]);
+            MPI_Irecv(crops[k].data, crop.height, row_type, 0, first + k, MPI_COMM_WORLD, &recv_requests[k]);
+            MPI_Type_free(&row_type);
+        }
+
+        // Filtrar cada trozo en cuanto llega y devolverlo sin esperar a los demás
+        for (int k = 0; k < count; k++) {
+            ImageRect piece = pieces[first + k];
+            ImageRect crop = dilate_image_rect(piece, 1, width, height);
+            MPI_Wait(&recv_requests[k], MPI_STATUS_IGNORE);
+            filter_roi_piece(&crops[k], crop, piece, &results[k], border, border_value, mode);
+            MPI_Datatype row_type = row_datatype(&results[k]);
+            MPI_Isend(results[k].data, piece.height, row_type, 0, first + k, MPI_COMM_WORLD, &send_requests[k]);
+            MPI_Type_free(&row_type);
+        }
+
+        MPI_Waitall(count, send_requests, MPI_STATUSES_IGNORE);
+        for (int k = 0; k < count; k++) {
+            image_free(crops[k].data);
+            image_free(results[k].data);
+        }
+        free(recv_requests);
+        free(send_requests);
+        free(crops);
+        free(results);
+    }
+}
+
+// Función para leer las opciones del filtro; devuelve 0 si alguna no es válida
+int parse_filter_options(int argc, char **argv, FilterOptions *options) {
+    for (int i = 0; i < argc; i++) {
+        int valid = 1;
+        if (strcmp(argv[i], "--pipeline") == 0 && i + 1 < argc) {
+            options->chunks = atoi(argv[++i]);
+            valid = options->chunks > 0;
+        } else if (strcmp(argv[i], "--border") == 0 && i + 1 < argc) {
+            valid = parse_border(argv[++i], &options->border, &options->border_value);
+        } else if (strcmp(argv[i], "--pixel") == 0 && i + 1 < argc) {
+            valid = parse_pixel_type(argv[++i], &options->pixel_type);
+        } else if (strcmp(argv[i], "--mode") == 0 && i + 1 < argc) {
+            i++;
+            options->mode = strcmp(argv[i], "vector") == 0 ? MODE_VECTOR : MODE_MEDIAN;
+            valid = options->mode == MODE_VECTOR || strcmp(argv[i], "median") == 0;
+        } else {
+            valid = 0;
+        }
+        if (!valid) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Función para filtrar una imagen entre todos los procesos; solo el proceso 0 tiene la imagen y la salida (NULL en
+// los demás, que toman la forma de la imagen de la cabecera)
+void filter_collective(const ImageView *image, const ImageView *output, const int *header, int rank, int size) {
+    ImageView shape = image_view_strided(NULL, header[0], header[1], header[2], header[3], image_row_stride(header[0], header[2], header[3]));
+    if (!image) {
+        image = output = &shape;
+    }
+    if (header[7] > 0) {
+        pipelined_mmf(image, output, header[4], header[5], header[6], rank, size, header[7]);
+    } else {
+        blocking_mmf(image, output, header[4], header[5], header[6], rank, size);
+    }
+}
+
+// Función para calcular la clave de la caché de resultados de una imagen con su cabecera de trabajo
+// El número de bloques no cambia el resultado, así que no forma parte de la clave; las regiones de interés sí
+uint64_t result_key(const ImageView *image, const int *header, const ImageRect *rois, int num_rois) {
+    char description[128 + ROI_MAX_RECTS * 64];
+    int length = snprintf(description, sizeof(description), "MMF-mpi window=3 mode=%d border=%d:%d %dx%dx%d pixel=%d",
+                          header[6], header[4], header[5], header[0], header[1], header[2], header[3]);
+    for (int i = 0; i < num_rois; i++) {
+        length += snprintf(description + length, sizeof(description) - length, " roi=%d,%d,%d,%d", rois[i].x, rois[i].y,
+                           rois[i].width, rois[i].height);
+    }
+    return result_cache_key_view(image, description);
+}
+
+// Función para rellenar la cabecera de trabajo de una imagen con sus opciones
+void fill_job_header(const ImageView *image, const FilterOptions *options, int *header) {
+    int values[JOB_HEADER_SIZE] = {image->width, image->height, image->channels, image->pixel_type, options->border, options->border_value, options->mode, options->chunks};
+    memcpy(header, values, sizeof(values));
+}
+
+// Función para cargar la imagen de un trabajo del lote y rellenar su cabecera; devuelve 0 si no se puede cargar
+int load_batch_image(const BatchJob *job, const FilterOptions *options, ImageView *image, int *header) {
+    if (!load_image_view(job->input, image, options->pixel_type)) {
+        printf("Error loading image %s\n", job->input);
+        return 0;
+    }
+    fill_job_header(image, options, header);
+    return 1;
+}
+
+// Función para guardar el resultado de un trabajo del lote; devuelve 0 si falla
+int write_batch_image(const BatchJob *job, const ImageView *output) {
+    if (!write_image_view(job->output, output)) {
+        printf("Error writing image %s\n", job->output);
+        return 0;
+    }
+    return 1;
+}
+
+// Modo por lotes, proceso 0. Fase 1: las imágenes pequeñas se envían enteras a los procesos trabajadores; el proceso 0
+// decodifica la siguiente mientras ellos filtran y codifica cada resultado en cuanto llega. Fase 2: las imágenes
+// grandes se filtran entre todos los procesos por filas, decodificando la siguiente en segundo plano
+// Devuelve el número de trabajos fallidos
+int run_batch_master(const char *manifest, const FilterOptions *defaults, const ResultCache *cache, int size) {
+    BatchJob *jobs = NULL;
+    int count = load_manifest(manifest, &jobs);
+    int failed = 0;
+    if (count < 0) {
+        printf("Error reading manifest %s\n", manifest);
+        count = 0;
+        failed = 1;
+    }
+
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    // Opciones de cada trabajo y clasificación por tamaño leyendo solo la cabecera del archivo
+    FilterOptions *options = (FilterOptions *)malloc((count > 0 ? count : 1) * sizeof(FilterOptions));
+    int *whole = (int *)malloc((count > 0 ? count : 1) * sizeof(int));  // 1 = imagen completa, 0 = por filas, -1 = no válida
+    int whole_count = 0, split_count = 0, cache_hits = 0;
+    for (int j = 0; j < count; j++) {
+        options[j] = *defaults;
+        int width, height, channels;
+        if (!parse_filter_options(jobs[j].argc, jobs[j].argv, &options[j])) {
+            printf("Invalid options for %s\n", jobs[j].input);
+            whole[j] = -1;
+            failed++;
+        } else {
+            whole[j] = size > 1 && stbi_info(jobs[j].input, &width, &height, &channels) && (long)width * height <= BATCH_WHOLE_IMAGE_PIXELS;
+            whole_count += whole[j];
+            split_count += !whole[j];
+        }
+    }
+
+    // Fase 1: una imagen completa por proceso trabajador
+    if (size > 1) {
+        int *job_of = (int *)malloc(size * sizeof(int));                              // Trabajo de cada proceso
+        uint64_t *key_of = (uint64_t *)malloc(size * sizeof(uint64_t));               // Clave en la caché del trabajo de cada proceso
+        int *headers = (int *)malloc((size_t)size * JOB_HEADER_SIZE * sizeof(int));  // Cabecera de la imagen de cada proceso
+        int pending_header[JOB_HEADER_SIZE];
+        ImageView pending = {NULL, 0, 0, 0, 0, 0};  // Imagen ya decodificada, a la espera de un proceso libre
+        int pending_job = -1;
+        uint64_t pending_key = 0;
+        int next = 0, next_worker = 1, active = 0;
+        while (1) {
+            // Decodificar la siguiente imagen pequeña mientras los procesos trabajadores filtran las suyas
+            while (!pending.data && next < count) {
+                if (whole[next] == 1) {
+                    failed += !load_batch_image(&jobs[next], &options[next], &pending, pending_header);
+                    pending_job = next;
+                }
+                // Los resultados que ya están en la caché se guardan sin pasar por ningún proceso trabajador
+                if (pending.data && cache->directory) {
+                    pending_key = result_key(&pending, pending_header, NULL, 0);
+                    ImageView cached = image_alloc_view(pending.width, pending.height, pending.channels, pending.pixel_type);
+                    if (result_cache_get_view(cache, pending_key, &cached)) {
+                        failed += !write_batch_image(&jobs[pending_job], &cached);
+                        cache_hits++;
+                        image_free(pending.data);
+                        pending.data = NULL;
                     }
+                    image_free(cached.data);
                 }
-                output[(y * width + x) * channels + c] = find_median(window, count);
+                next++;
+            }
+            if (!pending.data && active == 0) {
+                break;
+            }
+
+            // Proceso libre: uno que aún no ha recibido nada o el primero que devuelva su resultado
+            int worker, result_job = -1;
+            uint64_t returned_key = 0;  // Clave del resultado, que se guarda después de dar otro trabajo al proceso
+            ImageView result = {NULL, 0, 0, 0, 0, 0};
+            if (pending.data && next_worker < size) {
+                worker = next_worker++;
+            } else {
+                MPI_Status status;
+                MPI_Probe(MPI_ANY_SOURCE, TAG_BATCH_RESULT, MPI_COMM_WORLD, &status);
+                worker = status.MPI_SOURCE;
+                result_job = job_of[worker];
+                returned_key = key_of[worker];
+                const int *result_header = headers + (size_t)worker * JOB_HEADER_SIZE;
+                result = image_alloc_view(result_header[0], result_header[1], result_header[2], result_header[3]);
+                MPI_Datatype row_type = row_datatype(&result);
+                MPI_Recv(result.data, result.height, row_type, worker, TAG_BATCH_RESULT, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+                MPI_Type_free(&row_type);
+                active--;
+            }
+
+            // Enviar la imagen pendiente al proceso libre antes de codificar el resultado que ha devuelto
+            if (pending.data) {
+                MPI_Datatype row_type = row_datatype(&pending);
+                MPI_Send(pending_header, JOB_HEADER_SIZE, MPI_INT, worker, TAG_BATCH_JOB, MPI_COMM_WORLD);
+                MPI_Send(pending.data, pending.height, row_type, worker, TAG_BATCH_PIXELS, MPI_COMM_WORLD);
+                MPI_Type_free(&row_type);
+                memcpy(headers + (size_t)worker * JOB_HEADER_SIZE, pending_header, sizeof(pending_header));
+                job_of[worker] = pending_job;
+                key_of[worker] = pending_key;
+                image_free(pending.data);
+                pending.data = NULL;
+                active++;
+            }
+            if (result.data) {
+                result_cache_put_view(cache, returned_key, &result);
+                failed += !write_batch_image(&jobs[result_job], &result);
+                image_free(result.data);
             }
         }
+
+        // Terminar la fase 1 en todos los procesos trabajadores
+        int stop[JOB_HEADER_SIZE] = {0};
+        for (int worker = 1; worker < size; worker++) {
+            MPI_Send(stop, JOB_HEADER_SIZE, MPI_INT, worker, TAG_BATCH_JOB, MPI_COMM_WORLD);
+        }
+        free(job_of);
+        free(key_of);
+        free(headers);
+    }
+
+    // Fase 2: imágenes grandes entre todos los procesos
+    ImagePrefetch prefetch;
+    int next = 0;
+    while (next < count && whole[next] != 0) {
+        next++;
+    }
+    if (next < count) {
+        prefetch_image(&prefetch, jobs[next].input, options[next].pixel_type);
+    }
+    while (next < count) {
+        int current = next;
+        ImageView image;
+        int loaded = prefetched_image(&prefetch, &image);
+
+        // Empezar a decodificar la siguiente imagen grande antes de filtrar la actual
+        next++;
+        while (next < count && whole[next] != 0) {
+            next++;
+        }
+        if (next < count) {
+            prefetch_image(&prefetch, jobs[next].input, options[next].pixel_type);
+        }
+
+        if (!loaded) {
+            printf("Error loading image %s\n", jobs[current].input);
+            failed++;
+            continue;
+        }
+        int header[JOB_HEADER_SIZE];
+        fill_job_header(&image, &options[current], header);
+        ImageView output = image_alloc_view(image.width, image.height, image.channels, image.pixel_type);
+        uint64_t key = cache->directory ? result_key(&image, header, NULL, 0) : 0;
+        if (result_cache_get_view(cache, key, &output)) {
+            cache_hits++;
+        } else {
+            MPI_Bcast(header, JOB_HEADER_SIZE, MPI_INT, 0, MPI_COMM_WORLD);
+            filter_collective(&image, &output, header, 0, size);
+            result_cache_put_view(cache, key, &output);
+        }
+        failed += !write_batch_image(&jobs[current], &output);
+        image_free(image.data);
+        image_free(output.data);
+    }
+    int stop[JOB_HEADER_SIZE] = {0};
+    MPI_Bcast(stop, JOB_HEADER_SIZE, MPI_INT, 0, MPI_COMM_WORLD);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+    printf("Batch: %d images (%d whole, %d split by rows), %d failed, %.3f s (%.2f ms per image)\n",
+           count, whole_count, split_count, failed, seconds, count > 0 ? 1000.0 * seconds / count : 0.0);
+    if (cache->directory) {
+        printf("Result cache: %d images found in %s\n", cache_hits, cache->directory);
+    }
+
+    free(options);
+    free(whole);
+    if (jobs) {
+        free_manifest(jobs, count);
+    }
+    return failed;
+}
+
+// Modo por lotes, procesos trabajadores: filtran imágenes completas hasta que el proceso 0 termina la fase 1
+// y después participan en el filtrado por filas de cada imagen grande
+void run_batch_worker(int rank, int size) {
+    int header[JOB_HEADER_SIZE];
+    while (1) {
+        MPI_Recv(header, JOB_HEADER_SIZE, MPI_INT, 0, TAG_BATCH_JOB, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        if (header[0] == 0) {
+            break;
+        }
+        ImageView input = image_alloc_view(header[0], header[1], header[2], header[3]);
+        ImageView output = image_alloc_view(header[0], header[1], header[2], header[3]);
+        MPI_Datatype row_type = row_datatype(&input);
+        MPI_Recv(input.data, input.height, row_type, 0, TAG_BATCH_PIXELS, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        apply_mmf_section(&input, &output, header[4], header[5], header[6], 0, input.height);
+        MPI_Send(output.data, output.height, row_type, 0, TAG_BATCH_RESULT, MPI_COMM_WORLD);
+        MPI_Type_free(&row_type);
+        image_free(input.data);
+        image_free(output.data);
+    }
+    while (1) {
+        MPI_Bcast(header, JOB_HEADER_SIZE, MPI_INT, 0, MPI_COMM_WORLD);
+        if (header[0] == 0) {
+            break;
+        }
+        filter_collective(NULL, NULL, header, rank, size);
     }
 }
 
 int main(int argc, char *argv[]) {
-    // Initialize MPI
-    MPI_Init(&argc, &argv);
+    // Initialize MPI (the batch mode decodes the next image on a second thread, which never calls MPI)
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
 
     int rank, size;
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);  // Get the rank of the current process
     MPI_Comm_size(MPI_COMM_WORLD, &size);  // Get the total number of processes
 
     // Comprobar los argumentos de la línea de comandos
-    if (argc != 4) {
+    // Con --batch, el segundo argumento es el manifiesto y las opciones son las de todas sus líneas
+    // --cache y --cache-size activan la caché de resultados, que solo consulta el proceso 0
+    // --huge-pages respalda las imágenes y secciones grandes con páginas de 2 MB en todos los procesos
+    // --roi filtra solo las regiones de interés y copia el resto de la entrada (no en el modo por lotes)
+    int batch = argc >= 2 && strcmp(argv[1], "--batch") == 0;
+    ImageRect rois[ROI_MAX_RECTS];
+    int num_rois = 0;
+    FilterOptions options = {0, BORDER_SHRINK, 0, PIXEL_AUTO, MODE_MEDIAN};
+    ResultCache cache = {NULL, RESULT_CACHE_DEFAULT_BYTES};
+    int filter_argc = 0;
+    char *filter_argv[argc > 4 ? argc - 4 : 1];
+    int valid_args = argc >= 4;
+    for (int i = 4; valid_args && i < argc; i++) {
+        if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            cache.directory = argv[++i];
+        } else if (strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc) {
+            cache.max_bytes = (size_t)(atof(argv[++i]) * 1024 * 1024);
+            valid_args = cache.max_bytes > 0;
+        } else if (strcmp(argv[i], "--huge-pages") == 0) {
+            image_alloc_huge_pages(1);
+        } else if (!batch && strcmp(argv[i], "--roi") == 0 && i + 1 < argc) {
+            valid_args = num_rois < ROI_MAX_RECTS && parse_image_rect(argv[++i], &rois[num_rois++]);
+        } else {
+            filter_argv[filter_argc++] = argv[i];
+        }
+    }
+    valid_args = valid_args && parse_filter_options(filter_argc, filter_argv, &options);
+    if (!valid_args) {
         if (rank == 0) {
-            printf("Usage: %s <input_image> <output_image> <num_nodes>\n", argv[0]);
+            printf("Usage: %s <input_image> <output_image> <num_nodes> [--pipeline <chunks>] [--border shrink|replicate|reflect|constant[:value]] [--pixel auto|u8|u16|f32]\n", argv[0]);
+            printf("       [--mode median|vector] [--cache <dir>] [--cache-size <MB>] [--huge-pages] [--roi x,y,w,h]...\n");
+            printf("       %s --batch <manifest> <num_nodes> [options]\n", argv[0]);
+            printf("Each manifest line is \"<input_image> <output_image> [options]\".\n");
+            printf("The constant:value border is given in 8-bit units (0-255) for every sample type.\n");
+            printf("--roi filters only the given rectangles, split among the processes by area, and copies the other pixels.\n");
         }
         MPI_Finalize();
         return 1;
     }
 
-    int width, height, channels;
-    unsigned char *image;
-    // Cargar la imagen de entrada solo en el proceso 0
+    if (batch) {
+        int failed = 0;
+        if (rank == 0) {
+            failed = run_batch_master(argv[2], &options, &cache, size);
+        } else {
+            run_batch_worker(rank, size);
+        }
+        MPI_Finalize();
+        return failed > 0;
+    }
+
+    int dims[5] = {0, 0, 0, 0, 0};  // Ancho, alto, canales y tipo de píxel de la imagen; 1 si el resultado está en la caché
+    ImageView image = {NULL, 0, 0, 0, 0, 0};
+    ImageView output = {NULL, 0, 0, 0, 0, 0};
+    uint64_t key = 0;
+    // Cargar la imagen de entrada y consultar la caché solo en el proceso 0
     if (rank == 0) {
-        image = stbi_load(argv[1], &width, &height, &channels, 0);
-        if (!image) {
+        if (!load_image_view(argv[1], &image, options.pixel_type)) {
             printf("Error loading image %s\n", argv[1]);
-            MPI_Finalize();
-            return 1;
+        } else {
+            output = image_alloc_view(image.width, image.height, image.channels, image.pixel_type);  // Imagen de salida
+            int header[JOB_HEADER_SIZE];
+            fill_job_header(&image, &options, header);
+            memcpy(dims, header, 4 * sizeof(int));
+            key = cache.directory ? result_key(&image, header, rois, num_rois) : 0;
+            dims[4] = result_cache_get_view(&cache, key, &output);
+            if (dims[4]) {
+                printf("Result found in cache %s\n", cache.directory);
+            }
         }
     }
 
-    int num_nodes = atoi(argv[3]);   // Número de nodos (procesos) en el clúster
-    int total_size = width * height * channels;
-    int section_size = total_size / size;  // Calcular el tamaño de la sección para cada proceso
-    unsigned char *input_section = (unsigned char *)malloc(section_size * sizeof(unsigned char));  // Sección de datos de entrada para este proceso
-    unsigned char *output_section = (unsigned char *)malloc(section_size * sizeof(unsigned char));  // Sección de datos de salida para este proceso
-
-    // Distribuir las secciones de datos a todos los procesos
-    MPI_Scatter(image, section_size, MPI_UNSIGNED_CHAR, input_section, section_size, MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
+    // Compartir las dimensiones y el tipo de píxel de la imagen con todos los procesos
+    MPI_Bcast(dims, 5, MPI_INT, 0, MPI_COMM_WORLD);
+    if (dims[0] == 0) {
+        MPI_Finalize();
+        return 1;
+    }
+    int width = dims[0], height = dims[1], channels = dims[2];
+    int pixel_type = dims[3];
+    if (rank != 0) {
+        // Los demás procesos solo necesitan la forma de la imagen
+        image = output = image_view_strided(NULL, width, height, channels, pixel_type, image_row_stride(width, channels, pixel_type));
+    }
 
-    // Aplicar el filtro de mediana a la sección de datos localmente
-    apply_mmf_section(input_section, output_section, width, height, channels);
+    // Regiones de interés recortadas a la imagen y sin solapes; todos los procesos las calculan igual
+    ImageRect regions[ROI_MAX_PIECES];
+    int num_regions = num_rois > 0 ? roi_disjoint(rois, num_rois, width, height, regions, ROI_MAX_PIECES) : 0;
+    if (num_regions < 0) {
+        if (rank == 0) {
+            printf("The regions of interest overlap in more than %d pieces\n", ROI_MAX_PIECES);
+            image_free(image.data);
+            image_free(output.data);
+        }
+        MPI_Finalize();
+        return 1;
+    }
+    if (rank == 0 && num_rois > 0) {
+        printf("Regions of interest: %d rectangles, %.1f%% of the image filtered\n", num_rois,
+               100.0 * roi_area(regions, num_regions) / ((double)width * height));
+    }
 
-    // Recolectar las secciones de salida de todos los procesos en el proceso 0
-    MPI_Gather(output_section, section_size, MPI_UNSIGNED_CHAR, image, section_size, MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
+    if (!dims[4] && num_rois > 0) {
+        roi_mmf(&image, &output, options.border, options.border_value, options.mode, regions, num_regions, rank, size);
+        if (rank == 0) {
+            result_cache_put_view(&cache, key, &output);
+        }
+    } else if (!dims[4]) {
+        int header[JOB_HEADER_SIZE];
+        fill_job_header(&image, &options, header);
+        filter_collective(&image, &output, header, rank, size);
+        if (rank == 0) {
+            result_cache_put_view(&cache, key, &output);
+        }
+    }
 
     // Guardar la imagen de salida solo desde el proceso 0
     if (rank == 0) {
-        if (!stbi_write_png(argv[2], width, height, channels, image, width * channels)) {
+        int ok = write_image_view(argv[2], &output);
+        image_free(image.data);   // Liberar la memoria de la imagen de entrada
+        image_free(output.data);  // Liberar la memoria de la imagen de salida
+        if (!ok) {
             printf("Error writing image %s\n", argv[2]);
-            free(image);
             MPI_Finalize();
             return 1;
         }
-        stbi_image_free(image);  // Liberar la memoria de la imagen de entrada
     }
 
-    free(input_section);   // Liberar la memoria de la sección de datos de entrada
-    free(output_section);  // Liberar la memoria de la sección de datos de salida
-
     MPI_Finalize();  // Finalizar MPI
     return 0;
 }
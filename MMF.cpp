@@ -2,22 +2,79 @@
 #include <iostream>
 #include <vector>
 #include <mpi.h>
+#include "filter_kernels.h"
+#define RESULT_CACHE_IMPLEMENTATION
+#include "result_cache.h"
 using namespace cv;
 using namespace std;
 
 /*
-mpic++ -o MMF MMF.cpp `pkg-config --cflags --libs opencv4`
+g++ -O3 -c filter_kernels.cpp
+mpic++ -o MMF MMF.cpp filter_kernels.o `pkg-config --cflags --libs opencv4`
 mpirun -np 4 ./MMF test-noise.png noise-output-test.png 5
+mpirun -np 4 ./MMF test-noise.png noise-output-test.png 5 --vector
+mpirun -np 4 ./MMF test-noise.png noise-output-test.png 5 --cache /tmp/mmf-cache --cache-size 256
+
+8-bit, 16-bit and float images are filtered at their own depth (other depths are converted to float).
+With --cache the master looks the result up (see result_cache.h) before sending any part to the other nodes.
 */
 
+// MPI datatype of the pixels of an image depth (CV_8U, CV_16U or CV_32F)
+MPI_Datatype mpi_datatype(int depth) {
+    return depth == CV_16U ? MPI_UNSIGNED_SHORT : depth == CV_32F ? MPI_FLOAT : MPI_UNSIGNED_CHAR;
+}
+
+// View of the pixels of a Mat, which may be a band or a crop of a larger one
+ImageView mat_view(const Mat& mat) {
+    int pixel_type = mat.depth() == CV_16U ? PIXEL_U16 : mat.depth() == CV_32F ? PIXEL_F32 : PIXEL_U8;
+    return image_view_strided(mat.data, mat.cols, mat.rows, mat.channels(), pixel_type, mat.step);
+}
+
+// Buffers of median_filter_part, kept between calls so that parts of the same size allocate nothing
+struct MedianScratch {
+    vector<Mat> channels = vector<Mat>(3);
+    vector<Mat> filtered = vector<Mat>(3);
+};
+
 // Function to apply a median filter on a part of the image for each channel
-void median_filter_part(const Mat& image_part, int filter_size, Mat& result) {
-    vector<Mat> channels(3);
-    split(image_part, channels);
+// With vector_median the three channels are filtered together: each pixel becomes the pixel of its window
+// with the smallest L1 distance to the others, in a single pass and without false colours
+// image_part and result may be bands of larger images; result keeps its memory when it has the right size
+void median_filter_part(const Mat& image_part, int filter_size, bool vector_median, Mat& result, MedianScratch& scratch) {
+    result.create(image_part.size(), image_part.type());
+    if (vector_median) {
+        ImageView input = mat_view(image_part);
+        ImageView output = mat_view(result);
+        vector_median_view(&input, &output, 0, 0, filter_size, BORDER_REPLICATE, 0);
+        return;
+    }
+
+    // split and create reuse the scratch Mats when the part has the same size as the previous one
+    split(image_part, scratch.channels);
     for (int i = 0; i < 3; ++i) {
-        medianBlur(channels[i], channels[i], filter_size);
+        Mat& channel = scratch.channels[i];
+        Mat& filtered = scratch.filtered[i];
+        if (channel.depth() == CV_8U || filter_size <= 5) {
+            medianBlur(channel, filtered, filter_size);
+        } else {
+            // medianBlur only takes 3x3 and 5x5 windows for 16-bit and float images; larger ones use the
+            // histogram (u16) or runtime-window (f32) kernels, with the same replicated border
+            filtered.create(channel.size(), channel.type());
+            ImageView input = mat_view(channel);
+            ImageView output = mat_view(filtered);
+            median_filter_view(&input, &output, 0, 0, filter_size, BORDER_REPLICATE, 0);
+        }
     }
-    merge(channels, result);
+    merge(scratch.filtered, result);
+}
+
+// Key of the result cache: the decoded pixels and everything that changes the result. Each node filters its band
+// on its own, with the border replicated at the band's edges, so the number of nodes is part of the key
+uint64_t result_key(const Mat& image, int filter_size, bool vector_median, int size) {
+    char description[128];
+    snprintf(description, sizeof(description), "MMF-opencv window=%d vector=%d nodes=%d %dx%dx%d type=%d", filter_size,
+             vector_median ? 1 : 0, size, image.cols, image.rows, image.channels(), image.type());
+    return result_cache_key(image.data, image.total() * image.elemSize(), description);
 }
 
 int main(int argc, char** argv) {
@@ -27,9 +84,26 @@ int main(int argc, char** argv) {
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
     MPI_Comm_size(MPI_COMM_WORLD, &size);
 
-    if (argc != 4) {
+    bool vector_median = false;
+    ResultCache cache = {NULL, RESULT_CACHE_DEFAULT_BYTES};
+    bool valid_args = argc >= 4;
+    for (int i = 4; valid_args && i < argc; ++i) {
+        string option = argv[i];
+        if (option == "--vector") {
+            vector_median = true;
+        } else if (option == "--cache" && i + 1 < argc) {
+            cache.directory = argv[++i];
+        } else if (option == "--cache-size" && i + 1 < argc) {
+            cache.max_bytes = (size_t)(stod(argv[++i]) * 1024 * 1024);
+            valid_args = cache.max_bytes > 0;
+        } else {
+            valid_args = false;
+        }
+    }
+    if (!valid_args) {
         if (rank == 0) {
-            cerr << "Usage: " << argv[0] << " <input_image_path> <output_image_path> <filter_size>" << endl;
+            cerr << "Usage: " << argv[0] << " <input_image_path> <output_image_path> <filter_size> [--vector]"
+                 << " [--cache <dir>] [--cache-size <MB>]" << endl;
         }
         MPI_Finalize();
         return -1;
@@ -40,16 +114,33 @@ int main(int argc, char** argv) {
     int filter_size = stoi(argv[3]);
 
     Mat image;
+    Mat filtered_image;
     int rows_per_node;
-    int total_rows, total_cols;
+    int total_rows, total_cols, image_type;
+    int cached = 0;  // 1 when the master found the result in the cache, so no node filters
+    uint64_t key = 0;
 
     if (rank == 0) {
-        // Master node loads the image
-        image = imread(input_image_path, IMREAD_COLOR);
+        // Master node loads the image at its own depth
+        image = imread(input_image_path, IMREAD_COLOR | IMREAD_ANYDEPTH);
         if (image.empty()) {
             cerr << "Error: could not read the image." << endl;
             MPI_Abort(MPI_COMM_WORLD, -1);
         }
+        if (image.depth() != CV_8U && image.depth() != CV_16U && image.depth() != CV_32F) {
+            image.convertTo(image, CV_32F);
+        }
+        image_type = image.type();
+
+        // Look the result up before any filtering
+        filtered_image.create(image.size(), image_type);
+        if (cache.directory) {
+            key = result_key(image, filter_size, vector_median, size);
+            cached = result_cache_get(&cache, key, filtered_image.data, filtered_image.total() * filtered_image.elemSize());
+            if (cached) {
+                cout << "Result found in cache " << cache.directory << endl;
+            }
+        }
 
         // Distribute the workload
         total_rows = image.rows;
@@ -61,13 +152,18 @@ int main(int argc, char** argv) {
             MPI_Send(&total_rows, 1, MPI_INT, i, 0, MPI_COMM_WORLD);
             MPI_Send(&total_cols, 1, MPI_INT, i, 0, MPI_COMM_WORLD);
             MPI_Send(&rows_per_node, 1, MPI_INT, i, 0, MPI_COMM_WORLD);
+            MPI_Send(&image_type, 1, MPI_INT, i, 0, MPI_COMM_WORLD);
+            MPI_Send(&cached, 1, MPI_INT, i, 0, MPI_COMM_WORLD);
         }
     } else {
         // Other nodes receive the size of the divisions
         MPI_Recv(&total_rows, 1, MPI_INT, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
         MPI_Recv(&total_cols, 1, MPI_INT, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
         MPI_Recv(&rows_per_node, 1, MPI_INT, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        MPI_Recv(&image_type, 1, MPI_INT, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        MPI_Recv(&cached, 1, MPI_INT, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
     }
+    MPI_Datatype datatype = mpi_datatype(CV_MAT_DEPTH(image_type));
 
     // Adjust the last part if it does not divide exactly
     int extra_rows = total_rows % size;
@@ -76,48 +172,47 @@ int main(int argc, char** argv) {
     }
 
     // Create the matrix for the part of the image that each node will process
-    Mat image_part(rows_per_node, total_cols, CV_8UC3);
+    // The master works on bands of the whole image and of the result instead, and receives into the result
+    Mat image_part(rows_per_node, total_cols, image_type);
     Mat result_part;
+    MedianScratch scratch;
 
-    if (rank == 0) {
+    if (cached) {
+        // Nothing to filter: the master already holds the result
+    } else if (rank == 0) {
         // Master node sends parts of the image to the other nodes
         for (int i = 1; i < size; ++i) {
             int start = i * rows_per_node - (i > 0 ? extra_rows : 0);
             int rows = (i == size - 1) ? (rows_per_node + extra_rows) : rows_per_node;
-            MPI_Send(image.ptr<uchar>(start), rows * total_cols * 3, MPI_UNSIGNED_CHAR, i, 0, MPI_COMM_WORLD);
+            MPI_Send(image.ptr(start), rows * total_cols * 3, datatype, i, 0, MPI_COMM_WORLD);
         }
 
-        // Master node processes its own part
-        image_part = image.rowRange(0, rows_per_node).clone();
-        median_filter_part(image_part, filter_size, result_part);
+        // Master node processes its own part in place
+        result_part = filtered_image.rowRange(0, rows_per_node);
+        median_filter_part(image.rowRange(0, rows_per_node), filter_size, vector_median, result_part, scratch);
     } else {
         // Other nodes receive their part of the image
-        MPI_Recv(image_part.data, rows_per_node * total_cols * 3, MPI_UNSIGNED_CHAR, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        MPI_Recv(image_part.data, rows_per_node * total_cols * 3, datatype, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
 
         // Process their part
-        median_filter_part(image_part, filter_size, result_part);
+        median_filter_part(image_part, filter_size, vector_median, result_part, scratch);
     }
 
     if (rank == 0) {
-        // Master node receives the processed parts from the other nodes and concatenates them
-        Mat filtered_image;
-        vector<Mat> filtered_parts(size);
-        filtered_parts[0] = result_part;
-
-        for (int i = 1; i < size; ++i) {
+        // Master node receives the processed parts from the other nodes straight into their rows of the result
+        for (int i = 1; !cached && i < size; ++i) {
             int rows = (i == size - 1) ? (rows_per_node + extra_rows) : rows_per_node;
-            Mat part(rows, total_cols, CV_8UC3);
-            MPI_Recv(part.data, rows * total_cols * 3, MPI_UNSIGNED_CHAR, i, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-            filtered_parts[i] = part;
+            MPI_Recv(filtered_image.ptr(i * rows_per_node), rows * total_cols * 3, datatype, i, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        }
+        if (!cached) {
+            result_cache_put(&cache, key, filtered_image.data, filtered_image.total() * filtered_image.elemSize());
         }
-
-        vconcat(filtered_parts, filtered_image);
 
         // Save the resulting image
         imwrite(output_image_path, filtered_image);
-    } else {
+    } else if (!cached) {
         // Other nodes send their processed part to the master node
-        MPI_Send(result_part.data, rows_per_node * total_cols * 3, MPI_UNSIGNED_CHAR, 0, 0, MPI_COMM_WORLD);
+        MPI_Send(result_part.data, rows_per_node * total_cols * 3, datatype, 0, 0, MPI_COMM_WORLD);
     }
 
     // Finalize MPI
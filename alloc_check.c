@@ -0,0 +1,154 @@
+// Comprobación de que el modo daemon (y el de lotes, que filtra con las mismas funciones) no reserva memoria del
+// montón en régimen estacionario: tras las peticiones de calentamiento de cada configuración, cada petición debe
+// hacer cero reservas. El programa incluye MMF-thread.c y sustituye malloc y compañía por versiones que cuentan las
+// llamadas de todos los hilos, también las de libstdc++ (operator new) y las de los kernels.
+//
+// gcc -o alloc_check alloc_check.c filter_kernels.o -lpthread -lm -lrt -lstdc++
+// ./alloc_check test-noise.png 4
+
+#define main mmf_main
+#include "MMF-thread.c"
+#undef main
+
+#define WARMUP_REQUESTS 2  // La primera hace crecer las arenas y la segunda, al reiniciarlas, junta sus bloques en uno
+#define CHECK_REQUESTS 5   // Peticiones contadas tras el calentamiento
+
+// Asignador de glibc al que delegan las versiones que cuentan
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+static atomic_size_t allocations;  // Reservas hechas desde el arranque, por cualquier hilo
+
+void *malloc(size_t size) {
+    atomic_fetch_add(&allocations, 1);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    atomic_fetch_add(&allocations, 1);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    atomic_fetch_add(&allocations, 1);
+    return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    atomic_fetch_add(&allocations, 1);
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    *ptr = memalign(alignment, size);
+    return *ptr ? 0 : ENOMEM;
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+
+// Función para crear un objeto de memoria anónimo de size bytes, como los que pasa un cliente del daemon
+int shared_buffer(const char *name, size_t size, const void *contents) {
+    int fd = memfd_create(name, 0);
+    if (fd < 0 || ftruncate(fd, size) < 0) {
+        return -1;
+    }
+    if (contents) {
+        void *mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        memcpy(mapped, contents, size);
+        munmap(mapped, size);
+    }
+    return fd;
+}
+
+// Función para atender CHECK_REQUESTS peticiones tras las de calentamiento; devuelve las reservas por petición
+double check_configuration(ThreadPool *pool, const ResultCache *cache, const char *path, int pixel_type, int window_size, int mode,
+                           const FilterOptions *defaults, int *status) {
+    int width, height, channels;
+    unsigned char *image = (unsigned char *)load_image(path, &width, &height, &channels, &pixel_type);
+    if (!image) {
+        *status = -1;
+        return 0.0;
+    }
+    size_t size = (size_t)width * height * channels * pixel_size(pixel_type);
+    int fds[2] = {shared_buffer("input", size, image), shared_buffer("output", size, NULL)};
+    image_free(image);
+
+    FilterRequest request;
+    FilterReply reply;
+    memset(&request, 0, sizeof(request));
+    request.magic = FILTER_DAEMON_MAGIC;
+    request.width = width;
+    request.height = height;
+    request.channels = channels;
+    request.pixel_type = pixel_type;
+    request.window_size = window_size;
+    request.mode = mode;
+    request.border = -1;
+
+    for (int i = 0; i < WARMUP_REQUESTS; i++) {
+        serve_request(pool, cache, &request, fds, 2, defaults, &reply);
+    }
+    size_t before = atomic_load(&allocations);
+    for (int i = 0; i < CHECK_REQUESTS && reply.status == FILTER_DAEMON_OK; i++) {
+        serve_request(pool, cache, &request, fds, 2, defaults, &reply);
+    }
+    size_t counted = atomic_load(&allocations) - before;
+    close(fds[0]);
+    close(fds[1]);
+    *status = reply.status;
+    return (double)counted / CHECK_REQUESTS;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        printf("Usage: %s <input_image> <num_threads>\n", argv[0]);
+        return 1;
+    }
+    ThreadPool pool;
+    ResultCache cache = {NULL, RESULT_CACHE_DEFAULT_BYTES};
+    create_thread_pool(&pool, atoi(argv[2]), 0);
+
+    // Opciones por defecto del daemon: todas las imágenes, y solo dos regiones de interés que se solapan
+    FilterOptions whole = {3, BORDER_REFLECT, 0, PIXEL_AUTO, MODE_MEDIAN, 40.0f, {{0, 0, 0, 0}}, 0};
+    FilterOptions regions = whole;
+    parse_image_rect("10,10,60,40", &regions.rois[0]);
+    parse_image_rect("40,20,50,50", &regions.rois[1]);
+    regions.num_rois = 2;
+
+    const char *pixel_names[] = {"u8", "u16", "f32"};
+    const char *mode_names[] = {"median", "switching", "adaptive", "vector"};
+    const int windows[] = {3, 5, 9};
+    int checked = 0, failed = 0;
+    for (int roi = 0; roi < 2; roi++) {
+        for (int pixel_type = PIXEL_U8; pixel_type <= PIXEL_F32; pixel_type++) {
+            for (int mode = MODE_MEDIAN; mode <= MODE_VECTOR; mode++) {
+                for (int w = 0; w < 3; w++) {
+                    int status;
+                    double per_request = check_configuration(&pool, &cache, argv[1], pixel_type, windows[w], mode, roi ? &regions : &whole, &status);
+                    if (status != FILTER_DAEMON_OK) {
+                        printf("%s %s window %d%s: request failed (status %d)\n", mode_names[mode], pixel_names[pixel_type], windows[w],
+                               roi ? " roi" : "", status);
+                        failed++;
+                    } else if (per_request > 0) {
+                        printf("%s %s window %d%s: %.1f allocations per request\n", mode_names[mode], pixel_names[pixel_type], windows[w],
+                               roi ? " roi" : "", per_request);
+                        failed++;
+                    }
+                    checked++;
+                }
+            }
+        }
+    }
+    destroy_thread_pool(&pool);
+    printf("%d of %d configurations allocate nothing after warm-up (%d requests each)\n", checked - failed, checked, CHECK_REQUESTS);
+    return failed > 0;
+}
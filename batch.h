@@ -0,0 +1,298 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+/*
+Batch manifests and background image decoding for the drivers' --batch mode.
+
+Include it after image_io.h, with the implementation in exactly one file of each program:
+
+#define BATCH_IMPLEMENTATION
+#include "batch.h"
+
+Every manifest line is one job; empty lines and lines starting with '#' are skipped:
+
+input.png output.png [options]
+
+The options use the driver's command line syntax and override the defaults given on
+the command line for that job only. Fields are separated by spaces or tabs, so paths
+cannot contain them. Lines may be of any length, but a line with more than
+BATCH_MAX_TOKENS fields is skipped with a warning rather than run without its options.
+
+BatchQueue connects the stages of a batch pipeline (decode, filter, encode): a bounded
+lock-free queue of pointers for any number of producers and consumers. A full queue
+makes the producer wait, which bounds the number of images in flight.
+
+The OpenCV drivers decode with imread and are C++, where <stdatomic.h> is not available:
+they define BATCH_MANIFEST_ONLY before including it, which leaves out the prefetch and
+the queue and keeps only the manifest functions.
+*/
+
+#include <stddef.h>
+#ifndef BATCH_MANIFEST_ONLY
+#include <pthread.h>
+#include <stdatomic.h>
+#endif
+
+#define BATCH_MAX_TOKENS 64  // Fields of a manifest line: the two paths and the options
+
+// One manifest line: input and output paths plus the job's own options
+typedef struct {
+    char *input;
+    char *output;
+    int argc;     // Number of option tokens
+    char **argv;  // Option tokens, in the same form as the command line
+} BatchJob;
+
+// Reads a manifest; returns the number of jobs, or -1 when the file cannot be read
+int load_manifest(const char *path, BatchJob **jobs);
+
+void free_manifest(BatchJob *jobs, int count);
+
+#ifndef BATCH_MANIFEST_ONLY
+// Image decoded by a background thread while the caller works on the previous one
+typedef struct {
+    pthread_t thread;
+    int running;
+    const char *path;
+    int pixel_type;
+    int loaded;
+    ImageView image;
+} ImagePrefetch;
+
+// Starts decoding `path` with load_image_view() in the background
+void prefetch_image(ImagePrefetch *prefetch, const char *path, int pixel_type);
+
+// Waits for the prefetched image and stores it in image; returns 0 when it could not be loaded
+int prefetched_image(ImagePrefetch *prefetch, ImageView *image);
+
+// Bounded multi-producer multi-consumer queue (ring of cells with sequence numbers)
+typedef struct {
+    atomic_size_t sequence;
+    void *value;
+} BatchQueueCell;
+
+typedef struct {
+    BatchQueueCell *cells;
+    size_t mask;
+    atomic_size_t head;  // Next position to pop
+    atomic_size_t tail;  // Next position to push
+} BatchQueue;
+
+// Capacity is rounded up to a power of two
+void batch_queue_init(BatchQueue *queue, size_t capacity);
+
+void batch_queue_free(BatchQueue *queue);
+
+// Non-blocking push and pop; return 0 when the queue is full or empty
+int batch_queue_try_push(BatchQueue *queue, void *value);
+int batch_queue_try_pop(BatchQueue *queue, void **value);
+
+// Blocking versions: spin briefly, then sleep while the queue is full or empty
+void batch_queue_push(BatchQueue *queue, void *value);
+void *batch_queue_pop(BatchQueue *queue);
+#endif
+
+#endif
+
+#ifdef BATCH_IMPLEMENTATION
+#ifndef BATCH_IMPLEMENTED
+#define BATCH_IMPLEMENTED
+
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Splits a line in place into tokens separated by spaces or tabs; returns the number of tokens, which may exceed
+// max_tokens (only the first max_tokens are stored)
+static int batch_tokenize(char *line, char **tokens, int max_tokens) {
+    int count = 0;
+    char *save = NULL;
+    for (char *token = strtok_r(line, " \t\r\n", &save); token; token = strtok_r(NULL, " \t\r\n", &save)) {
+        if (count < max_tokens) {
+            tokens[count] = token;
+        }
+        count++;
+    }
+    return count;
+}
+
+int load_manifest(const char *path, BatchJob **jobs) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    int count = 0, capacity = 64;
+    *jobs = (BatchJob *)malloc(capacity * sizeof(BatchJob));
+    char *line = NULL;
+    size_t line_capacity = 0;
+    int line_number = 0;
+    while (getline(&line, &line_capacity, file) >= 0) {
+        char *tokens[BATCH_MAX_TOKENS];
+        int n = batch_tokenize(line, tokens, BATCH_MAX_TOKENS);
+        line_number++;
+        if (n == 0 || tokens[0][0] == '#') {
+            continue;
+        }
+        if (n < 2) {
+            fprintf(stderr, "Manifest %s: skipping line without an output path (%s)\n", path, tokens[0]);
+            continue;
+        }
+        if (n > BATCH_MAX_TOKENS) {
+            fprintf(stderr, "Manifest %s:%d: skipping line with %d fields (at most %d)\n", path, line_number, n, BATCH_MAX_TOKENS);
+            continue;
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            *jobs = (BatchJob *)realloc(*jobs, capacity * sizeof(BatchJob));
+        }
+        BatchJob *job = &(*jobs)[count++];
+        job->input = strdup(tokens[0]);
+        job->output = strdup(tokens[1]);
+        job->argc = n - 2;
+        job->argv = (char **)malloc((n - 2 + 1) * sizeof(char *));
+        for (int i = 2; i < n; i++) {
+            job->argv[i - 2] = strdup(tokens[i]);
+        }
+        job->argv[n - 2] = NULL;
+    }
+    free(line);
+    fclose(file);
+    return count;
+}
+
+void free_manifest(BatchJob *jobs, int count) {
+    for (int i = 0; i < count; i++) {
+        free(jobs[i].input);
+        free(jobs[i].output);
+        for (int k = 0; k < jobs[i].argc; k++) {
+            free(jobs[i].argv[k]);
+        }
+        free(jobs[i].argv);
+    }
+    free(jobs);
+}
+
+#ifndef BATCH_MANIFEST_ONLY
+static void *batch_prefetch_thread(void *arg) {
+    ImagePrefetch *prefetch = (ImagePrefetch *)arg;
+    prefetch->loaded = load_image_view(prefetch->path, &prefetch->image, prefetch->pixel_type);
+    return NULL;
+}
+
+void prefetch_image(ImagePrefetch *prefetch, const char *path, int pixel_type) {
+    prefetch->path = path;
+    prefetch->pixel_type = pixel_type;
+    prefetch->loaded = 0;
+    prefetch->running = pthread_create(&prefetch->thread, NULL, batch_prefetch_thread, prefetch) == 0;
+    if (!prefetch->running) {
+        batch_prefetch_thread(prefetch);  // No thread available: decode on the calling thread
+    }
+}
+
+int prefetched_image(ImagePrefetch *prefetch, ImageView *image) {
+    if (prefetch->running) {
+        pthread_join(prefetch->thread, NULL);
+        prefetch->running = 0;
+    }
+    *image = prefetch->image;
+    return prefetch->loaded;
+}
+
+void batch_queue_init(BatchQueue *queue, size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+        size *= 2;
+    }
+    queue->cells = (BatchQueueCell *)malloc(size * sizeof(BatchQueueCell));
+    queue->mask = size - 1;
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&queue->cells[i].sequence, i);
+        queue->cells[i].value = NULL;
+    }
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+}
+
+void batch_queue_free(BatchQueue *queue) {
+    free(queue->cells);
+}
+
+// A cell is free for position pos when its sequence equals pos, and holds the value pushed at pos when it
+// equals pos + 1; popping moves it one lap ahead (pos + capacity)
+int batch_queue_try_push(BatchQueue *queue, void *value) {
+    size_t pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    BatchQueueCell *cell;
+    while (1) {
+        cell = &queue->cells[pos & queue->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+        }
+    }
+    cell->value = value;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+    return 1;
+}
+
+int batch_queue_try_pop(BatchQueue *queue, void **value) {
+    size_t pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    BatchQueueCell *cell;
+    while (1) {
+        cell = &queue->cells[pos & queue->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+        }
+    }
+    *value = cell->value;
+    atomic_store_explicit(&cell->sequence, pos + queue->mask + 1, memory_order_release);
+    return 1;
+}
+
+// Waits for the other side of a queue: yields first, then sleeps 100 us so idle stages leave the cores to the filter
+static void batch_queue_wait(int *spins) {
+    if (++*spins < 64) {
+        sched_yield();
+    } else {
+        struct timespec pause = {0, 100000};
+        nanosleep(&pause, NULL);
+    }
+}
+
+void batch_queue_push(BatchQueue *queue, void *value) {
+    int spins = 0;
+    while (!batch_queue_try_push(queue, value)) {
+        batch_queue_wait(&spins);
+    }
+}
+
+void *batch_queue_pop(BatchQueue *queue) {
+    void *value;
+    int spins = 0;
+    while (!batch_queue_try_pop(queue, &value)) {
+        batch_queue_wait(&spins);
+    }
+    return value;
+}
+
+#endif
+
+#endif
+#endif
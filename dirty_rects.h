@@ -0,0 +1,101 @@
+#ifndef DIRTY_RECTS_H
+#define DIRTY_RECTS_H
+
+/*
+Dirty rectangles for the drivers' incremental mode (--incremental), which re-filters
+only the parts of an image that changed since a previous run.
+
+Include it after image_io.h, with the implementation in exactly one file of each program:
+
+#define DIRTY_RECTS_IMPLEMENTATION
+#include "dirty_rects.h"
+
+A filter whose output pixel depends on the input within `radius` pixels only changes
+inside the dirty rectangles dilated by radius. Each of those regions is recomputed
+from a crop dilated by radius once more, so the pixels kept from the crop never see
+the crop's edges. When the crops add up to more than DIRTY_FULL_RUN_FRACTION of the
+image, a full run is cheaper.
+*/
+
+#include <stddef.h>
+
+#include "image_rect.h"
+#include "image_view.h"
+
+#define DIRTY_TILE 32                 // Tile size used when the rectangles come from comparing two images
+#define DIRTY_MAX_RECTS 256           // Rectangles accepted by the drivers
+#define DIRTY_FULL_RUN_FRACTION 0.5   // Crop area, as a fraction of the image, beyond which a full run is used
+
+// Compares two images in DIRTY_TILE tiles. Each horizontal run of changed tiles becomes a rectangle, and runs
+// spanning the same columns in consecutive tile rows are merged. Returns the number of rectangles, or -1 when
+// more than max_rects would be needed
+int find_dirty_rects(const ImageView *previous, const ImageView *current, ImageRect *rects, int max_rects);
+
+// Area of the crops needed to recompute the rectangles (each one dilated by 2 * radius) over the image area
+double dirty_crop_fraction(const ImageRect *rects, int count, int radius, int width, int height);
+
+#endif
+
+#ifdef DIRTY_RECTS_IMPLEMENTATION
+#ifndef DIRTY_RECTS_IMPLEMENTED
+#define DIRTY_RECTS_IMPLEMENTED
+
+#include <stdio.h>
+#include <string.h>
+
+// Whether any sample of a tile differs between the two images
+static int dirty_tile_changed(const ImageView *previous, const ImageView *current, int x0, int y0, int x1, int y1) {
+    size_t pixel_bytes = (size_t)previous->channels * image_view_sample_bytes(previous->pixel_type);
+    for (int y = y0; y < y1; y++) {
+        if (memcmp(image_view_pixel(previous, x0, y), image_view_pixel(current, x0, y), (size_t)(x1 - x0) * pixel_bytes) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int find_dirty_rects(const ImageView *previous, const ImageView *current, ImageRect *rects, int max_rects) {
+    int width = current->width, height = current->height;
+    int count = 0;
+    for (int ty = 0; ty < height; ty += DIRTY_TILE) {
+        int y1 = ty + DIRTY_TILE < height ? ty + DIRTY_TILE : height;
+        int run_start = -1;
+        for (int tx = 0; tx < width + DIRTY_TILE; tx += DIRTY_TILE) {  // One step past the last tile closes the last run
+            int changed = tx < width && dirty_tile_changed(previous, current, tx, ty, tx + DIRTY_TILE < width ? tx + DIRTY_TILE : width, y1);
+            if (changed && run_start < 0) {
+                run_start = tx;
+            } else if (!changed && run_start >= 0) {
+                // End of a run: extend the rectangle of the same columns that ends on the previous tile row, if any
+                int run_end = tx < width ? tx : width;
+                int merged = 0;
+                for (int i = count - 1; i >= 0 && !merged; i--) {
+                    if (rects[i].x == run_start && rects[i].width == run_end - run_start && rects[i].y + rects[i].height == ty) {
+                        rects[i].height = y1 - rects[i].y;
+                        merged = 1;
+                    }
+                }
+                if (!merged) {
+                    if (count == max_rects) {
+                        return -1;
+                    }
+                    ImageRect rect = {run_start, ty, run_end - run_start, y1 - ty};
+                    rects[count++] = rect;
+                }
+                run_start = -1;
+            }
+        }
+    }
+    return count;
+}
+
+double dirty_crop_fraction(const ImageRect *rects, int count, int radius, int width, int height) {
+    double area = 0.0;
+    for (int i = 0; i < count; i++) {
+        ImageRect crop = dilate_image_rect(rects[i], 2 * radius, width, height);
+        area += (double)crop.width * crop.height;
+    }
+    return area / ((double)width * height);
+}
+
+#endif
+#endif
@@ -0,0 +1,274 @@
+#ifndef FILTER_DAEMON_H
+#define FILTER_DAEMON_H
+
+/*
+Protocol of the filter daemons:
+
+./MMF --daemon <socket_path> <window_size> <num_nodes> [options]
+./DDF --daemon <socket_path> <iterations> <lambda> <num_nodes> [options]
+
+Clients connect to the Unix domain socket (SOCK_STREAM) and send FilterRequest
+messages, each answered with a FilterReply, on a connection that may stay open for
+any number of requests. Pixels never travel through the socket: the input and output
+images live in POSIX shared memory, given either by name (input_shm / output_shm,
+opened with shm_open) or, when the names are empty, as two file descriptors (input,
+then output) in an SCM_RIGHTS control message sent with the request, which also
+works for memfd_create buffers. Both hold width * height * channels interleaved
+samples of the pixel type. The daemon's command-line options apply to every request;
+the request fields of its filter override them when set: window_size, mode and border
+for the median filter, iterations and lambda (in 8-bit units, like the command line)
+for the diffusion filter. Each daemon ignores the other filter's fields.
+
+A request may arrive in several pieces: the daemon reads each connection without
+blocking and keeps the part received so far, so a slow client never holds up the
+others. A client that does not read its replies is disconnected.
+
+The socket loop is shared by both drivers; include it with the implementation in
+exactly one file of each program:
+
+#define FILTER_DAEMON_IMPLEMENTATION
+#include "filter_daemon.h"
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FILTER_DAEMON_MAGIC 0x4D4D4644u  // "MMFD"
+
+#define FILTER_DAEMON_MAX_CLIENTS 64  // Connections open at once
+
+// Reply status
+#define FILTER_DAEMON_OK 0
+#define FILTER_DAEMON_BAD_REQUEST 1    // Wrong magic or image shape
+#define FILTER_DAEMON_BAD_BUFFER 2     // Shared memory missing or smaller than the image
+#define FILTER_DAEMON_BAD_OPTIONS 3    // Options rejected by the filter
+
+typedef struct {
+    uint32_t magic;        // FILTER_DAEMON_MAGIC
+    int32_t width;
+    int32_t height;
+    int32_t channels;      // 1 to 4
+    int32_t pixel_type;    // PIXEL_U8, PIXEL_U16 or PIXEL_F32
+    int32_t window_size;   // 0 = daemon default
+    int32_t mode;          // -1 = daemon default
+    int32_t border;        // -1 = daemon default; border_value goes with it
+    int32_t border_value;
+    int32_t iterations;    // Diffusion: 0 = daemon default
+    float lambda;          // Diffusion: 0 = daemon default
+    char input_shm[64];    // shm_open names; empty = descriptors passed with the request
+    char output_shm[64];
+} FilterRequest;
+
+typedef struct {
+    int32_t status;        // FILTER_DAEMON_OK or an error code
+    int32_t cached;        // 1 when the result came from the daemon's result cache (--cache)
+    uint64_t filtered;     // Samples filtered (all of them except in switching mode)
+    double filter_ms;      // Time spent filtering
+    double total_ms;       // From the request arriving to the reply, mapping included
+} FilterReply;
+
+// Answers one complete request; fds are the descriptors that came with it (closed afterwards by the loop)
+typedef void (*FilterDaemonHandler)(void *context, FilterRequest *request, const int *fds, int num_fds, FilterReply *reply);
+
+// Serves requests on socket_path until SIGINT or SIGTERM. The requests of every connection are answered one
+// at a time by handler, so each one gets all of the filter's threads. Returns 1 if the socket cannot be opened
+int run_filter_daemon(const char *socket_path, int num_threads, FilterDaemonHandler handler, void *context);
+
+// Maps a shared memory object, by name (shm_open) or by descriptor when the name is empty.
+// Returns NULL when it does not exist or is smaller than size bytes
+void *map_shared_buffer(const char *name, int fd, size_t size, int writable);
+
+#endif
+
+#ifdef FILTER_DAEMON_IMPLEMENTATION
+#ifndef FILTER_DAEMON_IMPLEMENTED
+#define FILTER_DAEMON_IMPLEMENTED
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// Tells the daemon loop to stop (SIGINT or SIGTERM)
+static volatile sig_atomic_t daemon_stop = 0;
+
+static void handle_stop_signal(int signal) {
+    (void)signal;
+    daemon_stop = 1;
+}
+
+// Request partly received on a daemon connection; the clients' sockets do not block, so a client that sends a
+// request in pieces and stops does not hold up the others
+typedef struct {
+    FilterRequest request;
+    size_t received;  // Bytes of the request received so far
+    int fds[2];       // Descriptors that came with the request (two at most)
+    int num_fds;
+} DaemonConnection;
+
+// Closes the descriptors of a request and leaves the connection ready for the next one
+static void reset_connection(DaemonConnection *connection) {
+    for (int i = 0; i < connection->num_fds; i++) {
+        close(connection->fds[i]);
+    }
+    connection->received = 0;
+    connection->num_fds = 0;
+}
+
+// Reads whatever arrived of a request without waiting for the rest.
+// Returns 1 when the request is complete, 0 when part of it is missing and -1 when the client closed the connection or failed
+static int receive_request(int client, DaemonConnection *connection) {
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = {(char *)&connection->request + connection->received, sizeof(FilterRequest) - connection->received};
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    ssize_t received = recvmsg(client, &message, MSG_DONTWAIT);
+    if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    }
+    if (received <= 0) {
+        return -1;
+    }
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (int i = 0; i < count; i++) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                if (connection->num_fds < 2) {
+                    connection->fds[connection->num_fds++] = fd;
+                } else {
+                    close(fd);
+                }
+            }
+        }
+    }
+    connection->received += received;
+    return connection->received == sizeof(FilterRequest);
+}
+
+void *map_shared_buffer(const char *name, int fd, size_t size, int writable) {
+    int own = name[0] != '\0';
+    if (own) {
+        fd = shm_open(name, writable ? O_RDWR : O_RDONLY, 0);
+    }
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    void *buffer = NULL;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= size) {
+        buffer = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        if (buffer == MAP_FAILED) {
+            buffer = NULL;
+        }
+    }
+    if (own) {
+        close(fd);
+    }
+    return buffer;
+}
+
+int run_filter_daemon(const char *socket_path, int num_threads, FilterDaemonHandler handler, void *context) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        printf("Socket path too long: %s\n", socket_path);
+        return 1;
+    }
+    strcpy(address.sun_path, socket_path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listener, 16) < 0) {
+        printf("Error listening on %s: %s\n", socket_path, strerror(errno));
+        if (listener >= 0) {
+            close(listener);
+        }
+        return 1;
+    }
+
+    // Without SA_RESTART, so that poll() returns when the signal arrives
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_stop_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    printf("Listening on %s with %d threads\n", socket_path, num_threads);
+    fflush(stdout);
+
+    struct pollfd polled[FILTER_DAEMON_MAX_CLIENTS + 1];  // The listening socket, then the clients
+    DaemonConnection connections[FILTER_DAEMON_MAX_CLIENTS + 1];  // Request in progress of each client, at the same index
+    int num_clients = 0;
+    size_t served = 0;
+    polled[0].fd = listener;
+    polled[0].events = POLLIN;
+    while (!daemon_stop) {
+        if (poll(polled, num_clients + 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (polled[0].revents & POLLIN) {
+            int client = accept(listener, NULL, NULL);
+            if (client >= 0 && num_clients < FILTER_DAEMON_MAX_CLIENTS && fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK) == 0) {
+                num_clients++;
+                polled[num_clients].fd = client;
+                polled[num_clients].events = POLLIN;
+                polled[num_clients].revents = 0;
+                connections[num_clients].received = 0;
+                connections[num_clients].num_fds = 0;
+            } else if (client >= 0) {
+                close(client);
+            }
+        }
+        for (int i = num_clients; i >= 1; i--) {
+            if (!(polled[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            DaemonConnection *connection = &connections[i];
+            int received = receive_request(polled[i].fd, connection);
+            int open = received >= 0;
+            if (received > 0) {
+                FilterReply reply;
+                handler(context, &connection->request, connection->fds, connection->num_fds, &reply);
+                reset_connection(connection);
+                // The reply fits in the socket's buffer; a client that does not read its replies is disconnected
+                open = send(polled[i].fd, &reply, sizeof(reply), MSG_NOSIGNAL) == (ssize_t)sizeof(reply);
+                served++;
+            }
+            if (!open) {
+                // Client gone: the last one takes its slot
+                reset_connection(connection);
+                close(polled[i].fd);
+                polled[i] = polled[num_clients];
+                connections[i] = connections[num_clients--];
+            }
+        }
+    }
+
+    for (int i = 1; i <= num_clients; i++) {
+        reset_connection(&connections[i]);
+        close(polled[i].fd);
+    }
+    close(listener);
+    unlink(socket_path);
+    printf("Daemon stopped after %zu requests\n", served);
+    return 0;
+}
+
+#endif
+#endif
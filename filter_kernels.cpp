@@ -0,0 +1,1310 @@
+#include "filter_kernels.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <new>
+#include <type_traits>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+g++ -O3 -c filter_kernels.cpp
+*/
+
+// Block of a scratch arena; the data follows the header, aligned to SCRATCH_ALIGN
+struct ScratchBlock {
+    ScratchBlock* next;
+    size_t size;  // Bytes of data
+    size_t used;
+};
+
+static constexpr size_t scratch_header = (sizeof(ScratchBlock) + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+
+static inline unsigned char* scratch_data(ScratchBlock* block) {
+    return reinterpret_cast<unsigned char*>(block) + scratch_header;
+}
+
+static ScratchBlock* new_scratch_block(size_t size) {
+    void* memory;
+    if (posix_memalign(&memory, SCRATCH_ALIGN, scratch_header + size) != 0) {
+        return nullptr;
+    }
+    ScratchBlock* block = static_cast<ScratchBlock*>(memory);
+    block->next = nullptr;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+extern "C" void scratch_arena_init(ScratchArena* arena) {
+    arena->first = nullptr;
+    arena->current = nullptr;
+}
+
+extern "C" void* scratch_arena_alloc(ScratchArena* arena, size_t size) {
+    size = (size + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+
+    // The current block or, past it, the first block with room (the blocks after the current one are empty)
+    ScratchBlock* last = nullptr;
+    for (ScratchBlock* block = arena->current; block; block = block->next) {
+        if (block != arena->current) {
+            block->used = 0;
+        }
+        if (block->size - block->used >= size) {
+            arena->current = block;
+            void* data = scratch_data(block) + block->used;
+            block->used += size;
+            return data;
+        }
+        last = block;
+    }
+
+    // Out of room: a new block at the end, at least twice as large as the last one
+    size_t block_size = std::max(std::max(size, SCRATCH_MIN_BLOCK), last ? 2 * last->size : 0);
+    ScratchBlock* block = new_scratch_block(block_size);
+    if (!block) {
+        return nullptr;
+    }
+    if (last) {
+        last->next = block;
+    } else {
+        arena->first = block;
+    }
+    arena->current = block;
+    block->used = size;
+    return scratch_data(block);
+}
+
+extern "C" void* scratch_arena_calloc(ScratchArena* arena, size_t count, size_t size) {
+    void* data = scratch_arena_alloc(arena, count * size);
+    if (data) {
+        std::memset(data, 0, count * size);
+    }
+    return data;
+}
+
+extern "C" ScratchMark scratch_arena_mark(const ScratchArena* arena) {
+    ScratchMark mark = {arena->current, arena->current ? arena->current->used : 0};
+    return mark;
+}
+
+extern "C" void scratch_arena_release(ScratchArena* arena, ScratchMark mark) {
+    arena->current = mark.block ? mark.block : arena->first;
+    if (arena->current) {
+        arena->current->used = mark.block ? mark.used : 0;
+    }
+}
+
+extern "C" void scratch_arena_reset(ScratchArena* arena) {
+    if (arena->first && arena->first->next) {
+        size_t total = 0;
+        for (ScratchBlock* block = arena->first; block; block = block->next) {
+            total += block->size;
+        }
+        scratch_arena_destroy(arena);
+        arena->first = arena->current = new_scratch_block(total);  // NULL when out of memory: the next allocation retries
+    }
+    ScratchMark start = {nullptr, 0};
+    scratch_arena_release(arena, start);
+}
+
+extern "C" void scratch_arena_destroy(ScratchArena* arena) {
+    ScratchBlock* block = arena->first;
+    while (block) {
+        ScratchBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    scratch_arena_init(arena);
+}
+
+namespace {
+
+// Arena of the threads that bound none; its blocks are freed when the thread exits
+struct ThreadArena {
+    ScratchArena arena = {nullptr, nullptr};
+    ~ThreadArena() { scratch_arena_destroy(&arena); }
+};
+
+thread_local ThreadArena private_arena;
+thread_local ScratchArena* bound_arena = nullptr;
+
+// Scratch of one kernel call: zeroed arrays from the thread's arena, all released when the call returns
+class KernelScratch {
+public:
+    KernelScratch() : arena_(bound_arena ? bound_arena : &private_arena.arena), mark_(scratch_arena_mark(arena_)) {}
+    ~KernelScratch() { scratch_arena_release(arena_, mark_); }
+    KernelScratch(const KernelScratch&) = delete;
+    KernelScratch& operator=(const KernelScratch&) = delete;
+
+    template <typename T>
+    T* array(size_t count) {
+        void* data = scratch_arena_calloc(arena_, count > 0 ? count : 1, sizeof(T));
+        if (!data) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(data);
+    }
+
+private:
+    ScratchArena* arena_;
+    ScratchMark mark_;
+};
+
+}  // namespace
+
+extern "C" void filter_kernels_bind_arena(ScratchArena* arena) {
+    bound_arena = arena;
+}
+
+// Function to compute the conductance, identical to the one in DDF-thread.c
+static inline float conductance(float gradient, float lambda) {
+    return std::exp(-(gradient * gradient) / (lambda * lambda));
+}
+
+// Splits the columns of an output window into the part left of [interior_begin, interior_end), the interior
+// and the part right of it, each possibly empty; the interior bounds come in for the whole row
+static inline void clip_interior(int x_begin, int x_end, int* interior_begin, int* interior_end) {
+    *interior_begin = std::min(std::max(*interior_begin, x_begin), x_end);
+    *interior_end = std::min(std::max(*interior_end, *interior_begin), x_end);
+}
+
+// Median of one border pixel, whose neighbours outside the image follow the border policy
+template <int Window, int Channels, typename PixelT>
+static inline void median_border_pixel(const PixelSource<PixelT>& input, PixelT* pixel, int border, float border_value,
+                                       int x, int y) {
+    constexpr int half = Window / 2;
+    PixelT window[Window * Window];
+
+    for (int c = 0; c < Channels; ++c) {
+        int count = 0;
+        for (int wy = -half; wy <= half; ++wy) {
+            int ny = border_index(y + wy, input.height, border);
+            for (int wx = -half; wx <= half; ++wx) {
+                int nx = border_index(x + wx, input.width, border);
+                if (ny >= 0 && nx >= 0) {
+                    window[count++] = input.at(nx, ny, c);
+                } else if (border == BORDER_CONSTANT) {
+                    window[count++] = (PixelT)border_value;
+                }
+            }
+        }
+        std::nth_element(window, window + count / 2, window + count);
+        pixel[c] = window[count / 2];
+    }
+}
+
+template <int Window, int Channels, typename PixelT>
+void median_kernel(const PixelSource<PixelT>& input, const PixelTarget<PixelT>& output, int border, float border_value) {
+    constexpr int half = Window / 2;
+    constexpr int area = Window * Window;
+    const int width = input.width, height = input.height;
+    const int x_begin = output.x, x_end = output.x + output.width;
+    PixelT window[area];
+
+    for (int y = output.y; y < output.y + output.height; ++y) {
+        PixelT* out = output.row(y);
+
+        // Rows whose window leaves the image, and the columns at both ends of every row, take the border path
+        bool interior_row = y >= half && y < height - half;
+        int interior_begin = interior_row ? std::min(half, width) : width;
+        int interior_end = interior_row ? std::max(width - half, interior_begin) : width;
+        clip_interior(x_begin, x_end, &interior_begin, &interior_end);
+        for (int x = x_begin; x < interior_begin; ++x) {
+            median_border_pixel<Window, Channels>(input, out + (size_t)(x - x_begin) * Channels, border, border_value, x, y);
+        }
+
+        // Interior pixels: the whole window is inside the image, so the gather has a fixed trip count
+        for (int x = interior_begin; x < interior_end; ++x) {
+            const PixelT* corner = input.row(y - half) + (size_t)(x - half) * Channels;
+            for (int c = 0; c < Channels; ++c) {
+                int count = 0;
+                for (int wy = 0; wy < Window; ++wy) {
+                    for (int wx = 0; wx < Window; ++wx) {
+                        window[count++] = corner[(size_t)wy * input.stride + wx * Channels + c];
+                    }
+                }
+                std::nth_element(window, window + area / 2, window + area);
+                out[(x - x_begin) * Channels + c] = window[area / 2];
+            }
+        }
+
+        for (int x = interior_end; x < x_end; ++x) {
+            median_border_pixel<Window, Channels>(input, out + (size_t)(x - x_begin) * Channels, border, border_value, x, y);
+        }
+    }
+}
+
+// Median of one sample with a runtime window size; neighbours outside the image follow the border policy.
+// `window` must hold window_size * window_size values.
+template <typename PixelT>
+static inline PixelT median_at(const PixelSource<PixelT>& input, int window_size, int border, float border_value,
+                               int x, int y, int c, PixelT* window) {
+    int half = window_size / 2;
+    size_t count = 0;
+    for (int wy = -half; wy <= half; ++wy) {
+        int ny = border_index(y + wy, input.height, border);
+        for (int wx = -half; wx <= half; ++wx) {
+            int nx = border_index(x + wx, input.width, border);
+            if (ny >= 0 && nx >= 0) {
+                window[count++] = input.at(nx, ny, c);
+            } else if (border == BORDER_CONSTANT) {
+                window[count++] = (PixelT)border_value;
+            }
+        }
+    }
+    std::nth_element(window, window + count / 2, window + count);
+    return window[count / 2];
+}
+
+// Median with the window size and channel count known only at run time (shapes without a specialisation)
+template <typename PixelT>
+static void median_runtime(const PixelSource<PixelT>& input, const PixelTarget<PixelT>& output, int window_size,
+                           int border, float border_value) {
+    const int channels = input.channels;
+    KernelScratch scratch;
+    PixelT* window = scratch.array<PixelT>((size_t)window_size * window_size);
+
+    for (int y = output.y; y < output.y + output.height; ++y) {
+        PixelT* out = output.row(y);
+        for (int x = output.x; x < output.x + output.width; ++x) {
+            for (int c = 0; c < channels; ++c) {
+                out[(x - output.x) * channels + c] = median_at(input, window_size, border, border_value, x, y, c, window);
+            }
+        }
+    }
+}
+
+// Largest value of the pixel range: the type maximum for integers, 1 for normalised float
+template <typename PixelT>
+static inline PixelT pixel_max() {
+    return std::is_floating_point<PixelT>::value ? (PixelT)1 : std::numeric_limits<PixelT>::max();
+}
+
+// Impulse test of sample i of `row` given its left/right neighbours at `left`/`right`. With Extremes the sample
+// holds an extreme of the pixel range and its 3x3 neighbourhood is not flat (flat saturated areas such as an
+// opaque alpha channel are left alone); otherwise it lies more than `threshold` outside the range of its
+// eight neighbours.
+template <typename PixelT, bool Extremes>
+static inline uint8_t impulse_at(const PixelT* up, const PixelT* row, const PixelT* down, size_t i, size_t left,
+                                 size_t right, float threshold) {
+    PixelT value = row[i];
+    if (Extremes) {
+        uint8_t extreme = (value <= (PixelT)0) | (value >= pixel_max<PixelT>());
+        uint8_t flat = (up[left] == value) & (up[i] == value) & (up[right] == value) & (row[left] == value) &
+                       (row[right] == value) & (down[left] == value) & (down[i] == value) & (down[right] == value);
+        return extreme & (uint8_t)!flat;
+    }
+    float low = std::min(std::min(std::min((float)up[left], (float)up[i]), std::min((float)up[right], (float)row[left])),
+                         std::min(std::min((float)row[right], (float)down[left]), std::min((float)down[i], (float)down[right])));
+    float high = std::max(std::max(std::max((float)up[left], (float)up[i]), std::max((float)up[right], (float)row[left])),
+                          std::max(std::max((float)row[right], (float)down[left]), std::max((float)down[i], (float)down[right])));
+    return (uint8_t)(((float)value < low - threshold) | ((float)value > high + threshold));
+}
+
+// Flags the samples of the columns [x_begin, x_end) of row y that look like impulses; neighbours are replicated
+// at the image edges. The interior loop has no data-dependent branches and no aliasing, so the compiler
+// vectorises it.
+template <typename PixelT, bool Extremes>
+static void detect_impulses(const PixelSource<PixelT>& input, float threshold, int y, int x_begin, int x_end,
+                            uint8_t* __restrict mask) {
+    const int width = input.width, height = input.height, channels = input.channels;
+    const PixelT* __restrict row = input.row(y);
+    const PixelT* __restrict up = input.row(y > 0 ? y - 1 : y);
+    const PixelT* __restrict down = input.row(y < height - 1 ? y + 1 : y);
+    size_t begin = (size_t)x_begin * channels;
+
+    for (int c = 0; c < channels; ++c) {
+        size_t first = c, last = (size_t)(width - 1) * channels + c;
+        if (x_begin == 0) {
+            mask[first] = impulse_at<PixelT, Extremes>(up, row, down, first, first, width > 1 ? first + channels : first, threshold);
+        }
+        if (x_end == width) {
+            mask[last - begin] = impulse_at<PixelT, Extremes>(up, row, down, last, width > 1 ? last - channels : last, last, threshold);
+        }
+    }
+    size_t interior_begin = (size_t)std::max(x_begin, 1) * channels;
+    size_t interior_end = std::max((size_t)std::min(x_end, width - 1) * channels, interior_begin);
+    for (size_t i = interior_begin; i < interior_end; ++i) {
+        mask[i - begin] = impulse_at<PixelT, Extremes>(up, row, down, i, i - channels, i + channels, threshold);
+    }
+}
+
+// Median only of the samples flagged as impulses; every other sample is copied unchanged
+template <typename PixelT>
+static size_t switching_median(const PixelSource<PixelT>& input, const PixelTarget<PixelT>& output, int window_size,
+                               int border, float border_value, float threshold) {
+    const int channels = input.channels;
+    size_t begin = (size_t)output.x * channels;
+    size_t samples = (size_t)output.width * channels;
+    KernelScratch scratch;
+    uint8_t* mask = scratch.array<uint8_t>(samples);
+    PixelT* window = scratch.array<PixelT>((size_t)window_size * window_size);
+    size_t filtered = 0;
+
+    for (int y = output.y; y < output.y + output.height; ++y) {
+        const PixelT* row = input.row(y) + begin;
+        PixelT* out = output.row(y);
+        if (threshold < 0) {
+            detect_impulses<PixelT, true>(input, threshold, y, output.x, output.x + output.width, mask);
+        } else {
+            detect_impulses<PixelT, false>(input, threshold, y, output.x, output.x + output.width, mask);
+        }
+        for (size_t i = 0; i < samples; ++i) {
+            if (mask[i]) {
+                int x = (int)((begin + i) / channels);
+                int c = (int)((begin + i) % channels);
+                out[i] = median_at(input, window_size, border, border_value, x, y, c, window);
+                ++filtered;
+            } else {
+                out[i] = row[i];
+            }
+        }
+    }
+    return filtered;
+}
+
+// Appends the samples of the square ring at distance `radius` from (x, y) to `window`, following the border
+// policy, and returns how many were added
+template <typename PixelT>
+static inline size_t gather_ring(const PixelSource<PixelT>& input, int border, float border_value, int x, int y, int c,
+                                 int radius, PixelT* window) {
+    size_t count = 0;
+    for (int wy = -radius; wy <= radius; ++wy) {
+        int ny = border_index(y + wy, input.height, border);
+        int step = (wy == -radius || wy == radius) ? 1 : 2 * radius;
+        for (int wx = -radius; wx <= radius; wx += step) {
+            int nx = border_index(x + wx, input.width, border);
+            if (ny >= 0 && nx >= 0) {
+                window[count++] = input.at(nx, ny, c);
+            } else if (border == BORDER_CONSTANT) {
+                window[count++] = (PixelT)border_value;
+            }
+        }
+    }
+    return count;
+}
+
+// Adaptive median: the window starts at 3x3 and grows by one ring while its median is itself an impulse
+// (equal to the window minimum or maximum), up to max_window. Once the median is not an impulse, the sample
+// is kept unless it is an extreme of the window, in which case it takes the median. A flat window also stops
+// the growth. The window stays sorted across growth steps: each new ring is sorted and merged in.
+template <typename PixelT>
+static void adaptive_median(const PixelSource<PixelT>& input, const PixelTarget<PixelT>& output, int max_window,
+                            int border, float border_value, size_t* window_counts) {
+    const int channels = input.channels;
+    int max_radius = max_window / 2;
+    KernelScratch scratch;
+    PixelT* window = scratch.array<PixelT>((size_t)max_window * max_window + 1);
+    PixelT* merged = scratch.array<PixelT>((size_t)max_window * max_window + 1);  // std::inplace_merge would allocate
+
+    for (int y = output.y; y < output.y + output.height; ++y) {
+        const PixelT* row = input.row(y);
+        PixelT* out = output.row(y);
+        for (int x = output.x; x < output.x + output.width; ++x) {
+            for (int c = 0; c < channels; ++c) {
+                PixelT value = row[x * channels + c];
+                PixelT* result = &out[(x - output.x) * channels + c];
+                size_t count = 0;
+                if (border_index(y, input.height, border) >= 0) {
+                    window[count++] = value;
+                }
+                count += gather_ring(input, border, border_value, x, y, c, 1, window + count);
+                std::sort(window, window + count);
+
+                int radius = 1;
+                while (true) {
+                    PixelT low = window[0], median = window[count / 2], high = window[count - 1];
+                    if ((low < median && median < high) || low == high) {
+                        *result = (low < value && value < high) ? value : median;
+                        break;
+                    }
+                    if (radius == max_radius) {
+                        *result = median;
+                        break;
+                    }
+                    radius++;
+                    size_t added = gather_ring(input, border, border_value, x, y, c, radius, window + count);
+                    std::sort(window + count, window + count + added);
+                    std::merge(window, window + count, window + count, window + count + added, merged);
+                    std::copy(merged, merged + count + added, window);
+                    count += added;
+                }
+                window_counts[radius - 1]++;
+            }
+        }
+    }
+}
+
+// Vector median: per window, the pixel (all channels together) whose summed L1 distance to the other pixels of
+// the window is smallest. The window columns live in a ring, channel-planar, together with the distance sums of
+// every column against every other one, so sliding right only computes the distances to the entering column
+// (k^3 instead of k^4 / 2 pixel pairs for a k x k window).
+template <typename PixelT>
+static void vector_median(const PixelSource<PixelT>& input, const PixelTarget<PixelT>& output, int window_size,
+                          int border, float border_value) {
+    using SumT = typename std::conditional<std::is_floating_point<PixelT>::value, float,
+                 typename std::conditional<(sizeof(PixelT) > 1), int64_t, int32_t>::type>::type;
+    const int width = input.width, height = input.height, channels = input.channels;
+    const int x_begin = output.x, x_end = output.x + output.width;
+    const int k = window_size;
+    const int half = k / 2;
+    KernelScratch scratch;
+    int* rows = scratch.array<int>(k);                             // Image rows of the window (-1 takes the constant)
+    SumT* columns = scratch.array<SumT>((size_t)k * channels * k);  // columns[(slot * channels + c) * k + i]
+    SumT* cross = scratch.array<SumT>((size_t)k * k * k);           // cross[(a * k + b) * k + i]: pixel i of slot a to slot b
+    SumT* distance = scratch.array<SumT>(k);
+    char* valid = scratch.array<char>(k);
+
+    for (int y = output.y; y < output.y + output.height; ++y) {
+        PixelT* out = output.row(y);
+        int count = 0, centre = 0;
+        for (int wy = -half; wy <= half; ++wy) {
+            int ny = border_index(y + wy, height, border);
+            if (ny >= 0 || border == BORDER_CONSTANT) {
+                centre = wy == 0 ? count : centre;
+                rows[count++] = ny;
+            }
+        }
+
+        // Loads column x into its slot and computes its distances to the columns already in the ring
+        auto enter = [&](int x) {
+            int slot = (x + half) % k;
+            int nx = border_index(x, width, border);
+            valid[slot] = nx >= 0 || border == BORDER_CONSTANT;
+            if (!valid[slot]) {
+                return;
+            }
+            SumT* column = &columns[(size_t)slot * channels * k];
+            for (int c = 0; c < channels; ++c) {
+                for (int i = 0; i < count; ++i) {
+                    column[c * k + i] = rows[i] >= 0 && nx >= 0 ? (SumT)input.at(nx, rows[i], c) : (SumT)border_value;
+                }
+            }
+            for (int a = 0; a < k; ++a) {
+                if (!valid[a]) {
+                    continue;
+                }
+                const SumT* other = &columns[(size_t)a * channels * k];
+                SumT* to_slot = &cross[((size_t)a * k + slot) * k];
+                SumT* from_slot = &cross[((size_t)slot * k + a) * k];
+                bool self = a == slot;  // The column against itself only needs the "to" sums
+                if (!self) {
+                    std::fill(from_slot, from_slot + count, SumT(0));
+                }
+                for (int i = 0; i < count; ++i) {
+                    std::fill(distance, distance + count, SumT(0));
+                    for (int c = 0; c < channels; ++c) {
+                        SumT value = other[c * k + i];
+                        const SumT* entering = column + c * k;
+                        for (int j = 0; j < count; ++j) {
+                            SumT diff = value - entering[j];
+                            distance[j] += diff < 0 ? -diff : diff;
+                        }
+                    }
+                    SumT total = 0;
+                    for (int j = 0; j < count; ++j) {
+                        total += distance[j];
+                    }
+                    if (!self) {
+                        for (int j = 0; j < count; ++j) {
+                            from_slot[j] += distance[j];
+                        }
+                    }
+                    to_slot[i] = total;
+                }
+            }
+        };
+
+        std::fill(valid, valid + k, 0);
+        for (int x = x_begin - half; x <= x_begin + half; ++x) {
+            enter(x);
+        }
+        for (int x = x_begin; x < x_end; ++x) {
+            if (x > x_begin) {
+                valid[(x - 1) % k] = 0;
+                enter(x + half);
+            }
+            // Columns are visited from left to right, not in slot order, so the result does not depend on where the
+            // ring starts (a crop of an image gives the same pixels, float sums included). Ties keep the centre
+            // pixel, then the leftmost and topmost candidate
+            int best_slot = (x + half) % k, best_row = centre;
+            SumT best = 0;
+            for (int column = 0; column < k; ++column) {
+                int b = (x + column) % k;
+                best += valid[b] ? cross[((size_t)best_slot * k + b) * k + best_row] : SumT(0);
+            }
+            for (int column = 0; column < k; ++column) {
+                int a = (x + column) % k;  // Window columns from left to right
+                if (!valid[a]) {
+                    continue;
+                }
+                for (int i = 0; i < count; ++i) {
+                    SumT total = 0;
+                    for (int other = 0; other < k; ++other) {
+                        int b = (x + other) % k;
+                        total += valid[b] ? cross[((size_t)a * k + b) * k + i] : SumT(0);
+                    }
+                    if (total < best) {
+                        best = total;
+                        best_slot = a;
+                        best_row = i;
+                    }
+                }
+            }
+            for (int c = 0; c < channels; ++c) {
+                out[(x - x_begin) * channels + c] = (PixelT)columns[((size_t)best_slot * channels + c) * k + best_row];
+            }
+        }
+    }
+}
+
+namespace {
+
+// Histogram of 16-bit samples in two levels: 256 coarse bins (high byte) above 65536 fine bins,
+// so a rank query scans at most 256 + 256 bins
+struct Histogram16 {
+    int* coarse;
+    int* fine;
+    int count = 0;
+
+    explicit Histogram16(KernelScratch& scratch) : coarse(scratch.array<int>(256)), fine(scratch.array<int>(65536)) {}
+
+    void add(uint16_t value, int delta) {
+        coarse[value >> 8] += delta;
+        fine[value] += delta;
+        count += delta;
+    }
+
+    // Value of the sample with 0-based rank k
+    uint16_t select(int k) const {
+        int bin = 0;
+        while (k >= coarse[bin]) {
+            k -= coarse[bin++];
+        }
+        const int* bins = &fine[bin << 8];
+        int low = 0;
+        while (k >= bins[low]) {
+            k -= bins[low++];
+        }
+        return (uint16_t)((bin << 8) | low);
+    }
+};
+
+// Adds (delta = 1) or removes (delta = -1) the column cx of the window centred on row y
+void histogram_column(Histogram16& histogram, const PixelSource<uint16_t>& input, int channel, int half, int border,
+                      float border_value, int y, int cx, int delta) {
+    int nx = border_index(cx, input.width, border);
+    if (nx < 0 && border != BORDER_CONSTANT) {
+        return;
+    }
+    for (int wy = -half; wy <= half; ++wy) {
+        int ny = border_index(y + wy, input.height, border);
+        if (ny >= 0 && nx >= 0) {
+            histogram.add(input.at(nx, ny, channel), delta);
+        } else if (border == BORDER_CONSTANT) {
+            histogram.add((uint16_t)border_value, delta);
+        }
+    }
+}
+
+}  // namespace
+
+void median_histogram_u16(const PixelSource<uint16_t>& input, const PixelTarget<uint16_t>& output, int window_size,
+                          int border, float border_value) {
+    const int channels = input.channels;
+    const int x_begin = output.x, x_end = output.x + output.width;
+    int half = window_size / 2;
+    KernelScratch scratch;
+    Histogram16 histogram(scratch);
+
+    for (int y = output.y; y < output.y + output.height; ++y) {
+        uint16_t* out = output.row(y);
+        for (int c = 0; c < channels; ++c) {
+            // Slide the window along the row: one column leaves and one enters per pixel
+            for (int cx = x_begin - half; cx <= x_begin + half; ++cx) {
+                histogram_column(histogram, input, c, half, border, border_value, y, cx, 1);
+            }
+            for (int x = x_begin; x < x_end; ++x) {
+                out[(x - x_begin) * channels + c] = histogram.select(histogram.count / 2);
+                if (x + 1 < x_end) {
+                    histogram_column(histogram, input, c, half, border, border_value, y, x - half, -1);
+                    histogram_column(histogram, input, c, half, border, border_value, y, x + half + 1, 1);
+                }
+            }
+            // Empty the histogram for the next channel
+            for (int cx = x_end - 1 - half; cx <= x_end - 1 + half; ++cx) {
+                histogram_column(histogram, input, c, half, border, border_value, y, cx, -1);
+            }
+        }
+    }
+}
+
+// Explicit diffusion step of one sample from its four neighbour differences.
+// Same expression (and therefore same rounding) as the generic path
+template <typename PixelT>
+static inline PixelT ddf_update(PixelT value, float deltaN, float deltaS, float deltaE, float deltaW, float lambda) {
+    float cN = conductance(deltaN, lambda);
+    float cS = conductance(deltaS, lambda);
+    float cE = conductance(deltaE, lambda);
+    float cW = conductance(deltaW, lambda);
+    return (PixelT)(value + 0.25 * (cN * deltaN + cS * deltaS + cE * deltaE + cW * deltaW));
+}
+
+// Diffusion of one border pixel: a neighbour outside the image contributes no flux
+template <int Channels, typename PixelT>
+static inline void ddf_border_pixel(const PixelSource<PixelT>& input, PixelT* pixel, float lambda, int x, int y) {
+    const int width = input.width, height = input.height;
+    const PixelT* row = input.row(y);
+    const PixelT* up = y > 0 ? input.row(y - 1) : row;
+    const PixelT* down = y < height - 1 ? input.row(y + 1) : row;
+    for (int c = 0; c < Channels; ++c) {
+        int idx = x * Channels + c;
+        float deltaN = (y > 0) ? (float)(up[idx] - row[idx]) : 0.0f;
+        float deltaS = (y < height - 1) ? (float)(down[idx] - row[idx]) : 0.0f;
+        float deltaE = (x < width - 1) ? (float)(row[idx + Channels] - row[idx]) : 0.0f;
+        float deltaW = (x > 0) ? (float)(row[idx - Channels] - row[idx]) : 0.0f;
+        pixel[c] = ddf_update(row[idx], deltaN, deltaS, deltaE, deltaW, lambda);
+    }
+}
+
+template <int Channels, typename PixelT>
+void ddf_kernel(const PixelSource<PixelT>& input, const PixelTarget<PixelT>& output, float lambda) {
+    const int width = input.width, height = input.height;
+    const int x_begin = output.x, x_end = output.x + output.width;
+    for (int y = output.y; y < output.y + output.height; ++y) {
+        PixelT* out = output.row(y);
+
+        // The first and last rows, and the first and last column of every row, take the border path
+        bool interior_row = y > 0 && y < height - 1;
+        int interior_begin = interior_row ? std::min(1, width) : width;
+        int interior_end = interior_row ? std::max(width - 1, interior_begin) : width;
+        clip_interior(x_begin, x_end, &interior_begin, &interior_end);
+        for (int x = x_begin; x < interior_begin; ++x) {
+            ddf_border_pixel<Channels>(input, out + (size_t)(x - x_begin) * Channels, lambda, x, y);
+        }
+
+        // Interior pixels: all four neighbours are inside the image
+        const PixelT* row = input.row(y);
+        const PixelT* up = interior_row ? input.row(y - 1) : row;
+        const PixelT* down = interior_row ? input.row(y + 1) : row;
+        for (int x = interior_begin; x < interior_end; ++x) {
+            for (int c = 0; c < Channels; ++c) {
+                int idx = x * Channels + c;
+                float deltaN = up[idx] - row[idx];
+                float deltaS = down[idx] - row[idx];
+                float deltaE = row[idx + Channels] - row[idx];
+                float deltaW = row[idx - Channels] - row[idx];
+                out[(x - x_begin) * Channels + c] = ddf_update(row[idx], deltaN, deltaS, deltaE, deltaW, lambda);
+            }
+        }
+
+        for (int x = interior_end; x < x_end; ++x) {
+            ddf_border_pixel<Channels>(input, out + (size_t)(x - x_begin) * Channels, lambda, x, y);
+        }
+    }
+}
+
+// Checks the horizontal pairs touching the block on its rows, then the vertical pairs on its columns
+template <typename PixelT>
+static bool ddf_block_flat_kernel(const PixelSource<PixelT>& input, float threshold, int start_row, int end_row,
+                                  int start_col, int end_col) {
+    const int width = input.width, height = input.height, channels = input.channels;
+    int first_col = start_col > 0 ? start_col - 1 : start_col;
+    int last_col = end_col < width ? end_col : width - 1;
+    for (int y = start_row; y < end_row; ++y) {
+        const PixelT* row = input.row(y);
+        for (int i = first_col * channels; i < last_col * channels; ++i) {
+            if (std::fabs((float)row[i + channels] - (float)row[i]) >= threshold) {
+                return false;
+            }
+        }
+    }
+    int first_row = start_row > 0 ? start_row - 1 : start_row;
+    int last_row = end_row < height ? end_row : height - 1;
+    for (int y = first_row; y < last_row; ++y) {
+        const PixelT* row = input.row(y);
+        const PixelT* next = input.row(y + 1);
+        for (int i = start_col * channels; i < end_col * channels; ++i) {
+            if (std::fabs((float)next[i] - (float)row[i]) >= threshold) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// 3x3 convolution of one border pixel, whose neighbours outside the image follow the border policy
+template <typename PixelT, typename SumT>
+static inline SumT convolve3x3_border_sum(const PixelSource<PixelT>& input, const int *weights, int border,
+                                          float border_value, int x, int y, int c) {
+    SumT sum = 0;
+    for (int ky = -1; ky <= 1; ++ky) {
+        int ny = border_index(y + ky, input.height, border);
+        for (int kx = -1; kx <= 1; ++kx) {
+            int nx = border_index(x + kx, input.width, border);
+            if (ny >= 0 && nx >= 0) {
+                sum += (SumT)input.at(nx, ny, c) * weights[(ky + 1) * 3 + kx + 1];
+            } else if (border == BORDER_CONSTANT) {
+                sum += (SumT)border_value * weights[(ky + 1) * 3 + kx + 1];
+            }
+        }
+    }
+    return sum;
+}
+
+template <typename PixelT>
+void convolve3x3_kernel(const PixelSource<PixelT>& input, const PixelTarget<PixelT>& output, const int *weights,
+                        int border, float border_value) {
+    using SumT = typename std::conditional<std::is_floating_point<PixelT>::value, PixelT, int64_t>::type;
+    // Integer results saturate like the 8-bit path in DDF.c; float results are left unclamped
+    auto store = [](SumT sum) -> PixelT {
+        if (std::is_floating_point<PixelT>::value) {
+            return (PixelT)sum;
+        }
+        SumT max = (SumT)std::numeric_limits<PixelT>::max();
+        return (PixelT)(sum > max ? max : (sum < 0 ? 0 : sum));
+    };
+    const int width = input.width, height = input.height, channels = input.channels;
+    const int x_begin = output.x, x_end = output.x + output.width;
+
+    for (int y = output.y; y < output.y + output.height; ++y) {
+        PixelT* out = output.row(y);
+        bool interior_row = y >= 1 && y < height - 1;
+        int interior_begin = interior_row ? std::min(1, width) : width;
+        int interior_end = interior_row ? std::max(width - 1, interior_begin) : width;
+        clip_interior(x_begin, x_end, &interior_begin, &interior_end);
+
+        for (int x = x_begin; x < interior_begin; ++x) {
+            for (int c = 0; c < channels; ++c) {
+                out[(x - x_begin) * channels + c] =
+                    store(convolve3x3_border_sum<PixelT, SumT>(input, weights, border, border_value, x, y, c));
+            }
+        }
+
+        // Interior pixels: the whole kernel is inside the image
+        for (int x = interior_begin; x < interior_end; ++x) {
+            for (int c = 0; c < channels; ++c) {
+                SumT sum = 0;
+                for (int ky = 0; ky < 3; ++ky) {
+                    const PixelT* row = input.row(y + ky - 1) + (size_t)(x - 1) * channels + c;
+                    for (int kx = 0; kx < 3; ++kx) {
+                        sum += (SumT)row[kx * channels] * weights[ky * 3 + kx];
+                    }
+                }
+                out[(x - x_begin) * channels + c] = store(sum);
+            }
+        }
+
+        for (int x = interior_end; x < x_end; ++x) {
+            for (int c = 0; c < channels; ++c) {
+                out[(x - x_begin) * channels + c] =
+                    store(convolve3x3_border_sum<PixelT, SumT>(input, weights, border, border_value, x, y, c));
+            }
+        }
+    }
+}
+
+// 8-bit Laplacian as 9*x - box3x3. The vertical sums of the three rows are computed once per row into a
+// 16-bit buffer, and each box sum then adds three of them; 9*255 and the box sum both fit in int16, and
+// packus saturates the result to [0, 255] exactly like the generic path. Samples are indexed along the
+// input row; the output and the vertical sums start at their own first sample.
+void laplacian3x3_u8(const PixelSource<uint8_t>& input, const PixelTarget<uint8_t>& output, int border, float border_value) {
+    static const int weights[9] = {-1, -1, -1, -1, 8, -1, -1, -1, -1};
+    const int width = input.width, height = input.height, channels = input.channels;
+    const size_t row_samples = (size_t)width * channels;
+    const size_t begin = (size_t)output.x * channels, end = begin + (size_t)output.width * channels;
+    KernelScratch scratch;
+    int16_t* column_sums = scratch.array<int16_t>(end - begin + 2 * (size_t)channels);
+
+    auto border_sample = [&](size_t i, int y) {
+        return (uint8_t)std::min(std::max(convolve3x3_border_sum<uint8_t, int>(input, weights, border, border_value,
+                                                                               (int)(i / channels), y, (int)(i % channels)), 0), 255);
+    };
+
+    for (int y = output.y; y < output.y + output.height; ++y) {
+        uint8_t* out = output.row(y);
+        bool interior_row = y >= 1 && y < height - 1 && width >= 3;
+        size_t interior_begin = interior_row ? std::min(std::max(begin, (size_t)channels), end) : end;
+        size_t interior_end = interior_row ? std::max(std::min(end, row_samples - channels), interior_begin) : end;
+
+        for (size_t i = begin; i < interior_begin; ++i) {
+            out[i - begin] = border_sample(i, y);
+        }
+
+        if (interior_begin < interior_end) {
+            const uint8_t* up = input.row(y - 1);
+            const uint8_t* row = input.row(y);
+            const uint8_t* down = input.row(y + 1);
+            const size_t sums_begin = interior_begin - channels, sums_end = interior_end + channels;
+            size_t i = sums_begin;
+#ifdef __SSE2__
+            const __m128i zero = _mm_setzero_si128();
+            for (; i + 16 <= sums_end; i += 16) {
+                __m128i a = _mm_loadu_si128((const __m128i*)(up + i));
+                __m128i b = _mm_loadu_si128((const __m128i*)(row + i));
+                __m128i c = _mm_loadu_si128((const __m128i*)(down + i));
+                __m128i low = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)),
+                                            _mm_unpacklo_epi8(c, zero));
+                __m128i high = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero)),
+                                             _mm_unpackhi_epi8(c, zero));
+                _mm_storeu_si128((__m128i*)&column_sums[i - sums_begin], low);
+                _mm_storeu_si128((__m128i*)&column_sums[i - sums_begin + 8], high);
+            }
+#endif
+            for (; i < sums_end; ++i) {
+                column_sums[i - sums_begin] = (int16_t)(up[i] + row[i] + down[i]);
+            }
+
+            // column_sums[j], [j + channels] and [j + 2 * channels] are the vertical sums left of, at and right of
+            // sample interior_begin + j
+            i = interior_begin;
+#ifdef __SSE2__
+            for (; i + 16 <= interior_end; i += 16) {
+                __m128i centre = _mm_loadu_si128((const __m128i*)(row + i));
+                __m128i results[2];
+                for (int half = 0; half < 2; ++half) {
+                    size_t j = i - interior_begin + 8 * half;
+                    __m128i box = _mm_adds_epi16(_mm_loadu_si128((const __m128i*)&column_sums[j]),
+                                                 _mm_loadu_si128((const __m128i*)&column_sums[j + channels]));
+                    box = _mm_adds_epi16(box, _mm_loadu_si128((const __m128i*)&column_sums[j + 2 * channels]));
+                    __m128i x = half == 0 ? _mm_unpacklo_epi8(centre, zero) : _mm_unpackhi_epi8(centre, zero);
+                    __m128i nine_x = _mm_adds_epi16(_mm_slli_epi16(x, 3), x);
+                    results[half] = _mm_subs_epi16(nine_x, box);
+                }
+                _mm_storeu_si128((__m128i*)(out + (i - begin)), _mm_packus_epi16(results[0], results[1]));
+            }
+#endif
+            for (; i < interior_end; ++i) {
+                size_t j = i - interior_begin;
+                int box = column_sums[j] + column_sums[j + channels] + column_sums[j + 2 * channels];
+                out[i - begin] = (uint8_t)std::min(std::max(9 * row[i] - box, 0), 255);
+            }
+        }
+
+        for (size_t i = interior_end; i < end; ++i) {
+            out[i - begin] = border_sample(i, y);
+        }
+    }
+}
+
+// Rank-1 factorisation of a kernel: weights[i][j] == column[i] * row[j] up to float rounding. The pivot is the
+// largest weight, so the row is divided by the best-conditioned value
+static bool separate_kernel(const float* weights, int kernel_width, int kernel_height, float* column, float* row) {
+    int pivot = 0;
+    for (int i = 1; i < kernel_width * kernel_height; ++i) {
+        pivot = std::fabs(weights[i]) > std::fabs(weights[pivot]) ? i : pivot;
+    }
+    float pivot_value = weights[pivot];
+    if (pivot_value == 0.0f) {
+        return false;
+    }
+    int pivot_row = pivot / kernel_width, pivot_column = pivot % kernel_width;
+    float tolerance = 1e-5f * std::fabs(pivot_value);
+    for (int i = 0; i < kernel_height; ++i) {
+        for (int j = 0; j < kernel_width; ++j) {
+            float factor = weights[i * kernel_width + pivot_column] * (weights[pivot_row * kernel_width + j] / pivot_value);
+            if (std::fabs(weights[i * kernel_width + j] - factor) > tolerance) {
+                return false;
+            }
+        }
+    }
+    for (int i = 0; column && i < kernel_height; ++i) {
+        column[i] = weights[i * kernel_width + pivot_column];
+    }
+    for (int j = 0; row && j < kernel_width; ++j) {
+        row[j] = weights[pivot_row * kernel_width + j] / pivot_value;
+    }
+    return true;
+}
+
+// Arbitrary kernel_width x kernel_height convolution with float weights. Source rows are converted once into a
+// ring of kernel_height float rows padded horizontally by the border policy (shrink and constant read 0 and
+// border_value outside the image), so every output row reads each input row from the ring. Separable kernels
+// run as a horizontal pass per input row, also kept in a ring, and a vertical pass per output row. The others
+// accumulate column tiles of the output row tap by tap, so the accumulators stay in L1 while the inner loop
+// streams through the padded rows.
+template <typename PixelT>
+static void convolve_kernel(const PixelSource<PixelT>& input, const PixelTarget<PixelT>& output, const float* weights,
+                            int kernel_width, int kernel_height, int border, float border_value) {
+    constexpr size_t tile = 512;
+    const int width = input.width, height = input.height, channels = input.channels;
+    const int half_x = kernel_width / 2, half_y = kernel_height / 2;
+    const size_t row_samples = (size_t)output.width * channels;
+    const size_t padded_samples = (size_t)(output.width + 2 * half_x) * channels;
+    const float outside = border == BORDER_CONSTANT ? (float)border_value : 0.0f;
+
+    KernelScratch scratch;
+    float* column = scratch.array<float>(kernel_height);
+    float* row = scratch.array<float>(kernel_width);
+    bool separable = separate_kernel(weights, kernel_width, kernel_height, column, row);
+    float* padded = scratch.array<float>(separable ? padded_samples : padded_samples * kernel_height);
+    float* horizontal = scratch.array<float>(separable ? row_samples * kernel_height : 0);
+    float* accumulator = scratch.array<float>(tile);
+
+    auto store = [](float sum) -> PixelT {
+        if (std::is_floating_point<PixelT>::value) {
+            return (PixelT)sum;
+        }
+        float max = (float)std::numeric_limits<PixelT>::max();
+        sum += 0.5f;
+        return (PixelT)(sum > max ? max : (sum < 0.0f ? 0.0f : sum));
+    };
+    auto slot = [&](int v) { return (size_t)((v - (output.y - half_y)) % kernel_height); };
+
+    // Loads the columns of image row v under the output window (border policy applied) into a padded float row
+    auto load_row = [&](int v, float* dst) {
+        int ny = border_index(v, height, border);
+        const PixelT* src = ny >= 0 ? input.row(ny) : nullptr;
+        for (int px = output.x - half_x; px < output.x + output.width + half_x; ++px) {
+            int nx = border_index(px, width, border);
+            float* sample = dst + (size_t)(px - output.x + half_x) * channels;
+            for (int c = 0; c < channels; ++c) {
+                sample[c] = ny >= 0 && nx >= 0 ? (float)src[(size_t)nx * channels + c] : outside;
+            }
+        }
+    };
+    auto enter_row = [&](int v) {
+        if (!separable) {
+            load_row(v, &padded[slot(v) * padded_samples]);
+            return;
+        }
+        load_row(v, padded);
+        float* dst = &horizontal[slot(v) * row_samples];
+        std::fill(dst, dst + row_samples, 0.0f);
+        for (int kx = 0; kx < kernel_width; ++kx) {
+            const float* src = padded + (size_t)kx * channels;
+            float w = row[kx];
+            for (size_t i = 0; i < row_samples; ++i) {
+                dst[i] += w * src[i];
+            }
+        }
+    };
+
+    for (int y = output.y; y < output.y + output.height; ++y) {
+        for (int v = (y == output.y ? y - half_y : y + half_y); v <= y + half_y; ++v) {
+            enter_row(v);
+        }
+        PixelT* out = output.row(y);
+
+        for (size_t begin = 0; begin < row_samples; begin += tile) {
+            size_t count = std::min(tile, row_samples - begin);
+            float* acc = accumulator;
+            std::fill(acc, acc + count, 0.0f);
+            for (int ky = 0; ky < kernel_height; ++ky) {
+                if (separable) {
+                    const float* src = &horizontal[slot(y - half_y + ky) * row_samples + begin];
+                    float w = column[ky];
+                    for (size_t i = 0; i < count; ++i) {
+                        acc[i] += w * src[i];
+                    }
+                    continue;
+                }
+                const float* src_row = &padded[slot(y - half_y + ky) * padded_samples + begin];
+                for (int kx = 0; kx < kernel_width; ++kx) {
+                    float w = weights[ky * kernel_width + kx];
+                    if (w == 0.0f) {
+                        continue;
+                    }
+                    const float* src = src_row + (size_t)kx * channels;
+                    for (size_t i = 0; i < count; ++i) {
+                        acc[i] += w * src[i];
+                    }
+                }
+            }
+            for (size_t i = 0; i < count; ++i) {
+                out[begin + i] = store(acc[i]);
+            }
+        }
+    }
+}
+
+// Explicit instantiations for the common shapes: 3/5/7 windows x 1/3/4 channels x u8/u16/f32
+#define INSTANTIATE_MEDIAN(W, C) \
+    template void median_kernel<W, C, uint8_t>(const PixelSource<uint8_t>&, const PixelTarget<uint8_t>&, int, float); \
+    template void median_kernel<W, C, uint16_t>(const PixelSource<uint16_t>&, const PixelTarget<uint16_t>&, int, float); \
+    template void median_kernel<W, C, float>(const PixelSource<float>&, const PixelTarget<float>&, int, float);
+
+INSTANTIATE_MEDIAN(3, 1)
+INSTANTIATE_MEDIAN(3, 3)
+INSTANTIATE_MEDIAN(3, 4)
+INSTANTIATE_MEDIAN(5, 1)
+INSTANTIATE_MEDIAN(5, 3)
+INSTANTIATE_MEDIAN(5, 4)
+INSTANTIATE_MEDIAN(7, 1)
+INSTANTIATE_MEDIAN(7, 3)
+INSTANTIATE_MEDIAN(7, 4)
+
+#define INSTANTIATE_DDF(C) \
+    template void ddf_kernel<C, uint8_t>(const PixelSource<uint8_t>&, const PixelTarget<uint8_t>&, float); \
+    template void ddf_kernel<C, uint16_t>(const PixelSource<uint16_t>&, const PixelTarget<uint16_t>&, float); \
+    template void ddf_kernel<C, float>(const PixelSource<float>&, const PixelTarget<float>&, float);
+
+INSTANTIATE_DDF(1)
+INSTANTIATE_DDF(2)
+INSTANTIATE_DDF(3)
+INSTANTIATE_DDF(4)
+
+template void convolve3x3_kernel<uint16_t>(const PixelSource<uint16_t>&, const PixelTarget<uint16_t>&, const int*, int, float);
+template void convolve3x3_kernel<float>(const PixelSource<float>&, const PixelTarget<float>&, const int*, int, float);
+
+// Typed access to an input view; the stride becomes a sample count
+template <typename PixelT>
+static PixelSource<PixelT> source_of(const ImageView* view) {
+    PixelSource<PixelT> source = {static_cast<const PixelT*>(view->data), view->stride / sizeof(PixelT), view->width,
+                                  view->height, view->channels};
+    return source;
+}
+
+// Output window of a kernel: `view` receives the input pixels from (x, y) on
+template <typename PixelT>
+static PixelTarget<PixelT> target_of(const ImageView* view, int x, int y) {
+    PixelTarget<PixelT> target = {static_cast<PixelT*>(view->data), view->stride / sizeof(PixelT), x, y, view->width,
+                                  view->height};
+    return target;
+}
+
+// Picks the median specialisation for a runtime shape
+template <typename PixelT>
+static bool dispatch_median(const ImageView* input, const ImageView* output, int x, int y, int window_size, int border,
+                            float border_value) {
+    PixelSource<PixelT> in = source_of<PixelT>(input);
+    PixelTarget<PixelT> out = target_of<PixelT>(output, x, y);
+
+#define MEDIAN_CASE(W, C) \
+    if (window_size == W && input->channels == C) { \
+        median_kernel<W, C, PixelT>(in, out, border, border_value); \
+        return true; \
+    }
+    MEDIAN_CASE(3, 1) MEDIAN_CASE(3, 3) MEDIAN_CASE(3, 4)
+    MEDIAN_CASE(5, 1) MEDIAN_CASE(5, 3) MEDIAN_CASE(5, 4)
+    MEDIAN_CASE(7, 1) MEDIAN_CASE(7, 3) MEDIAN_CASE(7, 4)
+#undef MEDIAN_CASE
+    return false;
+}
+
+// Picks the diffusion specialisation for a runtime channel count
+template <typename PixelT>
+static bool dispatch_ddf(const ImageView* input, const ImageView* output, int x, int y, float lambda) {
+    PixelSource<PixelT> in = source_of<PixelT>(input);
+    PixelTarget<PixelT> out = target_of<PixelT>(output, x, y);
+
+    switch (input->channels) {
+        case 1: ddf_kernel<1, PixelT>(in, out, lambda); return true;
+        case 2: ddf_kernel<2, PixelT>(in, out, lambda); return true;
+        case 3: ddf_kernel<3, PixelT>(in, out, lambda); return true;
+        case 4: ddf_kernel<4, PixelT>(in, out, lambda); return true;
+        default: return false;
+    }
+}
+
+// Packed views of the row-based entry points: the whole input, and the output rows from start_row on
+static ImageView input_view(const void* input, int width, int height, int channels, int pixel_type) {
+    return image_view(const_cast<void*>(input), width, height, channels, pixel_type);
+}
+
+static ImageView output_view(void* output, int width, int channels, int pixel_type, int start_row, int end_row) {
+    return image_view(output, width, std::max(end_row - start_row, 0), channels, pixel_type);
+}
+
+extern "C" int median_filter_view(const ImageView* input, const ImageView* output, int x, int y, int window_size,
+                                  int border, float border_value) {
+    switch (input->pixel_type) {
+        case PIXEL_U8:
+            return dispatch_median<uint8_t>(input, output, x, y, window_size, border, border_value);
+        case PIXEL_U16:
+            if (!dispatch_median<uint16_t>(input, output, x, y, window_size, border, border_value)) {
+                median_histogram_u16(source_of<uint16_t>(input), target_of<uint16_t>(output, x, y), window_size, border,
+                                     border_value);
+            }
+            return 1;
+        case PIXEL_F32:
+            if (!dispatch_median<float>(input, output, x, y, window_size, border, border_value)) {
+                median_runtime<float>(source_of<float>(input), target_of<float>(output, x, y), window_size, border,
+                                      border_value);
+            }
+            return 1;
+        default: return 0;
+    }
+}
+
+extern "C" int median_filter_rows(const void* input, void* output, int width, int height, int channels, int window_size,
+                                  int pixel_type, int border, float border_value, int start_row, int end_row) {
+    ImageView in = input_view(input, width, height, channels, pixel_type);
+    ImageView out = output_view(output, width, channels, pixel_type, start_row, end_row);
+    return median_filter_view(&in, &out, 0, start_row, window_size, border, border_value);
+}
+
+extern "C" int ddf_filter_view(const ImageView* input, const ImageView* output, int x, int y, float lambda) {
+    switch (input->pixel_type) {
+        case PIXEL_U8: return dispatch_ddf<uint8_t>(input, output, x, y, lambda);
+        case PIXEL_U16: return dispatch_ddf<uint16_t>(input, output, x, y, lambda);
+        case PIXEL_F32: return dispatch_ddf<float>(input, output, x, y, lambda);
+        default: return 0;
+    }
+}
+
+extern "C" int ddf_filter_rows(const void* input, void* output, int width, int height, int channels, float lambda,
+                               int pixel_type, int start_row, int end_row) {
+    return ddf_filter_block(input, output, width, height, channels, lambda, pixel_type, start_row, end_row, 0, width);
+}
+
+extern "C" int ddf_filter_block(const void* input, void* output, int width, int height, int channels, float lambda,
+                                int pixel_type, int start_row, int end_row, int start_col, int end_col) {
+    ImageView in = input_view(input, width, height, channels, pixel_type);
+    ImageView rows = output_view(output, width, channels, pixel_type, start_row, end_row);
+    ImageView out = image_view_crop(&rows, start_col, 0, std::max(end_col - start_col, 0), rows.height);
+    return ddf_filter_view(&in, &out, start_col, start_row, lambda);
+}
+
+extern "C" int ddf_view_flat(const ImageView* input, float threshold, int x, int y, int width, int height) {
+    switch (input->pixel_type) {
+        case PIXEL_U16:
+            return ddf_block_flat_kernel(source_of<uint16_t>(input), threshold, y, y + height, x, x + width);
+        case PIXEL_F32:
+            return ddf_block_flat_kernel(source_of<float>(input), threshold, y, y + height, x, x + width);
+        default:
+            return ddf_block_flat_kernel(source_of<uint8_t>(input), threshold, y, y + height, x, x + width);
+    }
+}
+
+extern "C" int ddf_block_flat(const void* input, int width, int height, int channels, int pixel_type, float threshold,
+                              int start_row, int end_row, int start_col, int end_col) {
+    ImageView in = input_view(input, width, height, channels, pixel_type);
+    return ddf_view_flat(&in, threshold, start_col, start_row, end_col - start_col, end_row - start_row);
+}
+
+extern "C" int convolve3x3_view(const ImageView* input, const ImageView* output, int x, int y, const int* weights,
+                                int border, float border_value) {
+    switch (input->pixel_type) {
+        case PIXEL_U16:
+            convolve3x3_kernel<uint16_t>(source_of<uint16_t>(input), target_of<uint16_t>(output, x, y), weights, border,
+                                         border_value);
+            return 1;
+        case PIXEL_F32:
+            convolve3x3_kernel<float>(source_of<float>(input), target_of<float>(output, x, y), weights, border,
+                                      border_value);
+            return 1;
+        default: {
+            static const int laplacian[9] = {-1, -1, -1, -1, 8, -1, -1, -1, -1};
+            if (!std::equal(laplacian, laplacian + 9, weights)) {
+                return 0;
+            }
+            laplacian3x3_u8(source_of<uint8_t>(input), target_of<uint8_t>(output, x, y), border, border_value);
+            return 1;
+        }
+    }
+}
+
+extern "C" int convolve3x3_rows(const void* input, void* output, int width, int height, int channels, const int *weights,
+                                int pixel_type, int border, float border_value, int start_row, int end_row) {
+    ImageView in = input_view(input, width, height, channels, pixel_type);
+    ImageView out = output_view(output, width, channels, pixel_type, start_row, end_row);
+    return convolve3x3_view(&in, &out, 0, start_row, weights, border, border_value);
+}
+
+extern "C" size_t switching_median_view(const ImageView* input, const ImageView* output, int x, int y, int window_size,
+                                        int border, float border_value, float impulse_threshold) {
+    switch (input->pixel_type) {
+        case PIXEL_U16:
+            return switching_median<uint16_t>(source_of<uint16_t>(input), target_of<uint16_t>(output, x, y), window_size,
+                                              border, border_value, impulse_threshold);
+        case PIXEL_F32:
+            return switching_median<float>(source_of<float>(input), target_of<float>(output, x, y), window_size,
+                                           border, border_value, impulse_threshold);
+        default:
+            return switching_median<uint8_t>(source_of<uint8_t>(input), target_of<uint8_t>(output, x, y), window_size,
+                                             border, border_value, impulse_threshold);
+    }
+}
+
+extern "C" size_t switching_median_rows(const void* input, void* output, int width, int height, int channels, int window_size,
+                                        int pixel_type, int border, float border_value, float impulse_threshold,
+                                        int start_row, int end_row) {
+    ImageView in = input_view(input, width, height, channels, pixel_type);
+    ImageView out = output_view(output, width, channels, pixel_type, start_row, end_row);
+    return switching_median_view(&in, &out, 0, start_row, window_size, border, border_value, impulse_threshold);
+}
+
+extern "C" void adaptive_median_view(const ImageView* input, const ImageView* output, int x, int y, int max_window,
+                                     int border, float border_value, size_t* window_counts) {
+    switch (input->pixel_type) {
+        case PIXEL_U16:
+            adaptive_median<uint16_t>(source_of<uint16_t>(input), target_of<uint16_t>(output, x, y), max_window, border,
+                                      border_value, window_counts);
+            break;
+        case PIXEL_F32:
+            adaptive_median<float>(source_of<float>(input), target_of<float>(output, x, y), max_window, border,
+                                   border_value, window_counts);
+            break;
+        default:
+            adaptive_median<uint8_t>(source_of<uint8_t>(input), target_of<uint8_t>(output, x, y), max_window, border,
+                                     border_value, window_counts);
+            break;
+    }
+}
+
+extern "C" void adaptive_median_rows(const void* input, void* output, int width, int height, int channels, int max_window,
+                                     int pixel_type, int border, float border_value, int start_row, int end_row,
+                                     size_t* window_counts) {
+    ImageView in = input_view(input, width, height, channels, pixel_type);
+    ImageView out = output_view(output, width, channels, pixel_type, start_row, end_row);
+    adaptive_median_view(&in, &out, 0, start_row, max_window, border, border_value, window_counts);
+}
+
+extern "C" void vector_median_view(const ImageView* input, const ImageView* output, int x, int y, int window_size,
+                                   int border, float border_value) {
+    switch (input->pixel_type) {
+        case PIXEL_U16:
+            vector_median<uint16_t>(source_of<uint16_t>(input), target_of<uint16_t>(output, x, y), window_size, border,
+                                    border_value);
+            break;
+        case PIXEL_F32:
+            vector_median<float>(source_of<float>(input), target_of<float>(output, x, y), window_size, border,
+                                 border_value);
+            break;
+        default:
+            vector_median<uint8_t>(source_of<uint8_t>(input), target_of<uint8_t>(output, x, y), window_size, border,
+                                   border_value);
+            break;
+    }
+}
+
+extern "C" void vector_median_rows(const void* input, void* output, int width, int height, int channels, int window_size,
+                                   int pixel_type, int border, float border_value, int start_row, int end_row) {
+    ImageView in = input_view(input, width, height, channels, pixel_type);
+    ImageView out = output_view(output, width, channels, pixel_type, start_row, end_row);
+    vector_median_view(&in, &out, 0, start_row, window_size, border, border_value);
+}
+
+extern "C" int separable_kernel(const float* weights, int kernel_width, int kernel_height, float* column, float* row) {
+    return separate_kernel(weights, kernel_width, kernel_height, column, row);
+}
+
+extern "C" void convolve_view(const ImageView* input, const ImageView* output, int x, int y, const float* weights,
+                              int kernel_width, int kernel_height, int border, float border_value) {
+    switch (input->pixel_type) {
+        case PIXEL_U16:
+            convolve_kernel<uint16_t>(source_of<uint16_t>(input), target_of<uint16_t>(output, x, y), weights,
+                                      kernel_width, kernel_height, border, border_value);
+            break;
+        case PIXEL_F32:
+            convolve_kernel<float>(source_of<float>(input), target_of<float>(output, x, y), weights, kernel_width,
+                                   kernel_height, border, border_value);
+            break;
+        default:
+            convolve_kernel<uint8_t>(source_of<uint8_t>(input), target_of<uint8_t>(output, x, y), weights,
+                                     kernel_width, kernel_height, border, border_value);
+            break;
+    }
+}
+
+extern "C" void convolve_rows(const void* input, void* output, int width, int height, int channels, const float* weights,
+                              int kernel_width, int kernel_height, int pixel_type, int border, float border_value,
+                              int start_row, int end_row) {
+    ImageView in = input_view(input, width, height, channels, pixel_type);
+    ImageView out = output_view(output, width, channels, pixel_type, start_row, end_row);
+    convolve_view(&in, &out, 0, start_row, weights, kernel_width, kernel_height, border, border_value);
+}
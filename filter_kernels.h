@@ -0,0 +1,222 @@
+#ifndef FILTER_KERNELS_H
+#define FILTER_KERNELS_H
+
+/*
+Kernels specialised at compile time over window size, channel count and pixel type.
+
+g++ -O3 -c filter_kernels.cpp
+gcc -o MMF MMF-thread.c filter_kernels.o -lpthread -lm -lstdc++
+
+The C entry points return 1 when a specialisation handled the rows and 0 when the
+shape is not instantiated, in which case the caller runs its generic path. The
+u16 and f32 pixel types are always handled (the callers' generic paths are 8-bit only):
+median windows without a specialisation use a two-level histogram for u16 and a
+runtime-sized window for f32.
+Rows [start_row, end_row) of an image with `height` rows are filtered and written
+to `output`, which points at the first output row (start_row). The *_view entry points
+take strided views instead (see image_view.h), so the input and the output may be
+crops, bands of rows or cv::Mat data. The kernels' working memory comes from a scratch
+arena (see scratch_arena.h and filter_kernels_bind_arena). A constant border value is
+a sample of the pixel type; border_sample converts the 8-bit value of --border.
+*/
+
+// Border policies for the pixels whose window leaves the image
+#define BORDER_SHRINK 0     // Only the neighbours inside the image take part (the window shrinks)
+#define BORDER_REPLICATE 1  // Edge pixel repeated: aaa|abcd|ddd
+#define BORDER_REFLECT 2    // Mirrored including the edge pixel: cba|abcd|dcb
+#define BORDER_CONSTANT 3   // Fixed value outside the image
+
+#ifdef __cplusplus
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#else
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#endif
+#include "image_view.h"
+#include "scratch_arena.h"
+
+// Maps a coordinate to the pixel that replaces it along an axis of length n,
+// or -1 when the neighbour is skipped (shrink) or takes the constant value
+static inline int border_index(int i, int n, int border) {
+    if (i >= 0 && i < n) {
+        return i;
+    }
+    switch (border) {
+        case BORDER_REPLICATE:
+            return i < 0 ? 0 : n - 1;
+        case BORDER_REFLECT:
+            while (i < 0 || i >= n) {
+                i = i < 0 ? -i - 1 : 2 * n - i - 1;
+            }
+            return i;
+        default:
+            return -1;
+    }
+}
+
+// Parses "shrink", "replicate", "reflect" or "constant[:value]"; returns 0 for unknown names
+static inline int parse_border(const char *name, int *border, int *border_value) {
+    *border_value = 0;
+    if (strcmp(name, "shrink") == 0) {
+        *border = BORDER_SHRINK;
+    } else if (strcmp(name, "replicate") == 0) {
+        *border = BORDER_REPLICATE;
+    } else if (strcmp(name, "reflect") == 0) {
+        *border = BORDER_REFLECT;
+    } else if (strncmp(name, "constant", 8) == 0 && (name[8] == '\0' || name[8] == ':')) {
+        *border = BORDER_CONSTANT;
+        *border_value = name[8] == ':' ? atoi(name + 9) : 0;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// Sample of the given pixel type for a constant border value in 8-bit units (clamped to 0-255), as the kernels
+// take it: the same level for u8, scaled by 257 for u16 and to [0, 1] for f32
+static inline float border_sample(int border_value, int pixel_type) {
+    float value = border_value < 0 ? 0.0f : border_value > 255 ? 255.0f : (float)border_value;
+    return pixel_type == PIXEL_U16 ? value * 257.0f : pixel_type == PIXEL_F32 ? value / 255.0f : value;
+}
+
+#ifdef __cplusplus
+
+// Samples of an input image; the stride counts samples, not bytes
+template <typename PixelT>
+struct PixelSource {
+    const PixelT* data;
+    size_t stride;
+    int width, height, channels;
+
+    const PixelT* row(int y) const { return data + (size_t)y * stride; }
+    PixelT at(int x, int y, int c) const { return row(y)[(size_t)x * channels + c]; }
+};
+
+// Output of a kernel: the pixels [x, x + width) x [y, y + height) of the input, stored from `data` on
+template <typename PixelT>
+struct PixelTarget {
+    PixelT* data;
+    size_t stride;
+    int x, y, width, height;
+
+    PixelT* row(int v) const { return data + (size_t)(v - y) * stride; }
+};
+
+// Median of a Window x Window neighbourhood per channel; border pixels follow the border policy
+template <int Window, int Channels, typename PixelT>
+void median_kernel(const PixelSource<PixelT>& input, const PixelTarget<PixelT>& output, int border, float border_value);
+
+// Median of a runtime window_size x window_size neighbourhood using a sliding two-level histogram (u16 only)
+void median_histogram_u16(const PixelSource<uint16_t>& input, const PixelTarget<uint16_t>& output, int window_size,
+                          int border, float border_value);
+
+// One explicit iteration of the four-neighbour diffusion used by DDF-thread.c
+template <int Channels, typename PixelT>
+void ddf_kernel(const PixelSource<PixelT>& input, const PixelTarget<PixelT>& output, float lambda);
+
+// 3x3 integer-weighted convolution used by DDF.c, saturated to the range of integer pixel types
+template <typename PixelT>
+void convolve3x3_kernel(const PixelSource<PixelT>& input, const PixelTarget<PixelT>& output, const int *weights,
+                        int border, float border_value);
+
+// 8-bit Laplacian {-1,-1,-1; -1,8,-1; -1,-1,-1} computed as 9*x - box3x3, with SSE2 on the interior rows
+void laplacian3x3_u8(const PixelSource<uint8_t>& input, const PixelTarget<uint8_t>& output, int border, float border_value);
+
+extern "C" {
+#endif
+
+// Arena the kernels called from this thread take their scratch memory from; they release it before returning.
+// NULL (the default) uses an arena private to the thread, so a thread that keeps calling the kernels only
+// allocates while its scratch grows
+void filter_kernels_bind_arena(ScratchArena *arena);
+
+int median_filter_rows(const void *input, void *output, int width, int height, int channels, int window_size,
+                       int pixel_type, int border, float border_value, int start_row, int end_row);
+
+int ddf_filter_rows(const void *input, void *output, int width, int height, int channels, float lambda,
+                    int pixel_type, int start_row, int end_row);
+
+// ddf_filter_rows restricted to the columns [start_col, end_col); output rows are still width pixels long
+int ddf_filter_block(const void *input, void *output, int width, int height, int channels, float lambda,
+                     int pixel_type, int start_row, int end_row, int start_col, int end_col);
+
+// Whether every four-neighbour difference of a block, including those with the pixels just outside it, is below
+// `threshold`. A diffusion step then changes no sample of the block by `threshold` or more (nothing at all when
+// the samples are integers and threshold <= 1).
+int ddf_block_flat(const void *input, int width, int height, int channels, int pixel_type, float threshold,
+                   int start_row, int end_row, int start_col, int end_col);
+
+// Switching median: only the samples flagged by an impulse detector are replaced by their median, the rest are
+// copied. A negative `impulse_threshold` flags extremes of the pixel range (0 and 255 for u8, 0 and 1 for f32)
+// outside flat areas; otherwise a sample is flagged when it lies more than the threshold outside the range of
+// its eight neighbours.
+// Handles every pixel type and returns the number of samples filtered.
+size_t switching_median_rows(const void *input, void *output, int width, int height, int channels, int window_size,
+                             int pixel_type, int border, float border_value, float impulse_threshold,
+                             int start_row, int end_row);
+
+// Vector median: every output pixel is the pixel of its window (all channels together) with the smallest summed
+// L1 distance to the others, so no new colours appear. Handles every pixel type.
+void vector_median_rows(const void *input, void *output, int width, int height, int channels, int window_size,
+                        int pixel_type, int border, float border_value, int start_row, int end_row);
+
+// Adaptive median: each sample starts with a 3x3 window that grows while its median is an impulse, up to
+// max_window. window_counts[k] is incremented for every sample that stopped at window 2k+3, so it needs
+// max_window / 2 entries. Handles every pixel type.
+void adaptive_median_rows(const void *input, void *output, int width, int height, int channels, int max_window,
+                          int pixel_type, int border, float border_value, int start_row, int end_row,
+                          size_t *window_counts);
+
+// `weights` holds the 3x3 kernel in row-major order. Handles u16 and f32, and u8 when the weights are the
+// Laplacian (fast path); returns 0 for other 8-bit kernels, which run the caller's generic path
+int convolve3x3_rows(const void *input, void *output, int width, int height, int channels, const int *weights,
+                     int pixel_type, int border, float border_value, int start_row, int end_row);
+
+// Returns 1 when the kernel is rank 1 (weights[i][j] == column[i] * row[j]) and fills column and row
+// (either may be NULL)
+int separable_kernel(const float *weights, int kernel_width, int kernel_height, float *column, float *row);
+
+// Convolution with an arbitrary kernel_width x kernel_height kernel (odd sizes, row-major float weights).
+// Separable kernels run as two 1D passes. Integer results are rounded and saturated; handles every pixel type.
+// Rows up to kernel_height / 2 above start_row and below end_row are read from `input` when inside the image
+void convolve_rows(const void *input, void *output, int width, int height, int channels, const float *weights,
+                   int kernel_width, int kernel_height, int pixel_type, int border, float border_value,
+                   int start_row, int end_row);
+
+// Views. `output` receives the pixels [x, x + output->width) x [y, y + output->height) of `input`, with the same
+// channels and pixel type; the border policy applies at the edges of `input`, and the pixels around the window
+// are read from `input` wherever it has them. The row functions above are these with packed views, x = 0 and
+// y = start_row. Only an output view may be written, and it must not overlap the input.
+
+int median_filter_view(const ImageView *input, const ImageView *output, int x, int y, int window_size, int border,
+                       float border_value);
+
+int ddf_filter_view(const ImageView *input, const ImageView *output, int x, int y, float lambda);
+
+// ddf_block_flat for the block [x, x + width) x [y, y + height) of a view
+int ddf_view_flat(const ImageView *input, float threshold, int x, int y, int width, int height);
+
+size_t switching_median_view(const ImageView *input, const ImageView *output, int x, int y, int window_size,
+                             int border, float border_value, float impulse_threshold);
+
+void vector_median_view(const ImageView *input, const ImageView *output, int x, int y, int window_size, int border,
+                        float border_value);
+
+void adaptive_median_view(const ImageView *input, const ImageView *output, int x, int y, int max_window, int border,
+                          float border_value, size_t *window_counts);
+
+int convolve3x3_view(const ImageView *input, const ImageView *output, int x, int y, const int *weights, int border,
+                     float border_value);
+
+void convolve_view(const ImageView *input, const ImageView *output, int x, int y, const float *weights,
+                   int kernel_width, int kernel_height, int border, float border_value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef IMAGE_ALLOC_H
+#define IMAGE_ALLOC_H
+
+/*
+Allocation of image buffers: every pixel buffer of the C drivers, including the ones
+stb_image decodes into, comes from image_alloc().
+
+Include it before stb_image.h, with the implementation in exactly one file of each program:
+
+#define IMAGE_ALLOC_IMPLEMENTATION
+#include "image_alloc.h"
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+Buffers start on an IMAGE_ALIGN boundary, so the first row of an image is aligned for
+any vector load. The images the drivers allocate themselves (outputs, crops, sections,
+levels) come from image_alloc_view(), whose rows are padded to image_row_stride() bytes:
+every row starts on an IMAGE_ALIGN boundary, so a kernel walking a view never splits a
+row's first cache line with the row before it. stb_image decodes packed rows;
+load_image_view() (image_io.h) moves them into a padded view. With image_alloc_huge_pages(1), buffers of IMAGE_HUGE_PAGE bytes or
+more are aligned to and padded to whole 2 MB pages and marked MADV_HUGEPAGE, so a
+100 MP image takes about 150 TLB entries instead of 75000. The pages are still backed
+lazily and placed by first touch (see numa_topology.h).
+
+Every buffer is an ordinary malloc block (posix_memalign): image_free() and free() are
+interchangeable, so images from load_image() may be released either way.
+*/
+
+#include <stddef.h>
+
+#include "image_view.h"
+
+#define IMAGE_ALIGN 64                   // Alignment of every buffer
+#define IMAGE_HUGE_PAGE ((size_t)2 << 20)  // Huge page size, and smallest buffer backed by huge pages
+
+// Enables (1) or disables (0) huge pages for the large buffers allocated from now on
+void image_alloc_huge_pages(int enable);
+
+// Allocates size bytes aligned to IMAGE_ALIGN (and to IMAGE_HUGE_PAGE for large buffers with huge pages on);
+// returns NULL when out of memory
+void *image_alloc(size_t size);
+
+// Same as image_alloc, with the bytes set to zero
+void *image_calloc(size_t count, size_t size);
+
+// Resizes a buffer from image_alloc, keeping its first min(old_size, new_size) bytes
+void *image_realloc(void *ptr, size_t old_size, size_t new_size);
+
+void image_free(void *ptr);
+
+// Bytes from one row to the next in the images of image_alloc_view: a row of pixels rounded up to IMAGE_ALIGN
+size_t image_row_stride(int width, int channels, int pixel_type);
+
+// Allocates a width x height image whose rows all start on an IMAGE_ALIGN boundary (stride image_row_stride);
+// data is NULL when out of memory. The padding after each row is not initialised. Free it with image_free(view.data)
+ImageView image_alloc_view(int width, int height, int channels, int pixel_type);
+
+// stb_image decodes into the same buffers
+#define STBI_MALLOC(size) image_alloc(size)
+#define STBI_REALLOC_SIZED(ptr, old_size, new_size) image_realloc(ptr, old_size, new_size)
+#define STBI_FREE(ptr) image_free(ptr)
+
+#endif
+
+#ifdef IMAGE_ALLOC_IMPLEMENTATION
+#ifndef IMAGE_ALLOC_IMPLEMENTED
+#define IMAGE_ALLOC_IMPLEMENTED
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+static int image_alloc_use_huge_pages = 0;
+
+void image_alloc_huge_pages(int enable) {
+    image_alloc_use_huge_pages = enable;
+}
+
+static void *image_alloc_aligned(size_t alignment, size_t size) {
+    void *ptr;
+    return posix_memalign(&ptr, alignment, size) == 0 ? ptr : NULL;
+}
+
+void *image_alloc(size_t size) {
+    if (size == 0) {
+        size = 1;  // stb_image and the drivers treat NULL as out of memory
+    }
+    if (!image_alloc_use_huge_pages || size < IMAGE_HUGE_PAGE) {
+        return image_alloc_aligned(IMAGE_ALIGN, size);
+    }
+    // Whole huge pages: no 4 KB page at either end, and no small block of another buffer shares them
+    size_t padded = (size + IMAGE_HUGE_PAGE - 1) & ~(IMAGE_HUGE_PAGE - 1);
+    void *ptr = image_alloc_aligned(IMAGE_HUGE_PAGE, padded);
+#ifdef MADV_HUGEPAGE
+    if (ptr) {
+        madvise(ptr, padded, MADV_HUGEPAGE);  // Advisory: without transparent huge pages the buffer keeps 4 KB pages
+    }
+#endif
+    return ptr;
+}
+
+void *image_calloc(size_t count, size_t size) {
+    void *ptr = image_alloc(count * size);
+    if (ptr) {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+void *image_realloc(void *ptr, size_t old_size, size_t new_size) {
+    // realloc() would drop the alignment
+    void *resized = image_alloc(new_size);
+    if (resized && ptr) {
+        memcpy(resized, ptr, old_size < new_size ? old_size : new_size);
+    }
+    if (resized) {
+        image_free(ptr);
+    }
+    return resized;
+}
+
+void image_free(void *ptr) {
+    free(ptr);
+}
+
+size_t image_row_stride(int width, int channels, int pixel_type) {
+    size_t row_bytes = (size_t)width * channels * image_view_sample_bytes(pixel_type);
+    return (row_bytes + IMAGE_ALIGN - 1) & ~(size_t)(IMAGE_ALIGN - 1);
+}
+
+ImageView image_alloc_view(int width, int height, int channels, int pixel_type) {
+    size_t stride = image_row_stride(width, channels, pixel_type);
+    return image_view_strided(image_alloc(stride * height), width, height, channels, pixel_type, stride);
+}
+
+#endif
+#endif
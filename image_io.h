@@ -0,0 +1,335 @@
+#ifndef IMAGE_IO_H
+#define IMAGE_IO_H
+
+/*
+Loading and saving of 8-bit, 16-bit and float images on top of stb_image / stb_image_write.
+
+Include it after the stb implementations in exactly one file of each program:
+
+#define IMAGE_ALLOC_IMPLEMENTATION
+#include "image_alloc.h"
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+#define IMAGE_IO_IMPLEMENTATION
+#include "image_io.h"
+
+Samples are stored interleaved in their native type (PIXEL_U8, PIXEL_U16 or PIXEL_F32),
+in buffers from image_alloc(): packed rows (load_image) or rows padded to IMAGE_ALIGN
+(load_image_view, see image_alloc_view). write_image_view takes any row stride.
+Float images converted from integer inputs are normalised to [0, 1]; Radiance .hdr
+inputs keep their linear values. 16-bit results are written as 16-bit PNG; float results
+are written as .hdr or .pfm according to the extension, and as 16-bit PNG otherwise.
+*/
+
+#include <stddef.h>
+#include "filter_kernels.h"
+#include "image_alloc.h"
+
+#define PIXEL_AUTO -1  // Native type of the file when loading
+
+// Bytes per sample of a pixel type
+size_t pixel_size(int pixel_type);
+
+// Largest value of an integer pixel type (1 for float)
+float pixel_range(int pixel_type);
+
+// Reads sample i as a float in the units of the pixel type
+float image_sample(const void *data, int pixel_type, size_t i);
+
+// Stores a float as sample i, rounding and clamping for integer types
+void image_store(void *data, int pixel_type, size_t i, float value);
+
+// Parses "auto", "u8", "u16" or "f32"; returns 0 for unknown names
+int parse_pixel_type(const char *name, int *pixel_type);
+
+// Loads an image with the requested pixel type (PIXEL_AUTO keeps the file's depth) into packed rows; free it with
+// stbi_image_free()
+void *load_image(const char *path, int *width, int *height, int *channels, int *pixel_type);
+
+// Same, into rows padded to image_row_stride (see image_alloc_view); returns 0 on failure. Free it with image_free(image->data)
+int load_image_view(const char *path, ImageView *image, int pixel_type);
+
+// Writes an image of the given pixel type from packed rows; returns 0 on failure
+int write_image(const char *path, const void *data, int width, int height, int channels, int pixel_type);
+
+// Same, from the rows of a view, whatever their stride
+int write_image_view(const char *path, const ImageView *image);
+
+#endif
+
+#ifdef IMAGE_IO_IMPLEMENTATION
+#ifndef IMAGE_IO_IMPLEMENTED
+#define IMAGE_IO_IMPLEMENTED
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+size_t pixel_size(int pixel_type) {
+    return image_view_sample_bytes(pixel_type);
+}
+
+float pixel_range(int pixel_type) {
+    return pixel_type == PIXEL_U16 ? 65535.0f : pixel_type == PIXEL_F32 ? 1.0f : 255.0f;
+}
+
+float image_sample(const void *data, int pixel_type, size_t i) {
+    switch (pixel_type) {
+        case PIXEL_U16: return ((const uint16_t *)data)[i];
+        case PIXEL_F32: return ((const float *)data)[i];
+        default: return ((const uint8_t *)data)[i];
+    }
+}
+
+void image_store(void *data, int pixel_type, size_t i, float value) {
+    if (pixel_type == PIXEL_F32) {
+        ((float *)data)[i] = value;
+        return;
+    }
+    float max = pixel_range(pixel_type);
+    value += 0.5f;
+    value = value > max ? max : (value < 0.0f ? 0.0f : value);
+    if (pixel_type == PIXEL_U16) {
+        ((uint16_t *)data)[i] = (uint16_t)value;
+    } else {
+        ((uint8_t *)data)[i] = (uint8_t)value;
+    }
+}
+
+int parse_pixel_type(const char *name, int *pixel_type) {
+    if (strcmp(name, "auto") == 0) {
+        *pixel_type = PIXEL_AUTO;
+    } else if (strcmp(name, "u8") == 0) {
+        *pixel_type = PIXEL_U8;
+    } else if (strcmp(name, "u16") == 0) {
+        *pixel_type = PIXEL_U16;
+    } else if (strcmp(name, "f32") == 0) {
+        *pixel_type = PIXEL_F32;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// Decodes a file in its native pixel type into packed rows from image_alloc()
+static void *image_io_decode(const char *path, int *width, int *height, int *channels, int *native_type) {
+    if (stbi_is_hdr(path)) {
+        *native_type = PIXEL_F32;
+        return stbi_loadf(path, width, height, channels, 0);
+    }
+    if (stbi_is_16_bit(path)) {
+        *native_type = PIXEL_U16;
+        return stbi_load_16(path, width, height, channels, 0);
+    }
+    *native_type = PIXEL_U8;
+    return stbi_load(path, width, height, channels, 0);
+}
+
+// Copies the packed rows of `native` into `image`, converting each sample to the pixel type of the image and
+// mapping the full range of one integer type onto the other
+static void image_io_convert(const void *native, int native_type, const ImageView *image) {
+    ImageView source = image_view((void *)native, image->width, image->height, image->channels, native_type);
+    if (native_type == image->pixel_type) {
+        image_view_copy(&source, image);
+        return;
+    }
+    size_t row_samples = (size_t)image->width * image->channels;
+    float scale = pixel_range(image->pixel_type) / pixel_range(native_type);
+    for (int y = 0; y < image->height; y++) {
+        const void *in = image_view_row(&source, y);
+        void *out = image_view_row(image, y);
+        for (size_t i = 0; i < row_samples; i++) {
+            image_store(out, image->pixel_type, i, image_sample(in, native_type, i) * scale);
+        }
+    }
+}
+
+void *load_image(const char *path, int *width, int *height, int *channels, int *pixel_type) {
+    int native_type;
+    void *native = image_io_decode(path, width, height, channels, &native_type);
+    if (!native) {
+        return NULL;
+    }
+    if (*pixel_type == PIXEL_AUTO || *pixel_type == native_type) {
+        *pixel_type = native_type;
+        return native;
+    }
+
+    // Convert to the requested type
+    ImageView converted = image_view(image_alloc((size_t)*width * *height * *channels * pixel_size(*pixel_type)), *width,
+                                     *height, *channels, *pixel_type);
+    image_io_convert(native, native_type, &converted);
+    stbi_image_free(native);
+    return converted.data;
+}
+
+int load_image_view(const char *path, ImageView *image, int pixel_type) {
+    int width, height, channels, native_type;
+    void *native = image_io_decode(path, &width, &height, &channels, &native_type);
+    if (!native) {
+        return 0;
+    }
+    pixel_type = pixel_type == PIXEL_AUTO ? native_type : pixel_type;
+    if (pixel_type == native_type && image_row_stride(width, channels, pixel_type) == (size_t)width * channels * pixel_size(pixel_type)) {
+        // The packed rows already end on IMAGE_ALIGN boundaries
+        *image = image_view(native, width, height, channels, pixel_type);
+        return 1;
+    }
+    *image = image_alloc_view(width, height, channels, pixel_type);
+    image_io_convert(native, native_type, image);
+    stbi_image_free(native);
+    return 1;
+}
+
+// Checks whether a path ends with the given extension (case-insensitive)
+static int image_io_has_extension(const char *path, const char *extension) {
+    size_t path_length = strlen(path);
+    size_t extension_length = strlen(extension);
+    if (path_length < extension_length) {
+        return 0;
+    }
+    for (size_t i = 0; i < extension_length; i++) {
+        char c = path[path_length - extension_length + i];
+        if ((c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c) != extension[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// CRC-32 of PNG chunks
+static uint32_t image_io_crc32(uint32_t crc, const unsigned char *data, size_t size) {
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) {
+        crc ^= data[i];
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1u)));
+        }
+    }
+    return ~crc;
+}
+
+static void image_io_put_u32(unsigned char *out, uint32_t value) {
+    out[0] = (unsigned char)(value >> 24);
+    out[1] = (unsigned char)(value >> 16);
+    out[2] = (unsigned char)(value >> 8);
+    out[3] = (unsigned char)value;
+}
+
+static int image_io_write_chunk(FILE *file, const char *type, const unsigned char *data, uint32_t size) {
+    unsigned char header[8];
+    unsigned char footer[4];
+    image_io_put_u32(header, size);
+    memcpy(header + 4, type, 4);
+    uint32_t crc = image_io_crc32(0, header + 4, 4);
+    crc = image_io_crc32(crc, data, size);
+    image_io_put_u32(footer, crc);
+    return fwrite(header, 1, 8, file) == 8 && (size == 0 || fwrite(data, 1, size, file) == size) && fwrite(footer, 1, 4, file) == 4;
+}
+
+// Writes a 16-bit PNG (stb_image_write only produces 8-bit PNG) from u16 samples, or from normalised float
+// samples scaled to the 16-bit range
+static int image_io_write_png16(const char *path, const ImageView *image) {
+    static const unsigned char color_types[5] = {0, 0, 4, 2, 6};
+    int width = image->width, height = image->height, channels = image->channels;
+    size_t row_size = (size_t)width * channels * 2 + 1;
+    unsigned char *raw = (unsigned char *)image_alloc(row_size * height);
+    for (int y = 0; y < height; y++) {
+        unsigned char *row = raw + row_size * y;
+        const void *samples = image_view_row(image, y);
+        row[0] = 0;  // Filter type None
+        for (size_t i = 0; i < (size_t)width * channels; i++) {
+            uint16_t sample;
+            if (image->pixel_type == PIXEL_U16) {
+                sample = ((const uint16_t *)samples)[i];
+            } else {
+                image_store(&sample, PIXEL_U16, 0, ((const float *)samples)[i] * 65535.0f);
+            }
+            row[1 + 2 * i] = (unsigned char)(sample >> 8);
+            row[2 + 2 * i] = (unsigned char)sample;
+        }
+    }
+    int zlib_size;
+    unsigned char *zlib = stbi_zlib_compress(raw, (int)(row_size * height), &zlib_size, 8);
+    image_free(raw);
+    if (!zlib) {
+        return 0;
+    }
+
+    unsigned char ihdr[13];
+    image_io_put_u32(ihdr, (uint32_t)width);
+    image_io_put_u32(ihdr + 4, (uint32_t)height);
+    ihdr[8] = 16;
+    ihdr[9] = color_types[channels];
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+
+    FILE *file = fopen(path, "wb");
+    int ok = file != NULL;
+    if (file) {
+        static const unsigned char signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+        ok = fwrite(signature, 1, 8, file) == 8 &&
+             image_io_write_chunk(file, "IHDR", ihdr, 13) &&
+             image_io_write_chunk(file, "IDAT", zlib, (uint32_t)zlib_size) &&
+             image_io_write_chunk(file, "IEND", NULL, 0);
+        ok = fclose(file) == 0 && ok;
+    }
+    STBIW_FREE(zlib);
+    return ok;
+}
+
+// Writes a Portable Float Map (grey or RGB; extra channels are dropped)
+static int image_io_write_pfm(const char *path, const ImageView *image) {
+    int width = image->width, height = image->height, channels = image->channels;
+    int out_channels = channels >= 3 ? 3 : 1;
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        return 0;
+    }
+    int ok = fprintf(file, "%s\n%d %d\n-1.0\n", out_channels == 3 ? "PF" : "Pf", width, height) > 0;
+    float *row = (float *)malloc((size_t)width * out_channels * sizeof(float));
+    // PFM stores rows bottom to top in little-endian order
+    for (int y = height - 1; ok && y >= 0; y--) {
+        for (int x = 0; x < width; x++) {
+            for (int c = 0; c < out_channels; c++) {
+                row[x * out_channels + c] = ((const float *)image_view_row(image, y))[(size_t)x * channels + c];
+            }
+        }
+        ok = fwrite(row, sizeof(float), (size_t)width * out_channels, file) == (size_t)width * out_channels;
+    }
+    free(row);
+    return fclose(file) == 0 && ok;
+}
+
+int write_image_view(const char *path, const ImageView *image) {
+    if (image->pixel_type == PIXEL_U8) {
+        return stbi_write_png(path, image->width, image->height, image->channels, image->data, (int)image->stride);
+    }
+    if (image->pixel_type == PIXEL_U16 || (!image_io_has_extension(path, ".hdr") && !image_io_has_extension(path, ".pfm"))) {
+        return image_io_write_png16(path, image);  // Other extensions: normalised float to 16-bit PNG
+    }
+    if (image_io_has_extension(path, ".pfm")) {
+        return image_io_write_pfm(path, image);
+    }
+
+    // stb_image_write takes the .hdr rows packed
+    if (image_view_packed(image)) {
+        return stbi_write_hdr(path, image->width, image->height, image->channels, (const float *)image->data);
+    }
+    ImageView packed = image_view(image_alloc(image_view_row_bytes(image) * image->height), image->width, image->height,
+                                  image->channels, image->pixel_type);
+    image_view_copy(image, &packed);
+    int ok = stbi_write_hdr(path, image->width, image->height, image->channels, (const float *)packed.data);
+    image_free(packed.data);
+    return ok;
+}
+
+int write_image(const char *path, const void *data, int width, int height, int channels, int pixel_type) {
+    ImageView image = image_view((void *)data, width, height, channels, pixel_type);
+    return write_image_view(path, &image);
+}
+
+#endif
+#endif
@@ -0,0 +1,39 @@
+#ifndef IMAGE_RECT_H
+#define IMAGE_RECT_H
+
+/*
+Rectangles of pixels, shared by the incremental mode (dirty_rects.h) and the regions of
+interest (roi.h): both take them as "x,y,width,height" on the command line and grow them
+by a filter's radius, clipped to the image.
+*/
+
+#include <stdio.h>
+
+typedef struct {
+    int x, y;
+    int width, height;
+} ImageRect;
+
+// Parses "x,y,width,height"; returns 0 when the text is malformed or the size is not positive
+static inline int parse_image_rect(const char *text, ImageRect *rect) {
+    char end;
+    if (sscanf(text, "%d,%d,%d,%d%c", &rect->x, &rect->y, &rect->width, &rect->height, &end) != 4) {
+        return 0;
+    }
+    return rect->width > 0 && rect->height > 0;
+}
+
+// Grows a rectangle by radius on every side (0 only clips it), clipped to the image; the result may be empty
+// (width or height 0). Grown by a filter's radius, it is the input the filter reads to compute the rectangle
+static inline ImageRect dilate_image_rect(ImageRect rect, int radius, int width, int height) {
+    int x0 = rect.x - radius, y0 = rect.y - radius;
+    int x1 = rect.x + rect.width + radius, y1 = rect.y + rect.height + radius;
+    x0 = x0 < 0 ? 0 : x0;
+    y0 = y0 < 0 ? 0 : y0;
+    x1 = x1 > width ? width : x1;
+    y1 = y1 > height ? height : y1;
+    ImageRect dilated = {x0, y0, x1 > x0 ? x1 - x0 : 0, y1 > y0 ? y1 - y0 : 0};
+    return dilated;
+}
+
+#endif
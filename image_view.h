@@ -0,0 +1,85 @@
+#ifndef IMAGE_VIEW_H
+#define IMAGE_VIEW_H
+
+/*
+Strided views of images, shared by the C drivers, the OpenCV drivers and filter_kernels.
+
+A view describes width x height interleaved pixels starting at `data`, with `stride`
+bytes from one row to the next. The view does not own its pixels: a crop of a view,
+a band of rows or a cv::Mat (its step) are all views of the same memory, so tiles,
+halos and receive buffers need no copies.
+
+The stride must be a multiple of the sample size and at least one row of samples.
+Kernels never write through an input view.
+*/
+
+#include <stddef.h>
+#include <string.h>
+
+// Pixel types understood by the dispatchers
+#define PIXEL_U8 0
+#define PIXEL_U16 1
+#define PIXEL_F32 2
+
+typedef struct {
+    void *data;      // First sample of row 0
+    int width;
+    int height;
+    int channels;
+    int pixel_type;  // PIXEL_U8, PIXEL_U16 or PIXEL_F32
+    size_t stride;   // Bytes from the start of one row to the start of the next
+} ImageView;
+
+// Bytes per sample of a pixel type
+static inline size_t image_view_sample_bytes(int pixel_type) {
+    return pixel_type == PIXEL_U16 ? 2 : pixel_type == PIXEL_F32 ? 4 : 1;
+}
+
+// View of an image stored with the given row stride
+static inline ImageView image_view_strided(void *data, int width, int height, int channels, int pixel_type, size_t stride) {
+    ImageView view = {data, width, height, channels, pixel_type, stride};
+    return view;
+}
+
+// View of an image whose rows follow each other without padding
+static inline ImageView image_view(void *data, int width, int height, int channels, int pixel_type) {
+    return image_view_strided(data, width, height, channels, pixel_type,
+                              (size_t)width * channels * image_view_sample_bytes(pixel_type));
+}
+
+// Bytes of the pixels of one row, without the padding up to the stride
+static inline size_t image_view_row_bytes(const ImageView *view) {
+    return (size_t)view->width * view->channels * image_view_sample_bytes(view->pixel_type);
+}
+
+static inline void *image_view_row(const ImageView *view, int y) {
+    return (unsigned char *)view->data + (size_t)y * view->stride;
+}
+
+static inline void *image_view_pixel(const ImageView *view, int x, int y) {
+    return (unsigned char *)image_view_row(view, y) + (size_t)x * view->channels * image_view_sample_bytes(view->pixel_type);
+}
+
+// Sub-image of width x height pixels at (x, y), sharing the pixels of `view`
+static inline ImageView image_view_crop(const ImageView *view, int x, int y, int width, int height) {
+    return image_view_strided(image_view_pixel(view, x, y), width, height, view->channels, view->pixel_type, view->stride);
+}
+
+// Whether the rows follow each other without padding, so the pixels form one block of memory
+static inline int image_view_packed(const ImageView *view) {
+    return view->height <= 1 || view->stride == image_view_row_bytes(view);
+}
+
+// Copies the pixels of `src` into `dst`, which has the same size, channels and pixel type
+static inline void image_view_copy(const ImageView *src, const ImageView *dst) {
+    size_t row_bytes = image_view_row_bytes(src);
+    if (image_view_packed(src) && image_view_packed(dst)) {
+        memmove(dst->data, src->data, row_bytes * src->height);
+        return;
+    }
+    for (int y = 0; y < src->height; y++) {
+        memmove(image_view_row(dst, y), image_view_row(src, y), row_bytes);
+    }
+}
+
+#endif
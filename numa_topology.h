@@ -0,0 +1,181 @@
+#ifndef NUMA_TOPOLOGY_H
+#define NUMA_TOPOLOGY_H
+
+/*
+NUMA placement for the threaded drivers' --numa mode (Linux only).
+
+Include it with the implementation in exactly one file of each program, which must
+define _GNU_SOURCE before its first system header:
+
+#define NUMA_TOPOLOGY_IMPLEMENTATION
+#include "numa_topology.h"
+
+The nodes and their CPUs are read from /sys/devices/system/node, keeping only the CPUs
+the process may run on (taskset, cgroups). Consecutive threads fill one node before
+moving to the next, so the threads of adjacent stripes, which read each other's halo
+rows, share a node. Every thread pins itself to its CPU before touching any buffer.
+
+Memory is placed by first touch: a page lands on the node of the thread that writes
+it first. numa_fresh_pages() makes malloc hand out untouched pages for every large
+buffer, so each thread places its own stripe of the images it writes first.
+*/
+
+#include <sched.h>
+
+#define NUMA_MAX_NODES 64
+#define NUMA_MMAP_THRESHOLD (1 << 20)  // Buffers from this size up are mapped fresh by malloc
+
+typedef struct {
+    int num_nodes;
+    int node_ids[NUMA_MAX_NODES];   // Node numbers in sysfs
+    cpu_set_t cpus[NUMA_MAX_NODES];  // CPUs of each node the process may run on
+    int num_cpus[NUMA_MAX_NODES];
+} NumaTopology;
+
+// Reads the nodes that have usable CPUs; without sysfs, all the usable CPUs form one node.
+// Returns the number of nodes
+int numa_read_topology(NumaTopology *topology);
+
+// CPU of thread `index` of `num_threads`; its node (position in the topology) goes to *node
+int numa_thread_cpu(const NumaTopology *topology, int index, int num_threads, int *node);
+
+// Pins the calling thread to one CPU; returns 0 on failure
+int numa_pin_current_thread(int cpu);
+
+// Serves every malloc of at least NUMA_MMAP_THRESHOLD bytes with a fresh mapping that free() unmaps,
+// instead of reusing heap pages already touched (and placed) by another thread
+void numa_fresh_pages(void);
+
+#endif
+
+#ifdef NUMA_TOPOLOGY_IMPLEMENTATION
+#ifndef NUMA_TOPOLOGY_IMPLEMENTED
+#define NUMA_TOPOLOGY_IMPLEMENTED
+
+#include <dirent.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Parses a sysfs CPU list such as "0-7,16-23"; returns 0 when it is malformed
+static int numa_parse_cpulist(const char *text, cpu_set_t *set) {
+    CPU_ZERO(set);
+    while (*text && *text != '\n') {
+        char *end;
+        long first = strtol(text, &end, 10);
+        long last = first;
+        if (end == text) {
+            return 0;
+        }
+        if (*end == '-') {
+            text = end + 1;
+            last = strtol(text, &end, 10);
+            if (end == text) {
+                return 0;
+            }
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        text = *end == ',' ? end + 1 : end;
+    }
+    return 1;
+}
+
+static int numa_compare_ids(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+int numa_read_topology(NumaTopology *topology) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        CPU_ZERO(&allowed);
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, &allowed);
+        }
+    }
+
+    // Node numbers in increasing order
+    int ids[NUMA_MAX_NODES];
+    int count = 0;
+    DIR *dir = opendir("/sys/devices/system/node");
+    struct dirent *item;
+    while (dir && (item = readdir(dir)) != NULL && count < NUMA_MAX_NODES) {
+        char *end;
+        if (strncmp(item->d_name, "node", 4) == 0 && item->d_name[4]) {
+            long id = strtol(item->d_name + 4, &end, 10);
+            if (*end == '\0') {
+                ids[count++] = (int)id;
+            }
+        }
+    }
+    if (dir) {
+        closedir(dir);
+    }
+    qsort(ids, count, sizeof(int), numa_compare_ids);
+
+    topology->num_nodes = 0;
+    for (int i = 0; i < count; i++) {
+        char path[64], list[4096];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", ids[i]);
+        FILE *file = fopen(path, "r");
+        int ok = file && fgets(list, sizeof(list), file);
+        if (file) {
+            fclose(file);
+        }
+        int n = topology->num_nodes;
+        if (!ok || !numa_parse_cpulist(list, &topology->cpus[n])) {
+            continue;
+        }
+        CPU_AND(&topology->cpus[n], &topology->cpus[n], &allowed);
+        topology->num_cpus[n] = CPU_COUNT(&topology->cpus[n]);
+        if (topology->num_cpus[n] > 0) {  // Nodes with memory only, or no usable CPU, get no threads
+            topology->node_ids[n] = ids[i];
+            topology->num_nodes++;
+        }
+    }
+
+    if (topology->num_nodes == 0) {
+        topology->num_nodes = 1;
+        topology->node_ids[0] = 0;
+        topology->cpus[0] = allowed;
+        topology->num_cpus[0] = CPU_COUNT(&allowed);
+    }
+    return topology->num_nodes;
+}
+
+int numa_thread_cpu(const NumaTopology *topology, int index, int num_threads, int *node) {
+    // Balanced blocks of consecutive threads per node
+    int n = (int)((long)index * topology->num_nodes / num_threads);
+    int first = index;
+    while (first > 0 && (int)((long)(first - 1) * topology->num_nodes / num_threads) == n) {
+        first--;
+    }
+    *node = n;
+
+    // The k-th thread of the node takes the node's k-th CPU, wrapping around when there are more threads
+    int k = (index - first) % topology->num_cpus[n];
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &topology->cpus[n]) && k-- == 0) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+int numa_pin_current_thread(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+void numa_fresh_pages(void) {
+    // A fixed threshold also stops glibc from raising it after buffers are freed
+    mallopt(M_MMAP_THRESHOLD, NUMA_MMAP_THRESHOLD);
+}
+
+#endif
+#endif
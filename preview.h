@@ -0,0 +1,127 @@
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+/*
+Previews of the threaded drivers (--preview): the filter runs on an area-downsampled copy
+of the image, so parameters can be settled in a small fraction of the time of a full run.
+
+Include it after image_io.h, with the implementation in exactly one file of each program:
+
+#define PREVIEW_IMPLEMENTATION
+#include "preview.h"
+
+The image is reduced by the smallest integer factor that leaves at most max_pixels
+pixels, each preview pixel being the mean of its factor x factor block. The drivers
+scale their parameters to the reduced image: a window radius shrinks by the factor and
+a diffusion time by its square, so the preview looks like the full result scaled down.
+
+Cost model: with fixed parameters the filter time is taken as proportional to its work
+units, the pixels times the per-pixel work the driver defines (iterations, time steps).
+The full run is projected as a measured time scaled by the ratio of work units, with the
+same threads (preview_project). Diffusion costs the same per pixel and step whatever the
+step count, so the preview time itself is scaled. A median does not: the window size
+picks the kernel, so a reduced window may run a faster specialisation than the full one.
+The median driver therefore also times a band of the preview (preview_sample_band) with
+the full-size window and projects from that. For runs that may stop early (--tolerance)
+the projection is an upper bound.
+*/
+
+#include <stddef.h>
+
+#include "image_rect.h"
+#include "image_view.h"
+
+#define PREVIEW_MAX_PIXELS ((size_t)1 << 20)     // Default size of a preview: 1 MP
+#define PREVIEW_SAMPLE_PIXELS ((size_t)1 << 14)  // Size of the band timed with full-size parameters
+
+// Smallest integer factor that reduces width x height to at most max_pixels pixels
+int preview_factor(int width, int height, size_t max_pixels);
+
+// Mean of each factor x factor block (the blocks on the right and bottom edges may be smaller); the preview
+// is ceil(width / factor) x ceil(height / factor) pixels from image_alloc_view()
+ImageView preview_downsample(const ImageView *image, int factor);
+
+// Band of whole rows in the middle of the image with about PREVIEW_SAMPLE_PIXELS pixels (at least one row)
+ImageRect preview_sample_band(int width, int height);
+
+// Time of full_work work units, from measured_ms taken by measured_work units
+double preview_project(double measured_ms, double measured_work, double full_work);
+
+// Prints the preview size and time, and the time the cost model projects for the full run
+void preview_report(int width, int height, int preview_width, int preview_height, int factor, double preview_ms,
+                    double projected_ms, int threads);
+
+#endif
+
+#ifdef PREVIEW_IMPLEMENTATION
+#ifndef PREVIEW_IMPLEMENTED
+#define PREVIEW_IMPLEMENTED
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int preview_factor(int width, int height, size_t max_pixels) {
+    int factor = 1;
+    while ((size_t)((width + factor - 1) / factor) * ((height + factor - 1) / factor) > max_pixels) {
+        factor++;
+    }
+    return factor;
+}
+
+ImageView preview_downsample(const ImageView *image, int factor) {
+    int width = image->width, height = image->height, channels = image->channels, pixel_type = image->pixel_type;
+    int w = (width + factor - 1) / factor;
+    int h = (height + factor - 1) / factor;
+    ImageView preview = image_alloc_view(w, h, channels, pixel_type);
+    double *sums = (double *)calloc((size_t)w * channels, sizeof(double));  // One row of blocks, summed row by row
+    for (int y = 0; y < h; y++) {
+        int y0 = y * factor;
+        int y1 = y0 + factor < height ? y0 + factor : height;
+        for (int sy = y0; sy < y1; sy++) {
+            const void *row = image_view_row(image, sy);
+            for (int sx = 0; sx < width; sx++) {
+                double *sum = sums + (size_t)(sx / factor) * channels;
+                for (int c = 0; c < channels; c++) {
+                    sum[c] += image_sample(row, pixel_type, (size_t)sx * channels + c);
+                }
+            }
+        }
+        for (int x = 0; x < w; x++) {
+            int x0 = x * factor;
+            int x1 = x0 + factor < width ? x0 + factor : width;
+            double count = (double)(x1 - x0) * (y1 - y0);
+            for (int c = 0; c < channels; c++) {
+                size_t i = (size_t)x * channels + c;
+                image_store(image_view_row(&preview, y), pixel_type, i, (float)(sums[i] / count));
+                sums[i] = 0.0;
+            }
+        }
+    }
+    free(sums);
+    return preview;
+}
+
+ImageRect preview_sample_band(int width, int height) {
+    int rows = (int)((PREVIEW_SAMPLE_PIXELS + width - 1) / width);
+    rows = rows < height ? rows : height;
+    ImageRect band = {0, (height - rows) / 2, width, rows};
+    return band;
+}
+
+double preview_project(double measured_ms, double measured_work, double full_work) {
+    return measured_work > 0 ? measured_ms * full_work / measured_work : 0.0;
+}
+
+void preview_report(int width, int height, int preview_width, int preview_height, int factor, double preview_ms,
+                    double projected_ms, int threads) {
+    printf("Preview: %dx%d reduced 1/%d to %dx%d, filtered in %.1f ms\n", width, height, factor, preview_width,
+           preview_height, preview_ms);
+    if (projected_ms >= 1000.0) {
+        printf("Projected full run: %.2f s with %d threads\n", projected_ms / 1000.0, threads);
+    } else {
+        printf("Projected full run: %.1f ms with %d threads\n", projected_ms, threads);
+    }
+}
+
+#endif
+#endif
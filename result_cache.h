@@ -0,0 +1,362 @@
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+/*
+On-disk cache of filter results, shared by the drivers' --cache option.
+
+Include it with the implementation in exactly one file of each program:
+
+#define RESULT_CACHE_IMPLEMENTATION
+#include "result_cache.h"
+
+A result is stored under a 64-bit key: the XXH64 hash of the decoded input samples,
+seeded with the hash of a description of the filter, its parameters and the image
+shape. Each entry is one file <directory>/<key>.rc holding a short header and the
+filtered samples, so a hit costs one hash of the input and one read (a vectored read
+straight into the rows of a view). Entries are
+written to a temporary file and renamed, so concurrent processes never see a partial
+entry. Every hit refreshes the entry's modification time; when a store pushes the
+directory past max_bytes, the least recently used entries are deleted.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "image_view.h"
+
+#define RESULT_CACHE_DEFAULT_BYTES ((size_t)1 << 30)  // Default size cap: 1 GiB
+
+typedef struct {
+    const char *directory;  // NULL = cache disabled
+    size_t max_bytes;       // Size cap of the entries
+} ResultCache;
+
+// XXH64 of a buffer
+uint64_t result_cache_hash(const void *data, size_t size, uint64_t seed);
+
+// Key of the result of filtering `input` (size bytes) as described by `description`,
+// e.g. "MMF median window=3 border=1:0 640x480x3 pixel=0"
+uint64_t result_cache_key(const void *input, size_t size, const char *description);
+
+// Reads the entry stored under key into output, which must be exactly size bytes, and marks it as recently used.
+// Returns 0 on a miss or when the cache is disabled
+int result_cache_get(const ResultCache *cache, uint64_t key, void *output, size_t size);
+
+// Stores a result, then evicts the least recently used entries while the cache exceeds max_bytes.
+// Returns 0 when the entry could not be written
+int result_cache_put(const ResultCache *cache, uint64_t key, const void *data, size_t size);
+
+// The same for images seen through views. The key hashes the pixels row by row, so it does not depend on the
+// row padding; an entry holds the rows packed and is read back into any stride
+uint64_t result_cache_key_view(const ImageView *input, const char *description);
+int result_cache_get_view(const ResultCache *cache, uint64_t key, const ImageView *output);
+int result_cache_put_view(const ResultCache *cache, uint64_t key, const ImageView *image);
+
+#endif
+
+#ifdef RESULT_CACHE_IMPLEMENTATION
+#ifndef RESULT_CACHE_IMPLEMENTED
+#define RESULT_CACHE_IMPLEMENTED
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define RESULT_CACHE_PRIME1 0x9E3779B185EBCA87ULL
+#define RESULT_CACHE_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define RESULT_CACHE_PRIME3 0x165667B19E3779F9ULL
+#define RESULT_CACHE_PRIME4 0x85EBCA77C2B2AE63ULL
+#define RESULT_CACHE_PRIME5 0x27D4EB2F165667C5ULL
+
+// Header of an entry file
+typedef struct {
+    char magic[8];  // "RCACHE01"
+    uint64_t key;
+    uint64_t size;  // Bytes of result after the header
+} ResultCacheHeader;
+
+static uint64_t result_cache_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t result_cache_read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static uint32_t result_cache_read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint64_t result_cache_round(uint64_t acc, uint64_t input) {
+    acc += input * RESULT_CACHE_PRIME2;
+    return result_cache_rotl(acc, 31) * RESULT_CACHE_PRIME1;
+}
+
+static uint64_t result_cache_merge(uint64_t acc, uint64_t value) {
+    acc ^= result_cache_round(0, value);
+    return acc * RESULT_CACHE_PRIME1 + RESULT_CACHE_PRIME4;
+}
+
+uint64_t result_cache_hash(const void *data, size_t size, uint64_t seed) {
+    const unsigned char *p = (const unsigned char *)data;
+    const unsigned char *end = p + size;
+    uint64_t h;
+    if (size >= 32) {
+        // Four independent lanes over 32-byte stripes
+        uint64_t v1 = seed + RESULT_CACHE_PRIME1 + RESULT_CACHE_PRIME2;
+        uint64_t v2 = seed + RESULT_CACHE_PRIME2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - RESULT_CACHE_PRIME1;
+        const unsigned char *limit = end - 32;
+        do {
+            v1 = result_cache_round(v1, result_cache_read64(p));
+            v2 = result_cache_round(v2, result_cache_read64(p + 8));
+            v3 = result_cache_round(v3, result_cache_read64(p + 16));
+            v4 = result_cache_round(v4, result_cache_read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+        h = result_cache_rotl(v1, 1) + result_cache_rotl(v2, 7) + result_cache_rotl(v3, 12) + result_cache_rotl(v4, 18);
+        h = result_cache_merge(h, v1);
+        h = result_cache_merge(h, v2);
+        h = result_cache_merge(h, v3);
+        h = result_cache_merge(h, v4);
+    } else {
+        h = seed + RESULT_CACHE_PRIME5;
+    }
+    h += (uint64_t)size;
+    for (; p + 8 <= end; p += 8) {
+        h ^= result_cache_round(0, result_cache_read64(p));
+        h = result_cache_rotl(h, 27) * RESULT_CACHE_PRIME1 + RESULT_CACHE_PRIME4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)result_cache_read32(p) * RESULT_CACHE_PRIME1;
+        h = result_cache_rotl(h, 23) * RESULT_CACHE_PRIME2 + RESULT_CACHE_PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * RESULT_CACHE_PRIME5;
+        h = result_cache_rotl(h, 11) * RESULT_CACHE_PRIME1;
+    }
+    h ^= h >> 33;
+    h *= RESULT_CACHE_PRIME2;
+    h ^= h >> 29;
+    h *= RESULT_CACHE_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t result_cache_key(const void *input, size_t size, const char *description) {
+    return result_cache_hash(input, size, result_cache_hash(description, strlen(description), 0));
+}
+
+static void result_cache_path(const ResultCache *cache, uint64_t key, char *path, size_t path_size) {
+    snprintf(path, path_size, "%s/%016llx.rc", cache->directory, (unsigned long long)key);
+}
+
+// Rows of an entry's samples: `rows` runs of row_bytes bytes, stride bytes apart (one run for a packed buffer)
+typedef struct {
+    unsigned char *data;
+    size_t row_bytes;
+    size_t stride;
+    size_t rows;
+} ResultCacheRows;
+
+#define RESULT_CACHE_IOV 64  // Rows moved by each readv or writev
+
+static ResultCacheRows result_cache_buffer_rows(const void *data, size_t size) {
+    ResultCacheRows rows = {(unsigned char *)data, size, size, 1};
+    return rows;
+}
+
+static ResultCacheRows result_cache_view_rows(const ImageView *view) {
+    ResultCacheRows rows = {(unsigned char *)view->data, image_view_row_bytes(view), view->stride, (size_t)view->height};
+    return rows;
+}
+
+// Reads or writes the header followed by the rows, RESULT_CACHE_IOV rows per call, resuming after short transfers.
+// Returns 0 on an error or at the end of the file
+static int result_cache_transfer(int fd, ResultCacheHeader *header, const ResultCacheRows *rows, int writing) {
+    struct iovec iov[RESULT_CACHE_IOV + 1];
+    size_t piece = 0;   // Next piece to move: 0 is the header, r + 1 is row r
+    size_t offset = 0;  // Bytes of that piece already moved
+    while (piece <= rows->rows) {
+        int count = 0;
+        for (size_t p = piece; p <= rows->rows && count <= RESULT_CACHE_IOV; p++, count++) {
+            unsigned char *base = p == 0 ? (unsigned char *)header : rows->data + (p - 1) * rows->stride;
+            size_t length = p == 0 ? sizeof(*header) : rows->row_bytes;
+            size_t skip = p == piece ? offset : 0;
+            iov[count].iov_base = base + skip;
+            iov[count].iov_len = length - skip;
+        }
+        ssize_t moved = writing ? writev(fd, iov, count) : readv(fd, iov, count);
+        if (moved < 0 && errno == EINTR) {
+            continue;
+        }
+        if (moved <= 0) {
+            return 0;
+        }
+        size_t left = (size_t)moved;
+        for (int k = 0; k < count; k++) {
+            if (left < iov[k].iov_len) {
+                offset = (k == 0 ? offset : 0) + left;
+                break;
+            }
+            left -= iov[k].iov_len;
+            piece++;
+            offset = 0;
+        }
+    }
+    return 1;
+}
+
+static int result_cache_read(const ResultCache *cache, uint64_t key, const ResultCacheRows *rows) {
+    if (!cache || !cache->directory) {
+        return 0;
+    }
+    char path[4096];
+    result_cache_path(cache, key, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    // Header and samples in one vectored read per RESULT_CACHE_IOV rows
+    ResultCacheHeader header;
+    int hit = result_cache_transfer(fd, &header, rows, 0) && memcmp(header.magic, "RCACHE01", 8) == 0 &&
+              header.key == key && header.size == rows->row_bytes * rows->rows;
+    if (hit) {
+        futimens(fd, NULL);  // Recently used: the eviction order follows the modification time
+    }
+    close(fd);
+    return hit;
+}
+
+int result_cache_get(const ResultCache *cache, uint64_t key, void *output, size_t size) {
+    ResultCacheRows rows = result_cache_buffer_rows(output, size);
+    return result_cache_read(cache, key, &rows);
+}
+
+int result_cache_get_view(const ResultCache *cache, uint64_t key, const ImageView *output) {
+    ResultCacheRows rows = result_cache_view_rows(output);
+    return result_cache_read(cache, key, &rows);
+}
+
+uint64_t result_cache_key_view(const ImageView *input, const char *description) {
+    uint64_t hash = result_cache_hash(description, strlen(description), 0);
+    size_t row_bytes = image_view_row_bytes(input);
+    for (int y = 0; y < input->height; y++) {
+        hash = result_cache_hash(image_view_row(input, y), row_bytes, hash);
+    }
+    return hash;
+}
+
+// One entry found while scanning the directory for eviction
+typedef struct {
+    struct timespec used;
+    off_t size;
+    char name[32];
+} ResultCacheEntry;
+
+static int result_cache_older(const void *a, const void *b) {
+    const struct timespec *x = &((const ResultCacheEntry *)a)->used;
+    const struct timespec *y = &((const ResultCacheEntry *)b)->used;
+    if (x->tv_sec != y->tv_sec) {
+        return x->tv_sec < y->tv_sec ? -1 : 1;
+    }
+    return x->tv_nsec < y->tv_nsec ? -1 : x->tv_nsec > y->tv_nsec;
+}
+
+// Deletes the least recently used entries until the cache fits in max_bytes
+static void result_cache_evict(const ResultCache *cache) {
+    DIR *dir = opendir(cache->directory);
+    if (!dir) {
+        return;
+    }
+    size_t count = 0, capacity = 64;
+    ResultCacheEntry *entries = (ResultCacheEntry *)malloc(capacity * sizeof(ResultCacheEntry));
+    size_t total = 0;
+    char path[4096];
+    struct dirent *item;
+    while ((item = readdir(dir)) != NULL) {
+        size_t length = strlen(item->d_name);
+        if (length < 4 || length >= sizeof(entries[0].name) || strcmp(item->d_name + length - 3, ".rc") != 0) {
+            continue;
+        }
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", cache->directory, item->d_name);
+        if (stat(path, &st) != 0) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            entries = (ResultCacheEntry *)realloc(entries, capacity * sizeof(ResultCacheEntry));
+        }
+        entries[count].used = st.st_mtim;
+        entries[count].size = st.st_size;
+        strcpy(entries[count].name, item->d_name);
+        total += st.st_size;
+        count++;
+    }
+    closedir(dir);
+
+    if (total > cache->max_bytes) {
+        qsort(entries, count, sizeof(ResultCacheEntry), result_cache_older);
+        for (size_t i = 0; i < count && total > cache->max_bytes; i++) {
+            snprintf(path, sizeof(path), "%s/%s", cache->directory, entries[i].name);
+            if (unlink(path) == 0 || errno == ENOENT) {
+                total -= entries[i].size;
+            }
+        }
+    }
+    free(entries);
+}
+
+static int result_cache_write(const ResultCache *cache, uint64_t key, const ResultCacheRows *rows) {
+    size_t size = rows->row_bytes * rows->rows;
+    if (!cache || !cache->directory || sizeof(ResultCacheHeader) + size > cache->max_bytes) {
+        return 0;
+    }
+    mkdir(cache->directory, 0755);
+    char path[4096], tmp_path[4200];
+    result_cache_path(cache, key, path, sizeof(path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%ld", path, (long)getpid());
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return 0;
+    }
+    ResultCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "RCACHE01", 8);
+    header.key = key;
+    header.size = size;
+    int ok = result_cache_transfer(fd, &header, rows, 1);
+    ok = close(fd) == 0 && ok && rename(tmp_path, path) == 0;
+    if (!ok) {
+        unlink(tmp_path);
+        return 0;
+    }
+    result_cache_evict(cache);
+    return 1;
+}
+
+int result_cache_put(const ResultCache *cache, uint64_t key, const void *data, size_t size) {
+    ResultCacheRows rows = result_cache_buffer_rows(data, size);
+    return result_cache_write(cache, key, &rows);
+}
+
+int result_cache_put_view(const ResultCache *cache, uint64_t key, const ImageView *image) {
+    ResultCacheRows rows = result_cache_view_rows(image);
+    return result_cache_write(cache, key, &rows);
+}
+
+#endif
+#endif
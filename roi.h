@@ -0,0 +1,148 @@
+#ifndef ROI_H
+#define ROI_H
+
+/*
+Regions of interest for the drivers' --roi option, which filters only the given rectangles
+and passes every other pixel through from the input.
+
+Include it after image_io.h, with the implementation in exactly one file of each program:
+
+#define ROI_IMPLEMENTATION
+#include "roi.h"
+
+The rectangles are clipped to the image and split where they overlap, so each output pixel
+is filtered once (roi_disjoint). The work is then divided by area rather than by image rows:
+roi_partition cuts the rectangles into bands of whole rows so that every thread or process
+gets about the same number of pixels, however the regions are laid out. A piece is filtered
+from the input around it (dilate_image_rect), so its halo is the surrounding image, not the edge of
+the region.
+
+The diffusion in DDF-thread.c does not use roi_partition: each output pixel depends on the
+input up to `iterations` pixels away and on where the threads' strips fall, so every region
+is diffused whole in a crop grown by that many pixels and split at the full run's strips.
+*/
+
+#include <stddef.h>
+
+#include "image_rect.h"
+
+#define ROI_MAX_RECTS 64      // Rectangles accepted by the drivers
+#define ROI_MAX_PIECES 1024   // Disjoint rectangles the overlaps may be split into
+
+// Clips the regions to the image and splits them into disjoint rectangles covering the same pixels.
+// Returns the number of rectangles written to out, or -1 when more than max_out would be needed
+int roi_disjoint(const ImageRect *rois, int count, int width, int height, ImageRect *out, int max_out);
+
+// Pixels covered by disjoint rectangles
+size_t roi_area(const ImageRect *rois, int count);
+
+// Cuts disjoint rectangles into bands of rows for `parts` workers with about the same area each. The pieces
+// of worker p are pieces[part_begin[p]] to pieces[part_begin[p + 1] - 1]; pieces needs count + parts entries
+// and part_begin parts + 1. Returns the number of pieces
+int roi_partition(const ImageRect *rois, int count, int parts, ImageRect *pieces, int *part_begin);
+
+#endif
+
+#ifdef ROI_IMPLEMENTATION
+#ifndef ROI_IMPLEMENTED
+#define ROI_IMPLEMENTED
+
+#include <stdio.h>
+#include <string.h>
+
+// Writes the parts of `rect` outside `hole` to out (up to four: above, below, left and right); returns how many
+static int roi_subtract(ImageRect rect, ImageRect hole, ImageRect *out) {
+    int x0 = rect.x > hole.x ? rect.x : hole.x;
+    int y0 = rect.y > hole.y ? rect.y : hole.y;
+    int x1 = rect.x + rect.width < hole.x + hole.width ? rect.x + rect.width : hole.x + hole.width;
+    int y1 = rect.y + rect.height < hole.y + hole.height ? rect.y + rect.height : hole.y + hole.height;
+    if (x0 >= x1 || y0 >= y1) {
+        out[0] = rect;
+        return 1;
+    }
+    int count = 0;
+    if (y0 > rect.y) {
+        ImageRect above = {rect.x, rect.y, rect.width, y0 - rect.y};
+        out[count++] = above;
+    }
+    if (y1 < rect.y + rect.height) {
+        ImageRect below = {rect.x, y1, rect.width, rect.y + rect.height - y1};
+        out[count++] = below;
+    }
+    if (x0 > rect.x) {
+        ImageRect left = {rect.x, y0, x0 - rect.x, y1 - y0};
+        out[count++] = left;
+    }
+    if (x1 < rect.x + rect.width) {
+        ImageRect right = {x1, y0, rect.x + rect.width - x1, y1 - y0};
+        out[count++] = right;
+    }
+    return count;
+}
+
+int roi_disjoint(const ImageRect *rois, int count, int width, int height, ImageRect *out, int max_out) {
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        ImageRect clipped = dilate_image_rect(rois[i], 0, width, height);
+        if (clipped.width == 0 || clipped.height == 0) {
+            continue;
+        }
+        if (n == max_out) {
+            return -1;
+        }
+        // The new region's pieces sit after the disjoint rectangles; each earlier rectangle is cut out of them
+        int start = n;
+        out[n++] = clipped;
+        for (int e = 0; e < start && n > start; e++) {
+            int end = n;
+            for (int k = start; k < end; k++) {
+                if (n + 4 > max_out) {
+                    return -1;
+                }
+                n += roi_subtract(out[k], out[e], out + n);
+            }
+            memmove(out + start, out + end, (size_t)(n - end) * sizeof(ImageRect));
+            n = start + (n - end);
+        }
+    }
+    return n;
+}
+
+size_t roi_area(const ImageRect *rois, int count) {
+    size_t area = 0;
+    for (int i = 0; i < count; i++) {
+        area += (size_t)rois[i].width * rois[i].height;
+    }
+    return area;
+}
+
+int roi_partition(const ImageRect *rois, int count, int parts, ImageRect *pieces, int *part_begin) {
+    size_t total = roi_area(rois, count);
+    size_t done = 0;
+    int n = 0, r = 0, row = 0;  // Next rectangle, and its first row not yet given out
+    for (int p = 0; p < parts; p++) {
+        part_begin[p] = n;
+        size_t target = total * (p + 1) / parts;
+        // Whole rows up to the nearest row boundary of the target; the last worker takes the rest
+        while (r < count && (p == parts - 1 || done + rois[r].width / 2 < target)) {
+            int rows = rois[r].height - row;
+            if (p < parts - 1) {
+                int wanted = (int)((target - done + rois[r].width / 2) / rois[r].width);
+                rows = wanted < rows ? wanted : rows;
+            }
+            ImageRect piece = {rois[r].x, rois[r].y + row, rois[r].width, rows};
+            pieces[n++] = piece;
+            done += (size_t)rows * rois[r].width;
+            row += rows;
+            if (row == rois[r].height) {
+                r++;
+                row = 0;
+            }
+        }
+    }
+    part_begin[parts] = n;
+    return n;
+}
+
+#endif
+#endif
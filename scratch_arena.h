@@ -0,0 +1,66 @@
+#ifndef SCRATCH_ARENA_H
+#define SCRATCH_ARENA_H
+
+/*
+Bump allocator for the scratch memory of the filter kernels and the drivers' worker threads
+(sort windows, histograms, column caches, ping-pong copies of the image).
+
+Each worker owns one arena and resets it between jobs. Allocations only move a pointer
+inside the arena's blocks; a new block is taken from the heap only when the current ones
+are full, and the blocks are kept across resets. Once the arena has served the largest
+job, later jobs of that size allocate nothing. A reset also merges the blocks into one,
+so the arena settles into a single contiguous buffer.
+
+scratch_arena_mark() and scratch_arena_release() free everything allocated after a point,
+stack-like, without returning memory to the heap; the kernels release their scratch that
+way before they return. An arena is used by one thread at a time.
+
+The implementation is compiled into filter_kernels.cpp, which every program links.
+*/
+
+#include <stddef.h>
+
+#define SCRATCH_ALIGN 64                  // Alignment of every allocation
+#define SCRATCH_MIN_BLOCK ((size_t)64 << 10)  // Smallest block taken from the heap
+
+typedef struct ScratchBlock ScratchBlock;
+
+typedef struct {
+    ScratchBlock *first;    // Blocks in allocation order (NULL = nothing allocated yet)
+    ScratchBlock *current;  // Block being filled; the ones after it are empty
+} ScratchArena;
+
+// Position of an arena, to release everything allocated after it
+typedef struct {
+    ScratchBlock *block;
+    size_t used;
+} ScratchMark;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void scratch_arena_init(ScratchArena *arena);
+
+// size bytes aligned to SCRATCH_ALIGN, valid until the arena is released past them or reset; NULL when out of memory
+void *scratch_arena_alloc(ScratchArena *arena, size_t size);
+
+// Same as scratch_arena_alloc, with the bytes set to zero
+void *scratch_arena_calloc(ScratchArena *arena, size_t count, size_t size);
+
+ScratchMark scratch_arena_mark(const ScratchArena *arena);
+
+// Frees every allocation made after the mark; the memory stays in the arena
+void scratch_arena_release(ScratchArena *arena, ScratchMark mark);
+
+// Frees every allocation and merges the blocks into one that fits all of them
+void scratch_arena_reset(ScratchArena *arena);
+
+// Returns the blocks to the heap
+void scratch_arena_destroy(ScratchArena *arena);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif